@@ -0,0 +1,1152 @@
+#pragma once
+
+#include "../ast/ast.cpp"
+#include "../eval/builtin.cpp"
+#include "../eval/scope.cpp"
+#include <algorithm>
+#include <cmath>
+#include <format>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// --emit-cpp: 把整个程序翻译成一个独立的 C++ 源文件, 与 aot/runtime.cpp 一起编译
+// 每个函数内做一次简单的类型推断, 只会被赋值为 int / float / bool 的局部变量
+// 直接保存为 C++ 的 int / double / bool, 其余的值仍是 obj_ptr, 运算交给解释器的
+// evalInfixExpression 等函数完成, 因此结果和解释器一致
+// 顶层用唯一名字定义的函数还会按调用处的参数类型生成不装箱的特化版本
+namespace aot {
+
+using std::string;
+using std::vector;
+using symbol::Symbol;
+typedef vector<std::unique_ptr<ast::Statement>> Statements;
+
+struct EmitError {
+    string message;
+};
+
+// 特化版本无法生成, 调用处退回通用版本
+struct SpecFail {};
+
+enum class Ty { Unknown, Int, Float, Bool, Obj };
+
+bool isNative(Ty typ) {
+    return typ == Ty::Int || typ == Ty::Float || typ == Ty::Bool;
+}
+
+Ty join(Ty a, Ty b) {
+    if (a == Ty::Unknown) {
+        return b;
+    }
+    if (b == Ty::Unknown || a == b) {
+        return a;
+    }
+    return Ty::Obj;
+}
+
+string cppType(Ty typ) {
+    switch (typ) {
+    case Ty::Int:
+        return "int";
+    case Ty::Float:
+        return "double";
+    case Ty::Bool:
+        return "bool";
+    default:
+        return "obj_ptr";
+    }
+}
+
+string boxCode(const string &code, Ty typ) {
+    return isNative(typ) ? "aot::box(" + code + ")" : code;
+}
+
+string tokenName(token::TokenType typ) {
+    static const std::map<token::TokenType, string> names = {
+        {token::PLUS, "PLUS"}, {token::MINUS, "MINUS"},
+        {token::BANG, "BANG"}, {token::ASTERISK, "ASTERISK"},
+        {token::SLASH, "SLASH"}, {token::LT, "LT"},
+        {token::GT, "GT"},     {token::LE, "LE"},
+        {token::GE, "GE"},     {token::EQ, "EQ"},
+        {token::NOT_EQ, "NOT_EQ"}, {token::AND, "AND"},
+        {token::OR, "OR"},     {token::NOT, "NOT"}};
+    auto iter = names.find(typ);
+    if (iter != names.end()) {
+        return "token::" + iter->second;
+    }
+    return std::format("static_cast<token::TokenType>({})",
+                       static_cast<int>(typ));
+}
+
+string cppOperator(token::TokenType typ) {
+    switch (typ) {
+    case token::PLUS:
+        return "+";
+    case token::MINUS:
+        return "-";
+    case token::ASTERISK:
+        return "*";
+    case token::SLASH:
+        return "/";
+    case token::LT:
+        return "<";
+    case token::GT:
+        return ">";
+    case token::LE:
+        return "<=";
+    case token::GE:
+        return ">=";
+    case token::EQ:
+        return "==";
+    case token::NOT_EQ:
+        return "!=";
+    default:
+        return "";
+    }
+}
+
+bool isCompare(token::TokenType typ) {
+    switch (typ) {
+    case token::LT:
+    case token::GT:
+    case token::LE:
+    case token::GE:
+    case token::EQ:
+    case token::NOT_EQ:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool isCalc(token::TokenType typ) {
+    return typ == token::PLUS || typ == token::MINUS ||
+           typ == token::ASTERISK || typ == token::SLASH;
+}
+
+string quote(std::string_view str) {
+    string res = "\"";
+    for (unsigned char ch : str) {
+        if (ch == '"' || ch == '\\') {
+            res += '\\';
+            res += static_cast<char>(ch);
+        } else if (ch >= 0x20 && ch < 0x7f) {
+            res += static_cast<char>(ch);
+        } else {
+            res += std::format("\\{:03o}", ch);
+        }
+    }
+    return res + "\"";
+}
+
+// 非有限值没有字面量写法, 用 numeric_limits 表示, 符号位单独加上
+string doubleLiteral(double val) {
+    if (std::isinf(val) || std::isnan(val)) {
+        auto res = std::isinf(val) ? "std::numeric_limits<double>::infinity()"
+                                   : "std::numeric_limits<double>::quiet_NaN()";
+        return std::signbit(val) ? std::format("(-{})", res) : res;
+    }
+    auto res = std::format("{}", val);
+    if (res.find_first_of(".e") == string::npos) {
+        res += ".0";
+    }
+    return res;
+}
+
+using scope::containsReturn;
+using scope::endsWithReturn;
+using scope::isTrueLiteral;
+using scope::nodeAs;
+using scope::SymbolLess;
+using scope::SymbolSet;
+typedef scope::Function FnDef;
+
+struct Spec {
+    enum State { Running, Valid, Invalid } state = Running;
+    FnDef *def = nullptr;
+    vector<Ty> params;
+    Ty ret = Ty::Unknown;
+    string name;
+    string code;
+};
+
+struct Value {
+    string code;
+    Ty type;
+    bool trivial = false; // 没有副作用也不会抛出异常
+    bool effects = false; // 可能有副作用 (包含函数调用)
+};
+
+class Emitter;
+
+// 生成一个函数的通用版本或者特化版本
+// 先反复生成直到局部变量的类型不再变化, 最后一遍的结果才是输出
+class FrameEmitter {
+    private:
+    Emitter &E;
+    FnDef *def;
+    Spec *spec;
+    std::map<Symbol, Ty, SymbolLess> types;
+    bool final = false;
+    bool changed = false;
+    string out;
+    int depth = 1;
+    int counter = 0;
+    vector<int> whiles;
+    std::set<int> usedLabels;
+
+    string indent(int level) const {
+        return string(level * 4, ' ');
+    }
+    void line(const string &str) {
+        out += indent(depth) + str + "\n";
+    }
+
+    bool isLocal(Symbol sym) const {
+        return def->declared.count(sym) && !def->captured.count(sym);
+    }
+    Ty varType(Symbol sym) const {
+        if (!isLocal(sym) || def->unsafe.count(sym)) {
+            return Ty::Obj;
+        }
+        auto iter = types.find(sym);
+        if (iter == types.end()) {
+            return final ? Ty::Obj : Ty::Unknown;
+        }
+        return iter->second;
+    }
+    string localName(Symbol sym) const {
+        return "v_" + sym->str;
+    }
+    // 本函数环境, 没有被捕获的变量时直接使用外层环境
+    string envName() const {
+        if (def->isProgram()) {
+            return "globals";
+        }
+        return def->captured.empty() ? "self->Env" : "env";
+    }
+    string outerName() const {
+        return def->isProgram() ? "globals" : "self->Env";
+    }
+
+    Value binary(const Value &l, const Value &r, Ty typ, bool trivial,
+                 const std::function<string(const string &, const string &)>
+                     &op);
+    Value readIdent(ast::Identifier *ident);
+    Value emitExpr(ast::Expression *expr);
+    Value emitPrefix(ast::PrefixExpression *prefix);
+    Value emitInfix(ast::InfixExpression *infix);
+    Value emitCall(ast::CallExpression *call);
+    Value emitClosure(FnDef *fn);
+    Value emitIfValue(ast::IfExpression *ifexpr);
+    Value emitCondition(ast::Expression *expr);
+    Value emitLogicOperand(token::TokenType typ, ast::Expression *expr);
+    void emitBlockValue(Statements &stmts);
+    void emitStatements(Statements &stmts);
+    void emitStatement(ast::Statement *stmt);
+    void emitIf(ast::IfExpression *ifexpr);
+    void emitFor(ast::ForStatement *forstmt);
+    void emitReturn(ast::ReturnStatement *ret);
+    void assign(Symbol sym, const Value &val);
+
+    void pass() {
+        out.clear();
+        depth = 1;
+        counter = 0;
+        whiles.clear();
+        usedLabels.clear();
+        changed = false;
+        emitStatements(*def->body);
+    }
+
+    public:
+    FrameEmitter(Emitter &E, FnDef *def, Spec *spec)
+        : E(E), def(def), spec(spec) {
+    }
+    string run();
+};
+
+class Emitter {
+    private:
+    scope::Analysis *analysis = nullptr;
+    std::map<string, Spec> specs;
+    vector<Spec *> specOrder;
+    vector<FnDef *> functionOrder;
+    std::map<FnDef *, string> generics; // 生成好的通用版本, 不含开头的特化分派
+    std::unordered_map<Symbol, string> symbolNames;
+    vector<Symbol> symbolOrder;
+    std::map<string, string> builtinNames;
+
+    string dispatch(FnDef *fn) {
+        string res;
+        for (auto spec : specOrder) {
+            if (spec->def != fn) {
+                continue;
+            }
+            string check, args;
+            for (size_t i = 0; i < spec->params.size(); i++) {
+                static const char *names[] = {"", "Int", "Float", "Bool"};
+                static const char *classes[] = {"", "Integer", "Double",
+                                                "Boolean"};
+                auto typ = static_cast<int>(spec->params[i]);
+                check += std::format("{}object::type(args[{}]) == object::{}_Obj",
+                                     i == 0 ? "" : " && ", i, names[typ]);
+                args += std::format("{}object::getValue<object::{}>(args[{}])",
+                                    i == 0 ? "" : ", ", classes[typ], i);
+            }
+            if (check.empty()) {
+                check = "true";
+            }
+            res += std::format("    if ({}) {{\n        return aot::box({}({}));\n"
+                               "    }}\n",
+                               check, spec->name, args);
+        }
+        return res;
+    }
+
+    string specSignature(Spec *spec) {
+        string params;
+        for (size_t i = 0; i < spec->params.size(); i++) {
+            params += std::format("{}{} {}", i == 0 ? "" : ", ",
+                                  cppType(spec->params[i]),
+                                  "v_" + (*spec->def->params)[i]->sym->str);
+        }
+        return std::format("{} {}({})", cppType(spec->ret), spec->name, params);
+    }
+
+    public:
+    FnDef *defOf(ast::BlockStatement *block) {
+        return analysis->functionOf(block);
+    }
+    FnDef *knownCallee(FnDef *from, Symbol sym) {
+        return analysis->knownCallee(from, sym);
+    }
+    const std::map<Symbol, FnDef *, SymbolLess> &known() {
+        return analysis->known;
+    }
+
+    string symbolName(Symbol sym) {
+        auto iter = symbolNames.find(sym);
+        if (iter != symbolNames.end()) {
+            return iter->second;
+        }
+        symbolOrder.push_back(sym);
+        return symbolNames[sym] = std::format("S{}", symbolOrder.size() - 1);
+    }
+
+    // 从未被定义过的名字一定指向内置函数
+    bool isBuiltin(Symbol sym) {
+        return analysis->isBuiltin(sym);
+    }
+    string builtinName(Symbol sym) {
+        return builtinNames[sym->str] = "B_" + sym->str;
+    }
+
+    Spec *specFor(FnDef *fn, const vector<Ty> &params) {
+        string name = std::format("fn{}_", fn->id);
+        for (auto typ : params) {
+            name += typ == Ty::Int ? 'i' : typ == Ty::Float ? 'f' : 'b';
+        }
+        auto [iter, inserted] = specs.try_emplace(name);
+        auto spec = &iter->second;
+        if (!inserted) {
+            return spec;
+        }
+        spec->def = fn;
+        spec->params = params;
+        spec->name = name;
+        // 返回值类型依次假设为 int / float / bool, 递归调用按假设的类型生成
+        for (auto ret : {Ty::Int, Ty::Float, Ty::Bool}) {
+            spec->ret = ret;
+            try {
+                FrameEmitter frame(*this, fn, spec);
+                spec->code = frame.run();
+                if (!endsWithReturn(*fn->body)) {
+                    break;
+                }
+                spec->state = Spec::Valid;
+                specOrder.push_back(spec);
+                return spec;
+            } catch (SpecFail &) {
+            }
+        }
+        spec->state = Spec::Invalid;
+        return spec;
+    }
+
+    void emitGeneric(FnDef *fn) {
+        if (generics.count(fn)) {
+            return;
+        }
+        generics[fn];
+        FrameEmitter frame(*this, fn, nullptr);
+        generics[fn] = frame.run();
+        functionOrder.push_back(fn);
+    }
+
+    string emit(ast::Program *prog, const string &source) {
+        scope::Analysis scopes(prog);
+        analysis = &scopes;
+        FrameEmitter frame(*this, &scopes.program, nullptr);
+        auto main = frame.run();
+
+        string res;
+        res += std::format("// 由 waii --emit-cpp 从 {} 生成\n", source);
+        res += "// 编译: g++ -std=c++20 -O2 -I <waiicpp 源码目录> <本文件>\n";
+        res += "#include \"aot/runtime.cpp\"\n\nnamespace {\n\n";
+        res += "using aot::obj_ptr;\nusing std::vector;\n\n";
+        for (auto sym : symbolOrder) {
+            res += std::format("const symbol::Symbol {} = symbol::intern({});\n",
+                               symbolNames[sym], quote(sym->str));
+        }
+        for (auto &[name, var] : builtinNames) {
+            res += std::format("const object::BuiltinFunction &{} = "
+                               "object::BUILTINS.at({});\n",
+                               var, quote(name));
+        }
+        for (auto [sym, fn] : known()) {
+            res += std::format("bool bound{} = false; // {}\n", fn->id,
+                               sym->str);
+        }
+        res += "environment::env_ptr globals =\n"
+               "    std::make_shared<environment::Enviroment>();\n\n";
+        for (auto fn : functionOrder) {
+            res += std::format("obj_ptr fn{}(aot::CompiledFunction *self, "
+                               "const vector<obj_ptr> &args);\n",
+                               fn->id);
+        }
+        for (auto spec : specOrder) {
+            res += specSignature(spec) + ";\n";
+        }
+        for (auto fn : functionOrder) {
+            res += std::format("\nobj_ptr fn{}(aot::CompiledFunction *self, "
+                               "const vector<obj_ptr> &args) {{\n",
+                               fn->id);
+            res += dispatch(fn) + generics[fn] + "}\n";
+        }
+        for (auto spec : specOrder) {
+            res += "\n" + specSignature(spec) + " {\n" + spec->code + "}\n";
+        }
+        res += "\nvoid program() {\n" + main + "}\n\n} // namespace\n\n";
+        res += "int main() {\n    return aot::run(program);\n}\n";
+        return res;
+    }
+};
+
+string FrameEmitter::run() {
+    if (spec != nullptr) {
+        for (size_t i = 0; i < spec->params.size(); i++) {
+            types[(*def->params)[i]->sym] = spec->params[i];
+        }
+    } else if (def->params != nullptr) {
+        for (auto &param : *def->params) {
+            types[param->sym] = Ty::Obj;
+        }
+    }
+    // 推断到不动点, 仍然未知的变量视为对象后再推断一次
+    while (true) {
+        do {
+            pass();
+        } while (changed);
+        bool resolved = false;
+        for (auto sym : def->declared) {
+            if (isLocal(sym) && !types.count(sym)) {
+                types[sym] = Ty::Obj;
+                resolved = true;
+            }
+        }
+        if (!resolved) {
+            break;
+        }
+    }
+    final = true;
+    pass();
+
+    string head;
+    if (spec == nullptr && !def->isProgram()) {
+        if (!def->captured.empty()) {
+            head += "    auto env = std::make_shared<environment::Enviroment>("
+                    "self->Env);\n";
+        }
+        for (size_t i = 0; i < def->params->size(); i++) {
+            auto sym = (*def->params)[i]->sym;
+            if (isLocal(sym)) {
+                head += std::format("    obj_ptr {} = args[{}];\n",
+                                    localName(sym), i);
+            } else {
+                head += std::format("    env->set({}, args[{}]);\n",
+                                    E.symbolName(sym), i);
+            }
+        }
+    }
+    for (auto sym : def->declared) {
+        if (!isLocal(sym)) {
+            continue;
+        }
+        bool param = false;
+        if (def->params != nullptr) {
+            for (auto &p : *def->params) {
+                param |= p->sym == sym;
+            }
+        }
+        if (param) {
+            continue;
+        }
+        auto typ = varType(sym);
+        if (spec != nullptr && !isNative(typ)) {
+            throw SpecFail{};
+        }
+        head += std::format("    {} {}{};\n", cppType(typ), localName(sym),
+                            isNative(typ) ? "{}" : "");
+    }
+    if (spec == nullptr && !def->isProgram()) {
+        out += "    return object::_NULL;\n";
+    }
+    return head + out;
+}
+
+void FrameEmitter::assign(Symbol sym, const Value &val) {
+    if (!isLocal(sym)) {
+        if (spec != nullptr) {
+            throw SpecFail{};
+        }
+        line(std::format("{}->set({}, {});", envName(), E.symbolName(sym),
+                         boxCode(val.code, val.type)));
+        return;
+    }
+    if (!def->unsafe.count(sym)) {
+        auto old = types.count(sym) ? types[sym] : Ty::Unknown;
+        auto now = join(old, val.type);
+        if (now != old) {
+            types[sym] = now;
+            changed = true;
+        }
+    }
+    auto typ = varType(sym);
+    if (spec != nullptr && final && !isNative(typ)) {
+        throw SpecFail{};
+    }
+    line(std::format("{} = {};", localName(sym),
+                     isNative(typ) ? val.code : boxCode(val.code, val.type)));
+}
+
+// 两个操作数都可能有副作用时, 借助花括号初始化保证从左到右求值
+Value FrameEmitter::binary(
+    const Value &l, const Value &r, Ty typ, bool trivial,
+    const std::function<string(const string &, const string &)> &op) {
+    Value res{"", typ, trivial && l.trivial && r.trivial,
+              l.effects || r.effects};
+    if (spec == nullptr && !l.trivial && !r.trivial && res.effects) {
+        res.code = std::format(
+            "std::apply([](auto a, auto b) {{ return {}; }}, "
+            "std::tuple<{}, {}>{{{}, {}}})",
+            op("a", "b"), cppType(l.type), cppType(r.type), l.code, r.code);
+    } else {
+        res.code = op(l.code, r.code);
+    }
+    return res;
+}
+
+Value FrameEmitter::readIdent(ast::Identifier *ident) {
+    auto sym = ident->sym;
+    if (def->declared.count(sym)) {
+        if (!isLocal(sym)) {
+            return {std::format("aot::lookup({}, {})", envName(),
+                                E.symbolName(sym)),
+                    Ty::Obj};
+        }
+        auto typ = varType(sym);
+        if (spec != nullptr && final && !isNative(typ)) {
+            throw SpecFail{};
+        }
+        if (def->unsafe.count(sym)) {
+            return {std::format("aot::local({}, {}, {})", localName(sym),
+                                outerName(), E.symbolName(sym)),
+                    Ty::Obj};
+        }
+        return {localName(sym), typ, true};
+    }
+    if (spec != nullptr) {
+        throw SpecFail{};
+    }
+    if (E.isBuiltin(sym)) {
+        return {std::format("std::make_shared<object::BuiltIn>({})",
+                            E.builtinName(sym)),
+                Ty::Obj, true};
+    }
+    return {std::format("aot::lookup({}, {})", outerName(), E.symbolName(sym)),
+            Ty::Obj};
+}
+
+Value FrameEmitter::emitExpr(ast::Expression *expr) {
+    if (expr == nullptr) {
+        return {"object::_NULL", Ty::Obj, true};
+    }
+    if (auto lit = nodeAs<ast::IntegerLiteral>(expr)) {
+        return {std::to_string(lit->value), Ty::Int, true};
+    }
+    if (auto lit = nodeAs<ast::DoubleLiteral>(expr)) {
+        return {doubleLiteral(lit->value), Ty::Float, true};
+    }
+    if (auto lit = nodeAs<ast::BooleanLiteral>(expr)) {
+        return {lit->value ? "true" : "false", Ty::Bool, true};
+    }
+    if (auto lit = nodeAs<ast::StringLiteral>(expr)) {
+        if (spec != nullptr) {
+            throw SpecFail{};
+        }
+        auto sym = lit->sym != nullptr ? lit->sym : symbol::intern(lit->value);
+        return {std::format("aot::str({})", E.symbolName(sym)), Ty::Obj, true};
+    }
+    if (auto ident = nodeAs<ast::Identifier>(expr)) {
+        return readIdent(ident);
+    }
+    if (auto prefix = nodeAs<ast::PrefixExpression>(expr)) {
+        return emitPrefix(prefix);
+    }
+    if (auto infix = nodeAs<ast::InfixExpression>(expr)) {
+        return emitInfix(infix);
+    }
+    if (auto call = nodeAs<ast::CallExpression>(expr)) {
+        return emitCall(call);
+    }
+    if (spec != nullptr) {
+        throw SpecFail{};
+    }
+    if (auto ifexpr = nodeAs<ast::IfExpression>(expr)) {
+        return emitIfValue(ifexpr);
+    }
+    if (auto lit = nodeAs<ast::FunctionLiteral>(expr)) {
+        return emitClosure(E.defOf(lit->body().get()));
+    }
+    if (auto arr = nodeAs<ast::ArrayLiteral>(expr)) {
+        Value res{"", Ty::Obj};
+        for (auto &elem : arr->elements()) {
+            auto val = emitExpr(elem.get());
+            res.code += (res.code.empty() ? "" : ", ") +
+                        boxCode(val.code, val.type);
+            res.effects |= val.effects;
+        }
+        res.code = "aot::array({" + res.code + "})";
+        return res;
+    }
+    if (auto idx = nodeAs<ast::IndexExpression>(expr)) {
+        auto left = emitExpr(idx->left());
+        auto index = emitExpr(idx->index());
+        return binary(left, index, Ty::Obj, false,
+                      [&](const string &a, const string &b) {
+                          return std::format("aot::index({}, {})",
+                                             boxCode(a, left.type),
+                                             boxCode(b, index.type));
+                      });
+    }
+    if (auto hash = nodeAs<ast::HashLiteral>(expr)) {
+        Value res{"", Ty::Obj};
+        for (auto &pair : hash->pairs) {
+            auto key = emitExpr(pair.first.get());
+            auto val = emitExpr(pair.second.get());
+            res.code += std::format("{}{{{}, {}}}", res.code.empty() ? "" : ", ",
+                                    boxCode(key.code, key.type),
+                                    boxCode(val.code, val.type));
+            res.effects |= key.effects || val.effects;
+        }
+        res.code = "aot::hash({" + res.code + "})";
+        return res;
+    }
+    throw EmitError{"unsupported expression: " + expr->output()};
+}
+
+Value FrameEmitter::emitPrefix(ast::PrefixExpression *prefix) {
+    auto typ = prefix->TokenType();
+    auto val = emitExpr(prefix->right());
+    if (val.type == Ty::Unknown) {
+        return {"", Ty::Unknown};
+    }
+    if (typ == token::MINUS && val.type == Ty::Int) {
+        return {"aot::neg(" + val.code + ")", Ty::Int, val.trivial,
+                val.effects};
+    }
+    if (typ == token::MINUS && val.type == Ty::Float) {
+        return {"(-" + val.code + ")", Ty::Float, val.trivial, val.effects};
+    }
+    if (typ == token::BANG || typ == token::NOT) {
+        // 与 evalBangOperatorExpression 一致: 只有 false / 0 / null 取反为 true
+        switch (val.type) {
+        case Ty::Bool:
+            return {"(!" + val.code + ")", Ty::Bool, val.trivial, val.effects};
+        case Ty::Int:
+            return {"(" + val.code + " == 0)", Ty::Bool, val.trivial,
+                    val.effects};
+        case Ty::Float:
+            return {"((void)" + val.code + ", false)", Ty::Bool, val.trivial,
+                    val.effects};
+        default:
+            return {"aot::bang(" + val.code + ")", Ty::Bool, false,
+                    val.effects};
+        }
+    }
+    if (spec != nullptr) {
+        throw SpecFail{};
+    }
+    return {std::format("aot::prefix({}, {})", tokenName(typ),
+                        boxCode(val.code, val.type)),
+            Ty::Obj, false, val.effects};
+}
+
+Value FrameEmitter::emitInfix(ast::InfixExpression *infix) {
+    auto typ = infix->TokenType();
+    if (typ == token::AND || typ == token::OR) {
+        return emitCondition(infix);
+    }
+    auto left = emitExpr(infix->left());
+    auto right = emitExpr(infix->right());
+    if (left.type == Ty::Unknown || right.type == Ty::Unknown) {
+        return {"", Ty::Unknown, false, left.effects || right.effects};
+    }
+    bool numbers = (left.type == Ty::Int || left.type == Ty::Float) &&
+                   (right.type == Ty::Int || right.type == Ty::Float);
+    if (isCalc(typ) && numbers) {
+        if (left.type == Ty::Int && right.type == Ty::Int) {
+            static const std::map<token::TokenType, string> funcs = {
+                {token::PLUS, "aot::add"},
+                {token::MINUS, "aot::sub"},
+                {token::ASTERISK, "aot::mul"}};
+            if (typ == token::SLASH) {
+                return binary(left, right, Ty::Int, false,
+                              [](const string &a, const string &b) {
+                                  return "(" + a + " / " + b + ")";
+                              });
+            }
+            return binary(left, right, Ty::Int, true,
+                          [&](const string &a, const string &b) {
+                              return std::format("{}({}, {})", funcs.at(typ),
+                                                 a, b);
+                          });
+        }
+        return binary(left, right, Ty::Float, true,
+                      [&](const string &a, const string &b) {
+                          return std::format("(static_cast<double>({}) {} {})",
+                                             a, cppOperator(typ), b);
+                      });
+    }
+    if (isCompare(typ) && isNative(left.type) && isNative(right.type)) {
+        return binary(left, right, Ty::Bool, true,
+                      [&](const string &a, const string &b) {
+                          return std::format("({} {} {})", a, cppOperator(typ),
+                                             b);
+                      });
+    }
+    if (spec != nullptr) {
+        throw SpecFail{};
+    }
+    if (isCompare(typ)) {
+        return binary(left, right, Ty::Bool, false,
+                      [&](const string &a, const string &b) {
+                          return std::format("aot::compare({}, {}, {})",
+                                             tokenName(typ),
+                                             boxCode(a, left.type),
+                                             boxCode(b, right.type));
+                      });
+    }
+    return binary(left, right, Ty::Obj, false,
+                  [&](const string &a, const string &b) {
+                      return std::format("aot::infix({}, {}, {})",
+                                         tokenName(typ), boxCode(a, left.type),
+                                         boxCode(b, right.type));
+                  });
+}
+
+// if / while 的条件, 与 evalCondition 一致
+Value FrameEmitter::emitCondition(ast::Expression *expr) {
+    if (auto lit = nodeAs<ast::BooleanLiteral>(expr)) {
+        return {lit->value ? "true" : "false", Ty::Bool, true};
+    }
+    auto infix = nodeAs<ast::InfixExpression>(expr);
+    if (infix != nullptr &&
+        (infix->TokenType() == token::AND || infix->TokenType() == token::OR)) {
+        auto typ = infix->TokenType();
+        auto left = emitLogicOperand(typ, infix->left());
+        auto right = emitLogicOperand(typ, infix->right());
+        return {std::format("({} {} {})", left.code,
+                            typ == token::AND ? "&&" : "||", right.code),
+                Ty::Bool, left.trivial && right.trivial,
+                left.effects || right.effects};
+    }
+    auto val = emitExpr(expr);
+    switch (val.type) {
+    case Ty::Bool:
+        return val;
+    case Ty::Int:
+    case Ty::Float:
+        return {"(" + val.code + " != 0)", Ty::Bool, val.trivial, val.effects};
+    default:
+        return {"aot::truthy(" + val.code + ")", Ty::Bool, false, val.effects};
+    }
+}
+
+Value FrameEmitter::emitLogicOperand(token::TokenType typ,
+                                     ast::Expression *expr) {
+    auto infix = nodeAs<ast::InfixExpression>(expr);
+    if (infix != nullptr && (isCompare(infix->TokenType()) ||
+                             infix->TokenType() == token::AND ||
+                             infix->TokenType() == token::OR)) {
+        return emitCondition(expr);
+    }
+    auto val = emitExpr(expr);
+    switch (val.type) {
+    case Ty::Bool:
+        return val;
+    case Ty::Int:
+    case Ty::Float:
+        return {"(" + val.code + " != 0)", Ty::Bool, val.trivial, val.effects};
+    case Ty::Unknown:
+        return {"", Ty::Bool, false, val.effects};
+    default:
+        if (spec != nullptr) {
+            throw SpecFail{};
+        }
+        return {std::format("aot::logicOperand({}, {})", tokenName(typ),
+                            val.code),
+                Ty::Bool, false, val.effects};
+    }
+}
+
+Value FrameEmitter::emitCall(ast::CallExpression *call) {
+    auto callee = nodeAs<ast::Identifier>(call->function());
+    vector<Value> args;
+    bool effects = false, unknown = false;
+    for (auto &arg : call->arguments()) {
+        args.push_back(emitExpr(arg.get()));
+        effects |= args.back().effects;
+        unknown |= args.back().type == Ty::Unknown;
+    }
+    auto boxedArgs = [&]() {
+        string res;
+        for (auto &arg : args) {
+            res += (res.empty() ? "" : ", ") + boxCode(arg.code, arg.type);
+        }
+        return res;
+    };
+
+    // 名字一直绑定在同一个顶层函数上时直接调用, 参数都是原生类型就调用特化版本
+    FnDef *target = nullptr;
+    if (callee != nullptr) {
+        target = E.knownCallee(def, callee->sym);
+    }
+    if (target != nullptr && target->params->size() == args.size()) {
+        if (unknown) {
+            return {"", Ty::Unknown, false, true};
+        }
+        vector<Ty> types;
+        for (auto &arg : args) {
+            types.push_back(arg.type);
+        }
+        bool native = std::all_of(types.begin(), types.end(), isNative);
+        Spec *callSpec = nullptr;
+        bool self = spec != nullptr && target == def && types == spec->params;
+        if (self) {
+            callSpec = spec;
+        } else if (native) {
+            callSpec = E.specFor(target, types);
+            if (callSpec->state != Spec::Valid) {
+                callSpec = nullptr;
+            }
+        }
+        if (callSpec != nullptr) {
+            string list;
+            for (auto &arg : args) {
+                list += (list.empty() ? "" : ", ") + arg.code;
+            }
+            string code;
+            if (spec == nullptr && effects && args.size() > 1) {
+                string tuple;
+                for (auto typ : types) {
+                    tuple += (tuple.empty() ? "" : ", ") + cppType(typ);
+                }
+                code = std::format("std::apply({}, std::tuple<{}>{{{}}})",
+                                   callSpec->name, tuple, list);
+            } else {
+                code = std::format("{}({})", callSpec->name, list);
+            }
+            if (!self) {
+                code = std::format("(aot::bound(bound{}, {}), {})", target->id,
+                                   E.symbolName(callee->sym), code);
+            }
+            return {code, callSpec->ret, false, true};
+        }
+    }
+    if (spec != nullptr) {
+        throw SpecFail{};
+    }
+    if (callee != nullptr && E.isBuiltin(callee->sym)) {
+        return {std::format("{}({{{}}})", E.builtinName(callee->sym),
+                            boxedArgs()),
+                Ty::Obj, false, true};
+    }
+    auto func = emitExpr(call->function());
+    return {std::format("aot::call({{{}, {{{}}}}})", func.code, boxedArgs()),
+            Ty::Obj, false, true};
+}
+
+Value FrameEmitter::emitClosure(FnDef *fn) {
+    if (final) {
+        E.emitGeneric(fn);
+    }
+    string signature = "fn(";
+    for (size_t i = 0; i < fn->params->size(); i++) {
+        signature += (i == 0 ? "" : ",") + (*fn->params)[i]->value;
+    }
+    signature += ")";
+    return {std::format("aot::closure(fn{}, {}, {}, {}, {})", fn->id,
+                        envName(), fn->params->size(), quote(signature),
+                        quote(fn->block->output())),
+            Ty::Obj, true};
+}
+
+// 作为值使用的 if, 生成一个立即调用的 lambda, 值为分支最后一条语句的值
+Value FrameEmitter::emitIfValue(ast::IfExpression *ifexpr) {
+    for (auto cur = ifexpr; cur != nullptr; cur = cur->alternative()) {
+        if (containsReturn(cur->consequence()->statements())) {
+            throw EmitError{"return inside if expression used as a value"};
+        }
+    }
+    auto saved = std::move(out);
+    auto savedDepth = depth;
+    out.clear();
+    depth++;
+    bool first = true;
+    for (auto cur = ifexpr; cur != nullptr; cur = cur->alternative()) {
+        if (!first && isTrueLiteral(cur->condition())) {
+            line("} else {");
+        } else {
+            auto cond = emitCondition(cur->condition());
+            line(std::format("{}if ({}) {{", first ? "" : "} else ",
+                             cond.code));
+        }
+        first = false;
+        depth++;
+        emitBlockValue(cur->consequence()->statements());
+        depth--;
+    }
+    line("}");
+    line("return object::_NULL;");
+    depth = savedDepth;
+    auto body = std::move(out);
+    out = std::move(saved);
+    return {"[&]() -> obj_ptr {\n" + body + indent(depth) + "}()", Ty::Obj,
+            false, true};
+}
+
+void FrameEmitter::emitBlockValue(Statements &stmts) {
+    for (size_t i = 0; i + 1 < stmts.size(); i++) {
+        emitStatement(stmts[i].get());
+    }
+    auto last = stmts.empty() ? nullptr
+                              : nodeAs<ast::ExpressionStatement>(
+                                    stmts.back().get());
+    if (last != nullptr && last->expression() != nullptr) {
+        auto val = emitExpr(last->expression());
+        line("return " + boxCode(val.code, val.type) + ";");
+        return;
+    }
+    if (!stmts.empty()) {
+        emitStatement(stmts.back().get());
+    }
+    line("return object::_NULL;");
+}
+
+void FrameEmitter::emitStatements(Statements &stmts) {
+    for (auto &stmt : stmts) {
+        emitStatement(stmt.get());
+    }
+}
+
+void FrameEmitter::emitStatement(ast::Statement *stmt) {
+    if (auto let = nodeAs<ast::LetStatement>(stmt)) {
+        auto sym = let->name()->sym;
+        assign(sym, emitExpr(let->value()));
+        if (def->isProgram() && E.known().count(sym)) {
+            line(std::format("bound{} = true;", E.known().at(sym)->id));
+        }
+        return;
+    }
+    if (auto fnstmt = nodeAs<ast::FunctionStatement>(stmt)) {
+        if (spec != nullptr) {
+            throw SpecFail{};
+        }
+        auto sym = fnstmt->name()->sym;
+        assign(sym, emitClosure(E.defOf(fnstmt->body().get())));
+        if (def->isProgram() && E.known().count(sym)) {
+            line(std::format("bound{} = true;", E.known().at(sym)->id));
+        }
+        return;
+    }
+    if (auto ret = nodeAs<ast::ReturnStatement>(stmt)) {
+        emitReturn(ret);
+        return;
+    }
+    if (auto exprStmt = nodeAs<ast::ExpressionStatement>(stmt)) {
+        if (exprStmt->expression() == nullptr) {
+            return;
+        }
+        if (auto ifexpr = nodeAs<ast::IfExpression>(exprStmt->expression())) {
+            emitIf(ifexpr);
+            return;
+        }
+        auto val = emitExpr(exprStmt->expression());
+        if (!val.trivial) {
+            line("(void)" + val.code + ";");
+        }
+        return;
+    }
+    if (auto block = nodeAs<ast::BlockStatement>(stmt)) {
+        line("{");
+        depth++;
+        emitStatements(block->statements());
+        depth--;
+        line("}");
+        return;
+    }
+    if (auto whilestmt = nodeAs<ast::WhileStatement>(stmt)) {
+        int id = counter++;
+        auto cond = emitCondition(whilestmt->condition());
+        line("while (" + cond.code + ") {");
+        depth++;
+        whiles.push_back(id);
+        line("{");
+        depth++;
+        emitStatements(whilestmt->body()->statements());
+        depth--;
+        line("}");
+        whiles.pop_back();
+        if (usedLabels.count(id)) {
+            line(std::format("next{}:;", id));
+        }
+        depth--;
+        line("}");
+        return;
+    }
+    if (auto forstmt = nodeAs<ast::ForStatement>(stmt)) {
+        emitFor(forstmt);
+        return;
+    }
+    throw EmitError{"unsupported statement: " + stmt->output()};
+}
+
+void FrameEmitter::emitIf(ast::IfExpression *ifexpr) {
+    bool first = true;
+    for (auto cur = ifexpr; cur != nullptr; cur = cur->alternative()) {
+        if (!first && isTrueLiteral(cur->condition())) {
+            line("} else {");
+        } else {
+            auto cond = emitCondition(cur->condition());
+            line(std::format("{}if ({}) {{", first ? "" : "} else ",
+                             cond.code));
+        }
+        first = false;
+        depth++;
+        emitStatements(cur->consequence()->statements());
+        depth--;
+    }
+    line("}");
+}
+
+// 解释器里 while 会丢弃循环体中 return 的结果并进入下一次循环, 这里保持一致
+void FrameEmitter::emitReturn(ast::ReturnStatement *ret) {
+    auto val = emitExpr(ret->returnValue());
+    if (!whiles.empty()) {
+        if (!val.trivial) {
+            line("(void)" + val.code + ";");
+        }
+        line(std::format("goto next{};", whiles.back()));
+        usedLabels.insert(whiles.back());
+        return;
+    }
+    if (spec != nullptr) {
+        if (val.type != Ty::Unknown && val.type != spec->ret) {
+            throw SpecFail{};
+        }
+        line("return " + val.code + ";");
+    } else if (def->isProgram()) {
+        if (!val.trivial) {
+            line("(void)" + val.code + ";");
+        }
+        line("return;");
+    } else {
+        line("return " + boxCode(val.code, val.type) + ";");
+    }
+}
+
+void FrameEmitter::emitFor(ast::ForStatement *forstmt) {
+    int id = counter++;
+    auto sym = forstmt->name()->sym;
+    // for (x in range(...)) 的参数都是 int 时直接计数
+    auto call = nodeAs<ast::CallExpression>(forstmt->range());
+    auto callee = call != nullptr ? nodeAs<ast::Identifier>(call->function())
+                                  : nullptr;
+    if (callee != nullptr && callee->sym->str == "range" &&
+        E.isBuiltin(callee->sym) && !call->arguments().empty() &&
+        call->arguments().size() <= 3) {
+        vector<Value> args;
+        bool ints = true, unknown = false;
+        for (auto &arg : call->arguments()) {
+            args.push_back(emitExpr(arg.get()));
+            ints &= args.back().type == Ty::Int;
+            unknown |= args.back().type == Ty::Unknown;
+        }
+        if (ints || unknown) {
+            string list;
+            for (auto &arg : args) {
+                list += (list.empty() ? "" : ", ") + arg.code;
+            }
+            line("{");
+            depth++;
+            line(std::format("aot::Counter range{}{{{}}};", id, list));
+            line(std::format("int item{};", id));
+            line(std::format("while (range{}.next(item{})) {{", id, id));
+            depth++;
+            assign(sym, {std::format("item{}", id), unknown ? Ty::Unknown
+                                                             : Ty::Int,
+                         true});
+            line("{");
+            depth++;
+            emitStatements(forstmt->body()->statements());
+            depth--;
+            line("}");
+            depth--;
+            line("}");
+            depth--;
+            line("}");
+            return;
+        }
+    }
+    if (spec != nullptr) {
+        throw SpecFail{};
+    }
+    auto range = emitExpr(forstmt->range());
+    line("{");
+    depth++;
+    // 迭代器引用着被迭代的对象, 需要保存到循环结束
+    line(std::format("auto range{} = {};", id,
+                     boxCode(range.code, range.type)));
+    line(std::format("auto iter{} = aot::iterate(range{});", id, id));
+    line(std::format("while (auto item{} = iter{}->next()) {{", id, id));
+    depth++;
+    assign(sym, {std::format("item{}", id), Ty::Obj, true});
+    line("{");
+    depth++;
+    emitStatements(forstmt->body()->statements());
+    depth--;
+    line("}");
+    depth--;
+    line("}");
+    depth--;
+    line("}");
+}
+
+} // namespace aot
@@ -0,0 +1,224 @@
+#pragma once
+
+// --emit-cpp 生成的程序所依赖的运行时
+// 对象模型, 内置函数和动态类型的运算全部复用解释器的实现,
+// 这里只补充编译后的函数对象以及生成代码里用到的一些小函数
+#include "../eval/eval.cpp"
+#include <initializer_list>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace aot {
+
+using environment::env_ptr;
+using object::obj_ptr;
+using std::string;
+using std::vector;
+
+class CompiledFunction;
+typedef obj_ptr (*Code)(CompiledFunction *self, const vector<obj_ptr> &args);
+
+// 编译后的函数, 和 FunctionObject 一样按词法作用域捕获环境
+// Signature / Body 只用于打印, 与解释器里函数的 Inspect 结果一致
+class CompiledFunction : public object::Object {
+    public:
+    Code Fn;
+    env_ptr Env;
+    size_t Arity;
+    const char *Signature;
+    const char *Body;
+
+    CompiledFunction(Code fn, env_ptr env, size_t arity, const char *signature,
+                     const char *body)
+        : Fn(fn), Env(env), Arity(arity), Signature(signature), Body(body) {
+    }
+    object::Type ObjectType() {
+        return object::Function_Obj;
+    }
+    string Inspect() {
+        object::Inspector out;
+        InspectTo(out);
+        return out.take();
+    }
+    void InspectTo(object::Inspector &out) {
+        out.write(Signature);
+        out.format(" {{{}}}", Body);
+    }
+};
+
+obj_ptr closure(Code fn, env_ptr env, size_t arity, const char *signature,
+                const char *body) {
+    return std::make_shared<CompiledFunction>(fn, env, arity, signature, body);
+}
+
+// 被调用的函数和参数放在同一个花括号初始化列表里, 保证从左到右求值
+struct Call {
+    obj_ptr fn;
+    vector<obj_ptr> args;
+};
+
+obj_ptr call(const Call &c) {
+    if (auto func = dynamic_cast<CompiledFunction *>(c.fn.get())) {
+        if (func->Arity != c.args.size()) {
+            throw object::newError("function {} expected {} arguments, got {}",
+                                   func->Signature, func->Arity,
+                                   c.args.size());
+        }
+        return func->Fn(func, c.args);
+    }
+    return eval::applyFunction(c.fn, c.args);
+}
+
+// 与 evalIdentifer 相同: 先查环境, 再查内置函数
+obj_ptr lookup(const env_ptr &env, symbol::Symbol sym) {
+    if (env != nullptr) {
+        auto [ok, val] = env->get(sym);
+        if (ok) {
+            return val;
+        }
+    }
+    auto iter = object::BUILTINS.find(sym->str);
+    if (iter != object::BUILTINS.end()) {
+        return std::make_shared<object::BuiltIn>(iter->second);
+    }
+    throw object::newError("identifier not found: {}", sym->str);
+}
+
+// 可能还没有赋值的局部变量, 没有赋值时和解释器一样到外层查找
+obj_ptr local(const obj_ptr &val, const env_ptr &outer, symbol::Symbol sym) {
+    if (val != nullptr) {
+        return val;
+    }
+    return lookup(outer, sym);
+}
+
+void bound(bool flag, symbol::Symbol sym) {
+    if (!flag) {
+        throw object::newError("identifier not found: {}", sym->str);
+    }
+}
+
+obj_ptr box(int val) {
+    return std::make_shared<object::Integer>(val);
+}
+obj_ptr box(double val) {
+    return std::make_shared<object::Double>(val);
+}
+obj_ptr box(bool val) {
+    return eval::nativeBoolToObject(val);
+}
+obj_ptr box(obj_ptr val) {
+    return val;
+}
+
+// 整数运算按补码回绕, 与解释器在常见平台上的行为一致, 同时避免有符号溢出的未定义行为
+int add(int a, int b) {
+    return static_cast<int>(static_cast<unsigned>(a) + static_cast<unsigned>(b));
+}
+int sub(int a, int b) {
+    return static_cast<int>(static_cast<unsigned>(a) - static_cast<unsigned>(b));
+}
+int mul(int a, int b) {
+    return static_cast<int>(static_cast<unsigned>(a) * static_cast<unsigned>(b));
+}
+int neg(int a) {
+    return static_cast<int>(0u - static_cast<unsigned>(a));
+}
+
+obj_ptr infix(token::TokenType typ, const obj_ptr &left, const obj_ptr &right) {
+    return eval::evalInfixExpression(typ, left, right);
+}
+obj_ptr prefix(token::TokenType typ, const obj_ptr &val) {
+    return eval::evalPrefixExpression(typ, val);
+}
+bool bang(const obj_ptr &val) {
+    return eval::evalBangOperatorExpression(val) == object::_TRUE;
+}
+bool compare(token::TokenType typ, const obj_ptr &left,
+             const obj_ptr &right) {
+    return eval::isTrue(eval::evalLogicExpression(typ, left, right));
+}
+bool truthy(const obj_ptr &val) {
+    return eval::isTrue(val);
+}
+
+// and / or 的操作数, 与 evalLogicOperand 一致只接受数字和布尔
+bool logicOperand(token::TokenType typ, const obj_ptr &val) {
+    auto typVal = object::type(val);
+    if (typVal != object::Int_Obj && typVal != object::Float_Obj &&
+        typVal != object::Bool_Obj) {
+        throw object::newError("unsupported operand for {}: {}",
+                               token::TypeToSymbol(typ),
+                               object::TypeToString(typVal));
+    }
+    return eval::isTrue(val);
+}
+
+obj_ptr index(const obj_ptr &left, const obj_ptr &idx) {
+    return eval::evalIndexExpression(left, idx);
+}
+
+obj_ptr array(vector<obj_ptr> elements) {
+    return std::make_shared<object::Array>(std::move(elements));
+}
+
+obj_ptr hash(std::initializer_list<std::pair<obj_ptr, obj_ptr>> pairs) {
+    auto res = std::make_shared<object::Hash>();
+    for (auto [key, val] : pairs) {
+        res->insert(key, val);
+    }
+    return res;
+}
+
+obj_ptr str(symbol::Symbol sym) {
+    return std::make_shared<object::String>(sym);
+}
+
+std::unique_ptr<object::Iterator> iterate(const obj_ptr &val) {
+    auto iterable = dynamic_cast<object::Iterable *>(val.get());
+    if (iterable == nullptr) {
+        throw object::newError("object is not iterable: {}",
+                               object::TypeToString(object::type(val)));
+    }
+    return iterable->iterate(val);
+}
+
+// for (i in range(...)) 在参数都是整数时直接计数, 不创建 Range 和 Integer
+class Counter {
+    private:
+    long long cur, end, step;
+
+    public:
+    Counter(int end) : Counter(0, end, 1) {
+    }
+    Counter(int start, int end, int step = 1)
+        : cur(start), end(end), step(step) {
+        if (step == 0) {
+            throw object::newError("range step must not be zero");
+        }
+    }
+    bool next(int &val) {
+        if (step > 0 ? cur >= end : cur <= end) {
+            return false;
+        }
+        val = static_cast<int>(cur);
+        cur += step;
+        return true;
+    }
+};
+
+int run(void (*program)()) {
+    auto &out = output::out();
+    try {
+        program();
+    } catch (object::ErrorObject &e) {
+        out.write(e.Inspect());
+    }
+    out.flush();
+    return 0;
+}
+
+} // namespace aot
@@ -3,11 +3,17 @@
 // #define DEBUG
 
 #include "../lexer/token/token.hpp"
+#include <atomic>
+#include <cstdint>
 #include <format>
 #include <memory>
 #include <string>
 #include <vector>
 
+namespace object {
+class Object;
+}
+
 namespace ast {
 
 using std::format;
@@ -15,6 +21,7 @@ using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
+using std::weak_ptr;
 using token::Token;
 class Node {
     public:
@@ -76,18 +83,27 @@ class Program : public Node {
 class Identifier : public Expression {
     public:
     Token token;
-    string value;
+    symbol::Symbol sym;
+    const string &value; // 就是 sym 里驻留的字符串
+    // 只可能绑定在全局环境里, 由 scope::markGlobals 标出
+    bool global = false;
+    // 上次在全局环境里找到的绑定, 由 eval::evalIdentifer 维护
+    uint64_t cacheRoot = 0;
+    shared_ptr<object::Object> *cacheSlot = nullptr;
 
     public:
     string expressionNode() {
         return "";
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
 
     public:
-    Identifier(Token token, string val) : token(token), value(val) {
+    explicit Identifier(Token token)
+        : token(token),
+          sym(token.Sym != nullptr ? token.Sym : symbol::intern(token.Literal)),
+          value(sym->str) {
     }
     string output() {
 #ifdef DEBUG
@@ -114,7 +130,7 @@ class LetStatement : public Statement {
         return "";
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
 #ifdef DEUBG
@@ -136,7 +152,7 @@ class ReturnStatement : public Statement {
         return ReturnValue.get();
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
 #ifdef DEUBG
@@ -157,7 +173,7 @@ class ExpressionStatement : public Statement {
         return _expression.get();
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
 #ifdef DEBUG
@@ -169,18 +185,30 @@ class ExpressionStatement : public Statement {
 };
 
 class BlockStatement : public Statement {
+    static uint64_t nextSerial() {
+        static std::atomic<uint64_t> count = 0;
+        return count.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
     public:
     Token token;
     vector<unique_ptr<Statement>> Statements;
+    // 优化前的写法, 函数体被改写之后打印函数时仍然显示源码的样子
+    string Source;
+    // 进程内唯一的编号. 地址在函数体释放后可能分给新的函数体, 编号不会
+    uint64_t serial = nextSerial();
 
     public:
     vector<unique_ptr<Statement>> &statements() {
         return Statements;
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
+        if (!Source.empty()) {
+            return Source;
+        }
         string res;
         for (auto &x : Statements) {
             res += x->output() + '\n';
@@ -208,7 +236,7 @@ class FunctionStatement : public Statement {
         return Body;
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
         string res = "fn " + Name->TokenLiteral() + "(";
@@ -244,7 +272,7 @@ class ForStatement : public Statement {
         return Range.get();
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
         return format("for({} in {}){{{}}}", SafeOutput(Name.get()),
@@ -254,12 +282,12 @@ class ForStatement : public Statement {
 
 class IntegerLiteral : public Expression {
     public:
-    Token token;
+    Token token; // Literal 只在语法分析期间有效, 之后以 value 为准
     int value;
 
     public:
     string TokenLiteral() {
-        return token.Literal;
+        return format("{}", value);
     }
     string output() {
 #ifdef DEBUG
@@ -272,12 +300,12 @@ class IntegerLiteral : public Expression {
 
 class DoubleLiteral : public Expression {
     public:
-    Token token;
+    Token token; // Literal 只在语法分析期间有效, 之后以 value 为准
     double value;
 
     public:
     string TokenLiteral() {
-        return token.Literal;
+        return format("{}", value);
     }
     string output() {
 #ifdef DEBUG
@@ -298,7 +326,7 @@ class BooleanLiteral : public Expression {
     BooleanLiteral(Token token, bool val) : token(token), value(val) {
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
 #ifdef DEBUG
@@ -313,10 +341,11 @@ class StringLiteral : public Expression {
     public:
     Token token;
     string value;
+    symbol::Symbol sym = nullptr;
 
     public:
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
 #ifdef DEBUG
@@ -327,6 +356,22 @@ class StringLiteral : public Expression {
     }
 };
 
+// 优化时预先构造好的不可变数组或哈希字面量, 每次求值都返回同一个对象
+class ConstantLiteral : public Expression {
+    public:
+    Token token;
+    shared_ptr<object::Object> value;
+    string source;
+
+    public:
+    string TokenLiteral() {
+        return string(token.Literal);
+    }
+    string output() {
+        return source;
+    }
+};
+
 class HashLiteral : public Expression {
     public:
     Token token;
@@ -334,7 +379,7 @@ class HashLiteral : public Expression {
 
     public:
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
 #ifdef DEBUG
@@ -365,7 +410,7 @@ class PrefixExpression : public Expression {
         return Right.get();
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     token::TokenType TokenType() {
         return token.Type;
@@ -389,7 +434,7 @@ class InfixExpression : public Expression {
         return Right.get();
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     token::TokenType TokenType() {
         return token.Type;
@@ -418,7 +463,7 @@ class IfExpression : public Expression {
         return Alternative.get();
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
 #ifdef DEBUG
@@ -447,7 +492,7 @@ class FunctionLiteral : public Expression {
         return Body;
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
         string res = "fn(";
@@ -474,7 +519,7 @@ class ArrayLiteral : public Expression {
         return Elements;
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
         string res;
@@ -503,7 +548,7 @@ class IndexExpression : public Expression {
         return Index.get();
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
         return format("({}[{}])", SafeOutput(Left.get()),
@@ -516,6 +561,9 @@ class CallExpression : public Expression {
     Token token;
     unique_ptr<Expression> Function;
     vector<unique_ptr<Expression>> Arguments;
+    // 上次调用的函数, 已经确认参数个数相符. 不持有它: 函数体里的调用点
+    // 持有函数本身时, 函数 -> 函数体 -> 调用点 -> 函数 成环, 永远不释放
+    weak_ptr<object::Object> cacheCallee;
 
     public:
     vector<unique_ptr<Expression>> &arguments() {
@@ -525,7 +573,7 @@ class CallExpression : public Expression {
         return Function.get();
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
         string res;
@@ -555,7 +603,7 @@ class WhileStatement : public Statement {
         return Body.get();
     }
     string TokenLiteral() {
-        return token.Literal;
+        return string(token.Literal);
     }
     string output() {
         return format("while({}){{{}}}", SafeOutput(Condition.get()),
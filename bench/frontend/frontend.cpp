@@ -0,0 +1,206 @@
+#include "../../lexer/lexer.cpp"
+#include "../../parser/parser.cpp"
+#include "../../parser/parser_func.cpp"
+#include "gen.cpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <new>
+#include <string_view>
+
+// 词法和语法分析的吞吐
+// 用法: frontend [--size=字节数] [--repeat=次数] [--emit=种类] [种类...]
+// 对每种合成源码分别计时 NextToken 扫完整个输入和 ParserProgram,
+// 各取最快的一次. 语法分析的时间包括它调用的词法分析.
+// 语法树占用的字节数是分析前后存活的堆内存之差, 由下面替换的
+// operator new 统计
+using namespace std;
+
+namespace {
+
+size_t liveBytes = 0;
+
+// 每块前面留 16 字节记录大小, 保持对齐
+constexpr size_t header = 16;
+
+double seconds(auto &&func) {
+    auto start = chrono::steady_clock::now();
+    func();
+    return chrono::duration<double>(chrono::steady_clock::now() - start)
+        .count();
+}
+
+size_t children(ast::Node *node);
+
+size_t countNodes(ast::Node *node) {
+    return node == nullptr ? 0 : 1 + children(node);
+}
+
+template <typename List>
+size_t countAll(List &list) {
+    size_t res = 0;
+    for (auto &item : list) {
+        res += countNodes(item.get());
+    }
+    return res;
+}
+
+size_t children(ast::Node *node) {
+    using namespace ast;
+    if (auto program = node->cast<Program>()) {
+        return countAll(program->Statements);
+    } else if (auto let = node->cast<LetStatement>()) {
+        return countNodes(let->Name.get()) + countNodes(let->Value.get());
+    } else if (auto ret = node->cast<ReturnStatement>()) {
+        return countNodes(ret->ReturnValue.get());
+    } else if (auto stmt = node->cast<ExpressionStatement>()) {
+        return countNodes(stmt->_expression.get());
+    } else if (auto block = node->cast<BlockStatement>()) {
+        return countAll(block->Statements);
+    } else if (auto fn = node->cast<FunctionStatement>()) {
+        return countNodes(fn->Name.get()) + countAll(fn->Parameters) +
+               countNodes(fn->Body.get());
+    } else if (auto loop = node->cast<ForStatement>()) {
+        return countNodes(loop->Name.get()) + countNodes(loop->Range.get()) +
+               countNodes(loop->Body.get());
+    } else if (auto loop = node->cast<WhileStatement>()) {
+        return countNodes(loop->Condition.get()) +
+               countNodes(loop->Body.get());
+    } else if (auto hash = node->cast<HashLiteral>()) {
+        size_t res = 0;
+        for (auto &[key, value] : hash->pairs) {
+            res += countNodes(key.get()) + countNodes(value.get());
+        }
+        return res;
+    } else if (auto prefix = node->cast<PrefixExpression>()) {
+        return countNodes(prefix->Right.get());
+    } else if (auto infix = node->cast<InfixExpression>()) {
+        return countNodes(infix->Left.get()) + countNodes(infix->Right.get());
+    } else if (auto cond = node->cast<IfExpression>()) {
+        return countNodes(cond->Condition.get()) +
+               countNodes(cond->Consequence.get()) +
+               countNodes(cond->Alternative.get());
+    } else if (auto fn = node->cast<FunctionLiteral>()) {
+        return countAll(fn->Parameters) + countNodes(fn->Body.get());
+    } else if (auto array = node->cast<ArrayLiteral>()) {
+        return countAll(array->Elements);
+    } else if (auto index = node->cast<IndexExpression>()) {
+        return countNodes(index->Left.get()) + countNodes(index->Index.get());
+    } else if (auto call = node->cast<CallExpression>()) {
+        return countNodes(call->Function.get()) + countAll(call->Arguments);
+    }
+    return 0;
+}
+
+struct Result {
+    size_t tokens = 0;
+    size_t nodes = 0;
+    size_t astBytes = 0;
+    double lex = 1e300;
+    double parse = 1e300;
+};
+
+Result measure(const string &source, int repeat) {
+    Result res;
+    for (int i = 0; i < repeat; i++) {
+        lexer::Lexer lex(source);
+        size_t tokens = 0;
+        res.lex = min(res.lex, seconds([&] {
+                          while (lex.NextToken().Type != token::END) {
+                              tokens++;
+                          }
+                      }));
+        res.tokens = tokens;
+    }
+    // 词法分析已经把所有名字放进了符号表, 这里的差值只剩语法树
+    for (int i = 0; i < repeat; i++) {
+        lexer::Lexer lex(source);
+        unique_ptr<ast::Program> program;
+        vector<string> errors;
+        auto before = liveBytes;
+        res.parse = min(res.parse, seconds([&] {
+                            parser::Parser parser(&lex);
+                            program = parser.ParserProgram();
+                            errors = move(parser.errors);
+                        }));
+        res.astBytes = liveBytes - before;
+        if (!errors.empty()) {
+            cerr << "generated source does not parse: " << errors[0] << endl;
+            exit(1);
+        }
+        res.nodes = countNodes(program.get());
+    }
+    return res;
+}
+
+} // namespace
+
+void *operator new(size_t size) {
+    auto block = static_cast<char *>(malloc(size + header));
+    if (block == nullptr) {
+        throw bad_alloc();
+    }
+    *reinterpret_cast<size_t *>(block) = size;
+    liveBytes += size;
+    return block + header;
+}
+
+void operator delete(void *ptr) noexcept {
+    if (ptr == nullptr) {
+        return;
+    }
+    auto block = static_cast<char *>(ptr) - header;
+    liveBytes -= *reinterpret_cast<size_t *>(block);
+    free(block);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+int main(int argc, char *argv[]) {
+    size_t size = 4 << 20;
+    int repeat = 5;
+    vector<string> kinds;
+    string emit;
+    for (int i = 1; i < argc; i++) {
+        string_view arg = argv[i];
+        if (arg.starts_with("--size=")) {
+            size = stoul(string(arg.substr(7)));
+        } else if (arg.starts_with("--repeat=")) {
+            repeat = max(1, stoi(string(arg.substr(9))));
+        } else if (arg.starts_with("--emit=")) {
+            emit = arg.substr(7);
+        } else {
+            kinds.emplace_back(arg);
+        }
+    }
+    // 只输出生成的源码, 可以交给 waii 测启动时间
+    if (!emit.empty()) {
+        cout << gen::generate(emit, size);
+        return 0;
+    }
+    if (kinds.empty()) {
+        kinds.assign(begin(gen::kinds), end(gen::kinds));
+    }
+    cout << format("{:<10} {:>9} {:>9} {:>9} {:>11} {:>9} {:>9} {:>11} {:>8}\n",
+                   "kind", "bytes", "tokens", "lex MB/s", "tokens/s",
+                   "nodes", "parse MB/s", "nodes/s", "AST B/B");
+    for (auto &kind : kinds) {
+        auto source = gen::generate(kind, size);
+        if (source.empty()) {
+            cerr << "unknown kind " << kind << endl;
+            return 1;
+        }
+        auto r = measure(source, repeat);
+        double mb = source.size() / 1e6;
+        cout << format(
+            "{:<10} {:>9} {:>9} {:>9.1f} {:>11.0f} {:>9} {:>10.1f} {:>11.0f} "
+            "{:>8.1f}\n",
+            kind, source.size(), r.tokens, mb / r.lex, r.tokens / r.lex,
+            r.nodes, mb / r.parse, r.nodes / r.parse,
+            double(r.astBytes) / source.size());
+    }
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cstdint>
+#include <format>
+#include <string>
+#include <string_view>
+
+// 合成源码, 同样的种类和大小总是生成同样的程序
+namespace gen {
+
+using std::string;
+
+const char *const kinds[] = {"nested", "idents", "literals", "functions"};
+
+namespace {
+
+class Random {
+    private:
+    uint64_t state = 0x9e3779b97f4a7c15;
+
+    public:
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+    // [0, n)
+    int below(int n) {
+        return static_cast<int>(next() % n);
+    }
+};
+
+const char *const operators[] = {"+", "-", "*", "/", "<", ">", "==", "!="};
+const char *const syllables[] = {"al", "be", "cor", "dan", "ex",  "fi",
+                                 "gor", "hu", "ip",  "ja",  "kel", "lo",
+                                 "mu", "nar", "os", "pe",  "qui", "ru"};
+
+string identifier(Random &rng) {
+    string res;
+    for (int i = 0, n = 2 + rng.below(3); i < n; i++) {
+        res += syllables[rng.below(std::size(syllables))];
+    }
+    if (rng.below(2) == 0) {
+        res += std::format("_{}", rng.below(100));
+    }
+    return res;
+}
+
+string literal(Random &rng) {
+    switch (rng.below(5)) {
+    case 0:
+        return std::to_string(rng.below(100000));
+    case 1:
+        return std::format("{}.{}", rng.below(1000), rng.below(100));
+    case 2:
+        return std::format("\"{}\"", identifier(rng));
+    case 3:
+        return rng.below(2) == 0 ? "true" : "false";
+    default:
+        return identifier(rng);
+    }
+}
+
+// 一层套一层的表达式, 每层是括号, 前缀, 调用或下标之一
+string nestedExpression(Random &rng, int depth) {
+    if (depth == 0) {
+        return literal(rng);
+    }
+    auto inner = nestedExpression(rng, depth - 1);
+    switch (rng.below(4)) {
+    case 0:
+        return std::format("({} {} {})", literal(rng),
+                           operators[rng.below(std::size(operators))], inner);
+    case 1:
+        return std::format("-({})", inner);
+    case 2:
+        return std::format("{}({}, {})", identifier(rng), inner, literal(rng));
+    default:
+        return std::format("{}[{}]", identifier(rng), inner);
+    }
+}
+
+void nested(Random &rng, string &out, int) {
+    out += std::format("let {} = {};\n", identifier(rng),
+                       nestedExpression(rng, 32 + rng.below(32)));
+}
+
+// 长语句, 几乎每个记号都是标识符
+void idents(Random &rng, string &out, int) {
+    auto line = std::format("let {} = {}", identifier(rng), identifier(rng));
+    for (int i = 0, n = 4 + rng.below(8); i < n; i++) {
+        line += std::format(" {} {}", operators[rng.below(4)], identifier(rng));
+        if (rng.below(4) == 0) {
+            line += std::format("({}, {})", identifier(rng), identifier(rng));
+        }
+    }
+    out += line + ";\n";
+}
+
+void literals(Random &rng, string &out, int) {
+    string body;
+    if (rng.below(2) == 0) {
+        for (int i = 0, n = 200 + rng.below(100); i < n; i++) {
+            body += (i == 0 ? "" : ", ") + literal(rng);
+        }
+        out += std::format("let {} = [{}];\n", identifier(rng), body);
+    } else {
+        for (int i = 0, n = 100 + rng.below(50); i < n; i++) {
+            auto key = rng.below(2) == 0
+                           ? std::format("\"{}\"", identifier(rng))
+                           : std::to_string(rng.below(100000));
+            body += std::format("{}{}: {}", i == 0 ? "" : ", ", key,
+                                rng.below(8) == 0 ? std::format("[{}, {}]",
+                                                                literal(rng),
+                                                                literal(rng))
+                                                  : literal(rng));
+        }
+        out += std::format("let {} = {{{}}};\n", identifier(rng), body);
+    }
+}
+
+// 具名函数和函数字面量交替出现
+void functions(Random &rng, string &out, int index) {
+    auto a = identifier(rng), b = identifier(rng), c = identifier(rng);
+    auto body = std::format(
+        "    let t = {} {} {} * {};\n"
+        "    if (t < {}) {{\n        return f{}(t, {}, {});\n    }} else {{\n"
+        "        return t - {};\n    }}\n",
+        a, operators[rng.below(4)], b, c, rng.below(1000), index, b, c, a);
+    if (rng.below(2) == 0) {
+        out += std::format("fn f{}({}, {}, {}) {{\n{}}}\n", index + 1, a, b, c,
+                           body);
+    } else {
+        out += std::format("let f{} = fn({}, {}, {}) {{\n{}}};\n", index + 1, a,
+                           b, c, body);
+    }
+}
+
+} // namespace
+
+// 生成至少 size 字节的程序, 未知的种类返回空串
+string generate(std::string_view kind, size_t size) {
+    Random rng;
+    void (*step)(Random &, string &, int) = kind == "nested"     ? nested
+                                       : kind == "idents"   ? idents
+                                       : kind == "literals" ? literals
+                                       : kind == "functions" ? functions
+                                                             : nullptr;
+    string res;
+    if (step == nullptr) {
+        return res;
+    }
+    res.reserve(size + 4096);
+    for (int i = 0; res.size() < size; i++) {
+        step(rng, res, i);
+    }
+    return res;
+}
+
+} // namespace gen
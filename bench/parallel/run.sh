@@ -0,0 +1,23 @@
+#!/bin/sh
+# pmap, pfilter, preduce 的加速比
+# 用法: bench/parallel/run.sh <waii binary> [线程数...]
+# --threads=1 时不启动线程池, 在调用的线程上依次执行, 作为比较的基准.
+# 各个线程数下的结果应当完全相同.
+# 进程里有了第二个线程之后 shared_ptr 的引用计数改用原子操作,
+# 所以每个线程的效率达不到 1, 只有一个核时加速比小于 1
+bin=${1:?usage: run.sh <waii binary> [threads...]}
+shift
+[ $# -eq 0 ] && set -- 1 2 4 "$(nproc)"
+script=$(dirname "$0")/parallel.monkey
+base=$("$bin" --threads=1 "$script")
+printf '%-8s %8s %12s %12s %12s\n' threads builtin ms speedup result
+for threads in "$@"; do
+    out=$("$bin" --threads="$threads" "$script")
+    result=$([ "$(echo "$out" | head -4)" = "$(echo "$base" | head -4)" ] &&
+        echo same || echo DIFFERENT)
+    # 结果的四行之后是 "名字" 和毫秒数交替的行
+    { echo "$base" | tail -n +5; echo "$out" | tail -n +5; } | awk -v t="$threads" -v r="$result" '
+        NR % 2 == 1 { name = $0; gsub(/"/, "", name); next }
+        NR <= 6 { base[name] = $0; next }
+        { printf "%-8s %8s %12.1f %12.2f %12s\n", t, name, $0, base[name] / $0, r }'
+done
@@ -0,0 +1,94 @@
+#!/bin/sh
+# 端到端基准: 每个脚本都经过 main.cpp 的完整流程 (解析, 优化, 推断, 求值)
+# 优化默认关闭, 需要时在解释器参数里给 -O1 / -O2
+# 用法: bench/suite/run.sh [-o results.json] [-b baseline.json] [-t 10] [-r 3]
+#                          <waii binary> [解释器参数...]
+# 每个脚本跑 r 次取最短的墙钟时间, 分配次数和峰值 RSS 取自 --stats.
+# 给了 baseline 时逐个比较, 比 baseline 慢超过 t% 的记为退步, 有退步时返回 1
+out=results.json
+baseline=
+threshold=10
+repeat=3
+while getopts o:b:t:r: opt; do
+    case $opt in
+    o) out=$OPTARG ;;
+    b) baseline=$OPTARG ;;
+    t) threshold=$OPTARG ;;
+    r) repeat=$OPTARG ;;
+    *) exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+bin=${1:?usage: run.sh [-o out] [-b baseline] [-t percent] [-r repeat] <waii binary> [flags...]}
+shift
+dir=$(dirname "$0")
+stderr=$(mktemp)
+trap 'rm -f "$stderr"' EXIT
+
+now() {
+    date +%s.%N
+}
+
+{
+    printf '{"binary": "%s", "flags": "%s", "repeat": %s, "results": [\n' \
+        "$bin" "$*" "$repeat"
+    sep=
+    grep -v '^#' "$dir/workloads" | while read -r name ops desc; do
+        best=
+        i=0
+        while [ $i -lt "$repeat" ]; do
+            start=$(now)
+            "$bin" "$@" --stats "$dir/$name.monkey" >/dev/null 2>"$stderr" || {
+                echo "$name failed:" >&2
+                cat "$stderr" >&2
+                exit 1
+            }
+            end=$(now)
+            best=$(awk -v a="$best" -v b="$end" -v c="$start" \
+                'BEGIN { t = b - c; if (a != "" && a < t) t = a; printf "%.6f", t }')
+            i=$((i + 1))
+        done
+        rss=$(sed -n 's/.*peak rss \([0-9]*\) KiB.*/\1/p' "$stderr")
+        allocs=$(sed -n 's/.*objects allocated \([0-9]*\).*/\1/p' "$stderr")
+        printf '%s{"name": "%s", "seconds": %s, "ops": %s, "ops_per_sec": %s, "peak_rss_kb": %s, "allocations": %s}' \
+            "$sep" "$name" "$best" "$ops" \
+            "$(awk -v n="$ops" -v t="$best" 'BEGIN { printf "%.0f", n / t }')" \
+            "${rss:-0}" "${allocs:-0}"
+        sep=',
+'
+    done
+    printf '\n]}\n'
+} >"$out" || exit 1
+
+# 结果每行一个脚本, 用 awk 按名字取出 seconds
+awk -v threshold="$threshold" -v baseline="$baseline" '
+function field(line, key,    m) {
+    if (match(line, "\"" key "\": \"?[^,\"}]*")) {
+        m = substr(line, RSTART, RLENGTH)
+        sub(/^"[a-z_]*": "?/, "", m)
+        return m
+    }
+    return ""
+}
+FNR == 1 { file++ }
+/"name"/ {
+    name = field($0, "name")
+    if (file == 1 && baseline != "") {
+        base[name] = field($0, "seconds")
+        next
+    }
+    secs = field($0, "seconds")
+    line = sprintf("%-14s %9.3fs %12s ops/s %9s KiB %10s allocs", name, secs,
+        field($0, "ops_per_sec"), field($0, "peak_rss_kb"), field($0, "allocations"))
+    if (name in base && base[name] > 0) {
+        change = (secs / base[name] - 1) * 100
+        line = line sprintf("  %+6.1f%%", change)
+        if (change > threshold) {
+            line = line "  REGRESSION"
+            bad++
+        }
+    }
+    print line
+}
+END { exit bad > 0 }
+' ${baseline:+"$baseline"} "$out"
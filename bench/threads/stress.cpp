@@ -0,0 +1,159 @@
+#include "../../eval/eval.cpp"
+#include "../../eval/infer.cpp"
+#include "../../eval/machine.cpp"
+#include "../../eval/output.cpp"
+#include "../../lexer/lexer.cpp"
+#include "../../opt/optimize.cpp"
+#include "../../parser/parser.cpp"
+#include "../../parser/parser_func.cpp"
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <string_view>
+#include <thread>
+
+// 多线程压力测试: 每个线程独立地完整执行脚本 (词法, 语法, 优化, 推断,
+// 求值), 检查每次执行后全局环境里的绑定都与单线程执行一致, 再按线程数
+// 1, 2, 4, ... 报告吞吐和相对单线程的加速比
+// 用法: stress [--threads=N] [--runs=M] [-O<n>] [--infer] [--no-infer]
+//              [--stackless] [--vm] 脚本...
+// 和解释器一样, 类型推断默认关闭, 只给 --vm 时打开
+// 每个线程执行 runs 次, 脚本的 print 输出被丢弃
+using namespace std;
+
+namespace {
+
+bool inferTypes = false;
+
+// 全局绑定按名字排序后的内容, 用来比较两次执行的结果
+string fingerprint(environment::Enviroment &env) {
+    map<string, string> sorted;
+    for (auto &[name, val] : env.bindings()) {
+        sorted[name->str] = val->Inspect();
+    }
+    string res;
+    for (auto &[name, text] : sorted) {
+        res += name + " = " + text + "\n";
+    }
+    return res;
+}
+
+string run(const string &source) {
+    lexer::Lexer lex(source);
+    parser::Parser parser(&lex);
+    auto program = parser.ParserProgram();
+    if (!parser.errors.empty()) {
+        return "parse error: " + parser.errors[0];
+    }
+    opt::optimize(program.get());
+    scope::markGlobals(program.get());
+    unique_ptr<infer::Inference> types;
+    if (inferTypes) {
+        types = make_unique<infer::Inference>(program.get());
+        types->install();
+    }
+    auto env = make_shared<environment::Enviroment>();
+    try {
+        if (machine::options.enabled) {
+            machine::run(program.get(), env);
+        } else {
+            eval::Eval(program.get(), env);
+        }
+    } catch (object::ErrorObject &e) {
+        return e.Inspect();
+    }
+    return fingerprint(*env);
+}
+
+double seconds(auto &&func) {
+    auto start = chrono::steady_clock::now();
+    func();
+    return chrono::duration<double>(chrono::steady_clock::now() - start)
+        .count();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    int maxThreads = max(1u, thread::hardware_concurrency());
+    int runs = 4;
+    vector<string> paths;
+    optional<bool> inferFlag;
+    for (int i = 1; i < argc; i++) {
+        string_view arg = argv[i];
+        if (arg.starts_with("--threads=")) {
+            maxThreads = max(1, stoi(string(arg.substr(10))));
+        } else if (arg.starts_with("--runs=")) {
+            runs = max(1, stoi(string(arg.substr(7))));
+        } else if (arg.starts_with("-O")) {
+            opt::options.level = min(stoi(string(arg.substr(2))), 2);
+        } else if (arg == "--infer") {
+            inferFlag = true;
+        } else if (arg == "--no-infer") {
+            inferFlag = false;
+        } else if (arg == "--stackless") {
+            machine::options.enabled = true;
+        } else if (arg == "--vm") {
+            vm::options.enabled = true;
+        } else {
+            paths.emplace_back(arg);
+        }
+    }
+    inferTypes = inferFlag.value_or(vm::options.enabled);
+    // 脚本的输出写进一个不输出的流, 报告直接写到原来的标准输出
+    ostream report(cout.rdbuf());
+    cout.rdbuf(nullptr);
+    report << format("{:<16} {:>7} {:>9} {:>12} {:>8} {:>10}\n", "script",
+                     "threads", "seconds", "scripts/s", "speedup",
+                     "efficiency");
+    bool failed = false;
+    for (auto &path : paths) {
+        ifstream file(path);
+        if (!file.is_open()) {
+            cerr << "could not open " << path << endl;
+            return 1;
+        }
+        string source((istreambuf_iterator<char>(file)),
+                      istreambuf_iterator<char>());
+        auto expected = run(source);
+        auto name = path.substr(path.find_last_of('/') + 1);
+        name = name.substr(0, name.find('.'));
+        double single = 0;
+        for (int threads = 1; threads <= maxThreads;
+             threads = threads == maxThreads ? threads + 1
+                                             : min(threads * 2, maxThreads)) {
+            vector<int> mismatches(threads);
+            auto elapsed = seconds([&] {
+                vector<jthread> pool;
+                for (int t = 0; t < threads; t++) {
+                    pool.emplace_back([&, t] {
+                        for (int i = 0; i < runs; i++) {
+                            mismatches[t] += run(source) != expected;
+                        }
+                    });
+                }
+            });
+            auto throughput = threads * runs / elapsed;
+            if (threads == 1) {
+                single = throughput;
+            }
+            report << format("{:<16} {:>7} {:>9.3f} {:>12.1f} {:>8.2f} {:>10.2f}\n",
+                             name, threads, elapsed, throughput,
+                             throughput / single,
+                             throughput / single / threads);
+            for (int t = 0; t < threads; t++) {
+                if (mismatches[t] != 0) {
+                    report << format("  thread {}: {} of {} runs differ from "
+                                     "the single-threaded result\n",
+                                     t, mismatches[t], runs);
+                    failed = true;
+                }
+            }
+        }
+    }
+    return failed ? 1 : 0;
+}
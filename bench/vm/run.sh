@@ -0,0 +1,46 @@
+#!/bin/sh
+# 对比树遍历解释器, typed 节点树, 栈式字节码和寄存器字节码
+# 用法: bench/vm/run.sh ./waii [脚本...]
+# 每种方式先单独跑一次取 --vm-stats 的计数, 计时的那次不带统计
+bin=${1:?usage: run.sh <waii binary> [script...]}
+shift
+dir=$(dirname "$0")
+[ $# -eq 0 ] && set -- "$dir"/*.monkey
+
+mode_flags() {
+    case $1 in
+    tree) echo "" ;;
+    typed) echo "--infer" ;;
+    stack) echo "--vm=stack" ;;
+    register) echo "--vm=register" ;;
+    esac
+}
+
+printf '%-14s %-9s %14s %12s %9s\n' script mode executed code_bytes seconds
+for script in "$@"; do
+    name=$(basename "$script" .monkey)
+    for mode in tree typed stack register; do
+        flags=$(mode_flags $mode)
+        stats=$("$bin" $flags --vm-stats "$script" 2>&1 >/dev/null)
+        case $mode in
+        tree)
+            executed=$(echo "$stats" | sed -n 's/^tree: \([0-9]*\) nodes.*/\1/p')
+            bytes=-
+            ;;
+        typed)
+            # typed 节点不计数
+            executed=-
+            bytes=-
+            ;;
+        *)
+            executed=$(echo "$stats" | sed -n 's/.*, \([0-9]*\) instructions.*/\1/p')
+            bytes=$(echo "$stats" | sed -n 's/.*, \([0-9]*\) bytes of code/\1/p')
+            ;;
+        esac
+        start=$(date +%s.%N)
+        "$bin" $flags "$script" >/dev/null
+        end=$(date +%s.%N)
+        printf '%-14s %-9s %14s %12s %9s\n' "$name" $mode "$executed" "$bytes" \
+            "$(awk "BEGIN { printf \"%.3f\", $end - $start }")"
+    done
+done
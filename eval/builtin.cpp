@@ -1,26 +1,72 @@
 #pragma once
 
+#include "../prof/heap.cpp"
+#include "../prof/metrics.cpp"
 #include "object.cpp"
+#include "output.cpp"
+#include "pool.cpp"
+#include <algorithm>
+#include <chrono>
+#include <limits>
 #include <memory>
+#include <numeric>
 #include <string>
 #include <unordered_map>
 
+namespace eval {
+// 在 eval.cpp 里定义, bench 和并行的 pmap 等用它们调用脚本函数
+object::obj_ptr applyFunction(object::obj_ptr func,
+                              const std::vector<object::obj_ptr> &args);
+bool isTrue(object::obj_ptr obj);
+} // namespace eval
+
 namespace object {
-using std::make_shared;
 using std::shared_ptr;
 using std::string;
 using std::unordered_map;
 
+// 把对象流式写进输出通道, 末尾换行
+void writeObject(output::Sink &out, Object *obj) {
+    Inspector ins(
+        [&out](std::string_view str) {
+            out.write(str);
+        },
+        inspectLimits);
+    obj->InspectTo(ins);
+    ins.finish();
+    out.write("\n");
+}
+
 obj_ptr len(const std::vector<obj_ptr> &args);
 obj_ptr first(const std::vector<obj_ptr> &args);
 obj_ptr last(const std::vector<obj_ptr> &args);
 obj_ptr rest(const std::vector<obj_ptr> &args);
 obj_ptr append(const std::vector<obj_ptr> &args);
 obj_ptr print(const std::vector<obj_ptr> &args);
+obj_ptr flush(const std::vector<obj_ptr> &args);
+obj_ptr range(const std::vector<obj_ptr> &args);
+obj_ptr heapdump(const std::vector<obj_ptr> &args);
+obj_ptr runtimeStats(const std::vector<obj_ptr> &args);
+obj_ptr clockNs(const std::vector<obj_ptr> &args);
+obj_ptr bench(const std::vector<obj_ptr> &args);
+obj_ptr pmap(const std::vector<obj_ptr> &args);
+obj_ptr pfilter(const std::vector<obj_ptr> &args);
+obj_ptr preduce(const std::vector<obj_ptr> &args);
 
-static unordered_map<string, BuiltinFunction> BUILTINS = {
+static const unordered_map<string, BuiltinFunction> BUILTINS = {
     {"len", len},   {"first", first},   {"last", last},
-    {"rest", rest}, {"append", append}, {"print", print}};
+    {"rest", rest}, {"append", append}, {"print", print},
+    {"flush", flush}, {"range", range}, {"heapdump", heapdump},
+    {"stats", runtimeStats}, {"clock_ns", clockNs}, {"bench", bench},
+    {"pmap", pmap}, {"pfilter", pfilter}, {"preduce", preduce}};
+
+// Integer 只有 32 位, 放不下的长度报错而不是回绕
+obj_ptr lengthOf(size_t size) {
+    if (size > static_cast<size_t>(std::numeric_limits<int>::max())) {
+        throw newError("length {} does not fit in an integer", size);
+    }
+    return make<Integer>(static_cast<int>(size));
+}
 
 obj_ptr len(const std::vector<obj_ptr> &args) {
     if (args.size() != 1) {
@@ -28,12 +74,13 @@ obj_ptr len(const std::vector<obj_ptr> &args) {
                        args.size());
     }
     if (type(args[0]) == Str_Obj) {
-        return make_shared<Integer>(
-            dynamic_cast<String *>(args[0].get())->Value.length());
+        return lengthOf(dynamic_cast<String *>(args[0].get())->length());
     }
     if (type(args[0]) == Array_Obj) {
-        return make_shared<Integer>(
-            dynamic_cast<Array *>(args[0].get())->Elements.size());
+        return lengthOf(dynamic_cast<Array *>(args[0].get())->Elements.size());
+    }
+    if (type(args[0]) == Range_Obj) {
+        return lengthOf(dynamic_cast<Range *>(args[0].get())->length());
     }
     throw newError("argument to `len` not supported, got {}",
                    TypeToString(type(args[0])));
@@ -54,8 +101,8 @@ obj_ptr first(const std::vector<obj_ptr> &args) {
     }
     if (type(args[0]) == Str_Obj) {
         auto str = dynamic_cast<String *>(args[0].get());
-        if (str->Value.length() > 0) {
-            return make_shared<String>(str->Value.substr(0, 1));
+        if (str->length() > 0) {
+            return make<String>(*str, 0, 1);
         } else {
             return _NULL;
         }
@@ -79,9 +126,8 @@ obj_ptr last(const std::vector<obj_ptr> &args) {
     }
     if (type(args[0]) == Str_Obj) {
         auto str = dynamic_cast<String *>(args[0].get());
-        if (str->Value.length() > 0) {
-            return make_shared<String>(
-                str->Value.substr(str->Value.length() - 1, 1));
+        if (str->length() > 0) {
+            return make<String>(*str, str->length() - 1, 1);
         } else {
             return _NULL;
         }
@@ -99,15 +145,15 @@ obj_ptr rest(const std::vector<obj_ptr> &args) {
         if (arr->Elements.size() > 0) {
             auto new_arr = arr->Elements;
             new_arr.erase(new_arr.begin());
-            return make_shared<Array>(new_arr);
+            return make<Array>(new_arr);
         } else {
             return _NULL;
         }
     }
     if (type(args[0]) == Str_Obj) {
         auto str = dynamic_cast<String *>(args[0].get());
-        if (str->Value.length() > 0) {
-            return make_shared<String>(str->Value.substr(1));
+        if (str->length() > 0) {
+            return make<String>(*str, 1, str->length() - 1);
         } else {
             return _NULL;
         }
@@ -125,15 +171,250 @@ obj_ptr append(const std::vector<obj_ptr> &args) {
         auto arr = dynamic_cast<Array *>(args[0].get());
         auto new_arr = arr->Elements;
         new_arr.push_back(args[1]);
-        return make_shared<Array>(new_arr);
+        return make<Array>(new_arr);
     }
     throw newError("argument to `append` not supported, got {}",
                    TypeToString(type(args[0])));
 }
 obj_ptr print(const std::vector<obj_ptr> &args) {
+    auto &out = output::out();
     for (auto &arg : args) {
-        std::cout << arg->Inspect() << std::endl;
+        writeObject(out, arg.get());
     }
     return _NULL;
 }
-} // namespace object
\ No newline at end of file
+obj_ptr flush(const std::vector<obj_ptr> &args) {
+    if (args.size() != 0) {
+        throw newError("function {} expected {} arguments, got {}", "flush", 0,
+                       args.size());
+    }
+    output::out().flush();
+    return _NULL;
+}
+// range(end), range(start, end), range(start, end, step)
+obj_ptr range(const std::vector<obj_ptr> &args) {
+    if (args.size() < 1 || args.size() > 3) {
+        throw newError("function {} expected {} arguments, got {}", "range",
+                       "1 to 3", args.size());
+    }
+    for (auto &arg : args) {
+        if (type(arg) != Int_Obj) {
+            throw newError("argument to `range` must be int, got {}",
+                           TypeToString(type(arg)));
+        }
+    }
+    int start = 0, end = 0, step = 1;
+    if (args.size() == 1) {
+        end = getValue<Integer>(args[0]);
+    } else {
+        start = getValue<Integer>(args[0]);
+        end = getValue<Integer>(args[1]);
+    }
+    if (args.size() == 3) {
+        step = getValue<Integer>(args[2]);
+    }
+    if (step == 0) {
+        throw newError("range step must not be zero");
+    }
+    return make<Range>(start, end, step);
+}
+// heapdump(path): 写出堆快照, 返回其中对象和环境的个数
+obj_ptr heapdump(const std::vector<obj_ptr> &args) {
+    if (args.size() != 1) {
+        throw newError("function {} expected {} arguments, got {}", "heapdump",
+                       1, args.size());
+    }
+    if (type(args[0]) != Str_Obj) {
+        throw newError("argument to `heapdump` must be str, got {}",
+                       TypeToString(type(args[0])));
+    }
+    auto path = dynamic_cast<String *>(args[0].get())->str();
+    return make<Integer>(static_cast<int>(heap::dump(path)));
+}
+// stats(): 运行时计数, 见 prof/metrics.cpp
+obj_ptr runtimeStats(const std::vector<obj_ptr> &args) {
+    if (args.size() != 0) {
+        throw newError("function {} expected {} arguments, got {}", "stats", 0,
+                       args.size());
+    }
+    return stats::toObject();
+}
+
+// 单调时钟, 从进程启动开始的纳秒数
+// int 只有 32 位, 所以用 float, 在 2^53 纳秒 (约 104 天) 以内是精确的
+static const auto clockOrigin = std::chrono::steady_clock::now();
+
+int64_t elapsedNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - clockOrigin)
+        .count();
+}
+
+obj_ptr clockNs(const std::vector<obj_ptr> &args) {
+    if (args.size() != 0) {
+        throw newError("function {} expected {} arguments, got {}", "clock_ns",
+                       0, args.size());
+    }
+    return make<Double>(static_cast<double>(elapsedNs()));
+}
+
+// bench(fn, n): 先预热 n / 10 次 (至少 1 次, 至多 1000 次), 再逐次计时
+// 调用 n 次. 返回每次调用的 min, median, p99, mean (纳秒) 和平均每次分配
+// 的对象数 allocations, 包括 fn 里 pmap 等在线程池上分配的
+obj_ptr bench(const std::vector<obj_ptr> &args) {
+    if (args.size() != 2) {
+        throw newError("function {} expected {} arguments, got {}", "bench", 2,
+                       args.size());
+    }
+    if (type(args[0]) != Function_Obj && type(args[0]) != Builtin_Obj) {
+        throw newError("argument to `bench` must be function, got {}",
+                       TypeToString(type(args[0])));
+    }
+    if (type(args[1]) != Int_Obj || getValue<Integer>(args[1]) <= 0) {
+        throw newError("iterations of `bench` must be a positive int");
+    }
+    auto func = args[0];
+    size_t n = getValue<Integer>(args[1]);
+    const std::vector<obj_ptr> none;
+    for (size_t i = 0, warmup = std::clamp<size_t>(n / 10, 1, 1000);
+         i < warmup; i++) {
+        eval::applyFunction(func, none);
+    }
+    auto allocated = [] {
+        auto totals = stats::collect();
+        return std::accumulate(std::begin(totals.objects),
+                               std::end(totals.objects), uint64_t(0));
+    };
+    std::vector<int64_t> times(n);
+    auto before = allocated();
+    for (size_t i = 0; i < n; i++) {
+        auto start = elapsedNs();
+        eval::applyFunction(func, none);
+        times[i] = elapsedNs() - start;
+    }
+    auto allocations = allocated() - before;
+    std::sort(times.begin(), times.end());
+    auto total = std::accumulate(times.begin(), times.end(), int64_t(0));
+
+    auto res = make<Hash>();
+    auto put = [&](const string &key, obj_ptr val) {
+        obj_ptr name = make<String>(key);
+        res->insert(name, val);
+    };
+    auto ns = [](double val) {
+        return make<Double>(val);
+    };
+    put("iterations", make<Integer>(static_cast<int>(n)));
+    put("min", ns(times.front()));
+    put("median", ns(times[n / 2]));
+    put("p99", ns(times[std::min(n - 1, (n * 99 + 99) / 100 - 1)]));
+    put("mean", ns(static_cast<double>(total) / n));
+    put("allocations", make<Double>(static_cast<double>(allocations) / n));
+    return res;
+}
+
+// pmap, pfilter, preduce 的第一个参数: 数组或 range, 按下标取元素
+class Items {
+    private:
+    Array *array = nullptr;
+    Range *range = nullptr;
+
+    public:
+    Items(const string &name, const obj_ptr &obj) {
+        if (type(obj) == Array_Obj) {
+            array = static_cast<Array *>(obj.get());
+        } else if (type(obj) == Range_Obj) {
+            range = static_cast<Range *>(obj.get());
+        } else {
+            throw newError("argument to `{}` must be ARRAY or RANGE, got {}",
+                           name, TypeToString(type(obj)));
+        }
+    }
+    size_t size() const {
+        return array != nullptr ? array->Elements.size() : range->length();
+    }
+    obj_ptr at(size_t i) const {
+        if (array != nullptr) {
+            return array->Elements[i];
+        }
+        return make<Integer>(
+            static_cast<int>(range->Start + static_cast<long long>(i) *
+                                                range->Step));
+    }
+};
+
+void checkParallel(const string &name, const std::vector<obj_ptr> &args,
+                   size_t count) {
+    if (args.size() != count) {
+        throw newError("function {} expected {} arguments, got {}", name, count,
+                       args.size());
+    }
+    if (type(args[1]) != Function_Obj && type(args[1]) != Builtin_Obj) {
+        throw newError("argument to `{}` must be function, got {}", name,
+                       TypeToString(type(args[1])));
+    }
+}
+
+// pmap(arr, fn): 在线程池上对每个元素调用 fn, 结果按原来的顺序排列
+// 出错时报告下标最小的那个错误, 与依次执行时相同
+obj_ptr pmap(const std::vector<obj_ptr> &args) {
+    checkParallel("pmap", args, 2);
+    Items items("pmap", args[0]);
+    auto &func = args[1];
+    std::vector<obj_ptr> res(items.size());
+    pool::parallelFor(items.size(), [&](size_t, size_t begin, size_t end) {
+        for (auto i = begin; i < end; i++) {
+            res[i] = eval::applyFunction(func, {items.at(i)});
+        }
+    });
+    return make<Array>(std::move(res));
+}
+
+// pfilter(arr, fn): 保留 fn 返回真的元素, 顺序不变
+obj_ptr pfilter(const std::vector<obj_ptr> &args) {
+    checkParallel("pfilter", args, 2);
+    Items items("pfilter", args[0]);
+    auto &func = args[1];
+    std::vector<char> keep(items.size());
+    pool::parallelFor(items.size(), [&](size_t, size_t begin, size_t end) {
+        for (auto i = begin; i < end; i++) {
+            keep[i] = eval::isTrue(eval::applyFunction(func, {items.at(i)}));
+        }
+    });
+    std::vector<obj_ptr> res;
+    for (size_t i = 0; i < keep.size(); i++) {
+        if (keep[i]) {
+            res.push_back(items.at(i));
+        }
+    }
+    return make<Array>(std::move(res));
+}
+
+// preduce(arr, fn, init): 第一块从 init 开始, 其余各块从自己的第一个元素
+// 开始依次归约, 再按块的顺序合并. init 和依次归约时一样只在最前面用一次;
+// 块的划分只取决于元素个数, 结果是确定的; fn 满足结合律时与依次归约的结果相同
+obj_ptr preduce(const std::vector<obj_ptr> &args) {
+    checkParallel("preduce", args, 3);
+    Items items("preduce", args[0]);
+    auto &func = args[1];
+    auto &init = args[2];
+    std::vector<obj_ptr> partial(pool::chunkCount(items.size()));
+    pool::parallelFor(items.size(),
+                      [&](size_t index, size_t begin, size_t end) {
+                          auto acc = index == 0 ? init : items.at(begin++);
+                          for (auto i = begin; i < end; i++) {
+                              acc = eval::applyFunction(func,
+                                                        {acc, items.at(i)});
+                          }
+                          partial[index] = acc;
+                      });
+    if (partial.empty()) {
+        return init;
+    }
+    auto res = partial[0];
+    for (size_t i = 1; i < partial.size(); i++) {
+        res = eval::applyFunction(func, {res, partial[i]});
+    }
+    return res;
+}
+} // namespace object
@@ -1,8 +1,12 @@
 #pragma once
 
+#include "../lexer/token/symbol.hpp"
 #include "object.hpp"
+#include <atomic>
+#include <cstdint>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 
@@ -12,30 +16,135 @@ using std::pair;
 using std::shared_ptr;
 using std::string;
 using std::unordered_map;
+using symbol::Symbol;
+
+// 堆快照要遍历全部存活的环境. 只有可能写快照时才把环境登记到链表里,
+// 否则创建和销毁环境都不加锁. 在创建全局环境之前设置, 之后不再改变
+static bool tracking = false;
+
 class Enviroment {
     private:
-    unordered_map<string, obj_ptr> store;
+    // 以驻留后的 Symbol 为键, 查找时只需哈希一个指针
+    unordered_map<Symbol, obj_ptr> store;
     shared_ptr<Enviroment> outer;
+    // 最外层环境的编号, 全局绑定的缓存用它确认还是同一个全局环境
+    uint64_t root;
+
+    static uint64_t nextRoot() {
+        static std::atomic<uint64_t> count = 0;
+        return count.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+    // 每个线程创建的存活环境串成一条链表, 堆快照从这里找到全部环境
+    // 环境可能在别的线程销毁 (比如闭包被交给另一个线程), 所以记下
+    // 所在的链表, 摘下时加这条链表的锁. 链表从不释放, 线程结束后
+    // 它创建的环境仍然可以安全地销毁
+    struct Registry {
+        std::mutex lock;
+        Enviroment *head = nullptr;
+    };
+    Registry *registry = nullptr;
+    Enviroment *prev = nullptr;
+    Enviroment *next = nullptr;
+
+    static Registry &local() {
+        thread_local Registry *mine = new Registry;
+        return *mine;
+    }
+
+    // 环境都由 make_shared 创建, 大小同样算上控制块
+    void created() {
+        if (tracking) {
+            registry = &local();
+            std::lock_guard guard(registry->lock);
+            next = registry->head;
+            if (next != nullptr) {
+                next->prev = this;
+            }
+            registry->head = this;
+        }
+        stats::bump(stats::local().objects[object::Env_Alloc]);
+        if (object::allocHooks.allocate != nullptr) {
+            object::allocHooks.allocate(this, object::Env_Alloc,
+                                        sizeof(Enviroment) + 2 * sizeof(void *));
+        }
+    }
 
     public:
-    pair<bool, obj_ptr> get(const string &name) {
-        auto iter = store.find(name);
-        if (iter != store.end()) {
-            return {true, iter->second};
-        } else {
-            if (outer != nullptr) {
-                return outer->get(name);
+    pair<bool, obj_ptr> get(Symbol name) {
+        auto &counters = stats::local();
+        stats::bump(counters.lookups);
+        uint64_t depth = 0;
+        for (auto env = this; env != nullptr; env = env->outer.get()) {
+            depth++;
+            auto iter = env->store.find(name);
+            if (iter != env->store.end()) {
+                stats::bump(counters.lookupDepth, depth);
+                return {true, iter->second};
             }
         }
+        stats::bump(counters.lookupDepth, depth);
         return {false, nullptr};
     }
-    obj_ptr set(const string &name, obj_ptr value) {
+    obj_ptr set(Symbol name, obj_ptr value) {
         store[name] = value;
         return value;
     }
-    Enviroment() {
+    pair<bool, obj_ptr> get(const string &name) {
+        return get(symbol::intern(name));
     }
-    Enviroment(shared_ptr<Enviroment> outer) : outer(outer) {
+    obj_ptr set(const string &name, obj_ptr value) {
+        return set(symbol::intern(name), value);
+    }
+    const shared_ptr<Enviroment> &outerEnv() const {
+        return outer;
+    }
+    const unordered_map<Symbol, obj_ptr> &bindings() const {
+        return store;
+    }
+    // 绑定表占用的大小 (桶数组和每个结点), 不含环境本身
+    size_t footprint() const {
+        return store.bucket_count() * sizeof(void *) +
+               store.size() * (sizeof(pair<const Symbol, obj_ptr>) +
+                               2 * sizeof(void *));
+    }
+    // 依次访问当前线程创建的所有存活环境, tracking 关闭时什么也不做
+    template <typename Func>
+    static void each(Func func) {
+        auto &mine = local();
+        std::lock_guard guard(mine.lock);
+        for (auto env = mine.head; env != nullptr; env = env->next) {
+            func(env);
+        }
+    }
+    uint64_t rootId() const {
+        return root;
+    }
+    // 全局环境里的绑定, 地址在环境销毁前保持不变 (绑定不会被删除)
+    obj_ptr *globalSlot(Symbol name) {
+        if (outer != nullptr) {
+            return outer->globalSlot(name);
+        }
+        auto iter = store.find(name);
+        return iter == store.end() ? nullptr : &iter->second;
+    }
+    Enviroment() : root(nextRoot()) {
+        created();
+    }
+    Enviroment(shared_ptr<Enviroment> outer)
+        : outer(outer), root(outer != nullptr ? outer->root : nextRoot()) {
+        created();
+    }
+    ~Enviroment() {
+        if (object::allocHooks.release != nullptr) {
+            object::allocHooks.release(this);
+        }
+        if (registry != nullptr) {
+            std::lock_guard guard(registry->lock);
+            (prev != nullptr ? prev->next : registry->head) = next;
+            if (next != nullptr) {
+                next->prev = prev;
+            }
+        }
     }
 };
 
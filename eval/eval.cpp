@@ -1,13 +1,21 @@
 #pragma once
 
 #include "../ast/ast.cpp"
+#include "../jit/jit.cpp"
+#include "../prof/alloc.cpp"
+#include "../prof/sampler.cpp"
+#include "../prof/trace.cpp"
+#include "../vm/vm.cpp"
 #include "./builtin.cpp"
 #include "./env.cpp"
 #include "./object.cpp"
+#include "./pool.cpp"
+#include "./typed.cpp"
 #include <format>
 #include <memory>
 #include <string>
 #include <tuple>
+#include <variant>
 #include <vector>
 
 namespace eval {
@@ -64,6 +72,8 @@ obj_ptr evalLogicExpression(token::TokenType typ, obj_ptr left, obj_ptr right);
 
 obj_ptr evalIfExpression(ast::IfExpression *ifexpr, env_ptr env);
 
+bool evalCondition(ast::Expression *expr, env_ptr env);
+
 obj_ptr evalIdentifer(ast::Identifier *ident, env_ptr env);
 
 obj_ptr evalIndexExpression(obj_ptr left, obj_ptr index);
@@ -75,11 +85,26 @@ evalExpressions(const vector<unique_ptr<ast::Expression>> &exprs, env_ptr env);
 
 void evalWhileStatement(ast::WhileStatement *whilestmt, env_ptr env);
 
+obj_ptr evalForStatement(ast::ForStatement *forstmt, env_ptr env);
+
 obj_ptr applyFunction(obj_ptr func, const vector<obj_ptr> &args);
 
+FunctionObject *cachedCallee(ast::CallExpression *call, const obj_ptr &func,
+                             size_t argc);
+
+obj_ptr callFunction(FunctionObject *function, const vector<obj_ptr> &args);
+
+obj_ptr nativeBoolToObject(bool val) {
+    return val ? _TRUE : _FALSE;
+}
+
 obj_ptr Eval(ast::Node *node, env_ptr env) {
+    alloc::Site here(node);
 
-#define isType(typ) auto _t = _isType<typ>(node)
+// 匹配到的节点按种类计数
+#define isType(typ)                                                           \
+    auto _t = _isType<typ>(node);                                             \
+    _t && stats::evaluated<typ>()
     if (node == nullptr) {
         return _NULL;
     }
@@ -93,18 +118,21 @@ obj_ptr Eval(ast::Node *node, env_ptr env) {
     }
 
     if (isType(ast::IntegerLiteral)) {
-        return make_shared<Integer>(_t.res->value);
+        return make<Integer>(_t.res->value);
     }
 
     if (isType(ast::DoubleLiteral)) {
-        return make_shared<Double>(_t.res->value);
+        return make<Double>(_t.res->value);
     }
 
     if (isType(ast::BooleanLiteral)) {
         return _t.res->value ? _TRUE : _FALSE;
     }
     if (isType(ast::StringLiteral)) {
-        return make_shared<String>(_t.res->value);
+        if (_t.res->sym != nullptr) {
+            return make<String>(_t.res->sym);
+        }
+        return make<String>(_t.res->value);
     }
 
     if (isType(ast::PrefixExpression)) {
@@ -113,6 +141,10 @@ obj_ptr Eval(ast::Node *node, env_ptr env) {
     }
 
     if (isType(ast::InfixExpression)) {
+        if (_t.res->TokenType() == token::AND ||
+            _t.res->TokenType() == token::OR) {
+            return nativeBoolToObject(evalCondition(_t.res, env));
+        }
         auto left = Eval(_t.res->left(), env);
         auto right = Eval(_t.res->right(), env);
         return evalInfixExpression(_t.res->TokenType(), left, right);
@@ -125,27 +157,38 @@ obj_ptr Eval(ast::Node *node, env_ptr env) {
     }
     if (isType(ast::ReturnStatement)) {
         auto val = Eval(_t.res->returnValue(), env);
-        return make_shared<ReturnValue>(val);
+        return make<ReturnValue>(val);
     }
     if (isType(ast::LetStatement)) {
         auto val = Eval(_t.res->value(), env);
-        env->set(_t.res->name()->value, val);
+        if (type(val) == Function_Obj) {
+            auto func = dynamic_cast<FunctionObject *>(val.get());
+            if (func->Name.empty()) {
+                func->Name = _t.res->name()->value;
+            }
+        }
+        env->set(_t.res->name()->sym, val);
         return nullptr;
     }
     if (isType(ast::WhileStatement)) {
         evalWhileStatement(_t.res, env);
         return nullptr;
     }
+    if (isType(ast::ForStatement)) {
+        return evalForStatement(_t.res, env);
+    }
     if (isType(ast::Identifier)) {
         return evalIdentifer(_t.res, env);
     }
     if (isType(ast::FunctionLiteral)) {
-        return make_shared<FunctionObject>(_t.res->parameters(), _t.res->body(),
-                                           env);
+        auto func = make<FunctionObject>(_t.res->parameters(),
+                                                _t.res->body(), env);
+        func->Plan = typed::planFor(_t.res->body().get());
+        return func;
     }
     if (isType(ast::ArrayLiteral)) {
         auto elements = evalExpressions(_t.res->elements(), env);
-        return make_shared<Array>(elements);
+        return make<Array>(elements);
     }
     if (isType(ast::IndexExpression)) {
         auto left = Eval(_t.res->left(), env);
@@ -153,34 +196,46 @@ obj_ptr Eval(ast::Node *node, env_ptr env) {
         return evalIndexExpression(left, index);
     }
     if (isType(ast::FunctionStatement)) {
-        auto func = make_shared<FunctionObject>(_t.res->parameters(),
+        auto func = make<FunctionObject>(_t.res->parameters(),
                                                 _t.res->body(), env);
-        env->set(_t.res->name()->value, func);
+        func->Name = _t.res->name()->value;
+        func->Plan = typed::planFor(_t.res->body().get());
+        env->set(_t.res->name()->sym, func);
         return nullptr;
     }
     if (isType(ast::CallExpression)) {
         auto func = Eval(_t.res->function(), env);
         auto args = evalExpressions(_t.res->arguments(), env);
+        if (auto function = cachedCallee(_t.res, func, args.size())) {
+            return callFunction(function, args);
+        }
         return applyFunction(func, args);
     }
     if (isType(ast::HashLiteral)) {
         return evalHashLiteral(_t.res, env);
     }
+    if (isType(ast::ConstantLiteral)) {
+        return _t.res->value;
+    }
 
     return _NULL;
 
 #undef isType
 }
 
-env_ptr extendFunctionEnv(FunctionObject *func, const vector<obj_ptr> &args) {
-    env_ptr env = make_shared<Enviroment>(func->Env);
+void checkArguments(FunctionObject *func, const vector<obj_ptr> &args) {
     if (func->Parameters.size() != args.size()) {
         throw newError("function {} expected {} arguments, got {}",
                        func->shortInspect(), func->Parameters.size(),
                        args.size());
     }
+}
+
+// 参数个数已经由调用方检查过
+env_ptr extendFunctionEnv(FunctionObject *func, const vector<obj_ptr> &args) {
+    env_ptr env = make_shared<Enviroment>(func->Env);
     for (size_t i = 0; i < func->Parameters.size(); i++) {
-        env->set(func->Parameters[i]->value, args[i]);
+        env->set(func->Parameters[i]->sym, args[i]);
     }
     return env;
 }
@@ -192,15 +247,71 @@ obj_ptr unwarpReturnValue(obj_ptr obj) {
     return _NULL;
 }
 
+// 调用点缓存: 与上次调用的是同一个函数时跳过类型和参数个数的检查
+// 不是函数或者参数个数不符时返回 nullptr, 由 applyFunction 报错
+FunctionObject *cachedCallee(ast::CallExpression *call, const obj_ptr &func,
+                             size_t argc) {
+    // 只比较控制块, 不动引用计数. weak_ptr 让控制块一直留着, 函数释放后
+    // 控制块的地址不会分给新对象, 所以不会把新函数错认成旧的.
+    // 常驻对象没有控制块, 和空缓存比较也相等, 所以先排除空缓存
+    auto &cache = call->cacheCallee;
+    if (func != nullptr && !cache.expired() && !cache.owner_before(func) &&
+        !func.owner_before(cache)) {
+        return static_cast<FunctionObject *>(func.get());
+    }
+    if (type(func) != Function_Obj) {
+        return nullptr;
+    }
+    auto function = static_cast<FunctionObject *>(func.get());
+    if (function->Parameters.size() != argc) {
+        return nullptr;
+    }
+    // 并行执行时不改语法树, 各个线程只读缓存
+    if (!pool::active) {
+        call->cacheCallee = func;
+    }
+    return function;
+}
+
+obj_ptr invokeFunction(FunctionObject *function, const vector<obj_ptr> &args) {
+    jit::ActiveProfile active;
+    if (jit::options.enabled) {
+        auto profile = jit::profileFor(function);
+        if (auto res = jit::tryCall(function, profile, args)) {
+            return res;
+        }
+        active.enter(profile);
+    }
+    if (function->Plan != nullptr) {
+        if (auto res = function->Plan->call(function, args)) {
+            return res;
+        }
+    }
+    auto env = extendFunctionEnv(function, args);
+    auto res = Eval(function->Body.get(), env);
+    return unwarpReturnValue(res);
+}
+
+obj_ptr callFunction(FunctionObject *function, const vector<obj_ptr> &args) {
+    stats::bump(stats::local().calls);
+    if (prof::options.enabled || trace::options.enabled) {
+        prof::Scope sampled(function);
+        auto span = trace::call(function);
+        return invokeFunction(function, args);
+    }
+    return invokeFunction(function, args);
+}
+
 obj_ptr applyFunction(obj_ptr func, const vector<obj_ptr> &args) {
     if (type(func) == Function_Obj) {
-        auto function = dynamic_cast<FunctionObject *>(func.get());
-        auto env = extendFunctionEnv(function, args);
-        auto res = Eval(function->Body.get(), env);
-        return unwarpReturnValue(res);
+        auto function = static_cast<FunctionObject *>(func.get());
+        checkArguments(function, args);
+        return callFunction(function, args);
     }
     if (type(func) == Builtin_Obj) {
         auto builtin = dynamic_cast<BuiltIn *>(func.get());
+        stats::bump(stats::local().builtins);
+        trace::Span span(builtin->name(), trace::Category::Builtin);
         return builtin->Fn(args);
     }
     throw newError("not a function: {}", TypeToString(type(func)));
@@ -216,12 +327,26 @@ evalExpressions(const vector<unique_ptr<ast::Expression>> &exprs, env_ptr env) {
 }
 
 obj_ptr evalIdentifer(ast::Identifier *ident, env_ptr env) {
-    auto [ok, val] = env->get(ident->value);
+    // 所在函数和外层函数都没有定义这个名字时, 查找结果就是全局环境里的绑定
+    // 绑定被 let 重新赋值时槽位不变, 直接读到新值
+    if (ident->global) {
+        if (ident->cacheRoot == env->rootId() && ident->cacheSlot != nullptr) {
+            return *ident->cacheSlot;
+        }
+        if (auto slot = env->globalSlot(ident->sym)) {
+            if (!pool::active) {
+                ident->cacheRoot = env->rootId();
+                ident->cacheSlot = slot;
+            }
+            return *slot;
+        }
+    }
+    auto [ok, val] = env->get(ident->sym);
     if (ok) {
         return val;
     }
-    if (BUILTINS.count(ident->value)) {
-        return std::make_shared<BuiltIn>(BUILTINS[ident->value]);
+    if (auto iter = BUILTINS.find(ident->value); iter != BUILTINS.end()) {
+        return make<BuiltIn>(iter->second, ident->sym);
     }
     throw newError("identifier not found: {}", ident->value);
 }
@@ -244,6 +369,9 @@ obj_ptr evalPrograms(const vector<unique_ptr<ast::Statement>> &statements,
                      env_ptr env) {
     obj_ptr res;
     for (auto &stmt : statements) {
+        if (heap::requested) {
+            heap::poll();
+        }
         res = Eval(stmt.get(), env);
         if (res != nullptr) {
             if (type(res) == Return_Obj) {
@@ -262,6 +390,9 @@ obj_ptr evalStatements(const vector<unique_ptr<ast::Statement>> &statements,
                        env_ptr env) {
     obj_ptr res;
     for (auto &stmt : statements) {
+        if (heap::requested) {
+            heap::poll();
+        }
         res = Eval(stmt.get(), env);
         if (res != nullptr) {
             if (type(res) == Return_Obj) {
@@ -294,10 +425,10 @@ obj_ptr evalBangOperatorExpression(obj_ptr obj) {
 
 obj_ptr evalMinusPrefixExpression(obj_ptr obj) {
     if (_isType<Integer>(obj)) {
-        return make_shared<Integer>(-getValue<Integer>(obj));
+        return make<Integer>(-getValue<Integer>(obj));
     }
     if (_isType<Double>(obj)) {
-        return make_shared<Double>(-getValue<Double>(obj));
+        return make<Double>(-getValue<Double>(obj));
     }
     throw newError("unknown operator: -{}", TypeToString(type(obj)));
 }
@@ -372,12 +503,12 @@ obj_ptr evalCalcExpression(token::TokenType typ, obj_ptr left, obj_ptr right) {
             auto valLeft = getValue<Double>(left);
             if (typeRight == Float_Obj) {
                 auto valRight = getValue<Double>(right);
-                return make_shared<Double>(
+                return make<Double>(
                     _calcFunction(typ, valLeft, valRight));
             }
             if (typeRight == Int_Obj) {
                 auto valRight = getValue<Integer>(right);
-                return make_shared<Double>(
+                return make<Double>(
                     _calcFunction(typ, valLeft, valRight));
             }
         }
@@ -385,21 +516,20 @@ obj_ptr evalCalcExpression(token::TokenType typ, obj_ptr left, obj_ptr right) {
             auto valLeft = getValue<Integer>(left);
             if (typeRight == Float_Obj) {
                 auto valRight = getValue<Double>(right);
-                return make_shared<Double>(
+                return make<Double>(
                     _calcFunction(typ, valLeft, valRight));
             }
             if (typeRight == Int_Obj) {
                 auto valRight = getValue<Integer>(right);
-                return make_shared<Integer>(
+                return make<Integer>(
                     _calcFunction(typ, valLeft, valRight));
             }
         }
     }
     if (type(left) == Str_Obj && type(right) == Str_Obj) {
-        auto valLeft = getValue<String>(left);
-        auto valRight = getValue<String>(right);
         if (typ == token::PLUS) {
-            return make_shared<String>(valLeft + valRight);
+            return String::concat(dynamic_cast<String *>(left.get()),
+                                  dynamic_cast<String *>(right.get()));
         }
     }
     throw newError("type mismatch: {} {} {}", TypeToString(type(left)),
@@ -409,18 +539,24 @@ obj_ptr evalCalcExpression(token::TokenType typ, obj_ptr left, obj_ptr right) {
 obj_ptr evalLogicExpression(token::TokenType typ, obj_ptr left, obj_ptr right) {
     auto typLeft = type(left);
     auto typRight = type(right);
+    if (typLeft == Str_Obj && typRight == Str_Obj &&
+        (typ == token::EQ || typ == token::NOT_EQ)) {
+        auto equal = dynamic_cast<String *>(left.get())->equals(
+            dynamic_cast<String *>(right.get()));
+        return (equal == (typ == token::EQ)) ? _TRUE : _FALSE;
+    }
     auto func = [&](auto valLeft) -> obj_ptr {
         if (typRight == Float_Obj) {
             auto valRight = getValue<Double>(right);
-            return make_shared<Boolean>(_logicFunction(typ, valLeft, valRight));
+            return nativeBoolToObject(_logicFunction(typ, valLeft, valRight));
         }
         if (typRight == Int_Obj) {
             auto valRight = getValue<Integer>(right);
-            return make_shared<Boolean>(_logicFunction(typ, valLeft, valRight));
+            return nativeBoolToObject(_logicFunction(typ, valLeft, valRight));
         }
         if (typRight == Bool_Obj) {
             auto valRight = getValue<Boolean>(right);
-            return make_shared<Boolean>(_logicFunction(typ, valLeft, valRight));
+            return nativeBoolToObject(_logicFunction(typ, valLeft, valRight));
         }
         throw newError("type mismatch: {} {} {}", TypeToString(type(left)),
                        token::TypeToSymbol(typ), TypeToString(type(right)));
@@ -456,9 +592,131 @@ bool isTrue(obj_ptr obj) {
     }
 }
 
+// 条件中的操作数: 数字和布尔直接保存原生值, 其它类型保留对象
+struct Operand {
+    std::variant<int, double, bool> value;
+    obj_ptr obj;
+};
+
+Operand evalOperand(ast::Expression *expr, env_ptr env) {
+    if (auto lit = _isType<ast::IntegerLiteral>(expr)) {
+        return {lit.res->value, nullptr};
+    }
+    if (auto lit = _isType<ast::DoubleLiteral>(expr)) {
+        return {lit.res->value, nullptr};
+    }
+    if (auto lit = _isType<ast::BooleanLiteral>(expr)) {
+        return {lit.res->value, nullptr};
+    }
+    auto obj = Eval(expr, env);
+    switch (type(obj)) {
+    case Int_Obj:
+        return {getValue<Integer>(obj), nullptr};
+    case Float_Obj:
+        return {getValue<Double>(obj), nullptr};
+    case Bool_Obj:
+        return {getValue<Boolean>(obj), nullptr};
+    default:
+        return {false, obj};
+    }
+}
+
+obj_ptr operandToObject(const Operand &operand) {
+    if (operand.obj != nullptr) {
+        return operand.obj;
+    }
+    return std::visit(
+        [](auto val) -> obj_ptr {
+            using T = decltype(val);
+            if constexpr (std::is_same_v<T, int>) {
+                return make<Integer>(val);
+            } else if constexpr (std::is_same_v<T, double>) {
+                return make<Double>(val);
+            } else {
+                return nativeBoolToObject(val);
+            }
+        },
+        operand.value);
+}
+
+bool isConditionOperator(token::TokenType typ) {
+    switch (typ) {
+    case token::AND:
+    case token::OR:
+    case token::EQ:
+    case token::NOT_EQ:
+    case token::LE:
+    case token::GE:
+    case token::LT:
+    case token::GT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// and / or 的操作数只接受数字和布尔
+bool evalLogicOperand(token::TokenType typ, ast::Expression *expr,
+                      env_ptr env) {
+    auto infix = _isType<ast::InfixExpression>(expr);
+    if (infix && isConditionOperator(infix.res->TokenType())) {
+        return evalCondition(expr, env);
+    }
+    auto obj = Eval(expr, env);
+    auto typObj = type(obj);
+    if (typObj != Int_Obj && typObj != Float_Obj && typObj != Bool_Obj) {
+        throw newError("unsupported operand for {}: {}",
+                       token::TypeToSymbol(typ), TypeToString(typObj));
+    }
+    return isTrue(obj);
+}
+
+// if / while 的条件以及 and / or 都从这里求值
+// 比较运算直接在原生值上完成, and / or 短路, 整个过程不创建 Boolean 对象
+bool evalCondition(ast::Expression *expr, env_ptr env) {
+    if (auto lit = _isType<ast::BooleanLiteral>(expr)) {
+        return lit.res->value;
+    }
+    auto _t = _isType<ast::InfixExpression>(expr);
+    if (!_t) {
+        return isTrue(Eval(expr, env));
+    }
+    auto infix = _t.res;
+    auto typ = infix->TokenType();
+    switch (typ) {
+    case token::AND:
+    case token::OR: {
+        bool left = evalLogicOperand(typ, infix->left(), env);
+        if (left == (typ == token::OR)) {
+            return left;
+        }
+        return evalLogicOperand(typ, infix->right(), env);
+    }
+    case token::EQ:
+    case token::NOT_EQ:
+    case token::LE:
+    case token::GE:
+    case token::LT:
+    case token::GT: {
+        auto left = evalOperand(infix->left(), env);
+        auto right = evalOperand(infix->right(), env);
+        if (left.obj == nullptr && right.obj == nullptr) {
+            return std::visit(
+                [typ](auto valLeft, auto valRight) {
+                    return _logicFunction(typ, valLeft, valRight);
+                },
+                left.value, right.value);
+        }
+        return isTrue(evalLogicExpression(typ, operandToObject(left),
+                                          operandToObject(right)));
+    }
+    default:
+        return isTrue(Eval(expr, env));
+    }
+}
+
 obj_ptr evalIfExpression(ast::IfExpression *ifexpr, env_ptr env) {
-    auto condition_res = Eval(ifexpr->condition(), env);
-    if (isTrue(condition_res)) {
+    if (evalCondition(ifexpr->condition(), env)) {
         return Eval(ifexpr->consequence(), env);
     } else if (ifexpr->Alternative != nullptr) {
         return Eval(ifexpr->alternative(), env);
@@ -468,11 +726,32 @@ obj_ptr evalIfExpression(ast::IfExpression *ifexpr, env_ptr env) {
 }
 
 void evalWhileStatement(ast::WhileStatement *whilestmt, env_ptr env) {
-    while (isTrue(Eval(whilestmt->condition(), env))) {
+    while (evalCondition(whilestmt->condition(), env)) {
+        jit::countLoop();
         Eval(whilestmt->body(), env);
     }
 }
 
+obj_ptr evalForStatement(ast::ForStatement *forstmt, env_ptr env) {
+    auto range = Eval(forstmt->range(), env);
+    auto iterable = dynamic_cast<Iterable *>(range.get());
+    if (iterable == nullptr) {
+        throw newError("object is not iterable: {}",
+                       TypeToString(type(range)));
+    }
+    auto name = forstmt->name()->sym;
+    auto iter = iterable->iterate(range);
+    while (auto val = iter->next()) {
+        jit::countLoop();
+        env->set(name, val);
+        auto res = Eval(forstmt->body(), env);
+        if (res != nullptr && type(res) == Return_Obj) {
+            return res;
+        }
+    }
+    return nullptr;
+}
+
 obj_ptr evalIndexExpression(obj_ptr left, obj_ptr index) {
     if (type(left) == Array_Obj && type(index) == Int_Obj) {
         auto arr = dynamic_cast<Array *>(left.get());
@@ -491,7 +770,7 @@ obj_ptr evalIndexExpression(obj_ptr left, obj_ptr index) {
 }
 
 obj_ptr evalHashLiteral(ast::HashLiteral *hash, env_ptr env) {
-    auto res = make_shared<Hash>();
+    auto res = make<Hash>();
     for (auto &pair : hash->pairs) {
         auto key = Eval(pair.first.get(), env);
         auto val = Eval(pair.second.get(), env);
@@ -0,0 +1,706 @@
+#pragma once
+
+#include "../ast/ast.cpp"
+#include "../vm/vm.cpp"
+#include "./scope.cpp"
+#include "./typed.cpp"
+#include <format>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// 静态类型推断
+// 对整个程序做一次流不敏感的不动点迭代: 字面量和运算给出表达式的类型,
+// 局部变量的类型是所有 let 的类型的并, 参数的类型是所有直接调用处实参类型的并,
+// 返回值的类型是所有 return 的类型的并
+// 参数, 局部变量和返回值都是 int / float / bool 的函数会翻译成 typed::Plan,
+// 调用时检查实参类型, 不符合时仍由解释器执行
+namespace infer {
+
+using scope::nodeAs;
+using scope::SymbolLess;
+using std::string;
+using std::vector;
+using symbol::Symbol;
+using typed::join;
+using typed::Type;
+typedef scope::Statements Statements;
+
+struct FunctionInfo {
+    scope::Function *fn;
+    std::map<Symbol, Type, SymbolLess> vars; // 参数和局部变量
+    Type ret = Type::Unknown;
+    string reason; // 不能不装箱执行的原因, 为空表示可以
+    std::unique_ptr<typed::Plan> plan;
+
+    string name() const {
+        return fn->name != nullptr ? fn->name->str
+                                   : std::format("<fn#{}>", fn->id);
+    }
+    Type varType(Symbol sym) const {
+        auto iter = vars.find(sym);
+        return iter == vars.end() ? Type::Unknown : iter->second;
+    }
+};
+
+struct Reject {
+    string reason;
+};
+
+bool isCompare(token::TokenType typ) {
+    switch (typ) {
+    case token::EQ:
+    case token::NOT_EQ:
+    case token::LE:
+    case token::GE:
+    case token::LT:
+    case token::GT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool isCalc(token::TokenType typ) {
+    return typ == token::PLUS || typ == token::MINUS ||
+           typ == token::ASTERISK || typ == token::SLASH;
+}
+
+// if (true) { ...; expr } 作为值时依次执行, 值是最后的表达式, 其中不能有 return
+ast::ExpressionStatement *valueBlock(ast::IfExpression *ifexpr) {
+    auto cond = nodeAs<ast::BooleanLiteral>(ifexpr->condition());
+    auto &stmts = ifexpr->consequence()->statements();
+    if (cond == nullptr || !cond->value || ifexpr->alternative() != nullptr ||
+        stmts.empty() || scope::containsReturn(stmts)) {
+        return nullptr;
+    }
+    return nodeAs<ast::ExpressionStatement>(stmts.back().get());
+}
+
+class Inference;
+
+// 把推断为单态的函数体翻译成 typed 的节点树
+class Builder {
+    private:
+    Inference &I;
+    FunctionInfo &info;
+    typed::Plan &plan;
+    std::map<Symbol, size_t, SymbolLess> slots;
+    int loops = 0;
+
+    typed::expr_ptr convert(typed::expr_ptr val, Type to);
+    typed::expr_ptr condition(ast::Expression *expr) {
+        return convert(expr_(expr), Type::Bool);
+    }
+    typed::expr_ptr infix(ast::InfixExpression *infix);
+    typed::expr_ptr call(ast::CallExpression *call);
+    typed::expr_ptr expr_(ast::Expression *expr);
+    typed::stmt_ptr block(Statements &stmts);
+    typed::stmt_ptr ifChain(ast::IfExpression *ifexpr);
+    typed::stmt_ptr forRange(ast::ForStatement *forstmt);
+    typed::stmt_ptr stmt(ast::Statement *stmt);
+
+    public:
+    Builder(Inference &I, FunctionInfo &info)
+        : I(I), info(info), plan(*info.plan) {
+    }
+    void build();
+};
+
+class Inference {
+    private:
+    scope::Analysis scopes;
+    std::map<scope::Function *, FunctionInfo> infos;
+    vector<FunctionInfo *> order; // 源码顺序, 顶层程序在最后
+    int loops = 0;
+    bool changed = false;
+
+    void assign(FunctionInfo &info, Symbol sym, Type typ) {
+        auto old = info.varType(sym);
+        auto res = join(old, typ);
+        if (res != old) {
+            info.vars[sym] = res;
+            changed = true;
+        }
+    }
+    void returns(FunctionInfo &info, Type typ) {
+        auto res = join(info.ret, typ);
+        if (res != info.ret) {
+            info.ret = res;
+            changed = true;
+        }
+    }
+
+    Type read(FunctionInfo &info, Symbol sym) {
+        if (!info.fn->declared.count(sym) || info.fn->unsafe.count(sym)) {
+            return Type::Any;
+        }
+        return info.varType(sym);
+    }
+
+    // for (i in range(...)) 的参数都是整数时循环变量是 int
+    bool isRangeCall(ast::Expression *expr) {
+        auto call = nodeAs<ast::CallExpression>(expr);
+        if (call == nullptr) {
+            return false;
+        }
+        auto callee = nodeAs<ast::Identifier>(call->function());
+        auto count = call->arguments().size();
+        return callee != nullptr && callee->value == "range" &&
+               scopes.isBuiltin(callee->sym) && count >= 1 && count <= 3;
+    }
+
+    Type visit(FunctionInfo &info, ast::Expression *expr) {
+        if (expr == nullptr) {
+            return Type::Any;
+        }
+        if (nodeAs<ast::IntegerLiteral>(expr)) {
+            return Type::Int;
+        }
+        if (nodeAs<ast::DoubleLiteral>(expr)) {
+            return Type::Float;
+        }
+        if (nodeAs<ast::BooleanLiteral>(expr)) {
+            return Type::Bool;
+        }
+        if (auto ident = nodeAs<ast::Identifier>(expr)) {
+            return read(info, ident->sym);
+        }
+        if (auto prefix = nodeAs<ast::PrefixExpression>(expr)) {
+            auto typ = visit(info, prefix->right());
+            if (prefix->TokenType() != token::MINUS) {
+                return Type::Bool;
+            }
+            return typ == Type::Bool ? Type::Any : typ;
+        }
+        if (auto infix = nodeAs<ast::InfixExpression>(expr)) {
+            auto left = visit(info, infix->left());
+            auto right = visit(info, infix->right());
+            if (!isCalc(infix->TokenType())) {
+                return Type::Bool;
+            }
+            if (left == Type::Any || right == Type::Any ||
+                left == Type::Bool || right == Type::Bool) {
+                return Type::Any;
+            }
+            if (left == Type::Unknown || right == Type::Unknown) {
+                return Type::Unknown;
+            }
+            return left == Type::Int && right == Type::Int ? Type::Int
+                                                           : Type::Float;
+        }
+        if (auto call = nodeAs<ast::CallExpression>(expr)) {
+            vector<Type> args;
+            for (auto &arg : call->arguments()) {
+                args.push_back(visit(info, arg.get()));
+            }
+            auto callee = nodeAs<ast::Identifier>(call->function());
+            auto target = callee != nullptr
+                              ? scopes.knownCallee(info.fn, callee->sym)
+                              : nullptr;
+            if (target == nullptr || target->params->size() != args.size()) {
+                visit(info, call->function());
+                return Type::Any;
+            }
+            auto &callee_ = infos.at(target);
+            for (size_t i = 0; i < args.size(); i++) {
+                assign(callee_, (*target->params)[i]->sym, args[i]);
+            }
+            return callee_.ret;
+        }
+        if (auto ifexpr = nodeAs<ast::IfExpression>(expr)) {
+            if (auto last = valueBlock(ifexpr)) {
+                auto &stmts = ifexpr->consequence()->statements();
+                for (size_t i = 0; i + 1 < stmts.size(); i++) {
+                    visit(info, stmts[i].get());
+                }
+                return visit(info, last->expression());
+            }
+            for (; ifexpr != nullptr; ifexpr = ifexpr->alternative()) {
+                visit(info, ifexpr->condition());
+                visit(info, ifexpr->consequence()->statements());
+            }
+            return Type::Any;
+        }
+        if (auto arr = nodeAs<ast::ArrayLiteral>(expr)) {
+            for (auto &elem : arr->elements()) {
+                visit(info, elem.get());
+            }
+        } else if (auto idx = nodeAs<ast::IndexExpression>(expr)) {
+            visit(info, idx->left());
+            visit(info, idx->index());
+        } else if (auto hash = nodeAs<ast::HashLiteral>(expr)) {
+            for (auto &pair : hash->pairs) {
+                visit(info, pair.first.get());
+                visit(info, pair.second.get());
+            }
+        }
+        return Type::Any;
+    }
+
+    void visit(FunctionInfo &info, Statements &stmts) {
+        for (auto &stmt : stmts) {
+            visit(info, stmt.get());
+        }
+    }
+    void visit(FunctionInfo &info, ast::Statement *stmt) {
+        if (auto let = nodeAs<ast::LetStatement>(stmt)) {
+            assign(info, let->name()->sym, visit(info, let->value()));
+        } else if (auto fnstmt = nodeAs<ast::FunctionStatement>(stmt)) {
+            assign(info, fnstmt->name()->sym, Type::Any);
+        } else if (auto ret = nodeAs<ast::ReturnStatement>(stmt)) {
+            auto typ = visit(info, ret->returnValue());
+            // 循环里的 return 只结束本轮循环, 不是函数的返回值
+            if (loops == 0) {
+                returns(info, typ);
+            }
+        } else if (auto exprStmt = nodeAs<ast::ExpressionStatement>(stmt)) {
+            visit(info, exprStmt->expression());
+        } else if (auto block = nodeAs<ast::BlockStatement>(stmt)) {
+            visit(info, block->statements());
+        } else if (auto whilestmt = nodeAs<ast::WhileStatement>(stmt)) {
+            visit(info, whilestmt->condition());
+            loops++;
+            visit(info, whilestmt->body()->statements());
+            loops--;
+        } else if (auto forstmt = nodeAs<ast::ForStatement>(stmt)) {
+            auto typ = Type::Any;
+            if (isRangeCall(forstmt->range())) {
+                typ = Type::Int;
+                for (auto &arg : nodeAs<ast::CallExpression>(forstmt->range())
+                                     ->arguments()) {
+                    typ = join(typ, visit(info, arg.get()));
+                }
+            } else {
+                visit(info, forstmt->range());
+            }
+            assign(info, forstmt->name()->sym, typ);
+            visit(info, forstmt->body()->statements());
+        }
+    }
+
+    // 参数, 局部变量和返回值都是原生类型, 且没有内层函数
+    string check(FunctionInfo &info) {
+        auto fn = info.fn;
+        if (!fn->children.empty()) {
+            return "defines nested functions";
+        }
+        if (!fn->unsafe.empty()) {
+            return std::format("`{}` may be read before assignment",
+                               (*fn->unsafe.begin())->str);
+        }
+        for (auto &param : *fn->params) {
+            if (!typed::isNative(info.varType(param->sym))) {
+                return std::format("parameter `{}` is {}", param->value,
+                                   typed::TypeName(info.varType(param->sym)));
+            }
+        }
+        for (auto sym : fn->declared) {
+            if (!typed::isNative(info.varType(sym))) {
+                return std::format("`{}` is {}", sym->str,
+                                   typed::TypeName(info.varType(sym)));
+            }
+        }
+        if (!typed::isNative(info.ret)) {
+            return std::format("returns {}", typed::TypeName(info.ret));
+        }
+        return "";
+    }
+
+    public:
+    Inference(ast::Program *prog) : scopes(prog) {
+        for (auto &fn : scopes.all()) {
+            auto &info = infos[fn.get()];
+            info.fn = fn.get();
+            // 可能执行到函数体末尾时返回 null
+            if (!scope::endsWithReturn(*fn->body)) {
+                info.ret = Type::Any;
+            }
+            order.push_back(&info);
+        }
+        auto &program = infos[&scopes.program];
+        program.fn = &scopes.program;
+        program.reason = "top level";
+        order.push_back(&program);
+
+        do {
+            changed = false;
+            for (auto info : order) {
+                visit(*info, *info->fn->body);
+            }
+        } while (changed);
+
+        for (auto info : order) {
+            if (info->reason.empty()) {
+                info->reason = check(*info);
+            }
+        }
+        // 调用了不能不装箱执行的函数时自己也不行, 反复构建直到没有变化
+        bool rejected = true;
+        while (rejected) {
+            rejected = false;
+            for (auto info : order) {
+                if (info->reason.empty()) {
+                    info->plan = std::make_unique<typed::Plan>();
+                }
+            }
+            for (auto info : order) {
+                if (!info->reason.empty()) {
+                    continue;
+                }
+                try {
+                    Builder(*this, *info).build();
+                } catch (Reject &e) {
+                    info->reason = e.reason;
+                    info->plan.reset();
+                    rejected = true;
+                }
+            }
+        }
+        for (auto info : order) {
+            if (info->plan != nullptr) {
+                info->plan->ready = true;
+            }
+        }
+    }
+    Inference(const Inference &) = delete;
+    Inference &operator=(const Inference &) = delete;
+    ~Inference() {
+        typed::plans.clear();
+    }
+
+    FunctionInfo *infoOf(scope::Function *fn) {
+        auto iter = infos.find(fn);
+        return iter == infos.end() ? nullptr : &iter->second;
+    }
+    scope::Analysis &analysis() {
+        return scopes;
+    }
+
+    // 登记之后新创建的 FunctionObject 会带上对应的 Plan
+    // --vm 时再编译成字节码执行
+    void install() {
+        for (auto info : order) {
+            if (info->plan != nullptr) {
+                if (vm::options.enabled) {
+                    vm::compile(*info->plan);
+                }
+                typed::plans[info->fn->block] = info->plan.get();
+            }
+        }
+    }
+
+    // --dump-types 的输出
+    string dump() {
+        string res;
+        for (auto info : order) {
+            auto fn = info->fn;
+            if (fn->isProgram()) {
+                res += "<top level>\n";
+            } else {
+                string params;
+                for (auto &param : *fn->params) {
+                    params += std::format(
+                        "{}{}: {}", params.empty() ? "" : ", ", param->value,
+                        typed::TypeName(info->varType(param->sym)));
+                }
+                res += std::format("fn {}({}) -> {}  ", info->name(), params,
+                                   typed::TypeName(info->ret));
+                res += info->plan != nullptr
+                           ? "unboxed\n"
+                           : std::format("boxed: {}\n", info->reason);
+            }
+            for (auto sym : fn->declared) {
+                if (!fn->isParam(sym)) {
+                    res += std::format("    {}: {}\n", sym->str,
+                                       typed::TypeName(read(*info, sym)));
+                }
+            }
+        }
+        return res;
+    }
+};
+
+typed::expr_ptr Builder::convert(typed::expr_ptr val, Type to) {
+    auto from = val->type;
+    if (from == to) {
+        return val;
+    }
+    if (to == Type::Bool) {
+        if (from == Type::Int) {
+            return std::make_unique<typed::Convert<int, bool>>(std::move(val));
+        }
+        return std::make_unique<typed::Convert<double, bool>>(std::move(val));
+    }
+    if (to == Type::Float) {
+        if (from == Type::Int) {
+            return std::make_unique<typed::Convert<int, double>>(
+                std::move(val));
+        }
+        return std::make_unique<typed::Convert<bool, double>>(std::move(val));
+    }
+    if (from == Type::Bool) {
+        return std::make_unique<typed::Convert<bool, int>>(std::move(val));
+    }
+    throw Reject{"converts float to int"};
+}
+
+template <typename T, template <typename, token::TokenType> class Node>
+typed::expr_ptr binary(token::TokenType typ, typed::expr_ptr left,
+                       typed::expr_ptr right) {
+#define CASE(op)                                                               \
+    case token::op:                                                            \
+        return std::make_unique<Node<T, token::op>>(std::move(left),           \
+                                                    std::move(right))
+    switch (typ) {
+        CASE(PLUS);
+        CASE(MINUS);
+        CASE(ASTERISK);
+        CASE(SLASH);
+        CASE(EQ);
+        CASE(NOT_EQ);
+        CASE(LT);
+        CASE(GT);
+        CASE(LE);
+        CASE(GE);
+    default:
+        throw Reject{std::format("uses operator {}",
+                                 token::TypeToSymbol(typ))};
+    }
+#undef CASE
+}
+
+typed::expr_ptr Builder::infix(ast::InfixExpression *infix) {
+    auto typ = infix->TokenType();
+    if (typ == token::AND || typ == token::OR) {
+        auto left = condition(infix->left());
+        auto right = condition(infix->right());
+        if (typ == token::OR) {
+            return std::make_unique<typed::Logic<true>>(std::move(left),
+                                                        std::move(right));
+        }
+        return std::make_unique<typed::Logic<false>>(std::move(left),
+                                                     std::move(right));
+    }
+    auto left = expr_(infix->left());
+    auto right = expr_(infix->right());
+    if (isCompare(typ)) {
+        // 与 C++ 的常规算术转换一致: 有 float 时比较 float, 否则比较 int
+        if (left->type == Type::Float || right->type == Type::Float) {
+            return binary<double, typed::Compare>(
+                typ, convert(std::move(left), Type::Float),
+                convert(std::move(right), Type::Float));
+        }
+        return binary<int, typed::Compare>(typ,
+                                           convert(std::move(left), Type::Int),
+                                           convert(std::move(right), Type::Int));
+    }
+    if (!isCalc(typ) || left->type == Type::Bool || right->type == Type::Bool) {
+        throw Reject{std::format("uses operator {}", token::TypeToSymbol(typ))};
+    }
+    if (left->type == Type::Int && right->type == Type::Int) {
+        return binary<int, typed::Arith>(typ, std::move(left),
+                                         std::move(right));
+    }
+    return binary<double, typed::Arith>(typ,
+                                        convert(std::move(left), Type::Float),
+                                        convert(std::move(right), Type::Float));
+}
+
+typed::expr_ptr Builder::call(ast::CallExpression *call) {
+    auto callee = nodeAs<ast::Identifier>(call->function());
+    auto target = callee != nullptr
+                      ? I.analysis().knownCallee(info.fn, callee->sym)
+                      : nullptr;
+    auto targetInfo = target != nullptr ? I.infoOf(target) : nullptr;
+    if (targetInfo == nullptr || targetInfo->plan == nullptr) {
+        throw Reject{std::format("calls `{}`", call->function()->output())};
+    }
+    auto &args = call->arguments();
+    if (args.size() != target->params->size()) {
+        throw Reject{std::format("calls `{}` with wrong arity", callee->value)};
+    }
+    vector<typed::expr_ptr> list;
+    for (size_t i = 0; i < args.size(); i++) {
+        list.push_back(expr_(args[i].get()));
+        if (list.back()->type !=
+            targetInfo->varType((*target->params)[i]->sym)) {
+            throw Reject{std::format("passes {} to `{}`",
+                                     typed::TypeName(list.back()->type),
+                                     callee->value)};
+        }
+    }
+    return std::make_unique<typed::Call>(targetInfo->plan.get(), callee->sym,
+                                         std::move(list));
+}
+
+typed::expr_ptr Builder::expr_(ast::Expression *expr) {
+    if (auto lit = nodeAs<ast::IntegerLiteral>(expr)) {
+        return std::make_unique<typed::Const>(Type::Int,
+                                              typed::slot(lit->value));
+    }
+    if (auto lit = nodeAs<ast::DoubleLiteral>(expr)) {
+        return std::make_unique<typed::Const>(Type::Float,
+                                              typed::slot(lit->value));
+    }
+    if (auto lit = nodeAs<ast::BooleanLiteral>(expr)) {
+        return std::make_unique<typed::Const>(Type::Bool,
+                                              typed::slot(lit->value));
+    }
+    if (auto ident = nodeAs<ast::Identifier>(expr)) {
+        auto iter = slots.find(ident->sym);
+        if (iter == slots.end()) {
+            throw Reject{std::format("reads `{}` from an outer scope",
+                                     ident->value)};
+        }
+        return std::make_unique<typed::Load>(plan.slotTypes[iter->second],
+                                             iter->second);
+    }
+    if (auto prefix = nodeAs<ast::PrefixExpression>(expr)) {
+        auto val = expr_(prefix->right());
+        auto typ = val->type;
+        if (prefix->TokenType() == token::MINUS) {
+            if (typ == Type::Int) {
+                return std::make_unique<typed::Neg<int>>(std::move(val));
+            }
+            if (typ == Type::Float) {
+                return std::make_unique<typed::Neg<double>>(std::move(val));
+            }
+            throw Reject{"negates a bool"};
+        }
+        if (typ == Type::Int) {
+            return std::make_unique<typed::Not<int>>(std::move(val));
+        }
+        if (typ == Type::Float) {
+            return std::make_unique<typed::Not<double>>(std::move(val));
+        }
+        return std::make_unique<typed::Not<bool>>(std::move(val));
+    }
+    if (auto node = nodeAs<ast::InfixExpression>(expr)) {
+        return infix(node);
+    }
+    if (auto node = nodeAs<ast::CallExpression>(expr)) {
+        return call(node);
+    }
+    if (auto node = nodeAs<ast::IfExpression>(expr)) {
+        if (auto last = valueBlock(node)) {
+            auto &stmts = node->consequence()->statements();
+            auto body = std::make_unique<typed::Block>();
+            for (size_t i = 0; i + 1 < stmts.size(); i++) {
+                body->stmts.push_back(stmt(stmts[i].get()));
+            }
+            return std::make_unique<typed::Seq>(std::move(body),
+                                                expr_(last->expression()));
+        }
+    }
+    throw Reject{std::format("uses `{}`", expr->output())};
+}
+
+typed::stmt_ptr Builder::block(Statements &stmts) {
+    auto res = std::make_unique<typed::Block>();
+    for (auto &stmt : stmts) {
+        res->stmts.push_back(this->stmt(stmt.get()));
+    }
+    return res;
+}
+
+typed::stmt_ptr Builder::ifChain(ast::IfExpression *ifexpr) {
+    auto cond = condition(ifexpr->condition());
+    auto consequence = block(ifexpr->consequence()->statements());
+    typed::stmt_ptr alternative;
+    if (ifexpr->alternative() != nullptr) {
+        alternative = ifChain(ifexpr->alternative());
+    }
+    return std::make_unique<typed::If>(std::move(cond), std::move(consequence),
+                                       std::move(alternative));
+}
+
+typed::stmt_ptr Builder::forRange(ast::ForStatement *forstmt) {
+    auto call = nodeAs<ast::CallExpression>(forstmt->range());
+    auto callee =
+        call != nullptr ? nodeAs<ast::Identifier>(call->function()) : nullptr;
+    auto count = call != nullptr ? call->arguments().size() : 0;
+    if (callee == nullptr || callee->value != "range" ||
+        !I.analysis().isBuiltin(callee->sym) || count < 1 || count > 3) {
+        throw Reject{"iterates over something other than range"};
+    }
+    vector<typed::expr_ptr> args;
+    for (auto &arg : call->arguments()) {
+        args.push_back(expr_(arg.get()));
+        if (args.back()->type != Type::Int) {
+            throw Reject{"passes a non-int to range"};
+        }
+    }
+    auto body = block(forstmt->body()->statements());
+    return std::make_unique<typed::ForRange>(slots.at(forstmt->name()->sym),
+                                             std::move(args), std::move(body));
+}
+
+typed::stmt_ptr Builder::stmt(ast::Statement *stmt) {
+    if (auto let = nodeAs<ast::LetStatement>(stmt)) {
+        auto index = slots.at(let->name()->sym);
+        auto val = expr_(let->value());
+        if (val->type != plan.slotTypes[index]) {
+            throw Reject{std::format("assigns {} to `{}`",
+                                     typed::TypeName(val->type),
+                                     let->name()->value)};
+        }
+        return std::make_unique<typed::Let>(index, std::move(val));
+    }
+    if (auto ret = nodeAs<ast::ReturnStatement>(stmt)) {
+        if (ret->returnValue() == nullptr) {
+            throw Reject{"returns null"};
+        }
+        auto val = expr_(ret->returnValue());
+        if (loops == 0 && val->type != plan.ret) {
+            throw Reject{std::format("returns {}", typed::TypeName(val->type))};
+        }
+        return std::make_unique<typed::Return>(std::move(val));
+    }
+    if (auto exprStmt = nodeAs<ast::ExpressionStatement>(stmt)) {
+        if (auto ifexpr = nodeAs<ast::IfExpression>(exprStmt->expression())) {
+            return ifChain(ifexpr);
+        }
+        return std::make_unique<typed::Discard>(
+            expr_(exprStmt->expression()));
+    }
+    if (auto node = nodeAs<ast::BlockStatement>(stmt)) {
+        return block(node->statements());
+    }
+    if (auto whilestmt = nodeAs<ast::WhileStatement>(stmt)) {
+        auto cond = condition(whilestmt->condition());
+        loops++;
+        auto body = block(whilestmt->body()->statements());
+        loops--;
+        return std::make_unique<typed::While>(std::move(cond),
+                                              std::move(body));
+    }
+    if (auto forstmt = nodeAs<ast::ForStatement>(stmt)) {
+        return forRange(forstmt);
+    }
+    throw Reject{std::format("uses `{}`", stmt->output())};
+}
+
+void Builder::build() {
+    auto fn = info.fn;
+    plan.name = info.name();
+    plan.block = fn->block;
+    plan.ret = info.ret;
+    for (auto &param : *fn->params) {
+        slots[param->sym] = plan.slotTypes.size();
+        plan.params.push_back(info.varType(param->sym));
+        plan.slotTypes.push_back(info.varType(param->sym));
+    }
+    for (auto sym : fn->declared) {
+        if (!slots.count(sym)) {
+            slots[sym] = plan.slotTypes.size();
+            plan.slotTypes.push_back(info.varType(sym));
+        }
+    }
+    for (auto &stmt : *fn->body) {
+        plan.body.push_back(this->stmt(stmt.get()));
+    }
+}
+
+} // namespace infer
@@ -0,0 +1,566 @@
+#pragma once
+
+#include "../ast/ast.cpp"
+#include "./eval.cpp"
+#include <cstdint>
+#include <memory>
+#include <typeindex>
+#include <unordered_map>
+#include <vector>
+
+// 不递归的求值器
+// eval::Eval 每层表达式和每次调用都占用一层 C++ 栈, 数据嵌套太深或者递归太深
+// 时进程直接崩溃. 这里把还没做完的工作放在堆上的续延栈里, 中间结果放在值栈里,
+// 一个循环反复推进栈顶的帧. 续延栈超过 maxDepth 时抛出 "stack overflow",
+// 其余行为与 eval::Eval 一致
+namespace machine {
+
+using environment::env_ptr;
+using eval::obj_ptr;
+using object::newError;
+using std::vector;
+
+struct Options {
+    bool enabled = false;
+    size_t maxDepth = 1 << 20; // 续延栈的最大帧数
+};
+
+static Options options;
+
+enum class Kind {
+    Null,
+    Program,
+    Block,
+    ExpressionStatement,
+    Integer,
+    Double,
+    Boolean,
+    String,
+    Prefix,
+    Infix,
+    If,
+    Return,
+    Let,
+    While,
+    For,
+    Identifier,
+    FunctionLiteral,
+    FunctionStatement,
+    Array,
+    Index,
+    Call,
+    Hash,
+    Constant,
+    // 不对应单独节点的帧, 与 eval::evalCondition / evalLogicOperand 对应
+    Condition,
+    LogicOperand,
+};
+
+Kind kindOf(ast::Node *node) {
+    static const std::unordered_map<std::type_index, Kind> kinds = {
+        {typeid(ast::Program), Kind::Program},
+        {typeid(ast::BlockStatement), Kind::Block},
+        {typeid(ast::ExpressionStatement), Kind::ExpressionStatement},
+        {typeid(ast::IntegerLiteral), Kind::Integer},
+        {typeid(ast::DoubleLiteral), Kind::Double},
+        {typeid(ast::BooleanLiteral), Kind::Boolean},
+        {typeid(ast::StringLiteral), Kind::String},
+        {typeid(ast::PrefixExpression), Kind::Prefix},
+        {typeid(ast::InfixExpression), Kind::Infix},
+        {typeid(ast::IfExpression), Kind::If},
+        {typeid(ast::ReturnStatement), Kind::Return},
+        {typeid(ast::LetStatement), Kind::Let},
+        {typeid(ast::WhileStatement), Kind::While},
+        {typeid(ast::ForStatement), Kind::For},
+        {typeid(ast::Identifier), Kind::Identifier},
+        {typeid(ast::FunctionLiteral), Kind::FunctionLiteral},
+        {typeid(ast::FunctionStatement), Kind::FunctionStatement},
+        {typeid(ast::ArrayLiteral), Kind::Array},
+        {typeid(ast::IndexExpression), Kind::Index},
+        {typeid(ast::CallExpression), Kind::Call},
+        {typeid(ast::HashLiteral), Kind::Hash},
+        {typeid(ast::ConstantLiteral), Kind::Constant},
+    };
+    if (node == nullptr) {
+        return Kind::Null;
+    }
+    auto it = kinds.find(typeid(*node));
+    return it == kinds.end() ? Kind::Null : it->second;
+}
+
+class Machine {
+    private:
+    struct Frame {
+        Kind kind;
+        ast::Node *node;
+        env_ptr env;
+        size_t base;   // 进入时值栈的高度, 结束时值栈恢复到这里再放入结果
+        int step = 0;  // 下一步做什么, 各种帧各自解释
+        size_t index = 0;
+        token::TokenType op = token::ILLEGAL; // LogicOperand 所属的 and / or
+        obj_ptr held{}; // 语句序列的上一个结果, for 的迭代对象, 正在构造的 hash
+        std::unique_ptr<object::Iterator> iter{};
+        jit::Profile *saved = nullptr; // 调用前的 jit::activeProfile
+        bool entered = false;
+    };
+
+    vector<Frame> frames;
+    vector<obj_ptr> values;
+    // 不装箱的调用因为 typed::stack 用完而放弃时, 它里面更深的调用同样会
+    // 放弃, 不再尝试, 否则深递归每一层都要重试一遍. 这个调用结束后恢复
+    size_t boxedFrom = SIZE_MAX;
+
+    void push(Kind kind, ast::Node *node, const env_ptr &env) {
+        if (frames.size() >= options.maxDepth) {
+            throw newError("stack overflow");
+        }
+        frames.push_back({kind, node, env, values.size()});
+    }
+    void eval(ast::Node *node, const env_ptr &env) {
+        stats::evaluated(node);
+        push(kindOf(node), node, env);
+    }
+    obj_ptr pop() {
+        auto res = std::move(values.back());
+        values.pop_back();
+        return res;
+    }
+    // 栈顶的帧完成, 结果留给下面的帧
+    void finish(obj_ptr res) {
+        values.resize(frames.back().base);
+        values.push_back(std::move(res));
+        frames.pop_back();
+    }
+    void leave(Frame &f) {
+        if (f.entered) {
+            jit::activeProfile = f.saved;
+            f.entered = false;
+        }
+    }
+
+    // Program 和 Block: 语句依次求值, 遇到 return 或者错误提前结束
+    void statements(Frame &f, const vector<std::unique_ptr<ast::Statement>> &list,
+                    bool program) {
+        if (f.step == 1) {
+            auto res = pop();
+            if (res != nullptr) {
+                if (type(res) == object::Return_Obj) {
+                    if (program) {
+                        res = static_cast<object::ReturnValue *>(res.get())->Value;
+                    }
+                    return finish(res);
+                }
+                if (type(res) == object::Error_Obj) {
+                    return finish(res);
+                }
+            }
+            f.held = res;
+        }
+        if (f.index == list.size()) {
+            return finish(f.held);
+        }
+        if (heap::requested) {
+            heap::poll();
+        }
+        f.step = 1;
+        eval(list[f.index++].get(), f.env);
+    }
+
+    void call(Frame &f, ast::CallExpression *node) {
+        if (f.step == 0) {
+            f.step = 1;
+            return eval(node->function(), f.env);
+        }
+        auto &arguments = node->arguments();
+        if (f.step == 1) {
+            if (f.index < arguments.size()) {
+                return eval(arguments[f.index++].get(), f.env);
+            }
+            f.step = 2;
+        }
+        if (f.step == 3) {
+            auto res = pop();
+            leave(f);
+            if (prof::options.enabled) {
+                prof::leave();
+            }
+            if (frames.size() - 1 == boxedFrom) {
+                boxedFrom = SIZE_MAX;
+            }
+            return finish(eval::unwarpReturnValue(res));
+        }
+        auto func = values[f.base];
+        vector<obj_ptr> args(values.begin() + f.base + 1, values.end());
+        auto function = eval::cachedCallee(node, func, args.size());
+        if (function == nullptr && type(func) == object::Function_Obj) {
+            function = static_cast<object::FunctionObject *>(func.get());
+            eval::checkArguments(function, args);
+        }
+        if (function != nullptr) {
+            stats::bump(stats::local().calls);
+            if (prof::options.enabled) {
+                prof::enter(function);
+            }
+            if (jit::options.enabled) {
+                auto profile = jit::profileFor(function);
+                if (auto res = jit::tryCall(function, profile, args)) {
+                    return done(res);
+                }
+                f.saved = jit::activeProfile;
+                f.entered = true;
+                jit::activeProfile = profile;
+            }
+            if (function->Plan != nullptr && frames.size() <= boxedFrom) {
+                if (auto res = function->Plan->call(function, args)) {
+                    leave(f);
+                    return done(res);
+                }
+                if (typed::stack.overflowed) {
+                    typed::stack.overflowed = false;
+                    boxedFrom = frames.size() - 1;
+                }
+            }
+            auto env = eval::extendFunctionEnv(function, args);
+            f.step = 3;
+            return eval(function->Body.get(), env);
+        }
+        if (type(func) == object::Builtin_Obj) {
+            auto builtin = static_cast<object::BuiltIn *>(func.get());
+            stats::bump(stats::local().builtins);
+            trace::Span span(builtin->name(), trace::Category::Builtin);
+            return finish(builtin->Fn(args));
+        }
+        throw newError("not a function: {}", TypeToString(type(func)));
+    }
+
+    // 调用不经过函数体直接得到结果
+    void done(obj_ptr res) {
+        if (prof::options.enabled) {
+            prof::leave();
+        }
+        finish(std::move(res));
+    }
+
+    // 与 eval::evalCondition 相同, 结果是 _TRUE 或 _FALSE
+    void condition(Frame &f) {
+        auto expr = static_cast<ast::Expression *>(f.node);
+        if (f.step == 0) {
+            if (auto lit = eval::_isType<ast::BooleanLiteral>(expr)) {
+                return finish(eval::nativeBoolToObject(lit.res->value));
+            }
+            auto infix = eval::_isType<ast::InfixExpression>(expr);
+            auto typ = infix ? infix.res->TokenType() : token::ILLEGAL;
+            if (typ == token::AND || typ == token::OR) {
+                f.step = 1;
+                push(Kind::LogicOperand, infix.res->left(), f.env);
+                frames.back().op = typ;
+            } else if (infix && eval::isConditionOperator(typ)) {
+                f.step = 3;
+                eval(infix.res->left(), f.env);
+            } else {
+                f.step = 5;
+                eval(expr, f.env);
+            }
+            return;
+        }
+        auto infix = static_cast<ast::InfixExpression *>(expr);
+        auto typ = infix->TokenType();
+        switch (f.step) {
+        case 1: {
+            bool left = pop() == object::_TRUE;
+            if (left == (typ == token::OR)) {
+                return finish(eval::nativeBoolToObject(left));
+            }
+            f.step = 2;
+            push(Kind::LogicOperand, infix->right(), f.env);
+            frames.back().op = typ;
+            return;
+        }
+        case 2:
+            return finish(pop());
+        case 3:
+            f.step = 4;
+            return eval(infix->right(), f.env);
+        case 4: {
+            auto right = pop(), left = pop();
+            auto a = operand(left), b = operand(right);
+            bool res;
+            if (a.obj == nullptr && b.obj == nullptr) {
+                res = std::visit(
+                    [typ](auto valLeft, auto valRight) {
+                        return eval::_logicFunction(typ, valLeft, valRight);
+                    },
+                    a.value, b.value);
+            } else {
+                res = eval::isTrue(eval::evalLogicExpression(typ, left, right));
+            }
+            return finish(eval::nativeBoolToObject(res));
+        }
+        default:
+            return finish(eval::nativeBoolToObject(eval::isTrue(pop())));
+        }
+    }
+    // 与 eval::evalOperand 求值之后的转换相同
+    static eval::Operand operand(const obj_ptr &obj) {
+        switch (type(obj)) {
+        case object::Int_Obj:
+            return {object::getValue<object::Integer>(obj), nullptr};
+        case object::Float_Obj:
+            return {object::getValue<object::Double>(obj), nullptr};
+        case object::Bool_Obj:
+            return {object::getValue<object::Boolean>(obj), nullptr};
+        default:
+            return {false, obj};
+        }
+    }
+    // 与 eval::evalLogicOperand 相同
+    void logicOperand(Frame &f) {
+        auto expr = static_cast<ast::Expression *>(f.node);
+        if (f.step == 0) {
+            auto infix = eval::_isType<ast::InfixExpression>(expr);
+            if (infix && eval::isConditionOperator(infix.res->TokenType())) {
+                f.step = 1;
+                return push(Kind::Condition, expr, f.env);
+            }
+            f.step = 2;
+            return eval(expr, f.env);
+        }
+        auto obj = pop();
+        if (f.step == 2) {
+            auto typObj = type(obj);
+            if (typObj != object::Int_Obj && typObj != object::Float_Obj &&
+                typObj != object::Bool_Obj) {
+                throw newError("unsupported operand for {}: {}",
+                               token::TypeToSymbol(f.op),
+                               TypeToString(typObj));
+            }
+            obj = eval::nativeBoolToObject(eval::isTrue(obj));
+        }
+        finish(obj);
+    }
+
+    void step() {
+        auto &f = frames.back();
+        auto node = f.node;
+        if (alloc::options.enabled) {
+            alloc::site = node;
+        }
+        switch (f.kind) {
+        case Kind::Null:
+            return finish(object::_NULL);
+        case Kind::Program:
+            return statements(f, node->cast<ast::Program>()->statements(), true);
+        case Kind::Block:
+            return statements(
+                f, node->cast<ast::BlockStatement>()->statements(), false);
+        case Kind::ExpressionStatement:
+            if (f.step == 0) {
+                f.step = 1;
+                return eval(
+                    node->cast<ast::ExpressionStatement>()->expression(),
+                    f.env);
+            }
+            return finish(pop());
+        case Kind::Integer:
+        case Kind::Double:
+        case Kind::Boolean:
+        case Kind::String:
+        case Kind::Identifier:
+        case Kind::FunctionLiteral:
+        case Kind::FunctionStatement:
+        case Kind::Constant:
+            // 不含子表达式的节点直接交给 eval::Eval
+            return finish(eval::Eval(node, f.env));
+        case Kind::Prefix: {
+            auto prefix = node->cast<ast::PrefixExpression>();
+            if (f.step == 0) {
+                f.step = 1;
+                return eval(prefix->right(), f.env);
+            }
+            return finish(
+                eval::evalPrefixExpression(prefix->TokenType(), pop()));
+        }
+        case Kind::Infix: {
+            auto infix = node->cast<ast::InfixExpression>();
+            if (f.step == 0 && (infix->TokenType() == token::AND ||
+                                infix->TokenType() == token::OR)) {
+                f.step = 3;
+                return push(Kind::Condition, node, f.env);
+            }
+            switch (f.step) {
+            case 0:
+                f.step = 1;
+                return eval(infix->left(), f.env);
+            case 1:
+                f.step = 2;
+                return eval(infix->right(), f.env);
+            case 2: {
+                auto right = pop(), left = pop();
+                return finish(eval::evalInfixExpression(infix->TokenType(),
+                                                        left, right));
+            }
+            default:
+                return finish(pop());
+            }
+        }
+        case Kind::If: {
+            auto ifexpr = node->cast<ast::IfExpression>();
+            if (f.step == 0) {
+                f.step = 1;
+                return push(Kind::Condition, ifexpr->condition(), f.env);
+            }
+            if (f.step == 1) {
+                f.step = 2;
+                if (pop() == object::_TRUE) {
+                    return eval(ifexpr->consequence(), f.env);
+                }
+                if (ifexpr->Alternative != nullptr) {
+                    return eval(ifexpr->alternative(), f.env);
+                }
+                return finish(object::_NULL);
+            }
+            return finish(pop());
+        }
+        case Kind::Return:
+            if (f.step == 0) {
+                f.step = 1;
+                return eval(node->cast<ast::ReturnStatement>()->returnValue(),
+                            f.env);
+            }
+            return finish(object::make<object::ReturnValue>(pop()));
+        case Kind::Let: {
+            auto let = node->cast<ast::LetStatement>();
+            if (f.step == 0) {
+                f.step = 1;
+                return eval(let->value(), f.env);
+            }
+            auto val = pop();
+            if (type(val) == object::Function_Obj) {
+                auto func = static_cast<object::FunctionObject *>(val.get());
+                if (func->Name.empty()) {
+                    func->Name = let->name()->value;
+                }
+            }
+            f.env->set(let->name()->sym, val);
+            return finish(nullptr);
+        }
+        case Kind::While: {
+            auto whilestmt = node->cast<ast::WhileStatement>();
+            if (f.step == 1) {
+                if (pop() != object::_TRUE) {
+                    return finish(nullptr);
+                }
+                jit::countLoop();
+                f.step = 2;
+                return eval(whilestmt->body(), f.env);
+            }
+            if (f.step == 2) {
+                pop();
+            }
+            f.step = 1;
+            return push(Kind::Condition, whilestmt->condition(), f.env);
+        }
+        case Kind::For: {
+            auto forstmt = node->cast<ast::ForStatement>();
+            if (f.step == 0) {
+                f.step = 1;
+                return eval(forstmt->range(), f.env);
+            }
+            if (f.step == 1) {
+                f.held = pop();
+                auto iterable = dynamic_cast<object::Iterable *>(f.held.get());
+                if (iterable == nullptr) {
+                    throw newError("object is not iterable: {}",
+                                   TypeToString(type(f.held)));
+                }
+                f.iter = iterable->iterate(f.held);
+            } else {
+                auto res = pop();
+                if (res != nullptr && type(res) == object::Return_Obj) {
+                    return finish(res);
+                }
+            }
+            auto val = f.iter->next();
+            if (!val) {
+                return finish(nullptr);
+            }
+            jit::countLoop();
+            f.env->set(forstmt->name()->sym, val);
+            f.step = 2;
+            return eval(forstmt->body(), f.env);
+        }
+        case Kind::Array: {
+            auto &elements = node->cast<ast::ArrayLiteral>()->elements();
+            if (f.index < elements.size()) {
+                return eval(elements[f.index++].get(), f.env);
+            }
+            vector<obj_ptr> res(values.begin() + f.base, values.end());
+            return finish(object::make<object::Array>(res));
+        }
+        case Kind::Index: {
+            auto index = node->cast<ast::IndexExpression>();
+            switch (f.step) {
+            case 0:
+                f.step = 1;
+                return eval(index->left(), f.env);
+            case 1:
+                f.step = 2;
+                return eval(index->index(), f.env);
+            default: {
+                auto idx = pop(), left = pop();
+                return finish(eval::evalIndexExpression(left, idx));
+            }
+            }
+        }
+        case Kind::Call:
+            return call(f, node->cast<ast::CallExpression>());
+        case Kind::Hash: {
+            auto &pairs = node->cast<ast::HashLiteral>()->pairs;
+            if (f.step == 0) {
+                f.held = object::make<object::Hash>();
+            } else if (f.step == 2) {
+                auto val = pop(), key = pop();
+                if (key == nullptr || val == nullptr) {
+                    throw newError("key or value is nullptr");
+                }
+                static_cast<object::Hash *>(f.held.get())->insert(key, val);
+                f.index++;
+            }
+            if (f.index == pairs.size()) {
+                return finish(f.held);
+            }
+            auto &pair = pairs[f.index];
+            f.step = f.step == 1 ? 2 : 1;
+            return eval(f.step == 1 ? pair.first.get() : pair.second.get(),
+                        f.env);
+        }
+        case Kind::Condition:
+            return condition(f);
+        case Kind::LogicOperand:
+            return logicOperand(f);
+        }
+    }
+
+    public:
+    obj_ptr run(ast::Node *node, const env_ptr &env) {
+        auto saved = jit::activeProfile;
+        auto mark = prof::mark();
+        try {
+            eval(node, env);
+            while (!frames.empty()) {
+                step();
+            }
+        } catch (...) {
+            jit::activeProfile = saved;
+            prof::unwind(mark);
+            throw;
+        }
+        return pop();
+    }
+};
+
+obj_ptr run(ast::Node *node, env_ptr env) {
+    return Machine().run(node, env);
+}
+
+} // namespace machine
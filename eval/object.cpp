@@ -3,11 +3,16 @@
 #include "object.hpp"
 #include "../ast/ast.cpp"
 #include "env.cpp"
+#include <atomic>
 #include <format>
 #include <functional>
 #include <memory>
 #include <string>
 
+namespace typed {
+class Plan;
+}
+
 namespace object {
 
 using std::format;
@@ -27,6 +32,9 @@ class Integer : public Object, public Hasher {
     string Inspect() {
         return format("{}", Value);
     }
+    void InspectTo(Inspector &out) {
+        out.format("{}", Value);
+    }
     size_t hash() {
         return std::hash<int>{}(Value);
     }
@@ -47,13 +55,16 @@ class Boolean : public Object, public Hasher {
     string Inspect() {
         return format("{}", Value);
     }
+    void InspectTo(Inspector &out) {
+        out.write(Value ? "true" : "false");
+    }
     size_t hash() {
         return std::hash<bool>{}(Value);
     }
 };
 
-static shared_ptr<Boolean> _TRUE = std::make_shared<Boolean>(true);
-static shared_ptr<Boolean> _FALSE = std::make_shared<Boolean>(false);
+static const shared_ptr<Boolean> _TRUE = immortal<Boolean>(true);
+static const shared_ptr<Boolean> _FALSE = immortal<Boolean>(false);
 
 class Double : public Object, public Hasher {
     public:
@@ -68,26 +79,127 @@ class Double : public Object, public Hasher {
     string Inspect() {
         return format("{}", Value);
     }
+    void InspectTo(Inspector &out) {
+        out.format("{}", Value);
+    }
     size_t hash() {
         return std::hash<double>{}(Value);
     }
 };
 
-class String : public Object, public Hasher {
+// 当前线程创建字符串时记下的编号, 只有编号相同的缓冲区才能原地追加
+// 并行执行 (eval/pool.cpp) 时换新的编号, 之前的缓冲区可能被别的线程读到
+thread_local uint64_t stringOwner = 0;
+
+class String : public Object, public Hasher, public Iterable {
+    private:
+    // 字符串是共享缓冲区上的一段视图 [offset, offset + size)
+    // writable 非空时缓冲区归字符串所有, 末尾可以原地追加
+    shared_ptr<const string> buffer;
+    string *writable = nullptr;
+    uint64_t owner = 0;
+    size_t offset = 0;
+    size_t size = 0;
+    // 为 0 表示还没有算, 可能有多个线程同时计算, 写入的值相同
+    std::atomic<size_t> hashCache = 0;
+
     public:
-    string Value;
+    // 来自字面量的字符串带有驻留的 Symbol, 直接引用驻留表里的内容
+    symbol::Symbol Sym = nullptr;
 
     public:
-    String(string val) : Value(val) {
+    String(string val) {
+        auto buf = std::make_shared<string>(std::move(val));
+        writable = buf.get();
+        owner = stringOwner;
+        size = buf->size();
+        buffer = std::move(buf);
+    }
+    String(symbol::Symbol sym)
+        : buffer(shared_ptr<const string>(), &sym->str), size(sym->str.size()),
+          Sym(sym) {
+    }
+    // 同一缓冲区上的子串, 不复制内容
+    String(const String &str, size_t pos, size_t len)
+        : buffer(str.buffer), offset(str.offset + pos), size(len) {
     }
     Type ObjectType() {
         return Str_Obj;
     }
+    std::string_view view() const {
+        return std::string_view(*buffer).substr(offset, size);
+    }
+    string str() const {
+        return string(view());
+    }
+    size_t length() const {
+        return size;
+    }
     string Inspect() {
-        return "\"" + Value + "\"";
+        string res;
+        res.reserve(size + 2);
+        res += '"';
+        res += view();
+        res += '"';
+        return res;
+    }
+    void InspectTo(Inspector &out) {
+        out.write('"');
+        out.write(view());
+        out.write('"');
     }
     size_t hash() {
-        return std::hash<string>{}(Value);
+        if (Sym != nullptr) {
+            return Sym->hash;
+        }
+        auto res = hashCache.load(std::memory_order_relaxed);
+        if (res == 0) {
+            res = std::hash<std::string_view>{}(view());
+            hashCache.store(res, std::memory_order_relaxed);
+        }
+        return res;
+    }
+    bool equals(String *other) {
+        if (Sym != nullptr && other->Sym != nullptr) {
+            return Sym == other->Sym;
+        }
+        return view() == other->view();
+    }
+    // 缓冲区和它的容量, 驻留表里的内容不归字符串所有, 容量为 0
+    std::pair<const void *, size_t> storage() const {
+        return {buffer.get(),
+                buffer.use_count() == 0 ? 0 : buffer->capacity()};
+    }
+    // 独占的缓冲区的大小, 与别的字符串共享的不算
+    size_t footprint() const {
+        return writable != nullptr && buffer.use_count() == 1
+                   ? writable->capacity()
+                   : 0;
+    }
+    std::unique_ptr<Iterator> iterate(const obj_ptr &self);
+    // 左侧恰好是缓冲区的末尾时原地追加, 循环里反复 s = s + x 均摊 O(|x|)
+    // 已经有别的字符串接在后面时才复制一份
+    static shared_ptr<String> concat(String *left, String *right) {
+        shared_ptr<String> res;
+        if (left->writable != nullptr && left->owner == stringOwner &&
+            left->offset + left->size == left->writable->size()) {
+            res = make<String>(*left, 0, left->size);
+            res->writable = left->writable;
+            res->owner = left->owner;
+        } else {
+            string buf;
+            buf.reserve(left->size + right->size);
+            buf.append(left->view());
+            res = make<String>(std::move(buf));
+        }
+        if (right->buffer == res->buffer) {
+            // s + s: 追加可能使 right 的视图失效, 先复制出来
+            res->writable->append(right->str());
+        } else {
+            res->writable->append(right->view());
+        }
+        res->size += right->size;
+        return res;
     }
 };
 
@@ -96,9 +208,14 @@ using BuiltinFunction = std::function<obj_ptr(const std::vector<obj_ptr> &)>;
 class BuiltIn : public Object {
     public:
     BuiltinFunction Fn;
+    symbol::Symbol Name = nullptr; // 查找时用的名字
 
     public:
-    BuiltIn(BuiltinFunction fn) : Fn(fn) {
+    BuiltIn(BuiltinFunction fn, symbol::Symbol name = nullptr)
+        : Fn(fn), Name(name) {
+    }
+    const char *name() const {
+        return Name != nullptr ? Name->str.c_str() : "<builtin>";
     }
     Type ObjectType() {
         return Builtin_Obj;
@@ -118,7 +235,7 @@ class Null : public Object {
     }
 };
 
-static shared_ptr<Null> _NULL = std::make_shared<Null>();
+static const shared_ptr<Null> _NULL = immortal<Null>();
 
 class ReturnValue : public Object {
     public:
@@ -129,6 +246,9 @@ class ReturnValue : public Object {
     string Inspect() {
         return Value->Inspect();
     }
+    void InspectTo(Inspector &out) {
+        Value->InspectTo(out);
+    }
     ReturnValue(shared_ptr<Object> val) : Value(val) {
     }
 };
@@ -148,6 +268,7 @@ class ErrorObject : public Object {
 
 template <typename... Args>
 ErrorObject newError(const string &fmt, Args... args) {
+    stats::bump(stats::local().errors);
     return ErrorObject(std::vformat(fmt, std::make_format_args(args...)));
 }
 
@@ -156,31 +277,41 @@ class FunctionObject : public Object {
     std::vector<shared_ptr<ast::Identifier>> Parameters;
     shared_ptr<ast::BlockStatement> Body;
     environment::env_ptr Env;
+    // fn 语句的名字, 或者第一次 let 绑定时的名字, 匿名函数为空
+    string Name;
+    // 类型推断证明单态时的不装箱版本
+    typed::Plan *Plan = nullptr;
 
     Type ObjectType() {
         return Function_Obj;
     }
 
     string shortInspect() {
-        std::string params;
-        for (auto para : Parameters) {
-            params += para->value + ",";
+        Inspector out;
+        writeSignature(out);
+        return out.take();
+    }
+
+    void writeSignature(Inspector &out) {
+        out.write("fn(");
+        for (size_t i = 0; i < Parameters.size(); i++) {
+            if (i != 0) {
+                out.write(',');
+            }
+            out.write(Parameters[i]->value);
         }
-        if (!params.empty()) {
-            params.pop_back();
-        }
-        return format("fn({})", params);
+        out.write(')');
     }
 
     string Inspect() {
-        std::string params;
-        for (auto para : Parameters) {
-            params += para->value + ",";
-        }
-        if (!params.empty()) {
-            params.pop_back();
-        }
-        return format("fn({}) {{{}}}", params, Body->output());
+        Inspector out;
+        InspectTo(out);
+        return out.take();
+    }
+
+    void InspectTo(Inspector &out) {
+        writeSignature(out);
+        out.format(" {{{}}}", Body->output());
     }
 
     FunctionObject(std::vector<shared_ptr<ast::Identifier>> params,
@@ -192,7 +323,26 @@ class FunctionObject : public Object {
     }
 };
 
-class Array : public Object {
+// 释放嵌套很深的数组和 hash 时不递归: 最外层的 teardown 持有一张工作表,
+// 里层容器析构时只把自己的子对象移进表里, 由最外层逐个释放
+void teardown(std::vector<obj_ptr> children) {
+    static thread_local std::vector<obj_ptr> *work = nullptr;
+    if (work != nullptr) {
+        for (auto &child : children) {
+            work->push_back(std::move(child));
+        }
+        return;
+    }
+    work = &children;
+    while (!children.empty()) {
+        auto child = std::move(children.back());
+        children.pop_back();
+        child.reset();
+    }
+    work = nullptr;
+}
+
+class Array : public Object, public Iterable {
     public:
     std::vector<shared_ptr<Object>> Elements;
 
@@ -201,37 +351,100 @@ class Array : public Object {
     }
 
     string Inspect() {
-        std::string res;
-        for (auto &p : Elements) {
-            res += p->Inspect() + ",";
+        Inspector out;
+        InspectTo(out);
+        return out.take();
+    }
+
+    void InspectTo(Inspector &out) {
+        if (!out.enter()) {
+            out.write("[...]");
+            return;
         }
-        if (!res.empty()) {
-            res.pop_back();
+        out.write('[');
+        out.later("]", true);
+        for (size_t i = Elements.size(); i-- > 0;) {
+            out.later(Elements[i].get());
+            if (i != 0) {
+                out.later(",");
+            }
         }
-        return format("[{}]", res);
+        out.drain();
+    }
+
+    ~Array() {
+        teardown(std::move(Elements));
     }
 
     Array(std::vector<shared_ptr<Object>> elements) : Elements(elements) {
     }
+    size_t footprint() const {
+        return Elements.capacity() * sizeof(shared_ptr<Object>);
+    }
+
+    std::unique_ptr<Iterator> iterate(const obj_ptr &self) {
+        class ArrayIterator : public Iterator {
+            obj_ptr owner;
+            Array *arr;
+            size_t pos = 0;
+
+            public:
+            ArrayIterator(obj_ptr owner, Array *arr)
+                : owner(std::move(owner)), arr(arr) {
+            }
+            obj_ptr next() {
+                if (pos >= arr->Elements.size()) {
+                    return nullptr;
+                }
+                return arr->Elements[pos++];
+            }
+        };
+        return std::make_unique<ArrayIterator>(self, this);
+    }
 };
 
-class Hash : public Object {
+class Hash : public Object, public Iterable {
     using Pair = std::pair<std::shared_ptr<Object>, std::shared_ptr<Object>>;
     std::unordered_map<size_t, Pair> pairs;
 
     public:
     Hash() {
     }
+    ~Hash() {
+        std::vector<obj_ptr> children;
+        children.reserve(pairs.size() * 2);
+        for (auto &p : pairs) {
+            children.push_back(std::move(p.second.first));
+            children.push_back(std::move(p.second.second));
+        }
+        teardown(std::move(children));
+    }
     string Inspect() {
-        std::string res;
+        Inspector out;
+        InspectTo(out);
+        return out.take();
+    }
+    void InspectTo(Inspector &out) {
+        if (!out.enter()) {
+            out.write("{...}");
+            return;
+        }
+        out.write('{');
+        out.later("}", true);
+        std::vector<const Pair *> order;
+        order.reserve(pairs.size());
         for (auto &p : pairs) {
-            res += p.second.first->Inspect() + ":" +
-                   p.second.second->Inspect() + ",";
+            order.push_back(&p.second);
         }
-        if (!res.empty()) {
-            res.pop_back();
+        for (size_t i = order.size(); i-- > 0;) {
+            out.later(order[i]->second.get());
+            out.later(":");
+            out.later(order[i]->first.get());
+            if (i != 0) {
+                out.later(",");
+            }
         }
-        return format("{{{}}}", res);
+        out.drain();
     }
     Type ObjectType() {
         return Hash_Obj;
@@ -258,8 +471,100 @@ class Hash : public Object {
         pairs[hasher->hash()] = std::make_pair(key, val);
         return true;
     }
+    const std::unordered_map<size_t, Pair> &entries() const {
+        return pairs;
+    }
+    size_t footprint() const {
+        return pairs.bucket_count() * sizeof(void *) +
+               pairs.size() * (sizeof(std::pair<const size_t, Pair>) +
+                               sizeof(void *));
+    }
+    // 依次产生所有的键
+    std::unique_ptr<Iterator> iterate(const obj_ptr &self) {
+        class HashIterator : public Iterator {
+            obj_ptr owner;
+            std::unordered_map<size_t, Pair>::iterator cur, end;
+
+            public:
+            HashIterator(obj_ptr owner, std::unordered_map<size_t, Pair> &pairs)
+                : owner(std::move(owner)), cur(pairs.begin()),
+                  end(pairs.end()) {
+            }
+            obj_ptr next() {
+                if (cur == end) {
+                    return nullptr;
+                }
+                return (cur++)->second.first;
+            }
+        };
+        return std::make_unique<HashIterator>(self, pairs);
+    }
+};
+
+// 惰性的整数区间 [Start, End), 迭代时只维护一个计数器
+class Range : public Object, public Iterable {
+    public:
+    int Start, End, Step;
+
+    public:
+    Range(int start, int end, int step) : Start(start), End(end), Step(step) {
+    }
+    Type ObjectType() {
+        return Range_Obj;
+    }
+    string Inspect() {
+        return format("range({}, {}, {})", Start, End, Step);
+    }
+    size_t length() const {
+        if (Step > 0 && Start < End) {
+            return (static_cast<long long>(End) - Start + Step - 1) / Step;
+        }
+        if (Step < 0 && Start > End) {
+            return (static_cast<long long>(Start) - End - Step - 1) / -Step;
+        }
+        return 0;
+    }
+    std::unique_ptr<Iterator> iterate(const obj_ptr &) {
+        class RangeIterator : public Iterator {
+            long long cur, end, step;
+
+            public:
+            RangeIterator(Range *range)
+                : cur(range->Start), end(range->End), step(range->Step) {
+            }
+            obj_ptr next() {
+                if (step > 0 ? cur >= end : cur <= end) {
+                    return nullptr;
+                }
+                auto res = make<Integer>(static_cast<int>(cur));
+                cur += step;
+                return res;
+            }
+        };
+        return std::make_unique<RangeIterator>(this);
+    }
 };
 
+std::unique_ptr<Iterator> String::iterate(const obj_ptr &self) {
+    class StringIterator : public Iterator {
+        obj_ptr owner;
+        String *str;
+        size_t pos = 0;
+
+        public:
+        StringIterator(obj_ptr owner, String *str)
+            : owner(std::move(owner)), str(str) {
+        }
+        obj_ptr next() {
+            if (pos >= str->length()) {
+                return nullptr;
+            }
+            return make<String>(*str, pos++, 1);
+        }
+    };
+    return std::make_unique<StringIterator>(self, this);
+}
+
 template <typename T>
 bool _isType(obj_ptr obj) {
     return (typeid(*obj.get()) == typeid(T));
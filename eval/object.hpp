@@ -1,27 +1,22 @@
 #pragma once
 
+#include "../prof/stats.cpp"
+#include "object_type.hpp"
 #include <format>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace object {
 
 using std::format;
 using std::shared_ptr;
 using std::string;
-enum Type {
-    Null_Obj,
-    Int_Obj,
-    Float_Obj,
-    Bool_Obj,
-    Return_Obj,
-    Error_Obj,
-    Function_Obj,
-    Str_Obj,
-    Builtin_Obj,
-    Array_Obj,
-    Hash_Obj
-};
 
 string TypeToString(Type t) {
     switch (t) {
@@ -47,17 +42,181 @@ string TypeToString(Type t) {
         return "array";
     case Hash_Obj:
         return "hash";
+    case Range_Obj:
+        return "range";
     default:
         return "unknown";
     }
 }
 
+class Object;
+
+// 流式序列化: 对象通过 format_to 直接写进缓冲区
+// 缓冲区超过 chunk 时交给 spill 写出, 打印巨大的值也只占用有限内存
+// maxDepth 限制嵌套层数, maxSize 限制输出的总字节数, 超出部分用 ... 代替
+struct InspectLimits {
+    size_t maxDepth = std::numeric_limits<size_t>::max();
+    size_t maxSize = std::numeric_limits<size_t>::max();
+};
+
+class Inspector {
+    public:
+    using Limits = InspectLimits;
+    using Spill = std::function<void(std::string_view)>;
+
+    private:
+    static constexpr size_t chunk = 1 << 14;
+    string buffer;
+    Spill spill;
+    Limits limits;
+    size_t spilled = 0;
+    size_t depth = 0;
+    bool truncated = false;
+
+    // 容器不递归地写子对象, 而是把子对象, 分隔符和右括号倒序压进 tasks,
+    // 由最外层的 drain 依次取出. 嵌套再深也只占用堆上的空间
+    struct Task {
+        Object *obj;      // 不为空时写这个对象
+        const char *text; // 否则写这段文字
+        bool leave;       // 写完之后离开一层嵌套
+    };
+    std::vector<Task> tasks;
+    bool draining = false;
+
+    void commit() {
+        auto total = spilled + buffer.size();
+        if (total > limits.maxSize) {
+            buffer.resize(buffer.size() - (total - limits.maxSize));
+            buffer += "...";
+            truncated = true;
+        }
+        if (spill && buffer.size() >= chunk) {
+            spill(buffer);
+            spilled += buffer.size();
+            buffer.clear();
+        }
+    }
+
+    public:
+    Inspector(Limits limits = {}) : limits(limits) {
+    }
+    Inspector(Spill spill, Limits limits = {})
+        : spill(std::move(spill)), limits(limits) {
+    }
+    Inspector(std::ostream &out, Limits limits = {})
+        : Inspector(
+              [&out](std::string_view str) {
+                  out.write(str.data(), str.size());
+              },
+              limits) {
+    }
+    ~Inspector() {
+        finish();
+    }
+
+    bool full() const {
+        return truncated;
+    }
+    void write(std::string_view str) {
+        if (truncated) {
+            return;
+        }
+        buffer.append(str);
+        commit();
+    }
+    void write(char ch) {
+        if (truncated) {
+            return;
+        }
+        buffer.push_back(ch);
+        commit();
+    }
+    template <typename... Args>
+    void format(std::format_string<Args...> fmt, Args &&...args) {
+        if (truncated) {
+            return;
+        }
+        std::format_to(std::back_inserter(buffer), fmt,
+                       std::forward<Args>(args)...);
+        commit();
+    }
+    // 进入一层嵌套, 超过深度限制时返回 false
+    bool enter() {
+        if (depth >= limits.maxDepth) {
+            return false;
+        }
+        depth++;
+        return true;
+    }
+    void leave() {
+        depth--;
+    }
+    void later(Object *obj) {
+        tasks.push_back({obj, nullptr, false});
+    }
+    void later(const char *text, bool leave = false) {
+        tasks.push_back({nullptr, text, leave});
+    }
+    void drain();
+    void finish() {
+        if (spill && !buffer.empty()) {
+            spill(buffer);
+            spilled += buffer.size();
+            buffer.clear();
+        }
+    }
+    string take() {
+        return std::move(buffer);
+    }
+};
+
+static InspectLimits inspectLimits;
+
+// 分配分析 (prof/alloc.cpp) 的钩子, 没有打开时为空
+// kind 是 Type, 或者表示环境的 Env_Alloc
+
+struct AllocHooks {
+    void (*allocate)(const void *ptr, int kind, size_t bytes) = nullptr;
+    void (*release)(const void *ptr) = nullptr;
+};
+
+static AllocHooks allocHooks;
+
 class Object {
     public:
+    ~Object() {
+        if (allocHooks.release != nullptr) {
+            allocHooks.release(this);
+        }
+    }
     virtual Type ObjectType() = 0;
     virtual string Inspect() = 0;
+    virtual void InspectTo(Inspector &out) {
+        out.write(Inspect());
+    }
 };
 
+void Inspector::drain() {
+    if (draining) {
+        return;
+    }
+    draining = true;
+    while (!tasks.empty() && !truncated) {
+        auto task = tasks.back();
+        tasks.pop_back();
+        if (task.obj != nullptr) {
+            task.obj->InspectTo(*this);
+        } else {
+            write(task.text);
+            if (task.leave) {
+                leave();
+            }
+        }
+    }
+    tasks.clear();
+    draining = false;
+}
+
 class Hasher {
     public:
     virtual size_t hash() = 0;
@@ -65,4 +224,41 @@ class Hasher {
 
 typedef shared_ptr<Object> obj_ptr;
 
+// 求值过程中创建对象都经过这里, 以便计数和分配分析记录
+// 大小是 make_shared 的一整块 (对象加控制块) 再加上对象自己持有的缓冲区
+template <typename T, typename... Args>
+shared_ptr<T> make(Args &&...args) {
+    auto res = std::make_shared<T>(std::forward<Args>(args)...);
+    stats::bump(stats::local().objects[res->ObjectType()]);
+    if (allocHooks.allocate != nullptr) {
+        size_t bytes = sizeof(T) + 2 * sizeof(void *);
+        if constexpr (requires { res->footprint(); }) {
+            bytes += res->footprint();
+        }
+        allocHooks.allocate(static_cast<Object *>(res.get()),
+                            res->ObjectType(), bytes);
+    }
+    return res;
+}
+
+// 永生对象: 从不释放, 返回的 shared_ptr 没有控制块,
+// 复制和销毁都不碰引用计数, 多个线程同时使用也不会争抢同一个计数
+template <typename T, typename... Args>
+shared_ptr<T> immortal(Args &&...args) {
+    return shared_ptr<T>(shared_ptr<T>(), new T(std::forward<Args>(args)...));
+}
+
+// for-in 使用的迭代协议, next 在结束时返回 nullptr
+class Iterator {
+    public:
+    virtual ~Iterator() = default;
+    virtual obj_ptr next() = 0;
+};
+
+// self 是对象自己, 迭代器持有它, 迭代期间对象不会被释放
+class Iterable {
+    public:
+    virtual std::unique_ptr<Iterator> iterate(const obj_ptr &self) = 0;
+};
+
 } // namespace object
\ No newline at end of file
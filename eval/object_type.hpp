@@ -0,0 +1,25 @@
+#pragma once
+
+// 对象的类型, 单独成一个文件: prof/stats.cpp 要按类型计数, 而
+// object.hpp 包含了 stats.cpp
+namespace object {
+
+enum Type {
+    Null_Obj,
+    Int_Obj,
+    Float_Obj,
+    Bool_Obj,
+    Return_Obj,
+    Error_Obj,
+    Function_Obj,
+    Str_Obj,
+    Builtin_Obj,
+    Array_Obj,
+    Hash_Obj,
+    Range_Obj
+};
+
+// 分配分析和运行时计数里的 kind 是 Type, 或者表示环境的 Env_Alloc
+constexpr int Env_Alloc = Range_Obj + 1;
+
+} // namespace object
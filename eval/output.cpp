@@ -0,0 +1,240 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+
+namespace output {
+
+using std::string;
+
+// 解释器统一的输出通道, print 和 REPL 的结果都写到这里
+// 缓冲区写满或者显式 flush 时才真正写出, 放不下的写入 (容量为 0 时是所有写入)
+// 直接写出. 写出后立即 flush 底层的流, 缓冲的内容只会留在 front 和 back 里
+// 进程因致命信号结束前, flushOnCrash 装上的处理函数把 front 直接写到 fd
+// 开启 async 后由后台线程写出, front 接收新输出, back 交给后台线程
+// 多个线程可以同时 write 和 flush, 一次 writeLine 的内容不会被别的线程打断
+class Sink {
+    private:
+    std::ostream *out;
+    size_t capacity;
+    int fd;
+    string front, back;
+
+    // 信号处理函数只能读这两个原子变量, 看到的是最近一次改动后的 front
+    // front 预留了 capacity 的空间, 追加时不会搬家
+    std::atomic<const char *> shownData{nullptr};
+    std::atomic<size_t> shownSize{0};
+
+    bool async = false;
+    std::atomic<bool> pending = false; // back 还没写完, 信号处理函数也会读
+    bool stopping = false;
+    std::thread writer;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::mutex writing; // 保护 front, 写出时一直持有, 保持输出的顺序
+
+    void writeOut(string &buf) {
+        out->write(buf.data(), buf.size());
+        out->flush();
+        buf.clear();
+    }
+    void publish() {
+        shownData.store(front.data(), std::memory_order_relaxed);
+        shownSize.store(front.size(), std::memory_order_release);
+    }
+    void waitWriter(std::unique_lock<std::mutex> &lock) {
+        cv.wait(lock, [this] {
+            return !pending;
+        });
+    }
+    void submit() {
+        if (front.empty()) {
+            return;
+        }
+        if (!async) {
+            writeOut(front);
+            publish();
+            return;
+        }
+        std::unique_lock lock(mtx);
+        waitWriter(lock);
+        std::swap(front, back);
+        publish();
+        pending = true;
+        cv.notify_all();
+    }
+    void run() {
+        std::unique_lock lock(mtx);
+        while (true) {
+            cv.wait(lock, [this] {
+                return pending || stopping;
+            });
+            if (pending) {
+                lock.unlock();
+                writeOut(back);
+                lock.lock();
+                pending = false;
+                cv.notify_all();
+            } else {
+                return;
+            }
+        }
+    }
+    void stopWriter() {
+        if (!writer.joinable()) {
+            return;
+        }
+        {
+            std::unique_lock lock(mtx);
+            waitWriter(lock);
+            stopping = true;
+            cv.notify_all();
+        }
+        writer.join();
+        stopping = false;
+    }
+    void append(std::string_view str) {
+        if (front.size() + str.size() > capacity) {
+            submit();
+        }
+        // 放不下的直接写出. async 时先等后台线程写完 back, 保持顺序
+        if (str.size() > capacity) {
+            if (async) {
+                std::unique_lock lock(mtx);
+                waitWriter(lock);
+            }
+            out->write(str.data(), str.size());
+            out->flush();
+            return;
+        }
+        front.append(str);
+        publish();
+    }
+
+    public:
+    // fd 是 out 底下的文件描述符, 崩溃时直接写它; -1 表示崩溃时不写出
+    Sink(std::ostream &out, size_t capacity = 1 << 16, int fd = -1)
+        : out(&out), capacity(capacity), fd(fd) {
+        front.reserve(capacity);
+        back.reserve(capacity);
+        publish();
+    }
+    Sink(const Sink &) = delete;
+    Sink &operator=(const Sink &) = delete;
+    ~Sink() {
+        flush();
+        stopWriter();
+    }
+
+    void write(std::string_view str) {
+        std::lock_guard guard(writing);
+        append(str);
+    }
+    void writeLine(std::string_view str) {
+        std::lock_guard guard(writing);
+        append(str);
+        append("\n");
+    }
+    void flush() {
+        std::lock_guard guard(writing);
+        submit();
+        if (async) {
+            std::unique_lock lock(mtx);
+            waitWriter(lock);
+        }
+        out->flush();
+    }
+
+    // 设置缓冲区大小, 0 表示每次写入后立即写出
+    void setCapacity(size_t size) {
+        flush();
+        capacity = size;
+        front.reserve(capacity);
+        back.reserve(capacity);
+        publish();
+    }
+    size_t getCapacity() const {
+        return capacity;
+    }
+    void setAsync(bool enable) {
+        if (enable == async) {
+            return;
+        }
+        flush();
+        if (enable) {
+            writer = std::thread(&Sink::run, this);
+        } else {
+            stopWriter();
+        }
+        async = enable;
+    }
+    bool isAsync() const {
+        return async;
+    }
+
+    // 只在信号处理函数里调用, 所以只读原子变量, 只用 nanosleep 和 ::write
+    // back 交给后台线程后最多等一秒让它写完, 等不到就放弃, 免得输出乱序
+    void emergencyFlush() {
+        if (fd < 0) {
+            return;
+        }
+        for (int i = 0; pending.load() && i < 1000; i++) {
+            timespec wait = {0, 1000000};
+            nanosleep(&wait, nullptr);
+        }
+        if (pending.load()) {
+            return;
+        }
+        auto size = shownSize.load(std::memory_order_acquire);
+        auto data = shownData.load(std::memory_order_relaxed);
+        while (size > 0) {
+            auto n = ::write(fd, data, size);
+            if (n <= 0) {
+                return;
+            }
+            data += n;
+            size -= n;
+        }
+    }
+};
+
+Sink &out() {
+    static Sink sink(std::cout, 1 << 16, STDOUT_FILENO);
+    return sink;
+}
+
+namespace {
+
+void crashed(int sig) {
+    out().emergencyFlush();
+    std::signal(sig, SIG_DFL);
+    std::raise(sig);
+}
+
+} // namespace
+
+// 除零, 栈溢出, abort (包括未捕获的异常) 时先写出缓冲的输出,
+// 再按原来的信号结束. 处理函数在备用栈上运行, C++ 栈溢出时也能执行
+void flushOnCrash() {
+    static char altStack[1 << 16];
+    stack_t stack = {};
+    stack.ss_sp = altStack;
+    stack.ss_size = sizeof(altStack);
+    sigaltstack(&stack, nullptr);
+    struct sigaction action = {};
+    action.sa_handler = crashed;
+    action.sa_flags = SA_ONSTACK;
+    for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) {
+        sigaction(sig, &action, nullptr);
+    }
+}
+
+} // namespace output
@@ -0,0 +1,231 @@
+#pragma once
+
+#include "object.cpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// pmap, pfilter, preduce 用的线程池
+// [0, n) 切成固定大小的块, 块的大小只取决于 n, 与线程数无关, 所以每块的
+// 结果和合并的顺序都是确定的. 块轮流分到各个线程的队列里, 线程从自己
+// 队列的尾部取, 空了就从别的队列的头部偷. 调用的线程也参与执行,
+// 所有块完成后才返回.
+// 执行期间 active 为真: 求值器不写语法树上的缓存, 字符串也不在别的线程
+// 创建的缓冲区上原地追加 (见 object::stringOwner)
+namespace pool {
+
+struct Options {
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+};
+
+static Options options;
+
+// 只在没有工作线程运行时由调用的线程修改
+static bool active = false;
+
+// 块的个数上限, 块再小调度的开销就比执行还多
+constexpr size_t maxChunks = 256;
+
+namespace {
+
+// 每次分配一个新的编号, 0 留给从未参与并行的线程
+std::atomic<uint64_t> stamps{0};
+
+uint64_t nextStamp() {
+    return stamps.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+} // namespace
+
+// Pool 的成员用到这两个类型, 不能放进匿名命名空间
+struct Chunk {
+    size_t index, begin, end;
+};
+
+struct Queue {
+    std::mutex lock;
+    std::deque<Chunk> chunks;
+};
+
+// 块的下标和范围 [begin, end)
+typedef std::function<void(size_t, size_t, size_t)> Job;
+
+class Pool {
+    private:
+    std::vector<std::thread> workers;
+    // 每个工作线程一个队列, 最后一个给调用的线程
+    std::vector<std::unique_ptr<Queue>> queues;
+    const Job *job = nullptr;
+
+    std::mutex lock;
+    std::condition_variable wake, finished;
+    uint64_t generation = 0;
+    bool stopping = false;
+    std::atomic<size_t> remaining{0};
+
+    // 出错时只保留下标最小的块的异常, 排在它后面的块不再执行
+    std::atomic<size_t> failedAt{std::numeric_limits<size_t>::max()};
+    std::exception_ptr error;
+
+    bool take(size_t self, Chunk &chunk) {
+        {
+            auto &mine = *queues[self];
+            std::lock_guard guard(mine.lock);
+            if (!mine.chunks.empty()) {
+                chunk = mine.chunks.back();
+                mine.chunks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            auto &other = *queues[(self + i) % queues.size()];
+            std::lock_guard guard(other.lock);
+            if (!other.chunks.empty()) {
+                chunk = other.chunks.front();
+                other.chunks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void drain(size_t self) {
+        Chunk chunk;
+        while (take(self, chunk)) {
+            if (chunk.index < failedAt.load(std::memory_order_relaxed)) {
+                // 上一块留下的字符串可能已经交给了别的线程
+                object::stringOwner = nextStamp();
+                try {
+                    (*job)(chunk.index, chunk.begin, chunk.end);
+                } catch (...) {
+                    std::lock_guard guard(lock);
+                    if (chunk.index < failedAt.load()) {
+                        failedAt.store(chunk.index);
+                        error = std::current_exception();
+                    }
+                }
+            }
+            if (remaining.fetch_sub(1) == 1) {
+                std::lock_guard guard(lock);
+                finished.notify_all();
+            }
+        }
+    }
+
+    void work(size_t self) {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock guard(lock);
+                wake.wait(guard, [&] {
+                    return stopping || generation != seen;
+                });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+            drain(self);
+        }
+    }
+
+    public:
+    explicit Pool(size_t threads) {
+        for (size_t i = 0; i < threads; i++) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (size_t i = 0; i + 1 < threads; i++) {
+            workers.emplace_back(&Pool::work, this, i);
+        }
+    }
+    Pool(const Pool &) = delete;
+    ~Pool() {
+        {
+            std::lock_guard guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    void run(size_t n, size_t size, const Job &func) {
+        size_t chunks = (n + size - 1) / size;
+        job = &func;
+        failedAt = std::numeric_limits<size_t>::max();
+        error = nullptr;
+        remaining = chunks;
+        for (size_t i = 0; i < chunks; i++) {
+            auto &queue = *queues[i % queues.size()];
+            std::lock_guard guard(queue.lock);
+            queue.chunks.push_back(
+                {i, i * size, std::min(n, (i + 1) * size)});
+        }
+        {
+            std::lock_guard guard(lock);
+            generation++;
+        }
+        wake.notify_all();
+        drain(queues.size() - 1);
+        {
+            std::unique_lock guard(lock);
+            finished.wait(guard, [&] {
+                return remaining.load() == 0;
+            });
+        }
+        job = nullptr;
+        if (error != nullptr) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+// 每块的元素个数, 只取决于 n
+size_t chunkSize(size_t n) {
+    return std::max<size_t>(1, (n + maxChunks - 1) / maxChunks);
+}
+
+size_t chunkCount(size_t n) {
+    return (n + chunkSize(n) - 1) / chunkSize(n);
+}
+
+// 对 [0, n) 的每一块调用 func(块下标, begin, end)
+// 只有一个线程, 或者已经在并行执行中 (脚本函数里又调用了 pmap) 时
+// 在当前线程上依次执行
+void parallelFor(size_t n, const Job &func) {
+    size_t size = chunkSize(n), chunks = chunkCount(n);
+    if (chunks == 0) {
+        return;
+    }
+    if (options.threads <= 1 || active || chunks == 1) {
+        for (size_t i = 0; i < chunks; i++) {
+            func(i, i * size, std::min(n, (i + 1) * size));
+        }
+        return;
+    }
+    static Pool pool(options.threads);
+    // 之前创建的字符串在这一段里可能被别的线程读到, 不能再原地追加
+    object::stringOwner = nextStamp();
+    active = true;
+    try {
+        pool.run(n, size, func);
+    } catch (...) {
+        active = false;
+        object::stringOwner = nextStamp();
+        throw;
+    }
+    active = false;
+    object::stringOwner = nextStamp();
+}
+
+} // namespace pool
@@ -0,0 +1,416 @@
+#pragma once
+
+#include "../ast/ast.cpp"
+#include "./builtin.cpp"
+#include <map>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+// 静态作用域分析, 供 --emit-cpp 和类型推断使用
+// 块不产生新的作用域, 所以每个函数 (以及顶层程序) 就是一个作用域
+namespace scope {
+
+using std::vector;
+using symbol::Symbol;
+typedef vector<std::unique_ptr<ast::Statement>> Statements;
+
+template <typename T>
+T *nodeAs(ast::Node *node) {
+    if (node != nullptr && typeid(*node) == typeid(T)) {
+        return static_cast<T *>(node);
+    }
+    return nullptr;
+}
+
+// else 分支在语法树里是条件为 true 的 IfExpression
+bool isTrueLiteral(ast::Expression *expr) {
+    auto lit = nodeAs<ast::BooleanLiteral>(expr);
+    return lit != nullptr && lit->value;
+}
+
+// 语句块是否一定以 return 结束
+bool endsWithReturn(Statements &stmts) {
+    if (stmts.empty()) {
+        return false;
+    }
+    auto last = stmts.back().get();
+    if (nodeAs<ast::ReturnStatement>(last)) {
+        return true;
+    }
+    auto exprStmt = nodeAs<ast::ExpressionStatement>(last);
+    if (exprStmt == nullptr) {
+        return false;
+    }
+    auto ifexpr = nodeAs<ast::IfExpression>(exprStmt->expression());
+    while (ifexpr != nullptr) {
+        if (!endsWithReturn(ifexpr->consequence()->statements())) {
+            return false;
+        }
+        if (ifexpr->alternative() == nullptr) {
+            return false;
+        }
+        if (isTrueLiteral(ifexpr->alternative()->condition())) {
+            return endsWithReturn(
+                ifexpr->alternative()->consequence()->statements());
+        }
+        ifexpr = ifexpr->alternative();
+    }
+    return false;
+}
+
+bool containsReturn(Statements &stmts);
+
+bool containsReturn(ast::Statement *stmt) {
+    if (nodeAs<ast::ReturnStatement>(stmt)) {
+        return true;
+    }
+    if (auto block = nodeAs<ast::BlockStatement>(stmt)) {
+        return containsReturn(block->statements());
+    }
+    if (auto whilestmt = nodeAs<ast::WhileStatement>(stmt)) {
+        return containsReturn(whilestmt->body()->statements());
+    }
+    if (auto forstmt = nodeAs<ast::ForStatement>(stmt)) {
+        return containsReturn(forstmt->body()->statements());
+    }
+    if (auto exprStmt = nodeAs<ast::ExpressionStatement>(stmt)) {
+        for (auto ifexpr = nodeAs<ast::IfExpression>(exprStmt->expression());
+             ifexpr != nullptr; ifexpr = ifexpr->alternative()) {
+            if (containsReturn(ifexpr->consequence()->statements())) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool containsReturn(Statements &stmts) {
+    for (auto &stmt : stmts) {
+        if (containsReturn(stmt.get())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 按驻留编号排序, 保证遍历顺序每次都一样
+struct SymbolLess {
+    bool operator()(Symbol a, Symbol b) const {
+        return a->id < b->id;
+    }
+};
+typedef std::set<Symbol, SymbolLess> SymbolSet;
+
+// 一个函数 (或顶层程序) 的作用域信息
+struct Function {
+    int id = -1; // -1 表示顶层程序
+    Function *parent = nullptr;
+    const vector<std::shared_ptr<ast::Identifier>> *params = nullptr;
+    ast::BlockStatement *block = nullptr;
+    Statements *body = nullptr;
+    Symbol name = nullptr; // 第一次绑定到的名字, 匿名函数为空
+
+    SymbolSet declared; // 参数以及 let / fn / for 定义的名字
+    SymbolSet reads;    // 本函数中直接读取的名字
+    vector<ast::Identifier *> idents; // 这些读取对应的结点
+    SymbolSet free;     // 需要到外层查找的名字, 包括内层函数的
+    SymbolSet captured; // 被内层函数引用, 必须放进环境的局部变量
+    SymbolSet unsafe;   // 可能在赋值前被读取的局部变量
+    std::map<Symbol, int, SymbolLess> declCount;
+    std::map<Symbol, Function *, SymbolLess> letFns; // let f = fn ... / fn f
+    vector<Function *> children;
+
+    bool isProgram() const {
+        return id < 0;
+    }
+    bool isParam(Symbol sym) const {
+        if (params != nullptr) {
+            for (auto &param : *params) {
+                if (param->sym == sym) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    // 没有被内层函数捕获的局部变量, 不需要放进环境
+    bool isLocal(Symbol sym) const {
+        return declared.count(sym) && !captured.count(sym);
+    }
+};
+
+class Analysis {
+    private:
+    vector<std::unique_ptr<Function>> functions;
+    std::unordered_map<ast::BlockStatement *, Function *> byBlock;
+
+    Function *newFunction(Function *parent,
+                          const vector<std::shared_ptr<ast::Identifier>> &params,
+                          ast::BlockStatement *block) {
+        auto fn = functions.emplace_back(std::make_unique<Function>()).get();
+        fn->id = static_cast<int>(functions.size()) - 1;
+        fn->parent = parent;
+        fn->params = &params;
+        fn->block = block;
+        fn->body = &block->statements();
+        byBlock[block] = fn;
+        parent->children.push_back(fn);
+        for (auto &param : params) {
+            declare(fn, param->sym);
+        }
+        collect(fn, *fn->body);
+        return fn;
+    }
+    void declare(Function *fn, Symbol sym) {
+        fn->declared.insert(sym);
+        fn->declCount[sym]++;
+        everywhere.insert(sym);
+    }
+    void bindName(Function *fn, Symbol sym, Function *target) {
+        fn->letFns[sym] = target;
+        if (target->name == nullptr) {
+            target->name = sym;
+        }
+    }
+
+    // 第一遍: 收集每个函数定义和读取的名字
+    void collect(Function *fn, Statements &stmts) {
+        for (auto &stmt : stmts) {
+            collect(fn, stmt.get());
+        }
+    }
+    void collect(Function *fn, ast::Statement *stmt) {
+        if (auto let = nodeAs<ast::LetStatement>(stmt)) {
+            collect(fn, let->value());
+            declare(fn, let->name()->sym);
+            if (auto lit = nodeAs<ast::FunctionLiteral>(let->value())) {
+                bindName(fn, let->name()->sym, byBlock[lit->body().get()]);
+            }
+        } else if (auto fnstmt = nodeAs<ast::FunctionStatement>(stmt)) {
+            declare(fn, fnstmt->name()->sym);
+            bindName(fn, fnstmt->name()->sym,
+                     newFunction(fn, fnstmt->parameters(),
+                                 fnstmt->body().get()));
+        } else if (auto ret = nodeAs<ast::ReturnStatement>(stmt)) {
+            collect(fn, ret->returnValue());
+        } else if (auto exprStmt = nodeAs<ast::ExpressionStatement>(stmt)) {
+            collect(fn, exprStmt->expression());
+        } else if (auto block = nodeAs<ast::BlockStatement>(stmt)) {
+            collect(fn, block->statements());
+        } else if (auto whilestmt = nodeAs<ast::WhileStatement>(stmt)) {
+            collect(fn, whilestmt->condition());
+            collect(fn, whilestmt->body()->statements());
+        } else if (auto forstmt = nodeAs<ast::ForStatement>(stmt)) {
+            collect(fn, forstmt->range());
+            declare(fn, forstmt->name()->sym);
+            collect(fn, forstmt->body()->statements());
+        }
+    }
+    void collect(Function *fn, ast::Expression *expr) {
+        if (expr == nullptr) {
+            return;
+        }
+        if (auto ident = nodeAs<ast::Identifier>(expr)) {
+            fn->reads.insert(ident->sym);
+            fn->idents.push_back(ident);
+        } else if (auto prefix = nodeAs<ast::PrefixExpression>(expr)) {
+            collect(fn, prefix->right());
+        } else if (auto infix = nodeAs<ast::InfixExpression>(expr)) {
+            collect(fn, infix->left());
+            collect(fn, infix->right());
+        } else if (auto ifexpr = nodeAs<ast::IfExpression>(expr)) {
+            for (; ifexpr != nullptr; ifexpr = ifexpr->alternative()) {
+                collect(fn, ifexpr->condition());
+                collect(fn, ifexpr->consequence()->statements());
+            }
+        } else if (auto lit = nodeAs<ast::FunctionLiteral>(expr)) {
+            newFunction(fn, lit->parameters(), lit->body().get());
+        } else if (auto arr = nodeAs<ast::ArrayLiteral>(expr)) {
+            for (auto &elem : arr->elements()) {
+                collect(fn, elem.get());
+            }
+        } else if (auto idx = nodeAs<ast::IndexExpression>(expr)) {
+            collect(fn, idx->left());
+            collect(fn, idx->index());
+        } else if (auto call = nodeAs<ast::CallExpression>(expr)) {
+            collect(fn, call->function());
+            for (auto &arg : call->arguments()) {
+                collect(fn, arg.get());
+            }
+        } else if (auto hash = nodeAs<ast::HashLiteral>(expr)) {
+            for (auto &pair : hash->pairs) {
+                collect(fn, pair.first.get());
+                collect(fn, pair.second.get());
+            }
+        }
+    }
+
+    // 被内层函数引用的名字要放进环境, 赋值前的读取会落到外层
+    void resolve(Function *fn) {
+        SymbolSet assigned;
+        if (fn->params != nullptr) {
+            for (auto &param : *fn->params) {
+                assigned.insert(param->sym);
+            }
+        }
+        checkAssigned(fn, *fn->body, assigned);
+        SymbolSet inner;
+        for (auto child : fn->children) {
+            resolve(child);
+            inner.insert(child->free.begin(), child->free.end());
+        }
+        for (auto sym : inner) {
+            if (fn->declared.count(sym)) {
+                fn->captured.insert(sym);
+            }
+        }
+        inner.insert(fn->reads.begin(), fn->reads.end());
+        for (auto sym : inner) {
+            if (!fn->declared.count(sym)) {
+                fn->free.insert(sym);
+            }
+        }
+        fn->free.insert(fn->unsafe.begin(), fn->unsafe.end());
+    }
+
+    // 找出赋值之前就可能被读取的局部变量, 分支和循环里的赋值不计入之后的代码
+    void checkAssigned(Function *fn, Statements &stmts, SymbolSet &assigned) {
+        for (auto &stmt : stmts) {
+            checkAssigned(fn, stmt.get(), assigned);
+        }
+    }
+    void checkAssigned(Function *fn, ast::Statement *stmt,
+                       SymbolSet &assigned) {
+        if (auto let = nodeAs<ast::LetStatement>(stmt)) {
+            checkAssigned(fn, let->value(), assigned);
+            assigned.insert(let->name()->sym);
+        } else if (auto fnstmt = nodeAs<ast::FunctionStatement>(stmt)) {
+            assigned.insert(fnstmt->name()->sym);
+        } else if (auto ret = nodeAs<ast::ReturnStatement>(stmt)) {
+            checkAssigned(fn, ret->returnValue(), assigned);
+        } else if (auto exprStmt = nodeAs<ast::ExpressionStatement>(stmt)) {
+            checkAssigned(fn, exprStmt->expression(), assigned);
+        } else if (auto block = nodeAs<ast::BlockStatement>(stmt)) {
+            checkAssigned(fn, block->statements(), assigned);
+        } else if (auto whilestmt = nodeAs<ast::WhileStatement>(stmt)) {
+            checkAssigned(fn, whilestmt->condition(), assigned);
+            auto inner = assigned;
+            checkAssigned(fn, whilestmt->body()->statements(), inner);
+        } else if (auto forstmt = nodeAs<ast::ForStatement>(stmt)) {
+            checkAssigned(fn, forstmt->range(), assigned);
+            auto inner = assigned;
+            inner.insert(forstmt->name()->sym);
+            checkAssigned(fn, forstmt->body()->statements(), inner);
+        }
+    }
+    void checkAssigned(Function *fn, ast::Expression *expr,
+                       SymbolSet &assigned) {
+        if (expr == nullptr) {
+            return;
+        }
+        if (auto ident = nodeAs<ast::Identifier>(expr)) {
+            if (fn->declared.count(ident->sym) &&
+                !assigned.count(ident->sym)) {
+                fn->unsafe.insert(ident->sym);
+            }
+        } else if (auto prefix = nodeAs<ast::PrefixExpression>(expr)) {
+            checkAssigned(fn, prefix->right(), assigned);
+        } else if (auto infix = nodeAs<ast::InfixExpression>(expr)) {
+            checkAssigned(fn, infix->left(), assigned);
+            checkAssigned(fn, infix->right(), assigned);
+        } else if (auto ifexpr = nodeAs<ast::IfExpression>(expr)) {
+            for (; ifexpr != nullptr; ifexpr = ifexpr->alternative()) {
+                auto inner = assigned;
+                checkAssigned(fn, ifexpr->condition(), inner);
+                checkAssigned(fn, ifexpr->consequence()->statements(), inner);
+            }
+        } else if (auto arr = nodeAs<ast::ArrayLiteral>(expr)) {
+            for (auto &elem : arr->elements()) {
+                checkAssigned(fn, elem.get(), assigned);
+            }
+        } else if (auto idx = nodeAs<ast::IndexExpression>(expr)) {
+            checkAssigned(fn, idx->left(), assigned);
+            checkAssigned(fn, idx->index(), assigned);
+        } else if (auto call = nodeAs<ast::CallExpression>(expr)) {
+            checkAssigned(fn, call->function(), assigned);
+            for (auto &arg : call->arguments()) {
+                checkAssigned(fn, arg.get(), assigned);
+            }
+        } else if (auto hash = nodeAs<ast::HashLiteral>(expr)) {
+            for (auto &pair : hash->pairs) {
+                checkAssigned(fn, pair.first.get(), assigned);
+                checkAssigned(fn, pair.second.get(), assigned);
+            }
+        }
+    }
+
+    public:
+    Function program;
+    SymbolSet everywhere; // 在程序任意位置定义过的名字
+    // 顶层只绑定过一次的函数, 这个名字一旦赋值就一直指向同一个函数体
+    std::map<Symbol, Function *, SymbolLess> known;
+
+    Analysis(ast::Program *prog) {
+        program.body = &prog->Statements;
+        collect(&program, *program.body);
+        resolve(&program);
+        for (auto [sym, fn] : program.letFns) {
+            if (program.declCount[sym] == 1 && fn != nullptr &&
+                !object::BUILTINS.count(sym->str)) {
+                known[sym] = fn;
+            }
+        }
+    }
+    Analysis(const Analysis &) = delete;
+    Analysis &operator=(const Analysis &) = delete;
+
+    const vector<std::unique_ptr<Function>> &all() const {
+        return functions;
+    }
+    Function *functionOf(ast::BlockStatement *block) const {
+        return byBlock.at(block);
+    }
+
+    // 从未被定义过的名字一定指向内置函数
+    bool isBuiltin(Symbol sym) const {
+        return !everywhere.count(sym) && object::BUILTINS.count(sym->str);
+    }
+
+    // 在 from 中调用名字 sym 时, 如果一定指向某个顶层函数就返回它
+    Function *knownCallee(Function *from, Symbol sym) const {
+        auto fn = from;
+        while (fn != nullptr && !fn->declared.count(sym)) {
+            fn = fn->parent;
+        }
+        if (fn == nullptr || !fn->isProgram()) {
+            return nullptr;
+        }
+        auto iter = known.find(sym);
+        return iter == known.end() ? nullptr : iter->second;
+    }
+};
+
+// 标出只可能在全局环境里找到的标识符: 所在函数和外层函数都没有定义这个名字
+// 非全局环境只由函数调用创建, 所以这在解析后就能确定, 求值时不用再记录
+// 返回程序从全局环境或内置函数读取的名字
+SymbolSet markGlobals(ast::Program *prog) {
+    Analysis scopes(prog);
+    auto mark = [](Function *fn) {
+        for (auto ident : fn->idents) {
+            auto outer = fn;
+            while (!outer->isProgram() && !outer->declared.count(ident->sym)) {
+                outer = outer->parent;
+            }
+            ident->global = outer->isProgram();
+        }
+    };
+    mark(&scopes.program);
+    for (auto &fn : scopes.all()) {
+        mark(fn.get());
+    }
+    return scopes.program.free;
+}
+
+} // namespace scope
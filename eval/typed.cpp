@@ -0,0 +1,643 @@
+#pragma once
+
+#include "../ast/ast.cpp"
+#include "./env.cpp"
+#include "./object.cpp"
+#include <climits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// 不装箱的执行路径
+// 类型推断证明参数, 局部变量和返回值都只会是 int / float / bool 的函数,
+// 函数体会被翻译成这里的节点树, 所有值都以原生类型保存在一块连续的栈上
+// 这样的函数只会调用同样不装箱的函数, 没有副作用, 遇到参数类型不符,
+// 除零或者栈用完时放弃 (Bail), 由解释器从头重新执行这次调用即可
+// 节点树也可以再编译成字节码 (vm/), 各节点的 emit 在 vm/vm.cpp 中实现
+namespace vm {
+class Assembler;
+}
+
+namespace typed {
+
+using object::obj_ptr;
+using std::string;
+using std::vector;
+
+// 推断用的类型格, Unknown 表示还没有见到值, Any 表示不能确定
+enum class Type { Unknown, Int, Float, Bool, Any };
+
+string TypeName(Type typ) {
+    switch (typ) {
+    case Type::Int:
+        return "int";
+    case Type::Float:
+        return "float";
+    case Type::Bool:
+        return "bool";
+    case Type::Unknown:
+        return "unknown";
+    default:
+        return "any";
+    }
+}
+
+bool isNative(Type typ) {
+    return typ == Type::Int || typ == Type::Float || typ == Type::Bool;
+}
+
+Type join(Type a, Type b) {
+    if (a == Type::Unknown) {
+        return b;
+    }
+    if (b == Type::Unknown || a == b) {
+        return a;
+    }
+    return Type::Any;
+}
+
+union Slot {
+    int i;
+    double f;
+    bool b;
+    long long l; // 字节码中 for 循环的计数器
+};
+
+inline Slot slot(int val) {
+    Slot res;
+    res.i = val;
+    return res;
+}
+inline Slot slot(double val) {
+    Slot res;
+    res.f = val;
+    return res;
+}
+inline Slot slot(bool val) {
+    Slot res;
+    res.b = val;
+    return res;
+}
+
+template <typename T>
+inline T get(Slot val);
+template <>
+inline int get<int>(Slot val) {
+    return val.i;
+}
+template <>
+inline double get<double>(Slot val) {
+    return val.f;
+}
+template <>
+inline bool get<bool>(Slot val) {
+    return val.b;
+}
+
+template <typename T>
+constexpr Type typeOf() {
+    if constexpr (std::is_same_v<T, int>) {
+        return Type::Int;
+    } else if constexpr (std::is_same_v<T, double>) {
+        return Type::Float;
+    } else {
+        return Type::Bool;
+    }
+}
+
+struct Bail {};
+
+struct Frame {
+    Slot *slots;
+    // 函数定义时的环境, 只用来确认被调用的名字仍然指向预期的函数
+    environment::Enviroment *env;
+    Slot result;
+};
+
+class Expr {
+    public:
+    Type type;
+
+    explicit Expr(Type type) : type(type) {
+    }
+    virtual ~Expr() = default;
+    virtual Slot eval(Frame &frame) = 0;
+    virtual void emit(vm::Assembler &as) = 0;
+};
+typedef std::unique_ptr<Expr> expr_ptr;
+
+class Stmt {
+    public:
+    virtual ~Stmt() = default;
+    // 执行了 return 时返回 true
+    virtual bool exec(Frame &frame) = 0;
+    virtual void emit(vm::Assembler &as) = 0;
+};
+typedef std::unique_ptr<Stmt> stmt_ptr;
+
+// 不装箱调用共用的值栈, 每个线程一个, 用完时放弃而不是让 C++ 栈溢出
+class Stack {
+    private:
+    static constexpr size_t capacity = 1 << 20;
+    static constexpr int maxDepth = 20000;
+    vector<Slot> slots;
+
+    public:
+    size_t top = 0;
+    int depth = 0;
+    bool overflowed = false; // 放弃是因为栈用完了, 由调用方清除
+
+    Slot *push(size_t count) {
+        if (slots.empty()) {
+            slots.resize(capacity);
+        }
+        if (top + count > capacity || depth >= maxDepth) {
+            overflowed = true;
+            throw Bail{};
+        }
+        auto res = slots.data() + top;
+        top += count;
+        depth++;
+        return res;
+    }
+    void pop(size_t count) {
+        top -= count;
+        depth--;
+    }
+};
+
+thread_local Stack stack;
+
+// 函数体编译后的另一种执行方式, 设置之后代替节点树执行
+class Code {
+    public:
+    virtual ~Code() = default;
+    virtual Slot run(Slot *slots, environment::Enviroment *env) = 0;
+};
+
+class Plan {
+    public:
+    string name;
+    ast::BlockStatement *block = nullptr;
+    vector<Type> params; // 参数占用前几个槽位
+    vector<Type> slotTypes;
+    Type ret = Type::Unknown;
+    vector<stmt_ptr> body;
+    bool ready = false;
+    std::unique_ptr<Code> code;
+    size_t scratch = 0; // code 需要的额外槽位, 跟在局部变量之后
+
+    size_t frameSize() const {
+        return slotTypes.size() + scratch;
+    }
+
+    Slot run(Slot *slots, environment::Enviroment *env) {
+        if (code != nullptr) {
+            return code->run(slots, env);
+        }
+        Frame frame{slots, env, slot(0)};
+        for (auto &stmt : body) {
+            if (stmt->exec(frame)) {
+                return frame.result;
+            }
+        }
+        // 推断保证函数体以 return 结束
+        throw Bail{};
+    }
+
+    Slot invoke(environment::Enviroment *env, const vector<expr_ptr> &args,
+                Frame &caller) {
+        auto slots = stack.push(frameSize());
+        for (size_t i = 0; i < args.size(); i++) {
+            slots[i] = args[i]->eval(caller);
+        }
+        auto res = run(slots, env);
+        stack.pop(frameSize());
+        return res;
+    }
+
+    // 解释器调用函数时的入口, 参数类型不符或者放弃时返回 nullptr
+    obj_ptr call(object::FunctionObject *func, const vector<obj_ptr> &args) {
+        if (!ready || args.size() != params.size()) {
+            return nullptr;
+        }
+        static const object::Type objectTypes[] = {
+            object::Null_Obj, object::Int_Obj, object::Float_Obj,
+            object::Bool_Obj};
+        for (size_t i = 0; i < args.size(); i++) {
+            if (object::type(args[i]) !=
+                objectTypes[static_cast<int>(params[i])]) {
+                return nullptr;
+            }
+        }
+        auto top = stack.top;
+        auto depth = stack.depth;
+        try {
+            auto slots = stack.push(frameSize());
+            for (size_t i = 0; i < args.size(); i++) {
+                switch (params[i]) {
+                case Type::Int:
+                    slots[i] = slot(object::getValue<object::Integer>(args[i]));
+                    break;
+                case Type::Float:
+                    slots[i] = slot(object::getValue<object::Double>(args[i]));
+                    break;
+                default:
+                    slots[i] = slot(object::getValue<object::Boolean>(args[i]));
+                    break;
+                }
+            }
+            auto res = run(slots, func->Env.get());
+            stack.pop(frameSize());
+            switch (ret) {
+            case Type::Int:
+                return object::make<object::Integer>(res.i);
+            case Type::Float:
+                return object::make<object::Double>(res.f);
+            default:
+                return res.b ? object::_TRUE : object::_FALSE;
+            }
+        } catch (Bail &) {
+            stack.top = top;
+            stack.depth = depth;
+            return nullptr;
+        }
+    }
+};
+
+// 确认名字仍然绑定在 plan 的函数体上, 返回被调用函数定义时的环境
+inline environment::Enviroment *callee(Plan *plan, symbol::Symbol sym,
+                                       environment::Enviroment *env) {
+    auto [ok, val] = env->get(sym);
+    if (!ok || object::type(val) != object::Function_Obj) {
+        throw Bail{};
+    }
+    auto func = static_cast<object::FunctionObject *>(val.get());
+    if (func->Body.get() != plan->block) {
+        throw Bail{};
+    }
+    return func->Env.get();
+}
+
+// 推断结束后按函数体登记, 创建 FunctionObject 时取出
+// 推断和创建函数在同一个线程上, 每个线程各有一张表
+thread_local std::unordered_map<ast::BlockStatement *, Plan *> plans;
+
+Plan *planFor(ast::BlockStatement *block) {
+    if (plans.empty()) {
+        return nullptr;
+    }
+    auto iter = plans.find(block);
+    return iter == plans.end() ? nullptr : iter->second;
+}
+
+// 表达式节点
+
+class Const : public Expr {
+    private:
+    Slot val;
+
+    public:
+    Const(Type type, Slot val) : Expr(type), val(val) {
+    }
+    Slot eval(Frame &) {
+        return val;
+    }
+    void emit(vm::Assembler &as);
+};
+
+class Load : public Expr {
+    private:
+    size_t index;
+
+    public:
+    Load(Type type, size_t index) : Expr(type), index(index) {
+    }
+    Slot eval(Frame &frame) {
+        return frame.slots[index];
+    }
+    void emit(vm::Assembler &as);
+};
+
+// 与解释器相同的隐式转换: 比较和混合运算时 bool 转为 int, int 转为 float,
+// 作为条件时按 isTrue 转为 bool
+template <typename From, typename To>
+class Convert : public Expr {
+    private:
+    expr_ptr val;
+
+    public:
+    Convert(expr_ptr val) : Expr(typeOf<To>()), val(std::move(val)) {
+    }
+    Slot eval(Frame &frame) {
+        return slot(static_cast<To>(get<From>(val->eval(frame))));
+    }
+    void emit(vm::Assembler &as);
+};
+
+// 整数运算按补码回绕, 解释器会因为除零崩溃的情况交给解释器处理
+template <token::TokenType Op>
+inline int calc(int a, int b) {
+    auto ua = static_cast<unsigned>(a), ub = static_cast<unsigned>(b);
+    if constexpr (Op == token::PLUS) {
+        return static_cast<int>(ua + ub);
+    } else if constexpr (Op == token::MINUS) {
+        return static_cast<int>(ua - ub);
+    } else if constexpr (Op == token::ASTERISK) {
+        return static_cast<int>(ua * ub);
+    } else {
+        if (b == 0 || (a == INT_MIN && b == -1)) {
+            throw Bail{};
+        }
+        return a / b;
+    }
+}
+template <token::TokenType Op>
+inline double calc(double a, double b) {
+    if constexpr (Op == token::PLUS) {
+        return a + b;
+    } else if constexpr (Op == token::MINUS) {
+        return a - b;
+    } else if constexpr (Op == token::ASTERISK) {
+        return a * b;
+    } else {
+        return a / b;
+    }
+}
+
+template <typename T, token::TokenType Op>
+class Arith : public Expr {
+    private:
+    expr_ptr left, right;
+
+    public:
+    Arith(expr_ptr left, expr_ptr right)
+        : Expr(typeOf<T>()), left(std::move(left)), right(std::move(right)) {
+    }
+    Slot eval(Frame &frame) {
+        T a = get<T>(left->eval(frame));
+        T b = get<T>(right->eval(frame));
+        return slot(calc<Op>(a, b));
+    }
+    void emit(vm::Assembler &as);
+};
+
+template <typename T, token::TokenType Op>
+class Compare : public Expr {
+    private:
+    expr_ptr left, right;
+
+    public:
+    Compare(expr_ptr left, expr_ptr right)
+        : Expr(Type::Bool), left(std::move(left)), right(std::move(right)) {
+    }
+    Slot eval(Frame &frame) {
+        T a = get<T>(left->eval(frame));
+        T b = get<T>(right->eval(frame));
+        if constexpr (Op == token::EQ) {
+            return slot(a == b);
+        } else if constexpr (Op == token::NOT_EQ) {
+            return slot(a != b);
+        } else if constexpr (Op == token::LT) {
+            return slot(a < b);
+        } else if constexpr (Op == token::GT) {
+            return slot(a > b);
+        } else if constexpr (Op == token::LE) {
+            return slot(a <= b);
+        } else {
+            return slot(a >= b);
+        }
+    }
+    void emit(vm::Assembler &as);
+};
+
+// and / or 短路, 两边都已经转成 bool
+template <bool IsOr>
+class Logic : public Expr {
+    private:
+    expr_ptr left, right;
+
+    public:
+    Logic(expr_ptr left, expr_ptr right)
+        : Expr(Type::Bool), left(std::move(left)), right(std::move(right)) {
+    }
+    Slot eval(Frame &frame) {
+        bool val = left->eval(frame).b;
+        if (val == IsOr) {
+            return slot(val);
+        }
+        return right->eval(frame);
+    }
+    void emit(vm::Assembler &as);
+};
+
+// 与 evalBangOperatorExpression 一致: 只有 false 和整数 0 取反为 true
+template <typename T>
+class Not : public Expr {
+    private:
+    expr_ptr val;
+
+    public:
+    Not(expr_ptr val) : Expr(Type::Bool), val(std::move(val)) {
+    }
+    Slot eval(Frame &frame) {
+        T res = get<T>(val->eval(frame));
+        if constexpr (std::is_same_v<T, double>) {
+            return slot(false);
+        } else {
+            return slot(!res);
+        }
+    }
+    void emit(vm::Assembler &as);
+};
+
+template <typename T>
+class Neg : public Expr {
+    private:
+    expr_ptr val;
+
+    public:
+    Neg(expr_ptr val) : Expr(typeOf<T>()), val(std::move(val)) {
+    }
+    Slot eval(Frame &frame) {
+        T res = get<T>(val->eval(frame));
+        if constexpr (std::is_same_v<T, int>) {
+            return slot(static_cast<int>(0u - static_cast<unsigned>(res)));
+        } else {
+            return slot(-res);
+        }
+    }
+    void emit(vm::Assembler &as);
+};
+
+// 调用另一个不装箱的函数, 先确认名字仍然绑定在预期的函数体上
+class Call : public Expr {
+    private:
+    Plan *plan;
+    symbol::Symbol sym;
+    vector<expr_ptr> args;
+
+    public:
+    Call(Plan *plan, symbol::Symbol sym, vector<expr_ptr> args)
+        : Expr(plan->ret), plan(plan), sym(sym), args(std::move(args)) {
+    }
+    Slot eval(Frame &frame) {
+        return plan->invoke(callee(plan, sym, frame.env), args, frame);
+    }
+    void emit(vm::Assembler &as);
+};
+
+// 语句节点
+
+class Let : public Stmt {
+    private:
+    size_t index;
+    expr_ptr val;
+
+    public:
+    Let(size_t index, expr_ptr val) : index(index), val(std::move(val)) {
+    }
+    bool exec(Frame &frame) {
+        frame.slots[index] = val->eval(frame);
+        return false;
+    }
+    void emit(vm::Assembler &as);
+};
+
+class Discard : public Stmt {
+    private:
+    expr_ptr val;
+
+    public:
+    Discard(expr_ptr val) : val(std::move(val)) {
+    }
+    bool exec(Frame &frame) {
+        val->eval(frame);
+        return false;
+    }
+    void emit(vm::Assembler &as);
+};
+
+class Return : public Stmt {
+    private:
+    expr_ptr val;
+
+    public:
+    Return(expr_ptr val) : val(std::move(val)) {
+    }
+    bool exec(Frame &frame) {
+        frame.result = val->eval(frame);
+        return true;
+    }
+    void emit(vm::Assembler &as);
+};
+
+class Block : public Stmt {
+    public:
+    vector<stmt_ptr> stmts;
+
+    bool exec(Frame &frame) {
+        for (auto &stmt : stmts) {
+            if (stmt->exec(frame)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    void emit(vm::Assembler &as);
+};
+
+class If : public Stmt {
+    private:
+    expr_ptr cond;
+    stmt_ptr consequence, alternative;
+
+    public:
+    If(expr_ptr cond, stmt_ptr consequence, stmt_ptr alternative)
+        : cond(std::move(cond)), consequence(std::move(consequence)),
+          alternative(std::move(alternative)) {
+    }
+    bool exec(Frame &frame) {
+        if (cond->eval(frame).b) {
+            return consequence->exec(frame);
+        }
+        return alternative != nullptr && alternative->exec(frame);
+    }
+    void emit(vm::Assembler &as);
+};
+
+// 作为值使用的 if (true) { ...; expr }, 内联展开的函数体就是这种形式
+class Seq : public Expr {
+    private:
+    stmt_ptr body;
+    expr_ptr val;
+
+    public:
+    Seq(stmt_ptr body, expr_ptr val)
+        : Expr(val->type), body(std::move(body)), val(std::move(val)) {
+    }
+    Slot eval(Frame &frame) {
+        body->exec(frame);
+        return val->eval(frame);
+    }
+    void emit(vm::Assembler &as);
+};
+
+// 与 evalWhileStatement 一致, 循环体里的 return 只结束本轮循环
+class While : public Stmt {
+    private:
+    expr_ptr cond;
+    stmt_ptr body;
+
+    public:
+    While(expr_ptr cond, stmt_ptr body)
+        : cond(std::move(cond)), body(std::move(body)) {
+    }
+    bool exec(Frame &frame) {
+        while (cond->eval(frame).b) {
+            body->exec(frame);
+        }
+        return false;
+    }
+    void emit(vm::Assembler &as);
+};
+
+// for (i in range(...)), 直接计数
+class ForRange : public Stmt {
+    private:
+    size_t index;
+    vector<expr_ptr> args;
+    stmt_ptr body;
+
+    public:
+    ForRange(size_t index, vector<expr_ptr> args, stmt_ptr body)
+        : index(index), args(std::move(args)), body(std::move(body)) {
+    }
+    bool exec(Frame &frame) {
+        long long cur = 0, end = 0, step = 1;
+        if (args.size() == 1) {
+            end = args[0]->eval(frame).i;
+        } else {
+            cur = args[0]->eval(frame).i;
+            end = args[1]->eval(frame).i;
+        }
+        if (args.size() == 3) {
+            step = args[2]->eval(frame).i;
+        }
+        if (step == 0) {
+            throw Bail{};
+        }
+        while (step > 0 ? cur < end : cur > end) {
+            frame.slots[index] = slot(static_cast<int>(cur));
+            if (body->exec(frame)) {
+                return true;
+            }
+            cur += step;
+        }
+        return false;
+    }
+    void emit(vm::Assembler &as);
+};
+
+} // namespace typed
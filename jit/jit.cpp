@@ -0,0 +1,655 @@
+#pragma once
+
+#include "../ast/ast.cpp"
+#include "../eval/object.cpp"
+#include "./x64.cpp"
+#include <bit>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// 基线模板 JIT
+// 函数体的调用次数和循环次数超过阈值后, 按参数类型特化编译成 x86-64 机器码
+// 只编译纯函数: 参数和局部变量只能是 int / float / bool, 只能调用自身,
+// 不能访问外层变量和内置函数. 这样编译后的代码没有副作用, 遇到类型变化或
+// 除零时直接放弃 (bail), 由解释器从头重新执行这次调用即可
+namespace jit {
+
+using object::obj_ptr;
+using std::string;
+using std::vector;
+
+enum ValueType : uint8_t { T_INT, T_FLOAT, T_BOOL, T_NULL, T_BAIL };
+
+string TypeName(ValueType typ) {
+    switch (typ) {
+    case T_INT:
+        return "int";
+    case T_FLOAT:
+        return "float";
+    case T_BOOL:
+        return "bool";
+    case T_NULL:
+        return "null";
+    default:
+        return "bail";
+    }
+}
+
+// 返回值在 rax, 类型标记在 rdx
+struct NativeResult {
+    uint64_t bits;
+    uint64_t tag;
+};
+typedef NativeResult (*NativeFn)(const uint64_t *args);
+
+struct Options {
+    bool enabled = false;
+    size_t threshold = 1000;
+};
+
+static Options options;
+
+static constexpr size_t maxArgs = 16;
+static constexpr size_t maxBails = 3;
+
+struct Specialization {
+    vector<ValueType> params;
+    NativeFn fn = nullptr; // 编译失败或者多次 bail 之后为空
+    bool callsSelf = false;
+    size_t bails = 0;
+};
+
+// 热度按函数体统计: 闭包每次求值都会得到新的 FunctionObject, 但函数体是共享的
+struct Profile {
+    size_t calls = 0;
+    size_t loops = 0;
+    vector<Specialization> specs;
+
+    Specialization *find(const ValueType *params, size_t count) {
+        for (auto &spec : specs) {
+            if (spec.params.size() == count &&
+                std::equal(spec.params.begin(), spec.params.end(), params)) {
+                return &spec;
+            }
+        }
+        return nullptr;
+    }
+};
+
+// 当前正在解释执行的函数, 循环每迭代一次给它的热度加一
+thread_local Profile *activeProfile = nullptr;
+
+class ActiveProfile {
+    private:
+    Profile *saved = activeProfile;
+    bool entered = false;
+
+    public:
+    void enter(Profile *profile) {
+        activeProfile = profile;
+        entered = true;
+    }
+    ~ActiveProfile() {
+        if (entered) {
+            activeProfile = saved;
+        }
+    }
+};
+
+void countLoop() {
+    if (activeProfile != nullptr) {
+        activeProfile->loops++;
+    }
+}
+
+struct Unsupported {};
+
+class Compiler {
+    private:
+    struct Local {
+        int slot;
+        ValueType type;
+        bool visible;
+    };
+
+    Assembler as;
+    object::FunctionObject *func;
+    vector<ValueType> params;
+    ValueType retType;
+    symbol::Symbol self = nullptr;
+    std::unordered_map<symbol::Symbol, Local> locals;
+    int slots = 0;
+    int loopDepth = 0;
+    bool callsSelf = false;
+    Assembler::Label exitLabel, bailLabel;
+
+    template <typename T>
+    T *as_(ast::Node *node) {
+        if (node != nullptr && typeid(*node) == typeid(T)) {
+            return static_cast<T *>(node);
+        }
+        return nullptr;
+    }
+
+    void declare(ast::Identifier *name, ValueType typ,
+                 vector<symbol::Symbol> &scope) {
+        auto iter = locals.find(name->sym);
+        if (iter == locals.end()) {
+            locals[name->sym] = {slots++, typ, true};
+            scope.push_back(name->sym);
+            as.storeSlot(slots - 1);
+            return;
+        }
+        if (iter->second.type != typ) {
+            throw Unsupported{};
+        }
+        if (!iter->second.visible) {
+            iter->second.visible = true;
+            scope.push_back(name->sym);
+        }
+        as.storeSlot(iter->second.slot);
+    }
+
+    void compileBlock(ast::BlockStatement *block, bool keepScope) {
+        vector<symbol::Symbol> scope;
+        for (auto &stmt : block->statements()) {
+            compileStatement(stmt.get(), scope);
+        }
+        if (!keepScope) {
+            // 块中新定义的变量在块外不一定已经赋值, 之后不允许再读取
+            for (auto sym : scope) {
+                locals[sym].visible = false;
+            }
+        }
+    }
+
+    void compileStatement(ast::Statement *stmt,
+                          vector<symbol::Symbol> &scope) {
+        if (auto let = as_<ast::LetStatement>(stmt)) {
+            auto typ = compileExpr(let->value());
+            declare(let->name(), typ, scope);
+            return;
+        }
+        if (auto ret = as_<ast::ReturnStatement>(stmt)) {
+            // 解释器里 while 会吞掉循环体中的 return, 这里不去模拟
+            if (loopDepth > 0) {
+                throw Unsupported{};
+            }
+            if (compileExpr(ret->returnValue()) != retType) {
+                throw Unsupported{};
+            }
+            as.movEdxImm(retType);
+            as.jmp(exitLabel);
+            return;
+        }
+        if (auto exprStmt = as_<ast::ExpressionStatement>(stmt)) {
+            if (exprStmt->expression() == nullptr) {
+                return;
+            }
+            if (auto ifexpr = as_<ast::IfExpression>(exprStmt->expression())) {
+                compileIf(ifexpr);
+            } else {
+                compileExpr(exprStmt->expression());
+            }
+            return;
+        }
+        if (auto whilestmt = as_<ast::WhileStatement>(stmt)) {
+            Assembler::Label loop, end;
+            as.bind(loop);
+            compileTest(whilestmt->condition());
+            as.jcc(CC_E, end);
+            loopDepth++;
+            compileBlock(whilestmt->body(), false);
+            loopDepth--;
+            as.jmp(loop);
+            as.bind(end);
+            return;
+        }
+        throw Unsupported{};
+    }
+
+    void compileIf(ast::IfExpression *ifexpr) {
+        Assembler::Label alter, end;
+        compileTest(ifexpr->condition());
+        as.jcc(CC_E, alter);
+        compileBlock(ifexpr->consequence(), false);
+        as.jmp(end);
+        as.bind(alter);
+        if (ifexpr->alternative() != nullptr) {
+            compileIf(ifexpr->alternative());
+        }
+        as.bind(end);
+    }
+
+    // 条件结果放在 eax, 只接受 int 和 bool
+    void compileTest(ast::Expression *expr) {
+        auto typ = compileExpr(expr);
+        if (typ != T_INT && typ != T_BOOL) {
+            throw Unsupported{};
+        }
+        as.testEaxEax();
+    }
+
+    ValueType compileExpr(ast::Expression *expr) {
+        if (auto lit = as_<ast::IntegerLiteral>(expr)) {
+            as.movEaxImm(lit->value);
+            return T_INT;
+        }
+        if (auto lit = as_<ast::DoubleLiteral>(expr)) {
+            as.movRaxImm(std::bit_cast<int64_t>(lit->value));
+            return T_FLOAT;
+        }
+        if (auto lit = as_<ast::BooleanLiteral>(expr)) {
+            as.movEaxImm(lit->value);
+            return T_BOOL;
+        }
+        if (auto ident = as_<ast::Identifier>(expr)) {
+            auto iter = locals.find(ident->sym);
+            if (iter == locals.end() || !iter->second.visible) {
+                throw Unsupported{};
+            }
+            as.loadSlot(iter->second.slot);
+            return iter->second.type;
+        }
+        if (auto prefix = as_<ast::PrefixExpression>(expr)) {
+            return compilePrefix(prefix);
+        }
+        if (auto infix = as_<ast::InfixExpression>(expr)) {
+            return compileInfix(infix);
+        }
+        if (auto call = as_<ast::CallExpression>(expr)) {
+            return compileCall(call);
+        }
+        throw Unsupported{};
+    }
+
+    ValueType compilePrefix(ast::PrefixExpression *prefix) {
+        auto typ = compileExpr(prefix->right());
+        switch (prefix->TokenType()) {
+        case token::MINUS:
+            if (typ == T_INT) {
+                as.negEax();
+                return T_INT;
+            }
+            if (typ == T_FLOAT) {
+                as.movRcxImm(std::numeric_limits<int64_t>::min());
+                as.xorRaxRcx();
+                return T_FLOAT;
+            }
+            throw Unsupported{};
+        case token::BANG:
+        case token::NOT:
+            // 与 evalBangOperatorExpression 一致: 只有 false 和 0 取反为 true
+            if (typ == T_BOOL) {
+                as.xorEaxImm8(1);
+            } else if (typ == T_INT) {
+                as.testEaxEax();
+                as.setccAl(CC_E);
+            } else {
+                as.movEaxImm(0);
+            }
+            return T_BOOL;
+        default:
+            throw Unsupported{};
+        }
+    }
+
+    ValueType compileLogic(ast::InfixExpression *infix) {
+        bool isAnd = infix->TokenType() == token::AND;
+        Assembler::Label shortcut, end;
+        compileTest(infix->left());
+        as.jcc(isAnd ? CC_E : CC_NE, shortcut);
+        compileTest(infix->right());
+        as.setccAl(CC_NE);
+        as.jmp(end);
+        as.bind(shortcut);
+        as.movEaxImm(isAnd ? 0 : 1);
+        as.bind(end);
+        return T_BOOL;
+    }
+
+    // 左操作数放进 xmm0, 右操作数放进 xmm1, int 和 bool 先转换为 double
+    void toXmm(ValueType left, ValueType right) {
+        if (left == T_FLOAT) {
+            as.movqXmm0Rax();
+        } else {
+            as.cvtEaxToXmm0();
+        }
+        if (right == T_FLOAT) {
+            as.movqXmm1Rcx();
+        } else {
+            as.cvtEcxToXmm1();
+        }
+    }
+
+    ValueType compileInfix(ast::InfixExpression *infix) {
+        auto typ = infix->TokenType();
+        if (typ == token::AND || typ == token::OR) {
+            return compileLogic(infix);
+        }
+        auto left = compileExpr(infix->left());
+        as.pushRax();
+        auto right = compileExpr(infix->right());
+        as.movRcxRax();
+        as.popRax();
+        bool isFloat = left == T_FLOAT || right == T_FLOAT;
+        switch (typ) {
+        case token::PLUS:
+        case token::MINUS:
+        case token::ASTERISK:
+        case token::SLASH:
+            if (left == T_BOOL || right == T_BOOL) {
+                throw Unsupported{};
+            }
+            if (!isFloat) {
+                switch (typ) {
+                case token::PLUS:
+                    as.addEaxEcx();
+                    break;
+                case token::MINUS:
+                    as.subEaxEcx();
+                    break;
+                case token::ASTERISK:
+                    as.imulEaxEcx();
+                    break;
+                default:
+                    as.testEcxEcx();
+                    as.jcc(CC_E, bailLabel);
+                    as.idivEcx();
+                    break;
+                }
+                return T_INT;
+            }
+            toXmm(left, right);
+            switch (typ) {
+            case token::PLUS:
+                as.addsd();
+                break;
+            case token::MINUS:
+                as.subsd();
+                break;
+            case token::ASTERISK:
+                as.mulsd();
+                break;
+            default:
+                as.divsd();
+                break;
+            }
+            as.movqRaxXmm0();
+            return T_FLOAT;
+        case token::EQ:
+        case token::NOT_EQ:
+        case token::LT:
+        case token::LE:
+        case token::GT:
+        case token::GE:
+            if (!isFloat) {
+                as.cmpEaxEcx();
+                switch (typ) {
+                case token::EQ:
+                    as.setccAl(CC_E);
+                    break;
+                case token::NOT_EQ:
+                    as.setccAl(CC_NE);
+                    break;
+                case token::LT:
+                    as.setccAl(CC_L);
+                    break;
+                case token::LE:
+                    as.setccAl(CC_LE);
+                    break;
+                case token::GT:
+                    as.setccAl(CC_G);
+                    break;
+                default:
+                    as.setccAl(CC_GE);
+                    break;
+                }
+                return T_BOOL;
+            }
+            // 浮点比较需要处理 NaN: 无序时 ZF / PF / CF 都为 1
+            toXmm(left, right);
+            switch (typ) {
+            case token::EQ:
+                as.ucomisdXmm0Xmm1();
+                as.setccCl(CC_NP);
+                as.setccAl(CC_E);
+                as.andAlCl();
+                break;
+            case token::NOT_EQ:
+                as.ucomisdXmm0Xmm1();
+                as.setccCl(CC_P);
+                as.setccAl(CC_NE);
+                as.orAlCl();
+                break;
+            case token::LT:
+                as.ucomisdXmm1Xmm0();
+                as.setccAl(CC_A);
+                break;
+            case token::LE:
+                as.ucomisdXmm1Xmm0();
+                as.setccAl(CC_AE);
+                break;
+            case token::GT:
+                as.ucomisdXmm0Xmm1();
+                as.setccAl(CC_A);
+                break;
+            default:
+                as.ucomisdXmm0Xmm1();
+                as.setccAl(CC_AE);
+                break;
+            }
+            return T_BOOL;
+        default:
+            throw Unsupported{};
+        }
+    }
+
+    ValueType compileCall(ast::CallExpression *call) {
+        auto callee = as_<ast::Identifier>(call->function());
+        if (callee == nullptr || self == nullptr || callee->sym != self ||
+            locals.count(self)) {
+            throw Unsupported{};
+        }
+        auto &args = call->arguments();
+        if (args.size() != params.size()) {
+            throw Unsupported{};
+        }
+        int32_t size = static_cast<int32_t>(args.size() * 8);
+        if (size != 0) {
+            as.subRsp(size);
+        }
+        for (size_t i = 0; i < args.size(); i++) {
+            if (compileExpr(args[i].get()) != params[i]) {
+                throw Unsupported{};
+            }
+            as.storeRsp(static_cast<int32_t>(i * 8));
+        }
+        as.movRdiRsp();
+        as.callSelf();
+        if (size != 0) {
+            as.addRsp(size);
+        }
+        // 返回类型与假设不一致 (比如返回了 null) 时整个调用交还给解释器
+        as.cmpEdxImm8(retType);
+        as.jcc(CC_NE, bailLabel);
+        callsSelf = true;
+        return retType;
+    }
+
+    public:
+    Compiler(object::FunctionObject *func, vector<ValueType> params,
+             ValueType retType)
+        : func(func), params(std::move(params)), retType(retType) {
+        if (!func->Name.empty()) {
+            self = symbol::intern(func->Name);
+        }
+    }
+
+    bool usesSelf() const {
+        return callsSelf;
+    }
+
+    const vector<uint8_t> &compile() {
+        auto frameAt = as.prologue();
+        vector<symbol::Symbol> scope;
+        for (size_t i = 0; i < params.size(); i++) {
+            as.loadArg(static_cast<int32_t>(i));
+            declare(func->Parameters[i].get(), params[i], scope);
+        }
+        compileBlock(func->Body.get(), true);
+        // 没有 return 时函数的值是 null
+        as.movEaxImm(0);
+        as.movEdxImm(T_NULL);
+        as.jmp(exitLabel);
+        as.bind(bailLabel);
+        as.movEdxImm(T_BAIL);
+        as.bind(exitLabel);
+        as.epilogue();
+        as.patchFrame(frameAt, (slots * 8 + 15) / 16 * 16);
+        return as.bytes();
+    }
+};
+
+class Runtime {
+    private:
+    CodeArena arena;
+    // 按函数体的编号而不是地址, 释放后同一地址上的新函数体不会继承
+    std::unordered_map<uint64_t, Profile> profiles;
+    std::ofstream perfMap;
+
+    // 给 Linux perf 用的符号表, 格式为 "起始地址 长度 名字"
+    void writePerfMap(void *code, size_t size, object::FunctionObject *func,
+                      const vector<ValueType> &params) {
+#if WAII_JIT_SUPPORTED
+        if (!perfMap.is_open()) {
+            perfMap.open(std::format("/tmp/perf-{}.map", getpid()),
+                         std::ios::app);
+        }
+        string sig;
+        for (auto typ : params) {
+            sig += (sig.empty() ? "" : ",") + TypeName(typ);
+        }
+        perfMap << std::format(
+            "{:x} {:x} jit:{}({})\n", reinterpret_cast<uintptr_t>(code), size,
+            func->Name.empty() ? "<anonymous>" : func->Name, sig);
+        perfMap.flush();
+#endif
+    }
+
+    public:
+    Profile *profileFor(object::FunctionObject *func) {
+        return &profiles[func->Body->serial];
+    }
+
+    Specialization *compile(object::FunctionObject *func, Profile *profile,
+                            const ValueType *params, size_t count) {
+        auto &spec = profile->specs.emplace_back();
+        spec.params.assign(params, params + count);
+        // 返回类型依次尝试 int / float / bool, 递归调用按假设的类型编译
+        for (auto ret : {T_INT, T_FLOAT, T_BOOL}) {
+            try {
+                Compiler compiler(func, spec.params, ret);
+                auto &code = compiler.compile();
+                auto entry = arena.install(code);
+                if (entry == nullptr) {
+                    break;
+                }
+                spec.fn = reinterpret_cast<NativeFn>(entry);
+                spec.callsSelf = compiler.usesSelf();
+                writePerfMap(entry, code.size(), func, spec.params);
+                break;
+            } catch (Unsupported &) {
+            }
+        }
+        return &spec;
+    }
+};
+
+// 每个线程各自编译和缓存, 互不干扰
+Runtime &runtime() {
+    thread_local Runtime rt;
+    return rt;
+}
+
+Profile *profileFor(object::FunctionObject *func) {
+    return runtime().profileFor(func);
+}
+
+// 尝试执行编译后的代码, 返回 nullptr 时交给解释器
+obj_ptr tryCall(object::FunctionObject *func, Profile *profile,
+                const vector<obj_ptr> &args) {
+#if WAII_JIT_SUPPORTED
+    profile->calls++;
+    auto count = args.size();
+    if (count != func->Parameters.size() || count > maxArgs) {
+        return nullptr;
+    }
+    uint64_t raw[maxArgs];
+    ValueType types[maxArgs];
+    for (size_t i = 0; i < count; i++) {
+        switch (object::type(args[i])) {
+        case object::Int_Obj:
+            types[i] = T_INT;
+            raw[i] = static_cast<uint32_t>(object::getValue<object::Integer>(args[i]));
+            break;
+        case object::Float_Obj:
+            types[i] = T_FLOAT;
+            raw[i] = std::bit_cast<uint64_t>(
+                object::getValue<object::Double>(args[i]));
+            break;
+        case object::Bool_Obj:
+            types[i] = T_BOOL;
+            raw[i] = object::getValue<object::Boolean>(args[i]);
+            break;
+        default:
+            return nullptr;
+        }
+    }
+    auto spec = profile->find(types, count);
+    if (spec == nullptr) {
+        if (profile->calls + profile->loops < options.threshold) {
+            return nullptr;
+        }
+        spec = runtime().compile(func, profile, types, count);
+    }
+    if (spec->fn == nullptr) {
+        return nullptr;
+    }
+    if (spec->callsSelf) {
+        // 编译时递归调用直接跳回自身, 执行前确认这个名字仍然绑定着同一个函数体
+        auto [ok, val] = func->Env->get(func->Name);
+        if (!ok || object::type(val) != object::Function_Obj ||
+            dynamic_cast<object::FunctionObject *>(val.get())->Body !=
+                func->Body) {
+            return nullptr;
+        }
+    }
+    auto res = spec->fn(raw);
+    switch (res.tag) {
+    case T_INT:
+        return object::make<object::Integer>(
+            static_cast<int32_t>(static_cast<uint32_t>(res.bits)));
+    case T_FLOAT:
+        return object::make<object::Double>(
+            std::bit_cast<double>(res.bits));
+    case T_BOOL:
+        return (res.bits & 1) ? object::_TRUE : object::_FALSE;
+    case T_NULL:
+        return object::_NULL;
+    default:
+        if (++spec->bails >= maxBails) {
+            spec->fn = nullptr;
+        }
+        return nullptr;
+    }
+#else
+    return nullptr;
+#endif
+}
+
+} // namespace jit
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__unix__)
+#define WAII_JIT_SUPPORTED 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define WAII_JIT_SUPPORTED 0
+#endif
+
+namespace jit {
+
+// x86-64 条件码, 直接作为 setcc / jcc 操作码的低 4 位
+enum Cond : uint8_t {
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_P = 0xA,
+    CC_NP = 0xB,
+    CC_L = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G = 0xF
+};
+
+// 只包含模板 JIT 用到的少量指令, 寄存器固定为 rax / rcx / rdx / rdi / rsp / rbp
+// 以及 xmm0 / xmm1
+// 所有跳转和调用都是相对地址, 生成的代码可以复制到任意位置执行
+class Assembler {
+    public:
+    struct Label {
+        int pos = -1;
+        std::vector<size_t> fixups;
+    };
+
+    private:
+    std::vector<uint8_t> code;
+
+    void emit(std::initializer_list<uint8_t> bytes) {
+        code.insert(code.end(), bytes);
+    }
+    void imm32(int32_t val) {
+        uint8_t buf[4];
+        std::memcpy(buf, &val, 4);
+        code.insert(code.end(), buf, buf + 4);
+    }
+    void imm64(int64_t val) {
+        uint8_t buf[8];
+        std::memcpy(buf, &val, 8);
+        code.insert(code.end(), buf, buf + 8);
+    }
+    void patch(size_t at, int32_t val) {
+        std::memcpy(code.data() + at, &val, 4);
+    }
+    void target(Label &label) {
+        if (label.pos >= 0) {
+            imm32(label.pos - static_cast<int32_t>(code.size() + 4));
+        } else {
+            label.fixups.push_back(code.size());
+            imm32(0);
+        }
+    }
+
+    public:
+    const std::vector<uint8_t> &bytes() const {
+        return code;
+    }
+    size_t size() const {
+        return code.size();
+    }
+
+    void bind(Label &label) {
+        label.pos = static_cast<int>(code.size());
+        for (auto at : label.fixups) {
+            patch(at, label.pos - static_cast<int32_t>(at + 4));
+        }
+        label.fixups.clear();
+    }
+
+    // 栈帧, 返回栈帧大小所在的位置, 函数体生成完之后再回填
+    size_t prologue() {
+        emit({0x55});             // push rbp
+        emit({0x48, 0x89, 0xE5}); // mov rbp, rsp
+        emit({0x48, 0x81, 0xEC}); // sub rsp, imm32
+        auto at = code.size();
+        imm32(0);
+        return at;
+    }
+    void patchFrame(size_t at, int32_t frameSize) {
+        patch(at, frameSize);
+    }
+    void epilogue() {
+        emit({0x48, 0x89, 0xEC}); // mov rsp, rbp
+        emit({0x5D});             // pop rbp
+        emit({0xC3});             // ret
+    }
+
+    // 数据移动
+    void loadArg(int32_t index) { // mov rax, [rdi + 8 * index]
+        emit({0x48, 0x8B, 0x87});
+        imm32(index * 8);
+    }
+    void loadSlot(int32_t slot) { // mov rax, [rbp - 8 * (slot + 1)]
+        emit({0x48, 0x8B, 0x85});
+        imm32(-8 * (slot + 1));
+    }
+    void storeSlot(int32_t slot) { // mov [rbp - 8 * (slot + 1)], rax
+        emit({0x48, 0x89, 0x85});
+        imm32(-8 * (slot + 1));
+    }
+    void movEaxImm(int32_t val) {
+        emit({0xB8});
+        imm32(val);
+    }
+    void movRaxImm(int64_t val) {
+        emit({0x48, 0xB8});
+        imm64(val);
+    }
+    void movEdxImm(int32_t val) {
+        emit({0xBA});
+        imm32(val);
+    }
+    void pushRax() {
+        emit({0x50});
+    }
+    void popRax() {
+        emit({0x58});
+    }
+    void movRcxRax() {
+        emit({0x48, 0x89, 0xC1});
+    }
+    void subRsp(int32_t size) {
+        emit({0x48, 0x81, 0xEC});
+        imm32(size);
+    }
+    void addRsp(int32_t size) {
+        emit({0x48, 0x81, 0xC4});
+        imm32(size);
+    }
+    void storeRsp(int32_t offset) { // mov [rsp + offset], rax
+        emit({0x48, 0x89, 0x84, 0x24});
+        imm32(offset);
+    }
+    void movRdiRsp() {
+        emit({0x48, 0x89, 0xE7});
+    }
+
+    // 32 位整数运算, 左操作数在 eax, 右操作数在 ecx
+    void addEaxEcx() {
+        emit({0x01, 0xC8});
+    }
+    void subEaxEcx() {
+        emit({0x29, 0xC8});
+    }
+    void imulEaxEcx() {
+        emit({0x0F, 0xAF, 0xC1});
+    }
+    void idivEcx() { // cdq; idiv ecx
+        emit({0x99, 0xF7, 0xF9});
+    }
+    void negEax() {
+        emit({0xF7, 0xD8});
+    }
+    void xorEaxImm8(int8_t val) {
+        emit({0x83, 0xF0, static_cast<uint8_t>(val)});
+    }
+    void testEaxEax() {
+        emit({0x85, 0xC0});
+    }
+    void testEcxEcx() {
+        emit({0x85, 0xC9});
+    }
+    void cmpEaxEcx() {
+        emit({0x39, 0xC8});
+    }
+    void cmpEdxImm8(int8_t val) {
+        emit({0x83, 0xFA, static_cast<uint8_t>(val)});
+    }
+    void setccAl(Cond cc) { // setcc al; movzx eax, al
+        emit({0x0F, static_cast<uint8_t>(0x90 | cc), 0xC0});
+        emit({0x0F, 0xB6, 0xC0});
+    }
+    void setccCl(Cond cc) {
+        emit({0x0F, static_cast<uint8_t>(0x90 | cc), 0xC1});
+    }
+    void andAlCl() { // and al, cl; movzx eax, al
+        emit({0x20, 0xC8, 0x0F, 0xB6, 0xC0});
+    }
+    void orAlCl() { // or al, cl; movzx eax, al
+        emit({0x08, 0xC8, 0x0F, 0xB6, 0xC0});
+    }
+
+    // 双精度运算, 左操作数在 xmm0, 右操作数在 xmm1
+    void movqXmm0Rax() {
+        emit({0x66, 0x48, 0x0F, 0x6E, 0xC0});
+    }
+    void movqXmm1Rcx() {
+        emit({0x66, 0x48, 0x0F, 0x6E, 0xC9});
+    }
+    void movqRaxXmm0() {
+        emit({0x66, 0x48, 0x0F, 0x7E, 0xC0});
+    }
+    void cvtEaxToXmm0() {
+        emit({0xF2, 0x0F, 0x2A, 0xC0});
+    }
+    void cvtEcxToXmm1() {
+        emit({0xF2, 0x0F, 0x2A, 0xC9});
+    }
+    void addsd() {
+        emit({0xF2, 0x0F, 0x58, 0xC1});
+    }
+    void subsd() {
+        emit({0xF2, 0x0F, 0x5C, 0xC1});
+    }
+    void mulsd() {
+        emit({0xF2, 0x0F, 0x59, 0xC1});
+    }
+    void divsd() {
+        emit({0xF2, 0x0F, 0x5E, 0xC1});
+    }
+    void ucomisdXmm0Xmm1() {
+        emit({0x66, 0x0F, 0x2E, 0xC1});
+    }
+    void ucomisdXmm1Xmm0() {
+        emit({0x66, 0x0F, 0x2E, 0xC8});
+    }
+    void xorRaxRcx() {
+        emit({0x48, 0x31, 0xC8});
+    }
+    void movRcxImm(int64_t val) {
+        emit({0x48, 0xB9});
+        imm64(val);
+    }
+
+    // 控制流
+    void jmp(Label &label) {
+        emit({0xE9});
+        target(label);
+    }
+    void jcc(Cond cc, Label &label) {
+        emit({0x0F, static_cast<uint8_t>(0x80 | cc)});
+        target(label);
+    }
+    // 调用当前函数自身 (偏移 0 处的入口)
+    void callSelf() {
+        emit({0xE8});
+        imm32(-static_cast<int32_t>(code.size() + 4));
+    }
+};
+
+// 可执行内存, 按页从 mmap 申请, 写入后改为只读可执行
+class CodeArena {
+    private:
+    std::vector<std::pair<uint8_t *, size_t>> chunks;
+
+    public:
+    CodeArena() = default;
+    CodeArena(const CodeArena &) = delete;
+    CodeArena &operator=(const CodeArena &) = delete;
+    ~CodeArena() {
+#if WAII_JIT_SUPPORTED
+        for (auto [ptr, size] : chunks) {
+            munmap(ptr, size);
+        }
+#endif
+    }
+
+    // 返回代码的入口地址, 失败时返回 nullptr
+    void *install(const std::vector<uint8_t> &code) {
+#if WAII_JIT_SUPPORTED
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t size = (code.size() + page - 1) / page * page;
+        void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return nullptr;
+        }
+        std::memcpy(mem, code.data(), code.size());
+        if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(mem, size);
+            return nullptr;
+        }
+        chunks.emplace_back(static_cast<uint8_t *>(mem), size);
+        return mem;
+#else
+        return nullptr;
+#endif
+    }
+};
+
+} // namespace jit
@@ -15,7 +15,11 @@ class Lexer {
     int position;
     int readPostition;
     char ch;
+    int line = 1;
     void readChar() {
+        if (ch == '\n') {
+            line++;
+        }
         if (readPostition >= input.length()) {
             ch = 0;
         } else {
@@ -50,36 +54,39 @@ class Lexer {
             return input[readPostition];
         }
     }
-    std::pair<string, TokenType> readNumber() {
+    // 读出的文本都指向 input. 名字和字符串做成词法单元前先驻留
+    std::pair<std::string_view, TokenType> readNumber() {
         auto start = position;
         bool double_flag = false;
         while (isDigit() || (ch == '.' && (!double_flag))) {
             double_flag |= (ch == '.');
             readChar();
         }
-        return std::make_pair(input.substr(start, position - start),
-                              double_flag ? TokenType::DOUBLE : TokenType::INT);
+        return std::make_pair(
+            std::string_view(input).substr(start, position - start),
+            double_flag ? TokenType::DOUBLE : TokenType::INT);
     }
-    string readIdentifier() {
+    std::string_view readIdentifier() {
         auto start = position;
         while (isLetter() || isDigit()) {
             readChar();
         }
         // std::cerr << start << " " << position << std::endl;
-        return input.substr(start, position - start);
+        return std::string_view(input).substr(start, position - start);
     }
-    string readString() {
+    std::string_view readString() {
         auto start = position + 1;
         readChar();
         while (ch != '\"' && ch != 0) {
             readChar();
         }
-        return input.substr(start, position - start);
+        return std::string_view(input).substr(start, position - start);
     }
     Token NextToken() {
         Token res;
         skipWhitespace();
-        auto setToken = [&res](TokenType type, string literal) -> void {
+        res.Line = line;
+        auto setToken = [&res](TokenType type, std::string_view literal) {
             res.Type = type;
             res.Literal = literal;
         };
@@ -147,7 +154,8 @@ class Lexer {
             }
             break;
         case '\"':
-            setToken(TokenType::STRING, readString());
+            res.Sym = symbol::intern(readString());
+            setToken(TokenType::STRING, res.Sym->str);
             break;
         case '[':
             setToken(TokenType::LBRACKET, "[");
@@ -163,15 +171,19 @@ class Lexer {
             break;
         default:
             if (isLetter()) {
-                auto literal = readIdentifier();
-                setToken(token::LookupIdent(literal), literal);
+                auto word = symbol::intern(readIdentifier());
+                setToken(token::LookupIdent(word->str), word->str);
+                if (res.Type == TokenType::IDENT) {
+                    res.Sym = word;
+                }
                 return res;
             } else if (isDigit()) {
                 auto [Lit, Typ] = readNumber();
                 setToken(Typ, Lit);
                 return res;
             } else {
-                setToken(TokenType::ILLEGAL, string() + ch);
+                setToken(TokenType::ILLEGAL,
+                         symbol::intern(std::string_view(&ch, 1))->str);
             }
             break;
         }
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace symbol {
+
+// 驻留后的字符串, 地址在整个进程内保持稳定
+struct SymbolData {
+    std::string str;
+    size_t hash;
+    uint32_t id;
+};
+
+// 同一内容只会驻留一次, 所以比较两个 Symbol 只需要比较指针
+typedef const SymbolData *Symbol;
+
+// 各线程的词法分析共用一张表, 表内的操作加锁
+class Interner {
+    private:
+    std::deque<SymbolData> storage;
+    std::unordered_map<std::string_view, SymbolData *> table;
+    mutable std::mutex lock;
+
+    public:
+    Symbol intern(std::string_view str) {
+        std::lock_guard guard(lock);
+        auto iter = table.find(str);
+        if (iter != table.end()) {
+            return iter->second;
+        }
+        auto &data = storage.emplace_back(
+            std::string(str), std::hash<std::string_view>{}(str),
+            static_cast<uint32_t>(storage.size()));
+        table.emplace(std::string_view(data.str), &data);
+        return &data;
+    }
+    size_t size() const {
+        std::lock_guard guard(lock);
+        return storage.size();
+    }
+    size_t bytes() const {
+        std::lock_guard guard(lock);
+        size_t res = 0;
+        for (auto &data : storage) {
+            res += sizeof(SymbolData) + data.str.capacity();
+        }
+        return res;
+    }
+};
+
+Interner &globalInterner() {
+    static Interner interner;
+    return interner;
+}
+
+// 每个线程先查自己驻留过的名字, 只有第一次遇到时才加锁查全局的表
+// 键指向 SymbolData 里的字符串, 和它一样一直有效
+Symbol intern(std::string_view str) {
+    thread_local std::unordered_map<std::string_view, Symbol> seen;
+    auto iter = seen.find(str);
+    if (iter != seen.end()) {
+        return iter->second;
+    }
+    auto sym = globalInterner().intern(str);
+    seen.emplace(sym->str, sym);
+    return sym;
+}
+
+} // namespace symbol
@@ -1,8 +1,10 @@
 #pragma once
 
+#include "./symbol.hpp"
 #include <iostream>
 #include <map>
 #include <string>
+#include <string_view>
 
 namespace token {
 
@@ -236,30 +238,33 @@ std::string TypeToName(TokenType type) {
 
 struct Token {
     TokenType Type;
-    std::string Literal;
+    // 指向驻留的字符串或者字符串常量, 不另外保存一份
+    // 数字不驻留, 指向源码, 只在词法分析器存活期间有效
+    std::string_view Literal;
+    // IDENT 和 STRING 的 Symbol
+    symbol::Symbol Sym = nullptr;
+    int Line = 0; // 所在的行, 从 1 开始
     void Output(std::ostream &out = std::cout) {
         out << TypeToName(Type) << " : " << Literal << std::endl;
     }
 };
 
-static std::map<std::string, TokenType> keywords = {
+static const std::map<std::string, TokenType, std::less<>> keywords = {
     {"fn", FUNCTION}, {"let", LET},   {"true", TRUE},     {"false", FALSE},
     {"if", IF},       {"else", ELSE}, {"return", RETURN}, {"or", OR},
     {"and", AND},     {"not", NOT},   {"for", FOR},       {"in", IN},
     {"while", WHILE}};
 
-Token newToken(TokenType Type, std::string Literal) {
+Token newToken(TokenType Type, std::string_view Literal) {
     Token res;
     res.Type = Type;
     res.Literal = Literal;
     return res;
 }
 
-TokenType LookupIdent(std::string str) {
-    if (keywords.count(str)) {
-        return keywords[str];
-    }
-    return IDENT;
+TokenType LookupIdent(std::string_view str) {
+    auto iter = keywords.find(str);
+    return iter == keywords.end() ? IDENT : iter->second;
 }
 
 } // namespace token
\ No newline at end of file
@@ -1,40 +1,275 @@
+#include "./aot/emit_cpp.cpp"
 #include "./eval/eval.cpp"
+#include "./eval/infer.cpp"
+#include "./eval/machine.cpp"
+#include "./eval/output.cpp"
 #include "./lexer/lexer.cpp"
+#include "./opt/optimize.cpp"
 #include "./parser/parser.cpp"
 #include "./parser/parser_func.cpp"
 #include "./repl/repl.cpp"
+#include <algorithm>
+#include <charconv>
 #include <format>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <numeric>
+#include <optional>
+#include <string_view>
 using namespace std;
 
+// 命令行参数有误, main 打印用法后退出
+struct UsageError {
+    string message;
+};
+
+// arg 去掉前 skip 个字符后应是 [min, INT_MAX] 内的整数
+size_t numberArg(string_view arg, size_t skip, size_t min = 0) {
+    auto text = arg.substr(skip), name = arg.substr(0, skip);
+    if (name.ends_with('=')) {
+        name.remove_suffix(1);
+    }
+    size_t value = 0;
+    auto [end, ec] = from_chars(text.data(), text.data() + text.size(), value);
+    if (text.empty() || ec != errc() || end != text.data() + text.size() ||
+        value < min || value > size_t(numeric_limits<int>::max())) {
+        throw UsageError{format("invalid value for {}: expected an integer "
+                                "between {} and {}",
+                                name, min, numeric_limits<int>::max())};
+    }
+    return value;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc == 1) {
-        repl::Repl(cin, cout);
+    auto &out = output::out();
+    output::flushOnCrash();
+    string path;
+    // --emit-cpp 只翻译不执行, 不带文件名时输出到标准输出
+    bool emitCpp = false;
+    string emitPath;
+    // 类型推断由 --infer / --no-infer 决定, 都没给时跟随 --vm (字节码
+    // 执行的是推断出的 typed 计划). --dump-types 只打印推断结果
+    std::optional<bool> inferFlag;
+    bool dumpTypes = false;
+    try {
+        for (int i = 1; i < argc; i++) {
+            string_view arg = argv[i];
+            if (arg.starts_with("--output-buffer=")) {
+                out.setCapacity(numberArg(arg, 16));
+            } else if (arg.starts_with("--inspect-depth=")) {
+                object::inspectLimits.maxDepth = numberArg(arg, 16);
+            } else if (arg.starts_with("--inspect-size=")) {
+                object::inspectLimits.maxSize = numberArg(arg, 15);
+            } else if (arg == "--async-output") {
+                out.setAsync(true);
+            } else if (arg == "--emit-cpp") {
+                emitCpp = true;
+            } else if (arg.starts_with("--emit-cpp=")) {
+                emitCpp = true;
+                emitPath = arg.substr(11);
+            } else if (arg == "--jit") {
+                jit::options.enabled = WAII_JIT_SUPPORTED;
+            } else if (arg.starts_with("--jit-threshold=")) {
+                jit::options.threshold = numberArg(arg, 16);
+            } else if (arg == "--dump-types") {
+                dumpTypes = true;
+            } else if (arg == "--infer") {
+                inferFlag = true;
+            } else if (arg == "--no-infer") {
+                inferFlag = false;
+            } else if (arg == "--vm" || arg == "--vm=stack") {
+                vm::options.enabled = true;
+            } else if (arg == "--vm=register") {
+                vm::options.enabled = true;
+                vm::options.backend = vm::Backend::Register;
+            } else if (arg == "--vm-stats") {
+                vm::options.stats = true;
+            } else if (arg == "--vm-histogram") {
+                vm::options.enabled = true;
+                vm::options.histogram = true;
+            } else if (arg == "--vm-no-super") {
+                vm::options.superinstructions = false;
+            } else if (arg.starts_with("--threads=")) {
+                pool::options.threads = numberArg(arg, 10, 1);
+            } else if (arg == "--stackless") {
+                machine::options.enabled = true;
+            } else if (arg.starts_with("--max-depth=")) {
+                machine::options.enabled = true;
+                machine::options.maxDepth = numberArg(arg, 12, 1);
+            } else if (arg == "--profile") {
+                prof::options.enabled = true;
+            } else if (arg.starts_with("--profile=")) {
+                prof::options.enabled = true;
+                prof::options.path = arg.substr(10);
+            } else if (arg.starts_with("--profile-interval=")) {
+                prof::options.interval = int(numberArg(arg, 19, 1));
+            } else if (arg == "--alloc-profile") {
+                alloc::options.enabled = true;
+            } else if (arg.starts_with("--alloc-profile=")) {
+                alloc::options.enabled = true;
+                alloc::options.path = arg.substr(16);
+            } else if (arg.starts_with("--alloc-sample=")) {
+                alloc::options.enabled = true;
+                alloc::options.sample = numberArg(arg, 15, 1);
+            } else if (arg == "--stats") {
+                stats::options.summary = true;
+            } else if (arg.starts_with("--metrics=")) {
+                stats::options.path = arg.substr(10);
+            } else if (arg.starts_with("--metrics-interval=")) {
+                stats::options.interval = int(numberArg(arg, 19, 1));
+            } else if (arg.starts_with("--heapdump=")) {
+                heap::options.path = arg.substr(11);
+            } else if (arg.starts_with("--heap-report=")) {
+                out.write(heap::analyse(string(arg.substr(14))));
+                out.flush();
+                return 0;
+            } else if (arg.starts_with("--trace=")) {
+                trace::options.enabled = true;
+                trace::options.path = arg.substr(8);
+            } else if (arg.starts_with("--trace-buffer=")) {
+                trace::options.capacity = numberArg(arg, 15, 1);
+            } else if (arg.starts_with("--inline-budget=")) {
+                opt::options.inlineBudget = numberArg(arg, 16);
+            } else if (arg == "--inline-report") {
+                opt::options.inlineReport = true;
+            } else if (arg.starts_with("-O")) {
+                // 高于 2 的级别按 -O2 处理
+                opt::options.level = std::min(int(numberArg(arg, 2)), 2);
+            } else if (arg.starts_with("-")) {
+                throw UsageError{format("unknown option {}", arg)};
+            } else {
+                path = arg;
+            }
+        }
+    } catch (const UsageError &e) {
+        cerr << format("{}\nusage: {} [options] [script]\n", e.message,
+                       argv[0]);
+        return 2;
+    }
+    if (trace::options.enabled) {
+        trace::start();
     }
-    if (argc == 2) {
-        ifstream file(argv[1]);
+    if (!heap::options.path.empty()) {
+        heap::listen();
+    }
+    if (!stats::options.path.empty()) {
+        stats::startExporter();
+    }
+    if (path.empty()) {
+        repl::Repl(cin, out);
+    } else {
+        ifstream file(path);
         if (!file.is_open()) {
-            cout << "Could not open file: " << argv[1] << endl;
+            out.writeLine("Could not open file: " + path);
+            out.flush();
             return 1;
         }
         string content((istreambuf_iterator<char>(file)),
                        (istreambuf_iterator<char>()));
         auto *L = new lexer::Lexer(content);
 
+        // 词法分析由语法分析按需驱动, 每批词法单元是 parse 里的一个 lex
+        trace::begin("parse");
+        stats::begin(stats::Phase::Parse);
         parser::Parser P(L);
-        environment::env_ptr env = std::make_shared<environment::Enviroment>();
         auto Node = P.ParserProgram();
+        stats::end(stats::Phase::Parse);
+        trace::end("parse");
         if (P.errors.empty()) {
+            // 生成的 C++ 里无法表示预先构造好的对象
+            if (emitCpp) {
+                opt::options.level = std::min(opt::options.level, 1);
+            }
+            trace::begin("optimize");
+            opt::optimize(Node.get());
+            trace::end("optimize");
+            auto reads = scope::markGlobals(Node.get());
+            // 只有可能写堆快照时才登记环境
+            environment::tracking = !heap::options.path.empty() ||
+                                    reads.count(symbol::intern("heapdump"));
+        }
+        environment::env_ptr env = std::make_shared<environment::Enviroment>();
+        if (P.errors.empty() && emitCpp) {
             try {
-                auto ptr = eval::Eval(Node.get(), env);
+                auto source = aot::Emitter().emit(Node.get(), path);
+                if (emitPath.empty()) {
+                    out.write(source);
+                } else {
+                    ofstream(emitPath) << source;
+                }
+            } catch (aot::EmitError &e) {
+                out.writeLine("emit-cpp: " + e.message);
+                out.flush();
+                return 1;
+            }
+        } else if (P.errors.empty() && dumpTypes) {
+            out.write(infer::Inference(Node.get()).dump());
+        } else if (P.errors.empty()) {
+            std::unique_ptr<infer::Inference> types;
+            if (inferFlag.value_or(vm::options.enabled)) {
+                trace::begin("infer");
+                types = std::make_unique<infer::Inference>(Node.get());
+                types->install();
+                trace::end("infer");
+            }
+            if (prof::options.enabled) {
+                prof::start();
+            }
+            if (alloc::options.enabled) {
+                alloc::start();
+            }
+            trace::begin("eval");
+            stats::begin(stats::Phase::Eval);
+            try {
+                // --stackless 时用不占 C++ 栈的求值器
+                auto ptr = machine::options.enabled
+                               ? machine::run(Node.get(), env)
+                               : eval::Eval(Node.get(), env);
             } catch (object::ErrorObject &e) {
-                cout << e.Inspect();
+                out.write(e.Inspect());
+            }
+            stats::end(stats::Phase::Eval);
+            trace::end("eval");
+            if (alloc::options.enabled) {
+                out.flush();
+                std::cerr << alloc::finish();
+            }
+            if (prof::options.enabled) {
+                out.flush();
+                std::cerr << prof::finish();
+            }
+            if (vm::options.histogram) {
+                out.flush();
+                std::cerr << vm::histogram();
+            }
+            if (vm::options.stats) {
+                out.flush();
+                if (vm::options.enabled) {
+                    std::cerr << vm::summary();
+                }
+                auto totals = stats::collect();
+                std::cerr << std::format(
+                    "tree: {} nodes evaluated\n",
+                    std::accumulate(std::begin(totals.nodes),
+                                    std::end(totals.nodes), uint64_t(0)));
             }
         } else {
             for (auto v : P.errors) {
-                cout << v << endl;
+                out.writeLine(v);
             }
         }
     }
-}
\ No newline at end of file
+    out.flush();
+    if (!stats::options.path.empty()) {
+        stats::stopExporter();
+    }
+    if (stats::options.summary) {
+        std::cerr << stats::summary();
+    }
+    if (trace::options.enabled) {
+        auto count = trace::finish();
+        std::cerr << std::format("trace: {} events written to {}\n", count,
+                                 trace::options.path);
+    }
+}
@@ -0,0 +1,582 @@
+#pragma once
+
+#include "../ast/ast.cpp"
+#include "../eval/scope.cpp"
+#include <format>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// 内联: 把对顶层小函数的直接调用替换成函数体
+// 被调用的函数必须由顶层的 let / fn 语句唯一绑定, 不递归, 没有循环, 不定义
+// 内层函数, 函数体里只有最后一条语句可以是 return
+// 参数和局部变量改成每个调用处唯一的名字 (源码里写不出来), 用 let 绑定在
+// 调用者的环境里; 函数体放进 if (true) { ... } 中, 块的值就是调用的值
+// 实参是字面量或者调用者的局部变量时直接代入, 只有一条 return 时不需要 if 包装
+namespace opt {
+
+using ast::Expression;
+using scope::nodeAs;
+using scope::SymbolLess;
+using scope::SymbolSet;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using symbol::Symbol;
+
+// 复制函数体, 把 renames 中的名字换掉
+class Copier {
+    public:
+    std::map<Symbol, string, SymbolLess> renames;
+    // 直接代入的实参
+    std::map<Symbol, Expression *, SymbolLess> substitutes;
+
+    unique_ptr<ast::Identifier> ident(ast::Identifier *id) {
+        auto iter = renames.find(id->sym);
+        if (iter == renames.end()) {
+            return std::make_unique<ast::Identifier>(id->token);
+        }
+        auto tok = id->token;
+        tok.Sym = symbol::intern(iter->second);
+        tok.Literal = tok.Sym->str;
+        return std::make_unique<ast::Identifier>(tok);
+    }
+
+    unique_ptr<Expression> expr(Expression *expr) {
+        if (expr == nullptr) {
+            return nullptr;
+        }
+        if (auto id = nodeAs<ast::Identifier>(expr)) {
+            auto iter = substitutes.find(id->sym);
+            if (iter != substitutes.end()) {
+                // 实参属于调用者, 原样复制
+                return Copier().expr(iter->second);
+            }
+            return ident(id);
+        }
+        if (auto lit = nodeAs<ast::IntegerLiteral>(expr)) {
+            return std::make_unique<ast::IntegerLiteral>(*lit);
+        }
+        if (auto lit = nodeAs<ast::DoubleLiteral>(expr)) {
+            return std::make_unique<ast::DoubleLiteral>(*lit);
+        }
+        if (auto lit = nodeAs<ast::BooleanLiteral>(expr)) {
+            return std::make_unique<ast::BooleanLiteral>(*lit);
+        }
+        if (auto lit = nodeAs<ast::StringLiteral>(expr)) {
+            return std::make_unique<ast::StringLiteral>(*lit);
+        }
+        if (auto lit = nodeAs<ast::ConstantLiteral>(expr)) {
+            return std::make_unique<ast::ConstantLiteral>(*lit);
+        }
+        if (auto prefix = nodeAs<ast::PrefixExpression>(expr)) {
+            auto res = std::make_unique<ast::PrefixExpression>();
+            res->token = prefix->token;
+            res->oper = prefix->oper;
+            res->Right = this->expr(prefix->right());
+            return res;
+        }
+        if (auto infix = nodeAs<ast::InfixExpression>(expr)) {
+            auto res = std::make_unique<ast::InfixExpression>();
+            res->token = infix->token;
+            res->oper = infix->oper;
+            res->Left = this->expr(infix->left());
+            res->Right = this->expr(infix->right());
+            return res;
+        }
+        if (auto ifexpr = nodeAs<ast::IfExpression>(expr)) {
+            return ifChain(ifexpr);
+        }
+        if (auto arr = nodeAs<ast::ArrayLiteral>(expr)) {
+            auto res = std::make_unique<ast::ArrayLiteral>();
+            res->token = arr->token;
+            for (auto &elem : arr->elements()) {
+                res->Elements.push_back(this->expr(elem.get()));
+            }
+            return res;
+        }
+        if (auto idx = nodeAs<ast::IndexExpression>(expr)) {
+            auto res = std::make_unique<ast::IndexExpression>();
+            res->token = idx->token;
+            res->Left = this->expr(idx->left());
+            res->Index = this->expr(idx->index());
+            return res;
+        }
+        if (auto call = nodeAs<ast::CallExpression>(expr)) {
+            auto res = std::make_unique<ast::CallExpression>();
+            res->token = call->token;
+            res->Function = this->expr(call->function());
+            for (auto &arg : call->arguments()) {
+                res->Arguments.push_back(this->expr(arg.get()));
+            }
+            return res;
+        }
+        if (auto hash = nodeAs<ast::HashLiteral>(expr)) {
+            auto res = std::make_unique<ast::HashLiteral>();
+            res->token = hash->token;
+            for (auto &pair : hash->pairs) {
+                res->pairs.emplace_back(this->expr(pair.first.get()),
+                                        this->expr(pair.second.get()));
+            }
+            return res;
+        }
+        // 内联前已经排除了函数字面量
+        return nullptr;
+    }
+
+    unique_ptr<ast::IfExpression> ifChain(ast::IfExpression *ifexpr) {
+        auto res = std::make_unique<ast::IfExpression>();
+        res->token = ifexpr->token;
+        res->Condition = expr(ifexpr->condition());
+        res->Consequence = block(ifexpr->consequence());
+        if (ifexpr->alternative() != nullptr) {
+            res->Alternative = ifChain(ifexpr->alternative());
+        }
+        return res;
+    }
+
+    unique_ptr<ast::BlockStatement> block(ast::BlockStatement *block) {
+        auto res = std::make_unique<ast::BlockStatement>();
+        res->token = block->token;
+        for (auto &stmt : block->statements()) {
+            res->Statements.push_back(this->stmt(stmt.get()));
+        }
+        return res;
+    }
+
+    unique_ptr<ast::Statement> stmt(ast::Statement *stmt) {
+        if (auto let = nodeAs<ast::LetStatement>(stmt)) {
+            auto res = std::make_unique<ast::LetStatement>();
+            res->token = let->token;
+            res->Name = ident(let->name());
+            res->Value = expr(let->value());
+            return res;
+        }
+        if (auto ret = nodeAs<ast::ReturnStatement>(stmt)) {
+            auto res = std::make_unique<ast::ReturnStatement>();
+            res->token = ret->token;
+            res->ReturnValue = expr(ret->returnValue());
+            return res;
+        }
+        if (auto exprStmt = nodeAs<ast::ExpressionStatement>(stmt)) {
+            auto res = std::make_unique<ast::ExpressionStatement>();
+            res->token = exprStmt->token;
+            res->_expression = expr(exprStmt->expression());
+            return res;
+        }
+        if (auto node = nodeAs<ast::BlockStatement>(stmt)) {
+            return block(node);
+        }
+        // 内联前已经排除了循环
+        return nullptr;
+    }
+};
+
+// 统计函数体的大小, 同时检查能否内联
+class Shape {
+    public:
+    size_t size = 0;
+    string problem;
+    SymbolSet declared; // let 定义的名字
+    SymbolSet reads;
+
+    void expr(Expression *expr) {
+        if (expr == nullptr) {
+            return;
+        }
+        size++;
+        if (auto id = nodeAs<ast::Identifier>(expr)) {
+            reads.insert(id->sym);
+        } else if (auto prefix = nodeAs<ast::PrefixExpression>(expr)) {
+            this->expr(prefix->right());
+        } else if (auto infix = nodeAs<ast::InfixExpression>(expr)) {
+            this->expr(infix->left());
+            this->expr(infix->right());
+        } else if (auto ifexpr = nodeAs<ast::IfExpression>(expr)) {
+            for (; ifexpr != nullptr; ifexpr = ifexpr->alternative()) {
+                this->expr(ifexpr->condition());
+                block(ifexpr->consequence()->statements());
+            }
+        } else if (nodeAs<ast::FunctionLiteral>(expr)) {
+            problem = "defines a function";
+        } else if (auto arr = nodeAs<ast::ArrayLiteral>(expr)) {
+            for (auto &elem : arr->elements()) {
+                this->expr(elem.get());
+            }
+        } else if (auto idx = nodeAs<ast::IndexExpression>(expr)) {
+            this->expr(idx->left());
+            this->expr(idx->index());
+        } else if (auto call = nodeAs<ast::CallExpression>(expr)) {
+            this->expr(call->function());
+            for (auto &arg : call->arguments()) {
+                this->expr(arg.get());
+            }
+        } else if (auto hash = nodeAs<ast::HashLiteral>(expr)) {
+            for (auto &pair : hash->pairs) {
+                this->expr(pair.first.get());
+                this->expr(pair.second.get());
+            }
+        }
+    }
+    void block(scope::Statements &stmts) {
+        for (auto &stmt : stmts) {
+            this->stmt(stmt.get());
+        }
+    }
+    void stmt(ast::Statement *stmt) {
+        size++;
+        if (auto let = nodeAs<ast::LetStatement>(stmt)) {
+            declared.insert(let->name()->sym);
+            expr(let->value());
+        } else if (auto ret = nodeAs<ast::ReturnStatement>(stmt)) {
+            problem = "returns before the end";
+            expr(ret->returnValue());
+        } else if (auto exprStmt = nodeAs<ast::ExpressionStatement>(stmt)) {
+            expr(exprStmt->expression());
+        } else if (auto node = nodeAs<ast::BlockStatement>(stmt)) {
+            block(node->statements());
+        } else if (nodeAs<ast::WhileStatement>(stmt) ||
+                   nodeAs<ast::ForStatement>(stmt)) {
+            // 循环本身的开销远大于一次调用, 展开后还可能失去不装箱执行
+            problem = "contains a loop";
+        } else {
+            problem = "defines a function";
+        }
+    }
+
+    // 最后一条 return 单独处理, 其余位置出现 return 都不能内联
+    ast::ReturnStatement *measure(scope::Statements &stmts) {
+        ast::ReturnStatement *ret = nullptr;
+        for (size_t i = 0; i < stmts.size(); i++) {
+            auto node = nodeAs<ast::ReturnStatement>(stmts[i].get());
+            if (node != nullptr && i + 1 == stmts.size()) {
+                ret = node;
+                size++;
+                expr(node->returnValue());
+            } else {
+                stmt(stmts[i].get());
+            }
+        }
+        return ret;
+    }
+};
+
+class Inliner {
+    private:
+    struct Callee {
+        scope::Function *fn = nullptr;
+        string name;
+        size_t index = 0; // 绑定它的顶层语句
+        string skip;      // 不能内联的原因
+        size_t size = 0;
+        std::map<string, size_t> sites; // 调用者 -> 内联次数
+    };
+
+    scope::Analysis scopes;
+    ast::Program *prog;
+    size_t budget; // 函数体最多包含的语法树节点数
+    std::map<Symbol, Callee, SymbolLess> callees;
+    scope::Function *current = nullptr;
+    size_t stmtIndex = 0;
+    int counter = 0;
+
+    // 在已知函数之间沿调用关系能回到自己
+    bool recursive(scope::Function *fn) {
+        SymbolSet seen;
+        vector<scope::Function *> work{fn};
+        while (!work.empty()) {
+            auto cur = work.back();
+            work.pop_back();
+            for (auto sym : cur->free) {
+                auto iter = scopes.known.find(sym);
+                if (iter == scopes.known.end() || !seen.insert(sym).second) {
+                    continue;
+                }
+                if (iter->second == fn) {
+                    return true;
+                }
+                work.push_back(iter->second);
+            }
+        }
+        return false;
+    }
+
+    string callerName() const {
+        if (current->isProgram()) {
+            return "<top level>";
+        }
+        if (current->name != nullptr) {
+            return current->name->str;
+        }
+        return std::format("<fn#{}>", current->id);
+    }
+
+    // 调用处到顶层之间没有重新定义这些名字
+    bool visible(const SymbolSet &names) const {
+        for (auto fn = current; fn != nullptr && !fn->isProgram();
+             fn = fn->parent) {
+            for (auto sym : names) {
+                if (fn->declared.count(sym)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // 调用者自己的参数或局部变量, 并且读取时一定已经赋值
+    bool assigned(ast::Identifier *id) const {
+        return current->declared.count(id->sym) &&
+               !current->unsafe.count(id->sym);
+    }
+    static bool isLiteral(Expression *expr) {
+        return nodeAs<ast::IntegerLiteral>(expr) ||
+               nodeAs<ast::DoubleLiteral>(expr) ||
+               nodeAs<ast::BooleanLiteral>(expr) ||
+               nodeAs<ast::StringLiteral>(expr);
+    }
+
+    unique_ptr<Expression> tryInline(ast::CallExpression *call) {
+        auto id = nodeAs<ast::Identifier>(call->function());
+        if (id == nullptr) {
+            return nullptr;
+        }
+        auto iter = callees.find(id->sym);
+        if (iter == callees.end() ||
+            scopes.knownCallee(current, id->sym) != iter->second.fn) {
+            return nullptr;
+        }
+        auto &callee = iter->second;
+        auto fn = callee.fn;
+        // 调用发生在绑定之前时解释器会报错, 保持原样
+        if (!callee.skip.empty() || stmtIndex <= callee.index ||
+            fn->params->size() != call->arguments().size()) {
+            return nullptr;
+        }
+        Shape shape;
+        auto ret = shape.measure(*fn->body);
+        if (!shape.problem.empty()) {
+            callee.skip = shape.problem;
+            return nullptr;
+        }
+        callee.size = shape.size;
+        if (shape.size > budget) {
+            callee.skip = std::format("{} nodes is over the budget of {}",
+                                      shape.size, budget);
+            return nullptr;
+        }
+        SymbolSet free;
+        for (auto sym : shape.reads) {
+            if (!shape.declared.count(sym) && !fn->isParam(sym)) {
+                free.insert(sym);
+            }
+        }
+        if (!visible(free)) {
+            return nullptr;
+        }
+
+        auto id_ = ++counter;
+        Copier copy;
+        auto fresh = [&](Symbol sym) {
+            return std::format("{}:{}#{}", callee.name, sym->str, id_);
+        };
+        for (auto sym : shape.declared) {
+            copy.renames[sym] = fresh(sym);
+        }
+        auto block = std::make_unique<ast::BlockStatement>();
+        block->token = call->token;
+        for (size_t i = 0; i < fn->params->size(); i++) {
+            auto &param = (*fn->params)[i];
+            auto &arg = call->arguments()[i];
+            bool local = shape.declared.count(param->sym);
+            // 字面量和已经赋值的局部变量可以直接代入, 函数体不会修改调用者的变量
+            auto var = nodeAs<ast::Identifier>(arg.get());
+            if (!local && (isLiteral(arg.get()) ||
+                           (var != nullptr && assigned(var)))) {
+                copy.substitutes[param->sym] = arg.get();
+                continue;
+            }
+            copy.renames[param->sym] = fresh(param->sym);
+            auto let = std::make_unique<ast::LetStatement>();
+            let->token = call->token;
+            let->Name = copy.ident(param.get());
+            let->Value = std::move(arg);
+            block->Statements.push_back(std::move(let));
+        }
+        for (auto &stmt : *fn->body) {
+            if (stmt.get() != ret) {
+                block->Statements.push_back(copy.stmt(stmt.get()));
+            }
+        }
+        callee.sites[callerName()]++;
+        if (ret != nullptr && block->Statements.empty()) {
+            return copy.expr(ret->returnValue());
+        }
+        // 没有 return 的函数返回 null, 用没有 else 的 if (false) {} 表示
+        auto value = std::make_unique<ast::ExpressionStatement>();
+        value->token = call->token;
+        if (ret != nullptr) {
+            value->_expression = copy.expr(ret->returnValue());
+        } else {
+            auto null = std::make_unique<ast::IfExpression>();
+            null->token = call->token;
+            null->Condition = std::make_shared<ast::BooleanLiteral>(
+                token::newToken(token::FALSE, "false"), false);
+            null->Consequence = std::make_unique<ast::BlockStatement>();
+            value->_expression = std::move(null);
+        }
+        block->Statements.push_back(std::move(value));
+        auto res = std::make_unique<ast::IfExpression>();
+        res->token = call->token;
+        res->Condition = std::make_shared<ast::BooleanLiteral>(
+            token::newToken(token::TRUE, "true"), true);
+        res->Consequence = std::move(block);
+        return res;
+    }
+
+    template <typename Ptr>
+    void visit(Ptr &slot) {
+        if (slot == nullptr) {
+            return;
+        }
+        if (auto res = expr(slot.get())) {
+            slot = std::move(res);
+        }
+    }
+
+    unique_ptr<Expression> expr(Expression *expr) {
+        if (auto prefix = nodeAs<ast::PrefixExpression>(expr)) {
+            visit(prefix->Right);
+        } else if (auto infix = nodeAs<ast::InfixExpression>(expr)) {
+            visit(infix->Left);
+            visit(infix->Right);
+        } else if (auto ifexpr = nodeAs<ast::IfExpression>(expr)) {
+            for (; ifexpr != nullptr; ifexpr = ifexpr->alternative()) {
+                visit(ifexpr->Condition);
+                block(ifexpr->consequence()->statements());
+            }
+        } else if (auto lit = nodeAs<ast::FunctionLiteral>(expr)) {
+            function(lit->body().get());
+        } else if (auto arr = nodeAs<ast::ArrayLiteral>(expr)) {
+            for (auto &elem : arr->elements()) {
+                visit(elem);
+            }
+        } else if (auto idx = nodeAs<ast::IndexExpression>(expr)) {
+            visit(idx->Left);
+            visit(idx->Index);
+        } else if (auto call = nodeAs<ast::CallExpression>(expr)) {
+            visit(call->Function);
+            for (auto &arg : call->arguments()) {
+                visit(arg);
+            }
+            return tryInline(call);
+        } else if (auto hash = nodeAs<ast::HashLiteral>(expr)) {
+            for (auto &pair : hash->pairs) {
+                visit(pair.first);
+                visit(pair.second);
+            }
+        }
+        return nullptr;
+    }
+
+    void function(ast::BlockStatement *body) {
+        auto outer = current;
+        current = scopes.functionOf(body);
+        block(body->statements());
+        current = outer;
+    }
+
+    void block(scope::Statements &stmts) {
+        for (auto &stmt : stmts) {
+            this->stmt(stmt.get());
+        }
+    }
+    void stmt(ast::Statement *stmt) {
+        if (auto let = nodeAs<ast::LetStatement>(stmt)) {
+            visit(let->Value);
+        } else if (auto ret = nodeAs<ast::ReturnStatement>(stmt)) {
+            visit(ret->ReturnValue);
+        } else if (auto fnstmt = nodeAs<ast::FunctionStatement>(stmt)) {
+            function(fnstmt->body().get());
+        } else if (auto exprStmt = nodeAs<ast::ExpressionStatement>(stmt)) {
+            visit(exprStmt->_expression);
+        } else if (auto node = nodeAs<ast::BlockStatement>(stmt)) {
+            block(node->statements());
+        } else if (auto whilestmt = nodeAs<ast::WhileStatement>(stmt)) {
+            visit(whilestmt->Condition);
+            block(whilestmt->body()->statements());
+        } else if (auto forstmt = nodeAs<ast::ForStatement>(stmt)) {
+            visit(forstmt->Range);
+            block(forstmt->body()->statements());
+        }
+    }
+
+    public:
+    Inliner(ast::Program *prog, size_t budget)
+        : scopes(prog), prog(prog), budget(budget) {
+        // 只考虑直接写在顶层的 let f = fn ... 和 fn f
+        for (size_t i = 0; i < prog->Statements.size(); i++) {
+            auto stmt = prog->Statements[i].get();
+            ast::Identifier *name = nullptr;
+            if (auto let = nodeAs<ast::LetStatement>(stmt)) {
+                if (nodeAs<ast::FunctionLiteral>(let->value())) {
+                    name = let->name();
+                }
+            } else if (auto fnstmt = nodeAs<ast::FunctionStatement>(stmt)) {
+                name = fnstmt->name();
+            }
+            auto iter = name != nullptr ? scopes.known.find(name->sym)
+                                        : scopes.known.end();
+            if (iter == scopes.known.end()) {
+                continue;
+            }
+            auto &callee = callees[name->sym];
+            callee.fn = iter->second;
+            callee.name = name->value;
+            callee.index = i;
+            if (!callee.fn->children.empty()) {
+                callee.skip = "defines a function";
+            } else if (!callee.fn->unsafe.empty()) {
+                callee.skip = "reads a local before assigning it";
+            } else if (recursive(callee.fn)) {
+                callee.skip = "recursive";
+            }
+        }
+    }
+
+    void run() {
+        // 改写之前记下函数的源码, 打印函数时不受内联影响
+        for (auto &fn : scopes.all()) {
+            if (fn->block->Source.empty()) {
+                fn->block->Source = fn->block->output();
+            }
+        }
+        current = &scopes.program;
+        for (stmtIndex = 0; stmtIndex < prog->Statements.size(); stmtIndex++) {
+            stmt(prog->Statements[stmtIndex].get());
+        }
+    }
+
+    // --inline-report 的输出
+    string report() const {
+        string res;
+        for (auto &[sym, callee] : callees) {
+            if (!callee.sites.empty()) {
+                string sites;
+                for (auto &[caller, count] : callee.sites) {
+                    sites += std::format("{}{} x{}", sites.empty() ? "" : ", ",
+                                         caller, count);
+                }
+                res += std::format("inline: {} ({} nodes) into {}\n",
+                                   callee.name, callee.size, sites);
+            } else if (!callee.skip.empty()) {
+                res += std::format("inline: {} skipped, {}\n", callee.name,
+                                   callee.skip);
+            }
+        }
+        return res;
+    }
+};
+
+} // namespace opt
@@ -0,0 +1,353 @@
+#pragma once
+
+#include "../ast/ast.cpp"
+#include "../eval/eval.cpp"
+#include "../eval/scope.cpp"
+#include "inline.cpp"
+#include <climits>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+// 解析之后, 求值之前对语法树做的优化
+// -O1: 折叠常量的算术, 比较, 逻辑运算和字符串拼接, 删除条件为常量的 if 分支和
+//      while 循环, 删除 return 之后不可达的语句
+// -O2: 另外把元素都是常量的数组和哈希字面量预先构造成对象, 求值时直接返回,
+//      并在折叠之前内联顶层的小函数 (见 inline.cpp)
+// 常量通过 eval::Eval 求值得到, 保证结果和解释器完全一致; 求值会出错,
+// 或者会让解释器崩溃的整数除零不折叠, 仍然留到运行时
+namespace opt {
+
+using ast::Expression;
+using scope::nodeAs;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+typedef scope::Statements Statements;
+
+// 默认 -O0, 不做任何改写; -O1 / -O2 打开优化
+struct Options {
+    int level = 0;
+    size_t inlineBudget = 40; // 0 关闭内联
+    bool inlineReport = false;
+};
+
+static Options options;
+
+class Optimizer {
+    private:
+    int level;
+    environment::env_ptr empty = std::make_shared<environment::Enviroment>();
+
+    static bool isLiteral(Expression *expr) {
+        return nodeAs<ast::IntegerLiteral>(expr) ||
+               nodeAs<ast::DoubleLiteral>(expr) ||
+               nodeAs<ast::BooleanLiteral>(expr) ||
+               nodeAs<ast::StringLiteral>(expr);
+    }
+    static bool isConstant(Expression *expr) {
+        return isLiteral(expr) || nodeAs<ast::ConstantLiteral>(expr);
+    }
+
+    // 作为条件时的真假, 与 evalCondition 一致
+    static std::optional<bool> truth(Expression *expr) {
+        if (auto lit = nodeAs<ast::BooleanLiteral>(expr)) {
+            return lit->value;
+        }
+        if (auto lit = nodeAs<ast::IntegerLiteral>(expr)) {
+            return lit->value != 0;
+        }
+        if (auto lit = nodeAs<ast::DoubleLiteral>(expr)) {
+            return static_cast<bool>(lit->value);
+        }
+        if (nodeAs<ast::StringLiteral>(expr) ||
+            nodeAs<ast::ConstantLiteral>(expr)) {
+            return false;
+        }
+        return std::nullopt;
+    }
+    // and / or 的操作数只接受数字和布尔
+    static std::optional<bool> logicOperand(Expression *expr) {
+        if (nodeAs<ast::StringLiteral>(expr) ||
+            nodeAs<ast::ConstantLiteral>(expr)) {
+            return std::nullopt;
+        }
+        return truth(expr);
+    }
+
+    static unique_ptr<Expression> boolean(bool val) {
+        token::Token tok;
+        tok.Type = val ? token::TRUE : token::FALSE;
+        tok.Literal = val ? "true" : "false";
+        return std::make_unique<ast::BooleanLiteral>(tok, val);
+    }
+
+    // 用解释器求出常量表达式的值, 只接受能写回字面量的结果
+    unique_ptr<Expression> evaluate(Expression *expr) {
+        object::obj_ptr val;
+        try {
+            val = eval::Eval(expr, empty);
+        } catch (object::ErrorObject &) {
+            return nullptr;
+        }
+        switch (object::type(val)) {
+        case object::Int_Obj: {
+            auto res = std::make_unique<ast::IntegerLiteral>();
+            res->value = object::getValue<object::Integer>(val);
+            res->token.Type = token::INT;
+            return res;
+        }
+        case object::Float_Obj: {
+            auto res = std::make_unique<ast::DoubleLiteral>();
+            res->value = object::getValue<object::Double>(val);
+            res->token.Type = token::DOUBLE;
+            return res;
+        }
+        case object::Bool_Obj:
+            return boolean(object::getValue<object::Boolean>(val));
+        case object::Str_Obj: {
+            auto res = std::make_unique<ast::StringLiteral>();
+            res->value = dynamic_cast<object::String *>(val.get())->str();
+            res->sym = symbol::intern(res->value);
+            res->token.Type = token::STRING;
+            res->token.Literal = res->sym->str;
+            return res;
+        }
+        default:
+            return nullptr;
+        }
+    }
+
+    // 整数除零和 INT_MIN / -1 会让解释器崩溃, 保持原样
+    static bool safeDivision(ast::InfixExpression *infix) {
+        if (infix->TokenType() != token::SLASH) {
+            return true;
+        }
+        auto left = nodeAs<ast::IntegerLiteral>(infix->left());
+        auto right = nodeAs<ast::IntegerLiteral>(infix->right());
+        if (left == nullptr || right == nullptr) {
+            return true;
+        }
+        return right->value != 0 && !(left->value == INT_MIN && right->value == -1);
+    }
+
+    unique_ptr<Expression> prebuild(Expression *expr) {
+        auto source = expr->output();
+        object::obj_ptr val;
+        try {
+            val = eval::Eval(expr, empty);
+        } catch (object::ErrorObject &) {
+            return nullptr;
+        }
+        auto res = std::make_unique<ast::ConstantLiteral>();
+        res->value = val;
+        res->source = source;
+        return res;
+    }
+
+    template <typename Ptr>
+    void visit(Ptr &slot) {
+        if (slot == nullptr) {
+            return;
+        }
+        if (auto res = fold(slot.get())) {
+            slot = std::move(res);
+        }
+    }
+
+    // 先处理子表达式, 自身能折叠时返回替换用的新节点
+    unique_ptr<Expression> fold(Expression *expr) {
+        if (auto prefix = nodeAs<ast::PrefixExpression>(expr)) {
+            visit(prefix->Right);
+            if (isLiteral(prefix->right())) {
+                return evaluate(prefix);
+            }
+        } else if (auto infix = nodeAs<ast::InfixExpression>(expr)) {
+            visit(infix->Left);
+            visit(infix->Right);
+            return foldInfix(infix);
+        } else if (auto ifexpr = nodeAs<ast::IfExpression>(expr)) {
+            foldChain(ifexpr, true);
+            if (!allFalse(ifexpr)) {
+                prune(ifexpr);
+            }
+        } else if (auto lit = nodeAs<ast::FunctionLiteral>(expr)) {
+            function(lit->body().get());
+        } else if (auto arr = nodeAs<ast::ArrayLiteral>(expr)) {
+            bool constant = true;
+            for (auto &elem : arr->elements()) {
+                visit(elem);
+                constant &= isConstant(elem.get());
+            }
+            if (level >= 2 && constant) {
+                return prebuild(arr);
+            }
+        } else if (auto hash = nodeAs<ast::HashLiteral>(expr)) {
+            bool constant = true;
+            for (auto &pair : hash->pairs) {
+                visit(pair.first);
+                visit(pair.second);
+                constant &= isConstant(pair.first.get()) &&
+                            isConstant(pair.second.get());
+            }
+            if (level >= 2 && constant) {
+                return prebuild(hash);
+            }
+        } else if (auto idx = nodeAs<ast::IndexExpression>(expr)) {
+            visit(idx->Left);
+            visit(idx->Index);
+        } else if (auto call = nodeAs<ast::CallExpression>(expr)) {
+            visit(call->Function);
+            for (auto &arg : call->arguments()) {
+                visit(arg);
+            }
+        }
+        return nullptr;
+    }
+
+    unique_ptr<Expression> foldInfix(ast::InfixExpression *infix) {
+        auto typ = infix->TokenType();
+        if (typ == token::AND || typ == token::OR) {
+            // 左边已经决定结果时右边不会被求值
+            auto left = logicOperand(infix->left());
+            if (!left.has_value()) {
+                return nullptr;
+            }
+            if (*left == (typ == token::OR)) {
+                return boolean(*left);
+            }
+            auto right = logicOperand(infix->right());
+            return right.has_value() ? boolean(*right) : nullptr;
+        }
+        if (isLiteral(infix->left()) && isLiteral(infix->right()) &&
+            safeDivision(infix)) {
+            return evaluate(infix);
+        }
+        return nullptr;
+    }
+
+    void foldChain(ast::IfExpression *ifexpr, bool valueUsed) {
+        for (; ifexpr != nullptr; ifexpr = ifexpr->alternative()) {
+            visit(ifexpr->Condition);
+            block(ifexpr->consequence()->statements(), valueUsed);
+        }
+    }
+    static bool allFalse(ast::IfExpression *ifexpr) {
+        for (; ifexpr != nullptr; ifexpr = ifexpr->alternative()) {
+            if (truth(ifexpr->condition()) != false) {
+                return false;
+            }
+        }
+        return true;
+    }
+    // 去掉条件恒为假的分支, 条件恒为真的分支之后的分支也不会执行
+    // 链表头可能被别的节点共享所有权, 所以把后面的分支搬进头节点而不是替换它
+    void prune(ast::IfExpression *node) {
+        while (truth(node->condition()) == false) {
+            auto next = std::move(node->Alternative);
+            node->token = next->token;
+            node->Condition = next->Condition;
+            node->Consequence = std::move(next->Consequence);
+            node->Alternative = std::move(next->Alternative);
+        }
+        if (truth(node->condition()) == true || node->alternative() == nullptr) {
+            node->Alternative.reset();
+        } else if (allFalse(node->alternative())) {
+            node->Alternative.reset();
+        } else {
+            prune(node->alternative());
+        }
+    }
+
+    void function(ast::BlockStatement *body) {
+        if (body->Source.empty()) {
+            body->Source = body->output();
+        }
+        block(body->statements(), false);
+    }
+
+    // valueUsed 表示语句块最后一条语句的值会被用到 (作为值使用的 if 的分支)
+    void block(Statements &stmts, bool valueUsed) {
+        Statements res;
+        for (size_t i = 0; i < stmts.size(); i++) {
+            bool observed = valueUsed && i + 1 == stmts.size();
+            auto stmt = std::move(stmts[i]);
+            if (!statement(stmt, observed, res)) {
+                res.push_back(std::move(stmt));
+            }
+            if (scope::endsWithReturn(res)) {
+                break;
+            }
+        }
+        stmts = std::move(res);
+    }
+
+    // 语句被删除或者展开到 res 中时返回 true
+    bool statement(unique_ptr<ast::Statement> &stmt, bool observed,
+                   Statements &res) {
+        if (auto let = nodeAs<ast::LetStatement>(stmt.get())) {
+            visit(let->Value);
+        } else if (auto ret = nodeAs<ast::ReturnStatement>(stmt.get())) {
+            visit(ret->ReturnValue);
+        } else if (auto fnstmt = nodeAs<ast::FunctionStatement>(stmt.get())) {
+            function(fnstmt->body().get());
+        } else if (auto exprStmt =
+                       nodeAs<ast::ExpressionStatement>(stmt.get())) {
+            auto ifexpr = nodeAs<ast::IfExpression>(exprStmt->expression());
+            if (ifexpr == nullptr) {
+                visit(exprStmt->_expression);
+                return false;
+            }
+            foldChain(ifexpr, observed);
+            if (allFalse(ifexpr)) {
+                // 值会被用到时保留, 结果是 null
+                return !observed;
+            }
+            prune(ifexpr);
+            if (!observed && truth(ifexpr->condition()) == true) {
+                // 块不产生新的作用域, 直接展开到外层
+                for (auto &inner : ifexpr->consequence()->statements()) {
+                    res.push_back(std::move(inner));
+                }
+                return true;
+            }
+        } else if (auto block = nodeAs<ast::BlockStatement>(stmt.get())) {
+            this->block(block->statements(), observed);
+        } else if (auto whilestmt = nodeAs<ast::WhileStatement>(stmt.get())) {
+            visit(whilestmt->Condition);
+            if (truth(whilestmt->condition()) == false && !observed) {
+                return true;
+            }
+            this->block(whilestmt->body()->statements(), false);
+        } else if (auto forstmt = nodeAs<ast::ForStatement>(stmt.get())) {
+            visit(forstmt->Range);
+            this->block(forstmt->body()->statements(), false);
+        }
+        return false;
+    }
+
+    public:
+    Optimizer(int level) : level(level) {
+    }
+
+    void optimize(ast::Program *prog) {
+        if (level >= 2 && options.inlineBudget > 0) {
+            Inliner inliner(prog, options.inlineBudget);
+            inliner.run();
+            if (options.inlineReport) {
+                std::cerr << inliner.report();
+            }
+        }
+        if (level > 0) {
+            block(prog->Statements, false);
+        }
+    }
+};
+
+void optimize(ast::Program *prog) {
+    Optimizer(options.level).optimize(prog);
+}
+
+} // namespace opt
@@ -2,9 +2,12 @@
 
 #include "../ast/ast.cpp"
 #include "../lexer/lexer.cpp"
+#include "../prof/stats.cpp"
+#include "../prof/trace.cpp"
 #include <functional>
 #include <map>
 #include <memory>
+#include <vector>
 
 namespace parser {
 
@@ -31,7 +34,7 @@ enum Priority {
     INDEX        // []
 };
 
-static unordered_map<token::TokenType, Priority> precedences = {
+static const unordered_map<token::TokenType, Priority> precedences = {
     {token::EQ, EQUALS},      {token::NOT_EQ, EQUALS},
     {token::LT, LESSGREATER}, {token::GT, LESSGREATER},
     {token::PLUS, SUM},       {token::MINUS, SUM},
@@ -50,6 +53,10 @@ class Parser {
     Lexer *L;
     Token curToken;
     Token peekToken;
+    // 预先取出的一批词法单元. 按批计时, 不必每个词法单元都读两次时钟
+    static constexpr size_t lexBatch = 256;
+    std::vector<Token> lexed;
+    size_t lexedPos = 0;
 
     public:
     vector<string> errors;
@@ -66,16 +73,23 @@ class Parser {
 
     void nextToken() {
         curToken = peekToken;
-        peekToken = L->NextToken();
+        if (lexedPos == lexed.size()) {
+            lexAhead();
+        }
+        peekToken = std::move(lexed[lexedPos++]);
+    }
+    void lexAhead() {
+        trace::Span span("lex", trace::Category::Lex);
+        stats::Timer timer(stats::Phase::Lex);
+        lexed.clear();
+        lexedPos = 0;
+        do {
+            lexed.push_back(L->NextToken());
+        } while (lexed.size() < lexBatch && lexed.back().Type != token::END);
     }
     void registerAll();
 
     public:
-    Parser(Lexer L) : L(&L) {
-        nextToken();
-        nextToken();
-        registerAll();
-    }
     Parser(Lexer *L) : L(L) {
         nextToken();
         nextToken();
@@ -130,16 +144,12 @@ class Parser {
         }
     }
     Priority peekPrecedence() {
-        if (precedences.count(peekToken.Type)) {
-            return precedences[peekToken.Type];
-        }
-        return LOWEST;
+        auto iter = precedences.find(peekToken.Type);
+        return iter == precedences.end() ? LOWEST : iter->second;
     }
     Priority curPrecedence() {
-        if (precedences.count(curToken.Type)) {
-            return precedences[curToken.Type];
-        }
-        return LOWEST;
+        auto iter = precedences.find(curToken.Type);
+        return iter == precedences.end() ? LOWEST : iter->second;
     }
     void peekError(token::TokenType typ) {
         // std::cerr << "???";
@@ -153,9 +163,12 @@ class Parser {
     }
 };
 
-static shared_ptr<BooleanLiteral> _TRUE =
-    std::make_shared<BooleanLiteral>(Token{token::TRUE, "true"}, true);
-static shared_ptr<BooleanLiteral> _FALSE =
-    std::make_shared<BooleanLiteral>(Token{token::FALSE, "false"}, false);
+// 所有语法树共用, 同 object::immortal 一样没有控制块, 不计引用
+static const shared_ptr<BooleanLiteral> _TRUE(
+    shared_ptr<BooleanLiteral>(),
+    new BooleanLiteral(Token{token::TRUE, "true"}, true));
+static const shared_ptr<BooleanLiteral> _FALSE(
+    shared_ptr<BooleanLiteral>(),
+    new BooleanLiteral(Token{token::FALSE, "false"}, false));
 
 } // namespace parser
@@ -12,51 +12,52 @@ using std::unique_ptr;
 
 void Parser::registerAll() {
     // Prefix
-    registerPrefixFunc(token::IDENT, parseIdentifier);
-    registerPrefixFunc(token::INT, parseIntegerLiteral);
-    registerPrefixFunc(token::DOUBLE, parseDoubleLiteral);
-    registerPrefixFunc(token::STRING, parseStringLiteral);
-    registerPrefixFunc(token::MINUS, parsePrefixExpression);
-    registerPrefixFunc(token::BANG, parsePrefixExpression);
-    registerPrefixFunc(token::NOT, parsePrefixExpression);
-    registerPrefixFunc(token::TRUE, parseBooleanLiteral);
-    registerPrefixFunc(token::FALSE, parseBooleanLiteral);
-    registerPrefixFunc(token::LPAREN, parseGroupedExpression);
-    registerPrefixFunc(token::IF, parseIfExpression);
-    registerPrefixFunc(token::LBRACKET, parseArrayLiteral);
-    registerPrefixFunc(token::FUNCTION, parseFunctionLiteral);
-    registerPrefixFunc(token::LBRACE, parseHashLiteral);
+    registerPrefixFunc(token::IDENT, &Parser::parseIdentifier);
+    registerPrefixFunc(token::INT, &Parser::parseIntegerLiteral);
+    registerPrefixFunc(token::DOUBLE, &Parser::parseDoubleLiteral);
+    registerPrefixFunc(token::STRING, &Parser::parseStringLiteral);
+    registerPrefixFunc(token::MINUS, &Parser::parsePrefixExpression);
+    registerPrefixFunc(token::BANG, &Parser::parsePrefixExpression);
+    registerPrefixFunc(token::NOT, &Parser::parsePrefixExpression);
+    registerPrefixFunc(token::TRUE, &Parser::parseBooleanLiteral);
+    registerPrefixFunc(token::FALSE, &Parser::parseBooleanLiteral);
+    registerPrefixFunc(token::LPAREN, &Parser::parseGroupedExpression);
+    registerPrefixFunc(token::IF, &Parser::parseIfExpression);
+    registerPrefixFunc(token::LBRACKET, &Parser::parseArrayLiteral);
+    registerPrefixFunc(token::FUNCTION, &Parser::parseFunctionLiteral);
+    registerPrefixFunc(token::LBRACE, &Parser::parseHashLiteral);
 
     // Infix
-    registerInfixFunc(token::AND, parseInfixExpression);
-    registerInfixFunc(token::OR, parseInfixExpression);
-    registerInfixFunc(token::PLUS, parseInfixExpression);
-    registerInfixFunc(token::MINUS, parseInfixExpression);
-    registerInfixFunc(token::ASTERISK, parseInfixExpression);
-    registerInfixFunc(token::SLASH, parseInfixExpression);
-    registerInfixFunc(token::EQ, parseInfixExpression);
-    registerInfixFunc(token::NOT_EQ, parseInfixExpression);
-    registerInfixFunc(token::LE, parseInfixExpression);
-    registerInfixFunc(token::GE, parseInfixExpression);
-    registerInfixFunc(token::LT, parseInfixExpression);
-    registerInfixFunc(token::GT, parseInfixExpression);
-    registerInfixFunc(token::LPAREN, parseCallExpression);
-    registerInfixFunc(token::ASSIGN, parseInfixExpression);
-    registerInfixFunc(token::IDENT, parseIdentInfixExpression);
-    registerInfixFunc(token::TRUE, parseIdentInfixExpression);
-    registerInfixFunc(token::FALSE, parseIdentInfixExpression);
-    registerInfixFunc(token::LBRACKET, parseIndexExpression);
+    registerInfixFunc(token::AND, &Parser::parseInfixExpression);
+    registerInfixFunc(token::OR, &Parser::parseInfixExpression);
+    registerInfixFunc(token::PLUS, &Parser::parseInfixExpression);
+    registerInfixFunc(token::MINUS, &Parser::parseInfixExpression);
+    registerInfixFunc(token::ASTERISK, &Parser::parseInfixExpression);
+    registerInfixFunc(token::SLASH, &Parser::parseInfixExpression);
+    registerInfixFunc(token::EQ, &Parser::parseInfixExpression);
+    registerInfixFunc(token::NOT_EQ, &Parser::parseInfixExpression);
+    registerInfixFunc(token::LE, &Parser::parseInfixExpression);
+    registerInfixFunc(token::GE, &Parser::parseInfixExpression);
+    registerInfixFunc(token::LT, &Parser::parseInfixExpression);
+    registerInfixFunc(token::GT, &Parser::parseInfixExpression);
+    registerInfixFunc(token::LPAREN, &Parser::parseCallExpression);
+    registerInfixFunc(token::ASSIGN, &Parser::parseInfixExpression);
+    registerInfixFunc(token::IDENT, &Parser::parseIdentInfixExpression);
+    registerInfixFunc(token::TRUE, &Parser::parseIdentInfixExpression);
+    registerInfixFunc(token::FALSE, &Parser::parseIdentInfixExpression);
+    registerInfixFunc(token::LBRACKET, &Parser::parseIndexExpression);
 }
 
 unique_ptr<Expression> Parser::parseIdentifier() {
-    return make_unique<Identifier>(curToken, curToken.Literal);
+    return make_unique<Identifier>(curToken);
 }
 
 unique_ptr<Expression> Parser::parseIntegerLiteral() {
     auto res = make_unique<IntegerLiteral>();
+    res->token = curToken;
     int val = 0;
     try {
-        val = std::stoi(curToken.Literal);
+        val = std::stoi(string(curToken.Literal));
     } catch (std::invalid_argument &e) {
         errors.push_back(
             format("could not parse {} as integer", curToken.Literal));
@@ -64,15 +65,17 @@ unique_ptr<Expression> Parser::parseIntegerLiteral() {
     }
 
     res->value = val;
+    res->token.Literal = {};
 
     return res;
 }
 
 unique_ptr<Expression> Parser::parseDoubleLiteral() {
     auto res = make_unique<DoubleLiteral>();
+    res->token = curToken;
     double val = 0;
     try {
-        val = std::stod(curToken.Literal);
+        val = std::stod(string(curToken.Literal));
     } catch (std::invalid_argument &e) {
         errors.push_back(
             format("could not parse {} as double", curToken.Literal));
@@ -80,6 +83,7 @@ unique_ptr<Expression> Parser::parseDoubleLiteral() {
     }
 
     res->value = val;
+    res->token.Literal = {};
 
     return res;
 }
@@ -88,6 +92,8 @@ unique_ptr<Expression> Parser::parseStringLiteral() {
     auto res = make_unique<StringLiteral>();
     res->token = curToken;
     res->value = curToken.Literal;
+    res->sym = curToken.Sym != nullptr ? curToken.Sym
+                                       : symbol::intern(curToken.Literal);
     return res;
 }
 
@@ -317,13 +323,13 @@ vector<shared_ptr<Identifier>> Parser::parseParameters() {
 
     nextToken();
 
-    paras.push_back(std::make_shared<Identifier>(curToken, curToken.Literal));
+    paras.push_back(std::make_shared<Identifier>(curToken));
 
     while (peekTokenIs(token::COMMA)) {
         nextToken();
         nextToken();
         paras.push_back(
-            std::make_shared<Identifier>(curToken, curToken.Literal));
+            std::make_shared<Identifier>(curToken));
     }
 
     if (!expectToken(token::RPAREN)) {
@@ -386,7 +392,7 @@ unique_ptr<LetStatement> Parser::parseLetStatement() {
         return nullptr;
     }
 
-    statement->Name = make_unique<Identifier>(curToken, curToken.Literal);
+    statement->Name = make_unique<Identifier>(curToken);
 
     if (!expectToken(token::ASSIGN)) {
         return nullptr;
@@ -425,7 +431,7 @@ unique_ptr<ForStatement> Parser::parseForStatement() {
     if (!expectToken(token::IDENT)) {
         return nullptr;
     }
-    statement->Name = std::make_shared<Identifier>(curToken, curToken.Literal);
+    statement->Name = std::make_shared<Identifier>(curToken);
 
     if (!expectToken(token::IN)) {
         return nullptr;
@@ -524,7 +530,7 @@ unique_ptr<FunctionStatement> Parser::parseFunctionStatement() {
     if (!expectToken(token::IDENT)) {
         return nullptr;
     }
-    statement->Name = make_unique<Identifier>(curToken, curToken.Literal);
+    statement->Name = make_unique<Identifier>(curToken);
 
     if (!expectToken(token::LPAREN)) {
         return nullptr;
@@ -0,0 +1,296 @@
+#pragma once
+
+#include "../ast/ast.cpp"
+#include "../eval/object.cpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <format>
+#include <fstream>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+// 分配分析
+// 求值时创建的对象 (object::make) 和环境按类型和创建它的语法树节点汇总
+// 次数, 字节数, 以及结束时仍然存活的个数. 存活的对象记在一张表里,
+// 对象析构时从表里删去. 采样时平均每 sample 次分配记录一次, 结果按比例放大
+// 只记录调用 start 的线程上的分配和释放
+namespace alloc {
+
+using std::string;
+using std::vector;
+
+struct Options {
+    bool enabled = false;
+    string path;        // 为空时打印到标准错误, 以 .json 结尾时输出 JSON
+    size_t sample = 1;  // 平均每多少次分配记录一次
+    size_t top = 20;    // 文本报告里列出的位置个数
+};
+
+static Options options;
+
+// 正在求值的节点, 这段时间里的分配都算在它头上
+thread_local ast::Node *site = nullptr;
+
+namespace {
+
+constexpr int kinds = object::Env_Alloc + 1;
+
+struct Counter {
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    uint64_t live = 0;
+    uint64_t liveBytes = 0;
+};
+
+struct Entry {
+    Counter *type;
+    Counter *site;
+    uint64_t bytes;
+};
+
+std::array<Counter, kinds> types;
+std::unordered_map<ast::Node *, std::array<Counter, kinds>> sites;
+std::unordered_map<const void *, Entry> live;
+
+size_t countdown = 1;
+thread_local bool recording = false;
+uint64_t seed = 0x9e3779b97f4a7c15;
+
+// 下一次记录前要跳过的分配次数, 在 [1, 2 * sample) 中均匀选取
+size_t nextCountdown() {
+    if (options.sample <= 1) {
+        return 1;
+    }
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return 1 + seed % (2 * options.sample - 1);
+}
+
+void onAllocate(const void *ptr, int kind, size_t bytes) {
+    if (!recording || --countdown != 0) {
+        return;
+    }
+    countdown = nextCountdown();
+    auto weight = options.sample;
+    auto &typeCounter = types[kind];
+    auto &siteCounter = sites[site][kind];
+    for (auto counter : {&typeCounter, &siteCounter}) {
+        counter->count += weight;
+        counter->bytes += weight * bytes;
+        counter->live += weight;
+        counter->liveBytes += weight * bytes;
+    }
+    live[ptr] = {&typeCounter, &siteCounter, weight * bytes};
+}
+
+void onRelease(const void *ptr) {
+    if (!recording || live.empty()) {
+        return;
+    }
+    auto iter = live.find(ptr);
+    if (iter == live.end()) {
+        return;
+    }
+    auto &entry = iter->second;
+    for (auto counter : {entry.type, entry.site}) {
+        counter->live -= options.sample;
+        counter->liveBytes -= entry.bytes;
+    }
+    live.erase(iter);
+}
+
+string kindName(int kind) {
+    return kind == object::Env_Alloc
+               ? "env"
+               : object::TypeToString(static_cast<object::Type>(kind));
+}
+
+template <typename... Nodes>
+int lineOf(ast::Node *node) {
+    int line = 0;
+    ((line == 0 && node->cast<Nodes>() != nullptr
+          ? line = node->cast<Nodes>()->token.Line
+          : 0),
+     ...);
+    return line;
+}
+
+// 节点所在的行和源码片段
+std::pair<int, string> describe(ast::Node *node) {
+    if (node == nullptr) {
+        return {0, "<outside eval>"};
+    }
+    int line = lineOf<
+        ast::Identifier, ast::LetStatement, ast::ReturnStatement,
+        ast::ExpressionStatement, ast::BlockStatement, ast::FunctionStatement,
+        ast::ForStatement, ast::IntegerLiteral, ast::DoubleLiteral,
+        ast::BooleanLiteral, ast::StringLiteral, ast::ConstantLiteral,
+        ast::HashLiteral, ast::PrefixExpression, ast::InfixExpression,
+        ast::IfExpression, ast::FunctionLiteral, ast::ArrayLiteral,
+        ast::IndexExpression, ast::CallExpression, ast::WhileStatement>(node);
+    string text;
+    for (auto ch : node->output()) {
+        if (ch == '\n' || ch == '\t') {
+            ch = ' ';
+        }
+        if (ch != ' ' || (!text.empty() && text.back() != ' ')) {
+            text += ch;
+        }
+    }
+    if (text.size() > 40) {
+        text.resize(37);
+        text += "...";
+    }
+    return {line, text};
+}
+
+struct Row {
+    ast::Node *node;
+    int kind;
+    Counter counter;
+};
+
+bool heavier(const Row &a, const Row &b) {
+    return std::tie(a.counter.bytes, a.counter.count) >
+           std::tie(b.counter.bytes, b.counter.count);
+}
+
+string escape(const string &str) {
+    string res;
+    for (auto ch : str) {
+        if (ch == '"' || ch == '\\') {
+            res += '\\';
+        }
+        if (static_cast<unsigned char>(ch) < 0x20) {
+            res += std::format("\\u{:04x}", ch);
+        } else {
+            res += ch;
+        }
+    }
+    return res;
+}
+
+string counterJson(const Counter &c) {
+    return std::format(
+        "\"count\":{},\"bytes\":{},\"live\":{},\"liveBytes\":{}", c.count,
+        c.bytes, c.live, c.liveBytes);
+}
+
+string textReport(const vector<Row> &byType, const vector<Row> &bySite) {
+    Counter total;
+    for (auto &row : byType) {
+        total.count += row.counter.count;
+        total.bytes += row.counter.bytes;
+        total.live += row.counter.live;
+        total.liveBytes += row.counter.liveBytes;
+    }
+    string res = std::format(
+        "alloc: {} allocations, {} bytes, {} live at exit ({} bytes)",
+        total.count, total.bytes, total.live, total.liveBytes);
+    if (options.sample > 1) {
+        res += std::format(", sampled about 1 in {}", options.sample);
+    }
+    res += '\n';
+    auto line = [&](const Counter &c, const string &rest) {
+        res += std::format("  {:>10}  {:>12}  {:>8}  {:>12}  {}\n", c.count,
+                           c.bytes, c.live, c.liveBytes, rest);
+    };
+    res += std::format("  {:>10}  {:>12}  {:>8}  {:>12}  {}\n", "count",
+                       "bytes", "live", "live bytes", "type");
+    for (auto &row : byType) {
+        line(row.counter, kindName(row.kind));
+    }
+    res += std::format("  {:>10}  {:>12}  {:>8}  {:>12}  {}\n", "count",
+                       "bytes", "live", "live bytes", "site");
+    for (size_t i = 0; i < bySite.size() && i < options.top; i++) {
+        auto &row = bySite[i];
+        auto [lineNo, text] = describe(row.node);
+        line(row.counter,
+             std::format("{:<8} line {}: {}", kindName(row.kind), lineNo, text));
+    }
+    return res;
+}
+
+string jsonReport(const vector<Row> &byType, const vector<Row> &bySite) {
+    string res = std::format("{{\"sample\":{},\"types\":[", options.sample);
+    for (size_t i = 0; i < byType.size(); i++) {
+        res += std::format("{}\n{{\"type\":\"{}\",{}}}", i == 0 ? "" : ",",
+                           kindName(byType[i].kind),
+                           counterJson(byType[i].counter));
+    }
+    res += "\n],\"sites\":[";
+    for (size_t i = 0; i < bySite.size(); i++) {
+        auto [line, text] = describe(bySite[i].node);
+        res += std::format(
+            "{}\n{{\"type\":\"{}\",\"line\":{},\"node\":\"{}\",{}}}",
+            i == 0 ? "" : ",", kindName(bySite[i].kind), line, escape(text),
+            counterJson(bySite[i].counter));
+    }
+    res += "\n]}\n";
+    return res;
+}
+
+} // namespace
+
+// 在 Eval 里标记当前节点, 离开时恢复外层的节点
+// 构造时 options.enabled 为假则什么也不做
+class Site {
+    private:
+    ast::Node *saved = nullptr;
+    bool active;
+
+    public:
+    explicit Site(ast::Node *node) : active(options.enabled) {
+        if (active) {
+            saved = site;
+            site = node;
+        }
+    }
+    ~Site() {
+        if (active) {
+            site = saved;
+        }
+    }
+};
+
+void start() {
+    countdown = nextCountdown();
+    recording = true;
+    object::allocHooks = {onAllocate, onRelease};
+}
+
+// 停止记录并生成报告. 写到文件时返回一行说明, 否则返回整份文本报告
+// 需要在语法树销毁之前调用, 报告里的位置从节点取得
+string finish() {
+    object::allocHooks = {};
+    recording = false;
+    vector<Row> byType, bySite;
+    for (int kind = 0; kind < kinds; kind++) {
+        if (types[kind].count != 0) {
+            byType.push_back({nullptr, kind, types[kind]});
+        }
+    }
+    for (auto &[node, counters] : sites) {
+        for (int kind = 0; kind < kinds; kind++) {
+            if (counters[kind].count != 0) {
+                bySite.push_back({node, kind, counters[kind]});
+            }
+        }
+    }
+    std::sort(byType.begin(), byType.end(), heavier);
+    std::sort(bySite.begin(), bySite.end(), heavier);
+    live.clear();
+    if (options.path.empty()) {
+        return textReport(byType, bySite);
+    }
+    bool json = options.path.ends_with(".json");
+    std::ofstream(options.path)
+        << (json ? jsonReport(byType, bySite) : textReport(byType, bySite));
+    return std::format("alloc: report written to {}\n", options.path);
+}
+
+} // namespace alloc
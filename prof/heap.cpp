@@ -0,0 +1,494 @@
+#pragma once
+
+#include "../eval/env.cpp"
+#include "../eval/object.cpp"
+#include <algorithm>
+#include <csignal>
+#include <cstdint>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// 堆快照
+// 从当前线程创建的所有存活环境出发遍历能到达的对象, 记录类型, 自身大小,
+// 支配树上的保留大小和对象之间的引用. 全局环境是根; 从全局环境到不了的
+// 环境 (正在执行的调用, 闭包和环境互相引用形成的环, 被调用点缓存留住的
+// 函数) 也作为根, 在快照里标成 unreachable.
+// 快照是按行的文本:
+//   node <id> <kind> <shallow> <retained> <idom> <label>
+//   edge <from> <to> <name>
+//   root <id> global|unreachable
+// idom 为 -1 表示直接挂在根上. analyse 读入快照打印汇总
+namespace heap {
+
+using environment::Enviroment;
+using std::string;
+using std::vector;
+
+struct Options {
+    string path; // 收到信号时写快照的文件, 为空时不处理信号
+    size_t top = 15;
+};
+
+static Options options;
+
+// 信号处理函数只设置标记, 求值器在语句之间检查并写出快照
+static volatile sig_atomic_t requested = 0;
+
+namespace {
+
+constexpr uint32_t none = UINT32_MAX;
+
+struct Node {
+    object::Object *obj = nullptr;
+    Enviroment *env = nullptr;
+    uint64_t shallow = 0;
+    uint64_t retained = 0;
+    uint32_t idom = none;
+};
+
+struct Edge {
+    uint32_t from, to;
+    string name;
+};
+
+string kindOf(const Node &node) {
+    return node.env != nullptr ? "env"
+                               : object::TypeToString(node.obj->ObjectType());
+}
+
+string oneLine(string str) {
+    std::replace(str.begin(), str.end(), '\n', ' ');
+    return str;
+}
+
+class Snapshot {
+    private:
+    vector<Node> nodes;
+    vector<Edge> edges;
+    vector<std::pair<uint32_t, bool>> roots; // 节点和是否全局环境
+    std::unordered_map<const void *, uint32_t> ids;
+    std::unordered_set<const void *> buffers;
+    vector<uint32_t> pending;
+
+    uint32_t add(const void *ptr, object::Object *obj, Enviroment *env) {
+        auto [iter, inserted] = ids.try_emplace(ptr, nodes.size());
+        if (inserted) {
+            nodes.push_back({obj, env});
+            pending.push_back(iter->second);
+        }
+        return iter->second;
+    }
+    void link(uint32_t from, const object::obj_ptr &to, string name) {
+        if (to != nullptr) {
+            edges.push_back({from, add(to.get(), to.get(), nullptr),
+                             std::move(name)});
+        }
+    }
+    void link(uint32_t from, Enviroment *to, string name) {
+        if (to != nullptr) {
+            edges.push_back({from, add(to, nullptr, to), std::move(name)});
+        }
+    }
+
+    // 记下节点的自身大小和它引用的节点
+    void expand(uint32_t id) {
+        constexpr size_t block = 2 * sizeof(void *);
+        if (auto env = nodes[id].env) {
+            nodes[id].shallow = sizeof(Enviroment) + block + env->footprint();
+            link(id, env->outerEnv().get(), "outer");
+            for (auto &[name, val] : env->bindings()) {
+                link(id, val, name->str);
+            }
+            return;
+        }
+        auto obj = nodes[id].obj;
+        uint64_t size = block;
+        switch (obj->ObjectType()) {
+        case object::Int_Obj:
+            size += sizeof(object::Integer);
+            break;
+        case object::Float_Obj:
+            size += sizeof(object::Double);
+            break;
+        case object::Bool_Obj:
+            size += sizeof(object::Boolean);
+            break;
+        case object::Null_Obj:
+            size += sizeof(object::Null);
+            break;
+        case object::Builtin_Obj:
+            size += sizeof(object::BuiltIn);
+            break;
+        case object::Range_Obj:
+            size += sizeof(object::Range);
+            break;
+        case object::Error_Obj:
+            size += sizeof(object::ErrorObject);
+            break;
+        case object::Str_Obj: {
+            // 共享同一个缓冲区的字符串, 缓冲区只算在第一个上
+            auto str = static_cast<object::String *>(obj);
+            auto [buffer, capacity] = str->storage();
+            size += sizeof(object::String);
+            if (buffers.insert(buffer).second) {
+                size += capacity;
+            }
+            break;
+        }
+        case object::Return_Obj:
+            size += sizeof(object::ReturnValue);
+            link(id, static_cast<object::ReturnValue *>(obj)->Value, "value");
+            break;
+        case object::Function_Obj: {
+            auto func = static_cast<object::FunctionObject *>(obj);
+            size += sizeof(object::FunctionObject);
+            link(id, func->Env.get(), "env");
+            break;
+        }
+        case object::Array_Obj: {
+            auto arr = static_cast<object::Array *>(obj);
+            size += sizeof(object::Array) + arr->footprint();
+            for (size_t i = 0; i < arr->Elements.size(); i++) {
+                link(id, arr->Elements[i], std::format("[{}]", i));
+            }
+            break;
+        }
+        case object::Hash_Obj: {
+            auto hash = static_cast<object::Hash *>(obj);
+            size += sizeof(object::Hash) + hash->footprint();
+            for (auto &[code, pair] : hash->entries()) {
+                link(id, pair.first, "key");
+                link(id, pair.second, "value");
+            }
+            break;
+        }
+        }
+        nodes[id].shallow = size;
+    }
+
+    void drain() {
+        while (!pending.empty()) {
+            auto id = pending.back();
+            pending.pop_back();
+            expand(id);
+        }
+    }
+
+    // Cooper, Harvey, Kennedy 的迭代算法, 虚拟的根编号为 nodes.size()
+    void dominators(vector<vector<uint32_t>> &succ) {
+        auto root = static_cast<uint32_t>(nodes.size());
+        succ.emplace_back();
+        vector<vector<uint32_t>> pred(nodes.size() + 1);
+        for (auto &[id, global] : roots) {
+            succ[root].push_back(id);
+        }
+        // 逆后序
+        vector<uint32_t> order, index(nodes.size() + 1, none);
+        vector<std::pair<uint32_t, size_t>> stack = {{root, 0}};
+        vector<bool> seen(nodes.size() + 1);
+        seen[root] = true;
+        while (!stack.empty()) {
+            auto &[node, next] = stack.back();
+            if (next < succ[node].size()) {
+                auto to = succ[node][next++];
+                pred[to].push_back(node);
+                if (!seen[to]) {
+                    seen[to] = true;
+                    stack.push_back({to, 0});
+                }
+            } else {
+                order.push_back(node);
+                stack.pop_back();
+            }
+        }
+        std::reverse(order.begin(), order.end());
+        for (uint32_t i = 0; i < order.size(); i++) {
+            index[order[i]] = i;
+        }
+        vector<uint32_t> idom(nodes.size() + 1, none);
+        idom[root] = root;
+        auto intersect = [&](uint32_t a, uint32_t b) {
+            while (a != b) {
+                while (index[a] > index[b]) {
+                    a = idom[a];
+                }
+                while (index[b] > index[a]) {
+                    b = idom[b];
+                }
+            }
+            return a;
+        };
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t i = 1; i < order.size(); i++) {
+                auto node = order[i];
+                uint32_t res = none;
+                for (auto p : pred[node]) {
+                    if (idom[p] != none) {
+                        res = res == none ? p : intersect(p, res);
+                    }
+                }
+                if (res != idom[node]) {
+                    idom[node] = res;
+                    changed = true;
+                }
+            }
+        }
+        for (uint32_t id = 0; id < nodes.size(); id++) {
+            nodes[id].retained = nodes[id].shallow;
+            nodes[id].idom = idom[id] == root ? none : idom[id];
+        }
+        // 逆后序反过来, 先处理支配树的叶子
+        for (auto iter = order.rbegin(); iter != order.rend(); iter++) {
+            auto &node = *iter;
+            if (node != root && nodes[node].idom != none) {
+                nodes[nodes[node].idom].retained += nodes[node].retained;
+            }
+        }
+    }
+
+    string label(const Node &node) {
+        if (node.env != nullptr) {
+            string res = "(";
+            size_t count = 0;
+            for (auto &[name, val] : node.env->bindings()) {
+                if (count++ == 3) {
+                    res += ", ...";
+                    break;
+                }
+                res += (count == 1 ? "" : ", ") + name->str;
+            }
+            return res + ")";
+        }
+        if (node.obj->ObjectType() == object::Function_Obj) {
+            auto func = static_cast<object::FunctionObject *>(node.obj);
+            return std::format("{}:{}",
+                               func->Name.empty() ? "<anonymous>" : func->Name,
+                               func->Body->token.Line);
+        }
+        object::Inspector out(object::InspectLimits{1, 40});
+        node.obj->InspectTo(out);
+        return oneLine(out.take());
+    }
+
+    public:
+    Snapshot() {
+        vector<uint32_t> envs;
+        Enviroment::each([&](Enviroment *env) {
+            envs.push_back(add(env, nullptr, env));
+        });
+        drain();
+        // 全局环境是根. 其余的环境里先取没有被引用的作为根,
+        // 最后仍然到不了的 (互相引用的环) 依次作为根
+        vector<vector<uint32_t>> succ(nodes.size());
+        vector<uint32_t> incoming(nodes.size());
+        for (auto &e : edges) {
+            succ[e.from].push_back(e.to);
+            incoming[e.to]++;
+        }
+        vector<bool> seen(nodes.size());
+        auto mark = [&](uint32_t from, bool global) {
+            roots.push_back({from, global});
+            vector<uint32_t> stack = {from};
+            seen[from] = true;
+            while (!stack.empty()) {
+                auto node = stack.back();
+                stack.pop_back();
+                for (auto to : succ[node]) {
+                    if (!seen[to]) {
+                        seen[to] = true;
+                        stack.push_back(to);
+                    }
+                }
+            }
+        };
+        for (auto id : envs) {
+            if (nodes[id].env->outerEnv() == nullptr) {
+                mark(id, true);
+            }
+        }
+        for (auto id : envs) {
+            if (!seen[id] && incoming[id] == 0) {
+                mark(id, false);
+            }
+        }
+        for (auto id : envs) {
+            if (!seen[id]) {
+                mark(id, false);
+            }
+        }
+        dominators(succ);
+    }
+
+    size_t size() const {
+        return nodes.size();
+    }
+
+    void write(std::ostream &out) {
+        out << "# waii heap snapshot\n";
+        for (uint32_t id = 0; id < nodes.size(); id++) {
+            auto &node = nodes[id];
+            out << std::format("node {} {} {} {} {} {}\n", id, kindOf(node),
+                               node.shallow, node.retained,
+                               node.idom == none ? -1 : int64_t(node.idom),
+                               label(node));
+        }
+        for (auto &e : edges) {
+            out << std::format("edge {} {} {}\n", e.from, e.to, oneLine(e.name));
+        }
+        for (auto &[id, global] : roots) {
+            out << std::format("root {} {}\n", id,
+                               global ? "global" : "unreachable");
+        }
+    }
+};
+
+void onSignal(int) {
+    requested = 1;
+}
+
+} // namespace
+
+// 写出快照, 返回对象和环境的个数
+size_t dump(const string &path) {
+    Snapshot snapshot;
+    std::ofstream out(path);
+    if (!out) {
+        throw object::newError("heapdump: could not open {}", path);
+    }
+    snapshot.write(out);
+    return snapshot.size();
+}
+
+// 收到 SIGUSR1 时写快照, 第 n 次写到 path.n
+void listen() {
+    struct sigaction action = {};
+    action.sa_handler = onSignal;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, nullptr);
+}
+
+// 求值器在语句之间调用
+void poll() {
+    if (requested) {
+        static size_t count = 0;
+        requested = 0;
+        auto path = std::format("{}.{}", options.path, ++count);
+        auto n = dump(path);
+        std::cerr << std::format("heapdump: {} nodes written to {}\n", n, path);
+    }
+}
+
+// 离线分析: 按类型汇总, 保留大小最大的节点和它们的支配链, 以及从全局环境
+// 到不了的根
+string analyse(const string &path) {
+    struct Entry {
+        string kind, label;
+        uint64_t shallow, retained;
+        int64_t idom;
+    };
+    std::ifstream in(path);
+    if (!in) {
+        return std::format("could not open {}\n", path);
+    }
+    vector<Entry> nodes;
+    vector<std::pair<uint32_t, string>> roots;
+    size_t edges = 0;
+    string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        string tag;
+        fields >> tag;
+        if (tag == "node") {
+            Entry e;
+            uint32_t id;
+            fields >> id >> e.kind >> e.shallow >> e.retained >> e.idom;
+            std::getline(fields >> std::ws, e.label);
+            nodes.resize(std::max<size_t>(nodes.size(), id + 1));
+            nodes[id] = std::move(e);
+        } else if (tag == "edge") {
+            edges++;
+        } else if (tag == "root") {
+            uint32_t id;
+            string what;
+            fields >> id >> what;
+            roots.push_back({id, what});
+        }
+    }
+
+    string res;
+    uint64_t total = 0;
+    std::map<string, std::pair<uint64_t, uint64_t>> kinds;
+    for (auto &e : nodes) {
+        total += e.shallow;
+        kinds[e.kind].first++;
+        kinds[e.kind].second += e.shallow;
+    }
+    res += std::format("{} nodes, {} edges, {} bytes\n", nodes.size(), edges,
+                       total);
+    vector<std::pair<string, std::pair<uint64_t, uint64_t>>> byKind(
+        kinds.begin(), kinds.end());
+    std::sort(byKind.begin(), byKind.end(), [](auto &a, auto &b) {
+        return a.second.second > b.second.second;
+    });
+    res += std::format("  {:>10}  {:>12}  kind\n", "count", "bytes");
+    for (auto &[kind, stat] : byKind) {
+        res += std::format("  {:>10}  {:>12}  {}\n", stat.first, stat.second,
+                           kind);
+    }
+
+    auto describe = [&](size_t id) {
+        return std::format("{} {} {}", nodes[id].kind, id, nodes[id].label);
+    };
+    vector<size_t> order(nodes.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return nodes[a].retained > nodes[b].retained;
+    });
+    res += std::format("largest retainers:\n  {:>12}  {:>12}  node, "
+                       "dominated by\n",
+                       "retained", "shallow");
+    for (size_t i = 0; i < order.size() && i < options.top; i++) {
+        auto id = order[i];
+        res += std::format("  {:>12}  {:>12}  {}\n", nodes[id].retained,
+                           nodes[id].shallow, describe(id));
+        for (auto dom = nodes[id].idom; dom >= 0; dom = nodes[dom].idom) {
+            res += std::format("  {:>12}  {:>12}    <- {}\n", "", "",
+                               describe(dom));
+        }
+    }
+    vector<uint32_t> unreachable;
+    uint64_t bytes = 0;
+    for (auto &[id, what] : roots) {
+        if (what == "unreachable") {
+            unreachable.push_back(id);
+            bytes += nodes[id].retained;
+        }
+    }
+    if (!unreachable.empty()) {
+        std::sort(unreachable.begin(), unreachable.end(),
+                  [&](uint32_t a, uint32_t b) {
+                      return nodes[a].retained > nodes[b].retained;
+                  });
+        res += std::format("{} roots not reachable from globals ({} bytes): "
+                           "active calls, closure cycles or cached callees\n",
+                           unreachable.size(), bytes);
+        for (size_t i = 0; i < unreachable.size() && i < options.top; i++) {
+            auto id = unreachable[i];
+            res += std::format("  {:>12}  {}\n", nodes[id].retained,
+                               describe(id));
+        }
+    }
+    return res;
+}
+
+} // namespace heap
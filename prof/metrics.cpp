@@ -0,0 +1,192 @@
+#pragma once
+
+#include "../eval/object.cpp"
+#include "stats.cpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <format>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+
+// 运行时计数的三种输出: --stats 退出时的汇总, 定期重写的 Prometheus
+// 文本文件 (给 node exporter 的 textfile collector), 以及 stats() 内置函数
+namespace stats {
+
+using std::string;
+
+struct Options {
+    bool summary = false; // --stats
+    string path;          // Prometheus 文件, 为空时不导出
+    int interval = 1000;  // 重写间隔, 毫秒
+};
+
+static Options options;
+
+namespace {
+
+string objectName(size_t kind) {
+    return kind == object::Env_Alloc
+               ? "env"
+               : object::TypeToString(static_cast<object::Type>(kind));
+}
+
+std::thread exporter;
+std::mutex exporterLock;
+std::condition_variable exporterWake;
+bool exporterStop = false;
+
+} // namespace
+
+string summary() {
+    auto t = collect();
+    string res = "stats:\n";
+    res += std::format("  time    lex {:.3f}ms  parse {:.3f}ms  eval {:.3f}ms "
+                       "(parse includes lex)\n",
+                       t.ns[0] / 1e6, t.ns[1] / 1e6, t.ns[2] / 1e6);
+    res += std::format("  calls   {} functions, {} builtins, {} errors\n",
+                       t.calls, t.builtins, t.errors);
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    res += std::format("  memory  peak rss {} KiB\n", usage.ru_maxrss);
+    res += std::format("  lookups {} walking {} scopes ({:.2f} per lookup)\n",
+                       t.lookups, t.lookupDepth,
+                       t.lookups == 0 ? 0.0
+                                      : double(t.lookupDepth) / t.lookups);
+    // 两张表都按次数从多到少
+    auto table = [&](const char *title, const uint64_t *counts, size_t n,
+                     auto name) {
+        std::vector<size_t> order;
+        uint64_t total = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (counts[i] != 0) {
+                order.push_back(i);
+                total += counts[i];
+            }
+        }
+        std::sort(order.begin(), order.end(),
+                  [&](size_t a, size_t b) { return counts[a] > counts[b]; });
+        res += std::format("  {} {}\n", title, total);
+        for (auto i : order) {
+            res += std::format("    {:>12}  {}\n", counts[i], name(i));
+        }
+    };
+    table("nodes evaluated", t.nodes, nodeKinds,
+          [](size_t i) { return string(nodeNames[i]); });
+    table("objects allocated", t.objects, objectKinds, objectName);
+    return res;
+}
+
+string prometheus() {
+    auto t = collect();
+    string res;
+    auto metric = [&](const char *name, const char *help, const char *type) {
+        res += std::format("# HELP waii_{} {}\n# TYPE waii_{} {}\n", name, help,
+                           name, type);
+    };
+    metric("nodes_evaluated_total", "AST nodes evaluated by kind.", "counter");
+    for (size_t i = 0; i < nodeKinds; i++) {
+        res += std::format("waii_nodes_evaluated_total{{kind=\"{}\"}} {}\n",
+                           nodeNames[i], t.nodes[i]);
+    }
+    metric("objects_allocated_total", "Objects allocated by type.", "counter");
+    for (size_t i = 0; i < objectKinds; i++) {
+        res += std::format("waii_objects_allocated_total{{type=\"{}\"}} {}\n",
+                           objectName(i), t.objects[i]);
+    }
+    auto single = [&](const char *name, const char *help, uint64_t value) {
+        metric(name, help, "counter");
+        res += std::format("waii_{} {}\n", name, value);
+    };
+    single("function_calls_total", "Script function calls.", t.calls);
+    single("builtin_calls_total", "Builtin function calls.", t.builtins);
+    single("env_lookups_total", "Environment chain lookups.", t.lookups);
+    single("env_lookup_depth_total", "Scopes walked by environment lookups.",
+           t.lookupDepth);
+    single("errors_total", "Runtime errors raised.", t.errors);
+    metric("phase_seconds_total", "Time spent per phase.", "counter");
+    for (size_t i = 0; i < phases; i++) {
+        res += std::format("waii_phase_seconds_total{{phase=\"{}\"}} {:.9f}\n",
+                           phaseNames[i], t.ns[i] / 1e9);
+    }
+    return res;
+}
+
+// 先写临时文件再改名, 读取方不会看到写了一半的文件
+void writeMetrics() {
+    auto tmp = options.path + ".tmp";
+    {
+        std::ofstream out(tmp);
+        out << prometheus();
+    }
+    std::rename(tmp.c_str(), options.path.c_str());
+}
+
+void startExporter() {
+    writeMetrics();
+    exporter = std::thread([] {
+        std::unique_lock guard(exporterLock);
+        while (!exporterWake.wait_for(
+            guard, std::chrono::milliseconds(options.interval),
+            [] { return exporterStop; })) {
+            writeMetrics();
+        }
+    });
+}
+
+// 停止后台线程, 再写一次最终的值
+void stopExporter() {
+    {
+        std::lock_guard guard(exporterLock);
+        exporterStop = true;
+    }
+    exporterWake.notify_all();
+    exporter.join();
+    writeMetrics();
+}
+
+// stats() 的返回值. int 只有 32 位, 计数超过时取最大值, 时间用秒
+object::obj_ptr toObject() {
+    auto t = collect();
+    auto integer = [](uint64_t n) {
+        return object::make<object::Integer>(static_cast<int>(
+            std::min<uint64_t>(n, std::numeric_limits<int>::max())));
+    };
+    auto res = object::make<object::Hash>();
+    auto put = [](object::Hash *hash, const string &key, object::obj_ptr val) {
+        object::obj_ptr name = object::make<object::String>(key);
+        hash->insert(name, val);
+    };
+    auto nodes = object::make<object::Hash>();
+    for (size_t i = 0; i < nodeKinds; i++) {
+        if (t.nodes[i] != 0) {
+            put(nodes.get(), nodeNames[i], integer(t.nodes[i]));
+        }
+    }
+    auto objects = object::make<object::Hash>();
+    for (size_t i = 0; i < objectKinds; i++) {
+        if (t.objects[i] != 0) {
+            put(objects.get(), objectName(i), integer(t.objects[i]));
+        }
+    }
+    auto time = object::make<object::Hash>();
+    for (size_t i = 0; i < phases; i++) {
+        put(time.get(), phaseNames[i], object::make<object::Double>(t.ns[i] / 1e9));
+    }
+    put(res.get(), "nodes", nodes);
+    put(res.get(), "objects", objects);
+    put(res.get(), "calls", integer(t.calls));
+    put(res.get(), "builtins", integer(t.builtins));
+    put(res.get(), "lookups", integer(t.lookups));
+    put(res.get(), "lookup_depth", integer(t.lookupDepth));
+    put(res.get(), "errors", integer(t.errors));
+    put(res.get(), "time", time);
+    return res;
+}
+
+} // namespace stats
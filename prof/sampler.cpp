@@ -0,0 +1,262 @@
+#pragma once
+
+#include "../ast/ast.cpp"
+#include "../eval/object.cpp"
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <ctime>
+#include <format>
+#include <fstream>
+#include <string>
+#include <sys/time.h>
+#include <tuple>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// glibc 2.39 之前没有定义这个名字
+#if defined(__linux__) && !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// 脚本层面的采样分析
+// 解释器调用函数时在一个影子栈上记下函数体, SIGPROF 到来时信号处理函数把
+// 影子栈原样复制到预先分配好的缓冲区里. 结束时汇总成 flamegraph.pl 可以直接
+// 读取的折叠栈格式, 并打印自身时间和总时间最多的函数.
+// 只分析调用 start 的线程: 计时器按这个线程的 CPU 时间计时, 信号也只发给它,
+// 线程池里执行 pmap 等的工作线程不记录影子栈.
+// 没有打开时调用处只多一次 options.enabled 的判断
+namespace prof {
+
+using std::string;
+using std::vector;
+
+struct Options {
+    bool enabled = false;
+    string path = "profile.folded"; // 折叠栈的输出文件
+    int interval = 1000;             // 采样间隔, 微秒 (CPU 时间)
+    size_t top = 15;                 // 汇总里列出的函数个数
+};
+
+static Options options;
+
+namespace {
+
+constexpr size_t maxDepth = 4096;
+constexpr size_t bufferSize = 1 << 22;
+
+// 同一个函数体只登记一次, 名字取第一次调用时的名字
+struct Function {
+    ast::BlockStatement *body;
+    string name;
+};
+
+vector<Function> functions;
+std::unordered_map<ast::BlockStatement *, uint32_t> ids;
+
+// 只在调用 start 的线程上为真, 下面的状态只有这个线程读写
+thread_local bool recording = false;
+
+uint32_t stack[maxDepth];
+volatile sig_atomic_t depth = 0;
+size_t overflow = 0; // 超过 maxDepth 的层数, 这些层不记录
+
+// 每个样本是栈深度, 然后从外到内的函数编号
+uint32_t *samples = nullptr;
+volatile sig_atomic_t used = 0;
+volatile sig_atomic_t dropped = 0;
+
+#ifdef __linux__
+timer_t timer;
+#endif
+
+void onSample(int) {
+    // 不能定向发信号的平台上, 落到别的线程的样本丢掉
+    if (!recording) {
+        return;
+    }
+    size_t n = depth;
+    if (used + n + 1 > bufferSize) {
+        dropped = dropped + 1;
+        return;
+    }
+    samples[used] = n;
+    std::copy(stack, stack + n, samples + used + 1);
+    used = used + n + 1;
+}
+
+uint32_t idFor(object::FunctionObject *func) {
+    auto body = func->Body.get();
+    auto [iter, inserted] = ids.try_emplace(body, functions.size());
+    if (inserted) {
+        functions.push_back({body, func->Name});
+    } else if (functions[iter->second].name.empty()) {
+        functions[iter->second].name = func->Name;
+    }
+    return iter->second;
+}
+
+string label(uint32_t id) {
+    auto &func = functions[id];
+    return std::format("{}:{}",
+                       func.name.empty() ? "<anonymous>" : func.name,
+                       func.body->token.Line);
+}
+
+} // namespace
+
+// 进入和离开脚本函数, 只在 options.enabled 时调用
+void enter(object::FunctionObject *func) {
+    if (!recording) {
+        return;
+    }
+    if (depth == maxDepth) {
+        overflow++;
+        return;
+    }
+    stack[depth] = idFor(func);
+    std::atomic_signal_fence(std::memory_order_release);
+    depth = depth + 1;
+}
+
+void leave() {
+    if (!recording) {
+        return;
+    }
+    if (overflow != 0) {
+        overflow--;
+        return;
+    }
+    depth = depth - 1;
+}
+
+// 不经过 Scope 的调用方 (machine.cpp) 出错时回到之前的深度
+size_t mark() {
+    return recording ? depth + overflow : 0;
+}
+void unwind(size_t to) {
+    while (mark() > to) {
+        leave();
+    }
+}
+
+// 异常穿过调用时也要离开, 构造时没有在记录则什么也不做
+class Scope {
+    private:
+    bool active;
+
+    public:
+    explicit Scope(object::FunctionObject *func)
+        : active(options.enabled && recording) {
+        if (active) {
+            enter(func);
+        }
+    }
+    ~Scope() {
+        if (active) {
+            leave();
+        }
+    }
+};
+
+void start() {
+    samples = new uint32_t[bufferSize];
+    recording = true;
+    struct sigaction action = {};
+    action.sa_handler = onSample;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &action, nullptr);
+#ifdef __linux__
+    sigevent event = {};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = gettid();
+    timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer);
+    itimerspec spec = {};
+    spec.it_interval.tv_sec = options.interval / 1000000;
+    spec.it_interval.tv_nsec = options.interval % 1000000 * 1000;
+    spec.it_value = spec.it_interval;
+    timer_settime(timer, 0, &spec, nullptr);
+#else
+    // ITIMER_PROF 按整个进程的 CPU 时间计时, 信号可能落到任何线程上
+    itimerval timer = {};
+    timer.it_interval.tv_usec = options.interval % 1000000;
+    timer.it_interval.tv_sec = options.interval / 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+#endif
+}
+
+// 停止采样, 写出折叠栈, 返回汇总
+string finish() {
+#ifdef __linux__
+    timer_delete(timer);
+#else
+    itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+#endif
+    signal(SIGPROF, SIG_IGN);
+    recording = false;
+
+    std::unordered_map<string, size_t> folded;
+    vector<size_t> self(functions.size()), total(functions.size());
+    size_t count = 0;
+    for (size_t pos = 0; pos < static_cast<size_t>(used);) {
+        size_t n = samples[pos];
+        auto frames = samples + pos + 1;
+        string key = "<main>";
+        for (size_t i = 0; i < n; i++) {
+            key += ';' + label(frames[i]);
+            // 递归时同一个函数只算一次总时间
+            if (std::find(frames, frames + i, frames[i]) == frames + i) {
+                total[frames[i]]++;
+            }
+        }
+        if (n != 0) {
+            self[frames[n - 1]]++;
+        }
+        folded[key]++;
+        count++;
+        pos += n + 1;
+    }
+    delete[] samples;
+    samples = nullptr;
+
+    vector<std::pair<string, size_t>> lines(folded.begin(), folded.end());
+    std::sort(lines.begin(), lines.end());
+    std::ofstream out(options.path);
+    for (auto &[key, n] : lines) {
+        out << key << ' ' << n << '\n';
+    }
+
+    string res = std::format("profile: {} samples every {}us written to {}",
+                             count, options.interval, options.path);
+    if (dropped != 0) {
+        res += std::format(", {} dropped", static_cast<size_t>(dropped));
+    }
+    res += '\n';
+    vector<uint32_t> order(functions.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return std::tie(self[b], total[b]) < std::tie(self[a], total[a]);
+    });
+    auto percent = [&](size_t n) {
+        return count == 0 ? 0.0 : 100.0 * n / count;
+    };
+    res += std::format("  {:>7}  {:>7}  function\n", "self", "total");
+    for (size_t i = 0; i < order.size() && i < options.top; i++) {
+        auto id = order[i];
+        if (total[id] == 0) {
+            break;
+        }
+        res += std::format("  {:6.1f}%  {:6.1f}%  {}\n", percent(self[id]),
+                           percent(total[id]), label(id));
+    }
+    return res;
+}
+
+} // namespace prof
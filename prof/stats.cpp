@@ -0,0 +1,197 @@
+#pragma once
+
+#include "../ast/ast.cpp"
+#include "../eval/object_type.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <type_traits>
+#include <typeindex>
+#include <unordered_map>
+#include <vector>
+
+// 运行时计数, 总是打开
+// 每个线程只在自己的计数块上累加, 只有这个线程写, 用 relaxed 的读和写
+// 就够了, 不需要加锁的读改写. 读取时才把所有线程的块加起来.
+// 报告的格式在 prof/metrics.cpp
+namespace stats {
+
+// 语法树节点的种类, 名字与 nodeNames 一一对应
+using Nodes = std::tuple<
+    ast::Program, ast::ExpressionStatement, ast::BlockStatement,
+    ast::LetStatement, ast::ReturnStatement, ast::FunctionStatement,
+    ast::WhileStatement, ast::ForStatement, ast::Identifier,
+    ast::IntegerLiteral, ast::DoubleLiteral, ast::BooleanLiteral,
+    ast::StringLiteral, ast::ConstantLiteral, ast::PrefixExpression,
+    ast::InfixExpression, ast::IfExpression, ast::FunctionLiteral,
+    ast::ArrayLiteral, ast::IndexExpression, ast::CallExpression,
+    ast::HashLiteral>;
+
+const char *const nodeNames[] = {
+    "program",  "expression", "block",    "let",      "return",
+    "fn",       "while",      "for",      "ident",    "int",
+    "float",    "bool",       "str",      "constant", "prefix",
+    "infix",    "if",         "function", "array",    "index",
+    "call",     "hash"};
+
+constexpr size_t nodeKinds = std::tuple_size_v<Nodes>;
+static_assert(std::size(nodeNames) == nodeKinds);
+
+// object::Type 的个数加上环境
+constexpr size_t objectKinds = object::Env_Alloc + 1;
+
+enum class Phase { Lex, Parse, Eval };
+constexpr size_t phases = 3;
+const char *const phaseNames[] = {"lex", "parse", "eval"};
+
+template <typename T, size_t I = 0>
+constexpr size_t nodeIndex() {
+    if constexpr (I == nodeKinds) {
+        return nodeKinds;
+    } else if constexpr (std::is_same_v<T, std::tuple_element_t<I, Nodes>>) {
+        return I;
+    } else {
+        return nodeIndex<T, I + 1>();
+    }
+}
+
+struct Counters {
+    std::atomic<uint64_t> nodes[nodeKinds] = {};
+    std::atomic<uint64_t> objects[objectKinds] = {};
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> builtins{0};
+    std::atomic<uint64_t> lookups{0};
+    std::atomic<uint64_t> lookupDepth{0}; // 查找时经过的环境层数之和
+    std::atomic<uint64_t> errors{0};
+};
+
+// 所有线程的计数之和
+struct Totals {
+    uint64_t nodes[nodeKinds] = {};
+    uint64_t objects[objectKinds] = {};
+    uint64_t calls = 0;
+    uint64_t builtins = 0;
+    uint64_t lookups = 0;
+    uint64_t lookupDepth = 0;
+    uint64_t errors = 0;
+    int64_t ns[phases] = {};
+};
+
+namespace {
+
+std::mutex lock;
+std::vector<std::unique_ptr<Counters>> blocks;
+thread_local Counters *mine = nullptr;
+
+// 阶段只在主线程上计时, 正在进行的阶段读取时算到当前时刻
+std::atomic<int64_t> elapsed[phases] = {};
+std::atomic<int64_t> started[phases] = {};
+
+int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+Counters *enroll() {
+    std::lock_guard guard(lock);
+    blocks.push_back(std::make_unique<Counters>());
+    return mine = blocks.back().get();
+}
+
+} // namespace
+
+inline Counters &local() {
+    return mine != nullptr ? *mine : *enroll();
+}
+
+inline void bump(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+
+// 求值器匹配到节点的种类时调用, 总是返回 true 以便写在条件里
+template <typename T>
+inline bool evaluated() {
+    bump(local().nodes[nodeIndex<T>()]);
+    return true;
+}
+
+// 不知道静态类型时按 typeid 查
+void evaluated(ast::Node *node) {
+    static const auto indices = [] {
+        std::unordered_map<std::type_index, size_t> res;
+        [&]<size_t... I>(std::index_sequence<I...>) {
+            (res.emplace(typeid(std::tuple_element_t<I, Nodes>), I), ...);
+        }(std::make_index_sequence<nodeKinds>());
+        return res;
+    }();
+    if (node == nullptr) {
+        return;
+    }
+    auto iter = indices.find(typeid(*node));
+    if (iter != indices.end()) {
+        bump(local().nodes[iter->second]);
+    }
+}
+
+void begin(Phase phase) {
+    started[static_cast<int>(phase)].store(now(), std::memory_order_relaxed);
+}
+void end(Phase phase) {
+    auto i = static_cast<int>(phase);
+    auto start = started[i].exchange(0, std::memory_order_relaxed);
+    elapsed[i].fetch_add(now() - start, std::memory_order_relaxed);
+}
+
+class Timer {
+    private:
+    Phase phase;
+
+    public:
+    explicit Timer(Phase phase) : phase(phase) {
+        begin(phase);
+    }
+    Timer(const Timer &) = delete;
+    ~Timer() {
+        end(phase);
+    }
+};
+
+Totals collect() {
+    Totals res;
+    auto load = [](const std::atomic<uint64_t> &c) {
+        return c.load(std::memory_order_relaxed);
+    };
+    {
+        std::lock_guard guard(lock);
+        for (auto &block : blocks) {
+            for (size_t i = 0; i < nodeKinds; i++) {
+                res.nodes[i] += load(block->nodes[i]);
+            }
+            for (size_t i = 0; i < objectKinds; i++) {
+                res.objects[i] += load(block->objects[i]);
+            }
+            res.calls += load(block->calls);
+            res.builtins += load(block->builtins);
+            res.lookups += load(block->lookups);
+            res.lookupDepth += load(block->lookupDepth);
+            res.errors += load(block->errors);
+        }
+    }
+    auto current = now();
+    for (size_t i = 0; i < phases; i++) {
+        res.ns[i] = elapsed[i].load(std::memory_order_relaxed);
+        auto start = started[i].load(std::memory_order_relaxed);
+        if (start != 0) {
+            res.ns[i] += current - start;
+        }
+    }
+    return res;
+}
+
+} // namespace stats
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Chrome trace-event 格式的时间线 (chrome://tracing, Perfetto 都能打开)
+// 各个阶段, 每次脚本函数调用和内置函数调用记录开始和结束两个事件.
+// 事件写进固定大小的环形缓冲区, 写入只需要一次原子加法和一次比较交换,
+// 缓冲区写满后覆盖最早的事件, 结束时只输出还留在缓冲区里的部分
+namespace trace {
+
+using std::string;
+
+struct Options {
+    bool enabled = false;
+    string path;
+    size_t capacity = 1 << 20; // 环形缓冲区能保存的事件数
+};
+
+static Options options;
+
+// 分类, 输出为 cat 字段
+enum class Category : uint8_t { Phase, Lex, Call, Builtin };
+
+namespace {
+
+const char *const categoryNames[] = {"phase", "lex", "call", "builtin"};
+
+struct Event {
+    int64_t ns;
+    const char *name; // 指向进程结束前一直有效的字符串
+    uint32_t tid;
+    Category category;
+    char phase; // 'B' 或 'E'
+};
+
+// 环绕后两个线程可能同时写同一格. 写之前把 seq 换成 busy 占住这一格,
+// 占不到就丢掉这个事件; 写完把 seq 设为下标 + 1, finish 只接受 seq 与
+// 下标相符的格子, 被更早的写入盖掉或者没写完的都跳过
+constexpr uint64_t busy = UINT64_MAX;
+
+struct Slot {
+    std::atomic<uint64_t> seq{0};
+    Event event;
+};
+
+std::unique_ptr<Slot[]> ring;
+std::atomic<uint64_t> head{0};
+std::chrono::steady_clock::time_point origin;
+
+std::atomic<uint32_t> threads{0};
+thread_local uint32_t tid = ++threads;
+
+void record(const char *name, Category category, char phase) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - origin)
+                  .count();
+    auto index = head.fetch_add(1, std::memory_order_relaxed);
+    auto &slot = ring[index % options.capacity];
+    auto seen = slot.seq.load(std::memory_order_relaxed);
+    if (seen == busy || !slot.seq.compare_exchange_strong(
+                            seen, busy, std::memory_order_acquire)) {
+        return;
+    }
+    slot.event = {ns, name, tid, category, phase};
+    slot.seq.store(index + 1, std::memory_order_release);
+}
+
+void escape(string &out, const char *str) {
+    for (; *str != 0; str++) {
+        if (*str == '"' || *str == '\\') {
+            out += '\\';
+        }
+        out += *str;
+    }
+}
+
+} // namespace
+
+void start() {
+    ring = std::make_unique<Slot[]>(options.capacity);
+    origin = std::chrono::steady_clock::now();
+}
+
+// 不对应一个作用域的阶段
+void begin(const char *name) {
+    if (options.enabled) {
+        record(name, Category::Phase, 'B');
+    }
+}
+void end(const char *name) {
+    if (options.enabled) {
+        record(name, Category::Phase, 'E');
+    }
+}
+
+// 开始和结束之间的一段, 构造时 options.enabled 为假则什么也不做
+class Span {
+    private:
+    const char *name = nullptr;
+    Category category;
+
+    public:
+    Span(const char *name, Category category) {
+        if (options.enabled && name != nullptr) {
+            this->name = name;
+            this->category = category;
+            record(name, category, 'B');
+        }
+    }
+    Span(const Span &) = delete;
+    ~Span() {
+        if (name != nullptr) {
+            record(name, category, 'E');
+        }
+    }
+};
+
+// 函数体对应的事件名, 同一个函数体只生成一次, 取第一次调用时的名字
+// 按函数体的编号而不是地址记, 释放后地址相同的新函数体不会拿到旧名字
+template <typename Body>
+const char *functionName(Body *body, const string &name) {
+    static std::mutex lock;
+    static std::unordered_map<uint64_t, string> names;
+    std::lock_guard guard(lock);
+    auto [iter, inserted] = names.try_emplace(body->serial);
+    if (inserted) {
+        iter->second = std::format(
+            "{}:{}", name.empty() ? "<anonymous>" : name, body->token.Line);
+    }
+    return iter->second.c_str();
+}
+
+// 脚本函数调用, Function 是 object::FunctionObject
+template <typename Function>
+Span call(Function *func) {
+    if (!options.enabled) {
+        return Span(nullptr, Category::Call);
+    }
+    return Span(functionName(func->Body.get(), func->Name), Category::Call);
+}
+
+// 写出 JSON, 返回写出的事件数
+// 缓冲区绕回之后, 开始事件已被覆盖的结束事件在最早的时刻补上开始,
+// 没有结束的 (出错退出) 在最后的时刻补上结束
+size_t finish() {
+    uint64_t end = head.load();
+    uint64_t begin = end > options.capacity ? end - options.capacity : 0;
+    // 完整写入的事件, 按下标顺序
+    std::vector<const Event *> events;
+    for (auto i = begin; i < end; i++) {
+        auto &slot = ring[i % options.capacity];
+        if (slot.seq.load(std::memory_order_acquire) == i + 1) {
+            events.push_back(&slot.event);
+        }
+    }
+    std::unordered_map<uint32_t, std::vector<const Event *>> open;
+    string out = "{\"traceEvents\":[\n";
+    size_t count = 0;
+    int64_t first = events.empty() ? 0 : events.front()->ns;
+    int64_t last = 0;
+    auto write = [&](const Event &e, char phase, int64_t ns) {
+        if (count != 0) {
+            out += ",\n";
+        }
+        out += "{\"name\":\"";
+        escape(out, e.name);
+        out += std::format("\",\"cat\":\"{}\",\"ph\":\"{}\",\"ts\":{}.{:03},"
+                           "\"pid\":1,\"tid\":{}}}",
+                           categoryNames[static_cast<int>(e.category)], phase,
+                           ns / 1000, ns % 1000, e.tid);
+        count++;
+    };
+    // 先找出开始事件已被覆盖的结束事件, 越晚结束的在越外层
+    std::vector<const Event *> orphans;
+    std::unordered_map<uint32_t, size_t> depth;
+    for (auto e : events) {
+        if (e->phase == 'B') {
+            depth[e->tid]++;
+        } else if (depth[e->tid] == 0) {
+            orphans.push_back(e);
+        } else {
+            depth[e->tid]--;
+        }
+    }
+    for (auto iter = orphans.rbegin(); iter != orphans.rend(); iter++) {
+        write(**iter, 'B', first);
+        open[(*iter)->tid].push_back(*iter);
+    }
+    for (auto e : events) {
+        auto &stack = open[e->tid];
+        if (e->phase == 'E') {
+            stack.pop_back();
+        } else {
+            stack.push_back(e);
+        }
+        write(*e, e->phase, e->ns);
+        last = std::max(last, e->ns);
+    }
+    for (auto &[tid, stack] : open) {
+        while (!stack.empty()) {
+            write(*stack.back(), 'E', last);
+            stack.pop_back();
+        }
+    }
+    out += "\n],\"displayTimeUnit\":\"ns\"}\n";
+    std::ofstream(options.path) << out;
+    ring.reset();
+    return count;
+}
+
+} // namespace trace
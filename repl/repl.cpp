@@ -1,6 +1,8 @@
 #pragma once
 
 #include "../eval/eval.cpp"
+#include "../eval/output.cpp"
+#include "../eval/scope.cpp"
 #include "../lexer/lexer.cpp"
 #include "../parser/parser.cpp"
 #include <iostream>
@@ -8,23 +10,30 @@
 namespace repl {
 class Repl {
     public:
-    Repl(std::istream &in, std::ostream &out) {
+    Repl(std::istream &in, output::Sink &out) {
         std::string line;
-        out << ">>";
+        out.write(">>");
+        out.flush();
+        // 随时可能调用 heapdump, 一直登记环境
+        environment::tracking = true;
         environment::env_ptr env = std::make_shared<environment::Enviroment>();
         while (getline(in, line)) {
             auto L = lexer::Lexer(line);
-            auto P = parser::Parser(L);
+            stats::begin(stats::Phase::Parse);
+            auto P = parser::Parser(&L);
 
             auto res = P.ParserProgram();
+            stats::end(stats::Phase::Parse);
             if (P.errors.empty()) {
+                scope::markGlobals(res.get());
                 try {
+                    stats::Timer timer(stats::Phase::Eval);
                     auto ptr = eval::Eval(res.get(), env);
                     if (ptr != nullptr) {
-                        out << ptr->Inspect() << std::endl;
+                        object::writeObject(out, ptr.get());
                     }
                 } catch (object::ErrorObject &e) {
-                    out << e.Inspect() << std::endl;
+                    out.writeLine(e.Inspect());
                 }
             } else {
                 // auto rpL = lexer::Lexer(line);
@@ -33,10 +42,11 @@ class Repl {
                 //     tok.Output(out);
                 // }
                 for (auto v : P.errors) {
-                    out << v << std::endl;
+                    out.writeLine(v);
                 }
             }
-            out << ">>";
+            out.write(">>");
+            out.flush();
         }
     }
 };
@@ -0,0 +1,40 @@
+#!/bin/sh
+# --emit-cpp 生成的 C++ 编译运行后, 输出要和解释器一致
+# 用法: test/aot/run.sh ./waii [脚本...]
+# 不给脚本时跑本目录的用例和 test/corpus
+# 编译器和参数取 CXX / CXXFLAGS, 生成的代码 include 仓库里的 aot/runtime.cpp
+bin=${1:?usage: run.sh <waii binary> [script...]}
+shift
+dir=$(dirname "$0")
+root=$(cd "$dir/../.." && pwd)
+[ $# -eq 0 ] && set -- "$dir"/*.monkey "$dir"/../corpus/*.monkey
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+for script in "$@"; do
+    name=$(basename "$script" .monkey)
+    # -O1 折叠出的常量 (比如 1.0 / 0.0) 也要能写成 C++
+    for level in -O0 -O1; do
+        "$bin" $level "$script" >"$tmp/expected" 2>&1
+        if ! "$bin" $level --emit-cpp="$tmp/$name.cpp" "$script" >/dev/null 2>&1; then
+            echo "FAIL $name $level: --emit-cpp failed"
+            failed=1
+            continue
+        fi
+        if ! ${CXX:-g++} ${CXXFLAGS:--std=c++20 -O1} -I "$root" -o "$tmp/$name" "$tmp/$name.cpp"; then
+            echo "FAIL $name $level: generated C++ does not compile"
+            failed=1
+            continue
+        fi
+        "$tmp/$name" >"$tmp/actual" 2>&1
+        if cmp -s "$tmp/expected" "$tmp/actual"; then
+            echo "ok   $name $level"
+        else
+            echo "FAIL $name $level"
+            diff "$tmp/expected" "$tmp/actual" | head -n 10
+            failed=1
+        fi
+    done
+done
+exit $failed
@@ -0,0 +1,24 @@
+#!/bin/sh
+# 调用点缓存和全局绑定缓存在 let 重新绑定或遮蔽名字后必须失效
+# 用法: test/cache/run.sh ./waii
+# 每个脚本在各种求值方式下的输出都要等于同名的 .out
+bin=${1:?usage: run.sh <waii binary>}
+dir=$(dirname "$0")
+out=$(mktemp)
+trap 'rm -f "$out"' EXIT
+failed=0
+
+for script in "$dir"/*.monkey; do
+    name=$(basename "$script" .monkey)
+    for mode in "" --infer --vm --vm=register --stackless --jit; do
+        "$bin" $mode "$script" >"$out" 2>&1
+        if cmp -s "$dir/$name.out" "$out"; then
+            echo "ok   $name $mode"
+        else
+            echo "FAIL $name $mode"
+            diff "$dir/$name.out" "$out" | head -n 10
+            failed=1
+        fi
+    done
+done
+exit $failed
@@ -0,0 +1,33 @@
+#!/bin/sh
+# 各优化级别下脚本的输出要和 -O0 完全一致
+# 用法: test/opt/run.sh ./waii [脚本...]
+# 不给脚本时跑本目录的折叠边界用例和 test/corpus, 每种求值方式都要比
+bin=${1:?usage: run.sh <waii binary> [script...]}
+shift
+dir=$(dirname "$0")
+[ $# -eq 0 ] && set -- "$dir"/*.monkey "$dir"/../corpus/*.monkey
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+for script in "$@"; do
+    name=$(basename "$script" .monkey)
+    ok=1
+    for mode in "" --infer --vm --stackless; do
+        "$bin" -O0 $mode "$script" >"$tmp/expected" 2>&1
+        for level in -O1 -O2; do
+            "$bin" $level $mode "$script" >"$tmp/actual" 2>&1
+            if ! cmp -s "$tmp/expected" "$tmp/actual"; then
+                echo "FAIL $name $level $mode"
+                diff "$tmp/expected" "$tmp/actual" | head -n 10
+                ok=0
+            fi
+        done
+    done
+    if [ $ok -eq 1 ]; then
+        echo "ok   $name"
+    else
+        failed=1
+    fi
+done
+exit $failed
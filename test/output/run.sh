@@ -0,0 +1,36 @@
+#!/bin/sh
+# 脚本中途崩溃或被杀死时, 之前 print 的内容仍然要写到 (管道或文件的) 标准输出
+# 用法: test/output/run.sh ./waii
+bin=${1:?usage: run.sh <waii binary>}
+dir=$(dirname "$0")
+out=$(mktemp)
+trap 'rm -f "$out"' EXIT
+failed=0
+
+check() {
+    if [ "$(head -n 1 "$out")" = '"before"' ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: output before the crash was lost"
+        failed=1
+    fi
+}
+
+# 除零和 C++ 栈溢出都以信号结束, 各种求值方式和缓冲方式都要试
+for mode in "" --infer --vm; do
+    for buffer in "" --output-buffer=0 --async-output "--async-output --output-buffer=0"; do
+        for script in div0 overflow; do
+            "$bin" $mode $buffer "$dir/$script.monkey" >"$out" 2>/dev/null
+            check "$script $mode $buffer"
+        done
+    done
+done
+
+# 不缓冲时每次写入都直接写出, 被 SIGKILL 杀死也不丢
+"$bin" --output-buffer=0 "$dir/spin.monkey" >"$out" 2>/dev/null &
+sleep 1
+kill -9 $! 2>/dev/null
+wait $! 2>/dev/null
+check "spin --output-buffer=0 (killed)"
+
+exit $failed
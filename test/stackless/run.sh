@@ -0,0 +1,37 @@
+#!/bin/sh
+# --stackless 的显式续延栈和树遍历解释器的输出要完全一致
+# 用法: test/stackless/run.sh ./waii [脚本...]
+# 不给脚本时跑本目录的调用/返回, 深层嵌套数据用例和 test/corpus, 带和不带类型推断各比一次
+bin=${1:?usage: run.sh <waii binary> [script...]}
+shift
+dir=$(dirname "$0")
+[ $# -eq 0 ] && set -- "$dir"/*.monkey "$dir"/../corpus/*.monkey
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+for script in "$@"; do
+    name=$(basename "$script" .monkey)
+    ok=1
+    for mode in "" --infer; do
+        "$bin" $mode "$script" >"$tmp/expected" 2>&1
+        echo "exit $?" >>"$tmp/expected"
+        "$bin" --stackless $mode "$script" >"$tmp/actual" 2>&1
+        echo "exit $?" >>"$tmp/actual"
+        # 两边都被信号杀掉时输出也一样, 所以单独检查
+        if grep -q '^exit 1[2-9][0-9]$' "$tmp/expected" "$tmp/actual"; then
+            echo "FAIL $name $mode crashed"
+            ok=0
+        elif ! cmp -s "$tmp/expected" "$tmp/actual"; then
+            echo "FAIL $name --stackless $mode"
+            diff "$tmp/expected" "$tmp/actual" | head -n 10
+            ok=0
+        fi
+    done
+    if [ $ok -eq 1 ]; then
+        echo "ok   $name"
+    else
+        failed=1
+    fi
+done
+exit $failed
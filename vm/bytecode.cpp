@@ -0,0 +1,397 @@
+#pragma once
+
+#include "../eval/typed.cpp"
+#include <algorithm>
+#include <cstdint>
+#include <format>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// GCC / Clang 支持 labels-as-values, 用 computed goto 分派, 否则退回 switch
+// 定义 WAII_VM_SWITCH 可以强制使用 switch, 方便对比
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(WAII_VM_SWITCH)
+#define WAII_VM_THREADED 1
+#else
+#define WAII_VM_THREADED 0
+#endif
+
+// 不装箱函数的字节码
+// typed 的节点树再编译成基于操作数栈的指令序列: 每条指令是一个操作码加上
+// 若干个 32 位操作数, 跳转的操作数是目标指令的下标. 局部变量仍然使用
+// typed::Plan 的槽位, 之后是 for 循环的计数器, 最后是操作数栈
+namespace vm {
+
+using std::string;
+using std::vector;
+using typed::Slot;
+
+// 栈式字节码, 或者由它转换得到的寄存器字节码 (register.cpp)
+enum class Backend { Stack, Register };
+
+struct Options {
+    bool enabled = false;
+    Backend backend = Backend::Stack;
+    bool superinstructions = true;
+    bool histogram = false; // 统计执行的指令和相邻指令对
+    bool stats = false;     // 只统计执行的指令数和字节码大小
+};
+
+static Options options;
+
+// 名字, 操作数个数, 执行后操作数栈深度的变化 (CALL 另外计算)
+// 超级指令放在最后, 由 Assembler 在生成时合并相邻的指令得到
+#define WAII_VM_OPCODES(X)                                                     \
+    X(CONST, 1, 1)                                                             \
+    X(LOAD, 1, 1)                                                              \
+    X(STORE, 1, -1)                                                            \
+    X(POP, 0, -1)                                                              \
+    X(ADD_I, 0, -1)                                                            \
+    X(SUB_I, 0, -1)                                                            \
+    X(MUL_I, 0, -1)                                                            \
+    X(DIV_I, 0, -1)                                                            \
+    X(ADD_F, 0, -1)                                                            \
+    X(SUB_F, 0, -1)                                                            \
+    X(MUL_F, 0, -1)                                                            \
+    X(DIV_F, 0, -1)                                                            \
+    X(EQ_I, 0, -1)                                                             \
+    X(NE_I, 0, -1)                                                             \
+    X(LT_I, 0, -1)                                                             \
+    X(GT_I, 0, -1)                                                             \
+    X(LE_I, 0, -1)                                                             \
+    X(GE_I, 0, -1)                                                             \
+    X(EQ_F, 0, -1)                                                             \
+    X(NE_F, 0, -1)                                                             \
+    X(LT_F, 0, -1)                                                             \
+    X(GT_F, 0, -1)                                                             \
+    X(LE_F, 0, -1)                                                             \
+    X(GE_F, 0, -1)                                                             \
+    X(NOT_I, 0, 0)                                                             \
+    X(NOT_F, 0, 0)                                                             \
+    X(NOT_B, 0, 0)                                                             \
+    X(NEG_I, 0, 0)                                                             \
+    X(NEG_F, 0, 0)                                                             \
+    X(I2F, 0, 0)                                                               \
+    X(I2B, 0, 0)                                                               \
+    X(F2I, 0, 0)                                                               \
+    X(F2B, 0, 0)                                                               \
+    X(B2I, 0, 0)                                                               \
+    X(B2F, 0, 0)                                                               \
+    X(JUMP, 1, 0)                                                              \
+    X(JUMP_IF_FALSE, 1, -1)                                                    \
+    X(JUMP_IF_TRUE, 1, -1)                                                     \
+    X(CALL, 1, 0)                                                              \
+    X(RET, 0, -1)                                                              \
+    X(FAIL, 0, 0)                                                              \
+    X(FOR_PREP, 2, 0)                                                          \
+    X(FOR_NEXT, 3, 0)                                                          \
+    X(FOR_STEP, 1, 0)                                                          \
+    X(LOAD_LOAD, 2, 2)                                                         \
+    X(LOAD_CONST, 2, 2)                                                        \
+    X(ADD_LOCAL_CONST_I, 2, 1)                                                 \
+    X(JUMP_UNLESS_EQ_I, 1, -2)                                                 \
+    X(JUMP_UNLESS_NE_I, 1, -2)                                                 \
+    X(JUMP_UNLESS_LT_I, 1, -2)                                                 \
+    X(JUMP_UNLESS_GT_I, 1, -2)                                                 \
+    X(JUMP_UNLESS_LE_I, 1, -2)                                                 \
+    X(JUMP_UNLESS_GE_I, 1, -2)
+
+enum Op : int32_t {
+#define X(name, operands, effect) name,
+    WAII_VM_OPCODES(X)
+#undef X
+    OP_COUNT
+};
+
+static const char *const opNames[] = {
+#define X(name, operands, effect) #name,
+    WAII_VM_OPCODES(X)
+#undef X
+};
+
+static constexpr int opOperands[] = {
+#define X(name, operands, effect) operands,
+    WAII_VM_OPCODES(X)
+#undef X
+};
+
+static constexpr int opEffects[] = {
+#define X(name, operands, effect) effect,
+    WAII_VM_OPCODES(X)
+#undef X
+};
+
+// 执行次数的统计, --vm-histogram 时记录
+template <int N>
+struct Stats {
+    uint64_t ops[N] = {};
+    uint64_t pairs[N][N] = {};
+
+    uint64_t total() const {
+        uint64_t res = 0;
+        for (auto count : ops) {
+            res += count;
+        }
+        return res;
+    }
+
+    // 每种指令和最常见的相邻指令对的执行次数
+    string histogram(const char *const names[], size_t top) const {
+        auto all = total();
+        vector<std::pair<uint64_t, int>> list;
+        vector<std::tuple<uint64_t, int, int>> pairList;
+        for (int a = 0; a < N; a++) {
+            if (ops[a] != 0) {
+                list.emplace_back(ops[a], a);
+            }
+            for (int b = 0; b < N; b++) {
+                if (pairs[a][b] != 0) {
+                    pairList.emplace_back(pairs[a][b], a, b);
+                }
+            }
+        }
+        std::sort(list.rbegin(), list.rend());
+        std::sort(pairList.rbegin(), pairList.rend());
+        auto percent = [&](uint64_t count) {
+            return all == 0 ? 0.0 : 100.0 * count / all;
+        };
+        string res = std::format("vm: {} instructions executed\n", all);
+        for (auto [count, op] : list) {
+            res += std::format("  {:<32}{:>14}  {:5.1f}%\n", names[op], count,
+                               percent(count));
+        }
+        res += "vm: most frequent pairs\n";
+        for (size_t i = 0; i < pairList.size() && i < top; i++) {
+            auto [count, a, b] = pairList[i];
+            res += std::format("  {:<32}{:>14}  {:5.1f}%\n",
+                               std::format("{} {}", names[a], names[b]), count,
+                               percent(count));
+        }
+        return res;
+    }
+};
+
+// 两种字节码的解释器共用的分派框架, 使用前要定义 Profile, pc, prev
+#define WAII_VM_PROFILE(stats)                                                 \
+    if constexpr (Profile) {                                                   \
+        stats.ops[*pc]++;                                                      \
+        if (prev >= 0) {                                                       \
+            stats.pairs[prev][*pc]++;                                          \
+        }                                                                      \
+        prev = *pc;                                                            \
+    }
+#if WAII_VM_THREADED
+#define WAII_VM_TARGET(name, ...) &&L_##name,
+#define WAII_VM_BEGIN(stats, OPCODES)                                          \
+    static void *const targets[] = {OPCODES(WAII_VM_TARGET)};                  \
+    WAII_VM_NEXT(stats);
+#define WAII_VM_CASE(name) L_##name:
+#define WAII_VM_NEXT(stats)                                                    \
+    do {                                                                       \
+        WAII_VM_PROFILE(stats);                                                \
+        goto *targets[*pc];                                                    \
+    } while (0)
+#define WAII_VM_END
+#else
+#define WAII_VM_BEGIN(stats, OPCODES)                                          \
+    for (;;) {                                                                 \
+        WAII_VM_PROFILE(stats);                                                \
+        switch (*pc) {
+#define WAII_VM_CASE(name) case name:
+#define WAII_VM_NEXT(stats) continue
+#define WAII_VM_END                                                            \
+    default:                                                                   \
+        throw typed::Bail{};                                                   \
+        }                                                                      \
+        }
+#endif
+
+struct CallSite {
+    typed::Plan *plan;
+    symbol::Symbol sym;
+    int32_t argc;
+};
+
+struct Bytecode {
+    vector<int32_t> code;
+    vector<Slot> consts;
+    vector<CallSite> calls;
+    size_t locals = 0;   // typed::Plan 的槽位
+    size_t hidden = 0;   // for 循环的计数器
+    size_t maxStack = 0; // 操作数栈的最大深度
+};
+
+// 生成字节码, 同时记录操作数栈的深度和需要合并的指令
+class Assembler {
+    private:
+    struct Label {
+        int32_t pos = -1;
+        vector<size_t> uses; // 还没有回填的操作数位置
+        int depth = -1;      // 跳转到这里时的栈深度
+    };
+
+    vector<Label> labels;
+    vector<size_t> starts; // 已生成指令的起始位置
+    size_t barrier = 0;    // 这之前的指令可能是跳转目标, 不能再合并
+    int depth = 0;
+    // 外层 while 循环的开头, 与 typed::While 一致, 循环里的 return 只结束本轮
+    vector<int> loops;
+
+    void setDepth(int val) {
+        depth = val;
+        if (depth > static_cast<int>(out.maxStack)) {
+            out.maxStack = depth;
+        }
+    }
+
+    void raw(Op op, std::initializer_list<int32_t> operands) {
+        starts.push_back(out.code.size());
+        out.code.push_back(op);
+        out.code.insert(out.code.end(), operands);
+        setDepth(depth + opEffects[op]);
+    }
+    // 最后一个操作数是跳转目标的指令
+    void target(Op op, std::initializer_list<int32_t> operands, Label &label) {
+        starts.push_back(out.code.size());
+        out.code.push_back(op);
+        out.code.insert(out.code.end(), operands);
+        out.code.push_back(label.pos);
+        if (label.pos < 0) {
+            label.uses.push_back(out.code.size() - 1);
+        }
+        setDepth(depth + opEffects[op]);
+        label.depth = depth;
+    }
+
+    // 倒数第 n 条指令, 不存在或者在跳转目标之前时返回 nullptr
+    const int32_t *previous(size_t n) const {
+        if (starts.size() < n || starts[starts.size() - n] < barrier) {
+            return nullptr;
+        }
+        return out.code.data() + starts[starts.size() - n];
+    }
+    // 去掉最后 n 条指令, 栈深度恢复到它们执行之前
+    void drop(size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            auto pos = starts.back();
+            starts.pop_back();
+            depth -= opEffects[out.code[pos]];
+            out.code.resize(pos);
+        }
+    }
+
+    bool fuse;
+
+    public:
+    Bytecode out;
+
+    Assembler(size_t locals, bool fuse) : fuse(fuse) {
+        out.locals = locals;
+    }
+
+    void emit(Op op, std::initializer_list<int32_t> operands = {}) {
+        if (fuse) {
+            auto last = previous(1);
+            // LOAD a; LOAD b
+            if (op == LOAD && last != nullptr && last[0] == LOAD) {
+                auto a = last[1];
+                drop(1);
+                raw(LOAD_LOAD, {a, *operands.begin()});
+                return;
+            }
+            // LOAD a; CONST k, 前面的 LOAD 可能已经和更早的 LOAD 合并
+            if (op == CONST && last != nullptr &&
+                (last[0] == LOAD || last[0] == LOAD_LOAD)) {
+                bool pair = last[0] == LOAD_LOAD;
+                auto first = last[1], a = pair ? last[2] : last[1];
+                drop(1);
+                if (pair) {
+                    raw(LOAD, {first});
+                }
+                raw(LOAD_CONST, {a, *operands.begin()});
+                return;
+            }
+            // LOAD a; CONST k; ADD_I
+            if (op == ADD_I && last != nullptr && last[0] == LOAD_CONST) {
+                auto a = last[1], k = last[2];
+                drop(1);
+                raw(ADD_LOCAL_CONST_I, {a, k});
+                return;
+            }
+        }
+        raw(op, operands);
+    }
+
+    int label() {
+        labels.emplace_back();
+        return labels.size() - 1;
+    }
+    void bind(int id) {
+        auto &label = labels[id];
+        label.pos = out.code.size();
+        for (auto use : label.uses) {
+            out.code[use] = label.pos;
+        }
+        if (label.depth >= 0) {
+            setDepth(label.depth);
+        }
+        barrier = out.code.size();
+    }
+    void jump(Op op, int id) {
+        auto &label = labels[id];
+        // 比较之后紧跟着条件跳转
+        auto last = previous(1);
+        if (fuse && op == JUMP_IF_FALSE &&
+            last != nullptr && last[0] >= EQ_I && last[0] <= GE_I) {
+            op = static_cast<Op>(JUMP_UNLESS_EQ_I + (last[0] - EQ_I));
+            drop(1);
+        }
+        target(op, {}, label);
+        if (op == JUMP) {
+            // 之后的代码只能从别的跳转到达
+            barrier = out.code.size();
+        }
+    }
+
+    void constant(Slot val) {
+        out.consts.push_back(val);
+        emit(CONST, {static_cast<int32_t>(out.consts.size() - 1)});
+    }
+    void call(typed::Plan *plan, symbol::Symbol sym, int32_t argc) {
+        out.calls.push_back({plan, sym, argc});
+        emit(CALL, {static_cast<int32_t>(out.calls.size() - 1)});
+        setDepth(depth + 1 - argc);
+    }
+    // 弹出 argc 个参数, 初始化从 index 开始的三个计数器
+    void forPrep(int32_t index, int32_t argc) {
+        emit(FOR_PREP, {index, argc});
+        setDepth(depth - argc);
+    }
+    // 计数器没有走完时写入循环变量, 否则跳到 end
+    void forNext(int32_t counter, size_t index, int end) {
+        target(FOR_NEXT, {counter, static_cast<int32_t>(index)}, labels[end]);
+    }
+    void ret() {
+        if (loops.empty()) {
+            emit(RET);
+        } else {
+            emit(POP);
+            jump(JUMP, loops.back());
+        }
+    }
+    void enterLoop(int top) {
+        loops.push_back(top);
+    }
+    void leaveLoop() {
+        loops.pop_back();
+    }
+    // 分配 count 个 for 循环计数器的槽位
+    int32_t hidden(size_t count) {
+        auto res = out.locals + out.hidden;
+        out.hidden += count;
+        return res;
+    }
+};
+
+} // namespace vm
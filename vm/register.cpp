@@ -0,0 +1,460 @@
+#pragma once
+
+#include "./bytecode.cpp"
+#include <memory>
+#include <vector>
+
+// 基于寄存器的字节码
+// 由栈式字节码转换得到: 操作数栈的每个位置固定对应一个寄存器, 局部变量和
+// 常量也都是寄存器, 所以 a + b 这样的运算是一条三地址指令, 不需要先把
+// 操作数压栈. 帧的布局是 [局部变量][for 计数器][栈位置][常量],
+// 常量在进入函数时复制到帧里
+namespace vm {
+
+// 名字, 操作数个数. 算术到类型转换的顺序与栈式指令一致, 方便对应
+#define WAII_VM_REG_OPCODES(X)                                                 \
+    X(R_ADD_I, 3)                                                              \
+    X(R_SUB_I, 3)                                                              \
+    X(R_MUL_I, 3)                                                              \
+    X(R_DIV_I, 3)                                                              \
+    X(R_ADD_F, 3)                                                              \
+    X(R_SUB_F, 3)                                                              \
+    X(R_MUL_F, 3)                                                              \
+    X(R_DIV_F, 3)                                                              \
+    X(R_EQ_I, 3)                                                               \
+    X(R_NE_I, 3)                                                               \
+    X(R_LT_I, 3)                                                               \
+    X(R_GT_I, 3)                                                               \
+    X(R_LE_I, 3)                                                               \
+    X(R_GE_I, 3)                                                               \
+    X(R_EQ_F, 3)                                                               \
+    X(R_NE_F, 3)                                                               \
+    X(R_LT_F, 3)                                                               \
+    X(R_GT_F, 3)                                                               \
+    X(R_LE_F, 3)                                                               \
+    X(R_GE_F, 3)                                                               \
+    X(R_NOT_I, 2)                                                              \
+    X(R_NOT_F, 2)                                                              \
+    X(R_NOT_B, 2)                                                              \
+    X(R_NEG_I, 2)                                                              \
+    X(R_NEG_F, 2)                                                              \
+    X(R_I2F, 2)                                                                \
+    X(R_I2B, 2)                                                                \
+    X(R_F2I, 2)                                                                \
+    X(R_F2B, 2)                                                                \
+    X(R_B2I, 2)                                                                \
+    X(R_B2F, 2)                                                                \
+    X(R_MOVE, 2)                                                               \
+    X(R_JUMP, 1)                                                               \
+    X(R_JUMP_IF_FALSE, 2)                                                      \
+    X(R_JUMP_IF_TRUE, 2)                                                       \
+    X(R_CALL, 3)                                                               \
+    X(R_RET, 1)                                                                \
+    X(R_FAIL, 0)                                                               \
+    X(R_FOR_PREP, 3)                                                           \
+    X(R_FOR_NEXT, 3)                                                           \
+    X(R_FOR_STEP, 1)                                                           \
+    X(R_JUMP_UNLESS_EQ_I, 3)                                                   \
+    X(R_JUMP_UNLESS_NE_I, 3)                                                   \
+    X(R_JUMP_UNLESS_LT_I, 3)                                                   \
+    X(R_JUMP_UNLESS_GT_I, 3)                                                   \
+    X(R_JUMP_UNLESS_LE_I, 3)                                                   \
+    X(R_JUMP_UNLESS_GE_I, 3)
+
+enum RegOp : int32_t {
+#define X(name, operands) name,
+    WAII_VM_REG_OPCODES(X)
+#undef X
+    R_COUNT
+};
+
+static const char *const regOpNames[] = {
+#define X(name, operands) #name,
+    WAII_VM_REG_OPCODES(X)
+#undef X
+};
+
+struct RegisterCode {
+    vector<int32_t> code;
+    vector<Slot> consts;
+    vector<CallSite> calls;
+    size_t locals = 0;     // typed::Plan 的槽位
+    int32_t constBase = 0; // 第一个常量寄存器
+    size_t frame = 0;      // 帧的总大小
+};
+
+// 栈式字节码到寄存器字节码的转换
+// 记录每个栈位置当前的值在哪个寄存器里: LOAD 和 CONST 只是把局部变量或
+// 常量的寄存器记下来, 不生成指令. 跳转, 调用和跳转目标处要求值都在栈位置
+// 自己的寄存器里, 这时才补上 MOVE
+class Translator {
+    private:
+    const Bytecode &in;
+    bool fuse;
+    RegisterCode out;
+    int32_t temps;           // 第一个栈位置的寄存器
+    vector<int32_t> values;  // 每个栈位置的值所在的寄存器
+    vector<int32_t> targets; // 栈式指令下标 -> 寄存器指令下标, -1 未生成
+    vector<int> depths;      // 跳转到栈式指令时的栈深度, -1 未知
+    vector<bool> isTarget;
+    vector<std::pair<size_t, int32_t>> fixups; // 向前跳转的操作数位置
+    // 最后一条指令的位置和它写入的寄存器操作数的位置
+    // 指令不写寄存器或者之后是跳转目标时 last 为 -1
+    long start = -1, last = -1;
+
+    int32_t temp(size_t pos) const {
+        return temps + static_cast<int32_t>(pos);
+    }
+    int32_t pop() {
+        auto res = values.back();
+        values.pop_back();
+        return res;
+    }
+    // 把值写到位置自己的寄存器里
+    void materialize(size_t pos) {
+        if (values[pos] != temp(pos)) {
+            put(R_MOVE, {temp(pos), values[pos]}, 1);
+            values[pos] = temp(pos);
+        }
+    }
+    void materialize() {
+        for (size_t i = 0; i < values.size(); i++) {
+            materialize(i);
+        }
+    }
+    // dest 是写入的寄存器在第几个操作数, 0 表示不写寄存器
+    void put(RegOp op, std::initializer_list<int32_t> operands, int dest = 0) {
+        start = out.code.size();
+        last = dest == 0 ? -1 : start + dest;
+        out.code.push_back(op);
+        out.code.insert(out.code.end(), operands);
+    }
+    void branch(RegOp op, std::initializer_list<int32_t> operands,
+                int32_t target) {
+        put(op, operands);
+        if (targets[target] < 0) {
+            fixups.emplace_back(out.code.size(), target);
+        }
+        out.code.push_back(targets[target]);
+        if (depths[target] < 0) {
+            depths[target] = values.size();
+        }
+    }
+    // 栈顶的值写入新的栈位置, 结果留在栈上
+    void compute(Op op, size_t argc) {
+        auto reg = static_cast<RegOp>(R_ADD_I + (op - ADD_I));
+        auto b = pop(), a = argc == 2 ? pop() : b;
+        auto dest = temp(values.size());
+        if (argc == 2) {
+            put(reg, {dest, a, b}, 1);
+        } else {
+            put(reg, {dest, a}, 1);
+        }
+        values.push_back(dest);
+    }
+    void store(int32_t local) {
+        auto val = pop();
+        bool used = false;
+        for (size_t i = 0; i < values.size(); i++) {
+            if (values[i] == local) {
+                materialize(i);
+                used = true;
+            }
+        }
+        // 直接让算出这个值的指令写入局部变量
+        if (!used && last >= 0 && out.code[last] == val &&
+            val == temp(values.size())) {
+            out.code[last] = local;
+            return;
+        }
+        if (val != local) {
+            put(R_MOVE, {local, val}, 1);
+        }
+    }
+    void jumpIfFalse(int32_t target) {
+        auto cond = pop();
+        auto op = last >= 0 ? out.code[start] : -1;
+        if (fuse && op >= R_EQ_I && op <= R_GE_I && out.code[last] == cond) {
+            // 去掉比较指令, 合并进条件跳转
+            auto a = out.code[start + 2], b = out.code[start + 3];
+            out.code.resize(start);
+            last = -1;
+            materialize();
+            branch(static_cast<RegOp>(R_JUMP_UNLESS_EQ_I + (op - R_EQ_I)),
+                   {a, b}, target);
+            return;
+        }
+        materialize();
+        branch(R_JUMP_IF_FALSE, {cond}, target);
+    }
+
+    public:
+    Translator(const Bytecode &in, bool fuse) : in(in), fuse(fuse) {
+        out.calls = in.calls;
+        out.locals = in.locals;
+        temps = in.locals + in.hidden;
+        out.constBase = temps + in.maxStack;
+        out.consts = in.consts;
+        out.frame = out.constBase + in.consts.size();
+    }
+
+    RegisterCode translate() {
+        auto &code = in.code;
+        targets.assign(code.size() + 1, -1);
+        depths.assign(code.size() + 1, -1);
+        isTarget.assign(code.size() + 1, false);
+        for (size_t pc = 0; pc < code.size(); pc += 1 + opOperands[code[pc]]) {
+            auto op = code[pc];
+            if ((op >= JUMP && op <= JUMP_IF_TRUE) || op == FOR_NEXT) {
+                isTarget[code[pc + opOperands[op]]] = true;
+            }
+        }
+        for (size_t pc = 0; pc < code.size(); pc += 1 + opOperands[code[pc]]) {
+            if (isTarget[pc]) {
+                // 从前一条指令落下来时先把值放好, 再按跳转过来时的深度继续
+                materialize();
+                if (depths[pc] >= 0) {
+                    values.resize(depths[pc]);
+                    for (size_t i = 0; i < values.size(); i++) {
+                        values[i] = temp(i);
+                    }
+                }
+                last = -1;
+            }
+            targets[pc] = out.code.size();
+            auto op = static_cast<Op>(code[pc]);
+            auto arg = pc + 1 < code.size() ? code[pc + 1] : 0;
+            switch (op) {
+            case CONST:
+                values.push_back(out.constBase + arg);
+                break;
+            case LOAD:
+                values.push_back(arg);
+                break;
+            case STORE:
+                store(arg);
+                break;
+            case POP:
+                values.pop_back();
+                break;
+            case JUMP:
+                materialize();
+                branch(R_JUMP, {}, arg);
+                break;
+            case JUMP_IF_FALSE:
+                jumpIfFalse(arg);
+                break;
+            case JUMP_IF_TRUE: {
+                auto cond = pop();
+                materialize();
+                branch(R_JUMP_IF_TRUE, {cond}, arg);
+                break;
+            }
+            case CALL: {
+                materialize();
+                auto argc = in.calls[arg].argc;
+                auto base = values.size() - argc;
+                values.resize(base);
+                put(R_CALL, {arg, temp(base), temp(base)}, 3);
+                values.push_back(temp(base));
+                break;
+            }
+            case RET:
+                put(R_RET, {pop()});
+                break;
+            case FAIL:
+                put(R_FAIL, {});
+                break;
+            case FOR_PREP: {
+                materialize();
+                auto argc = code[pc + 2];
+                auto base = values.size() - argc;
+                values.resize(base);
+                put(R_FOR_PREP, {arg, temp(base), argc});
+                break;
+            }
+            case FOR_NEXT:
+                materialize();
+                branch(R_FOR_NEXT, {arg, code[pc + 2]}, code[pc + 3]);
+                break;
+            case FOR_STEP:
+                put(R_FOR_STEP, {arg});
+                break;
+            default:
+                if (op >= ADD_I && op <= GE_F) {
+                    compute(op, 2);
+                } else if (op >= NOT_I && op <= B2F) {
+                    compute(op, 1);
+                } else {
+                    // 输入由不合并超级指令的 Assembler 生成
+                    throw typed::Bail{};
+                }
+            }
+        }
+        for (auto [pos, target] : fixups) {
+            out.code[pos] = targets[target];
+        }
+        return std::move(out);
+    }
+};
+
+thread_local Stats<R_COUNT> regStats;
+
+template <bool Profile>
+Slot executeRegisters(const RegisterCode &rc, Slot *r,
+                      environment::Enviroment *env) {
+    using typed::calc;
+    const int32_t *code = rc.code.data();
+    const int32_t *pc = code;
+    std::copy(rc.consts.begin(), rc.consts.end(), r + rc.constBase);
+    [[maybe_unused]] int32_t prev = -1;
+
+#define CASE(name) WAII_VM_CASE(name)
+#define NEXT() WAII_VM_NEXT(regStats)
+    WAII_VM_BEGIN(regStats, WAII_VM_REG_OPCODES)
+
+#define BINARY(name, T, expr)                                                  \
+    CASE(name) {                                                               \
+        T a = typed::get<T>(r[pc[2]]), b = typed::get<T>(r[pc[3]]);            \
+        r[pc[1]] = typed::slot(expr);                                          \
+        pc += 4;                                                               \
+        NEXT();                                                                \
+    }
+#define UNARY(name, From, expr)                                                \
+    CASE(name) {                                                               \
+        From a = typed::get<From>(r[pc[2]]);                                   \
+        r[pc[1]] = typed::slot(expr);                                          \
+        pc += 3;                                                               \
+        NEXT();                                                                \
+    }
+#define JUMP_UNLESS(name, op)                                                  \
+    CASE(name) {                                                               \
+        pc = r[pc[1]].i op r[pc[2]].i ? pc + 4 : code + pc[3];                 \
+        NEXT();                                                                \
+    }
+
+    BINARY(R_ADD_I, int, calc<token::PLUS>(a, b))
+    BINARY(R_SUB_I, int, calc<token::MINUS>(a, b))
+    BINARY(R_MUL_I, int, calc<token::ASTERISK>(a, b))
+    BINARY(R_DIV_I, int, calc<token::SLASH>(a, b))
+    BINARY(R_ADD_F, double, a + b)
+    BINARY(R_SUB_F, double, a - b)
+    BINARY(R_MUL_F, double, a * b)
+    BINARY(R_DIV_F, double, a / b)
+    BINARY(R_EQ_I, int, a == b)
+    BINARY(R_NE_I, int, a != b)
+    BINARY(R_LT_I, int, a < b)
+    BINARY(R_GT_I, int, a > b)
+    BINARY(R_LE_I, int, a <= b)
+    BINARY(R_GE_I, int, a >= b)
+    BINARY(R_EQ_F, double, a == b)
+    BINARY(R_NE_F, double, a != b)
+    BINARY(R_LT_F, double, a < b)
+    BINARY(R_GT_F, double, a > b)
+    BINARY(R_LE_F, double, a <= b)
+    BINARY(R_GE_F, double, a >= b)
+    UNARY(R_NOT_I, int, !a)
+    UNARY(R_NOT_F, double, (static_cast<void>(a), false))
+    UNARY(R_NOT_B, bool, !a)
+    UNARY(R_NEG_I, int, static_cast<int>(0u - static_cast<unsigned>(a)))
+    UNARY(R_NEG_F, double, -a)
+    UNARY(R_I2F, int, static_cast<double>(a))
+    UNARY(R_I2B, int, static_cast<bool>(a))
+    UNARY(R_F2I, double, static_cast<int>(a))
+    UNARY(R_F2B, double, static_cast<bool>(a))
+    UNARY(R_B2I, bool, static_cast<int>(a))
+    UNARY(R_B2F, bool, static_cast<double>(a))
+    CASE(R_MOVE) {
+        r[pc[1]] = r[pc[2]];
+        pc += 3;
+        NEXT();
+    }
+    CASE(R_JUMP) {
+        pc = code + pc[1];
+        NEXT();
+    }
+    CASE(R_JUMP_IF_FALSE) {
+        pc = r[pc[1]].b ? pc + 3 : code + pc[2];
+        NEXT();
+    }
+    CASE(R_JUMP_IF_TRUE) {
+        pc = r[pc[1]].b ? code + pc[2] : pc + 3;
+        NEXT();
+    }
+    CASE(R_CALL) {
+        auto &site = rc.calls[pc[1]];
+        auto target = typed::callee(site.plan, site.sym, env);
+        auto size = site.plan->frameSize();
+        auto frame = typed::stack.push(size);
+        std::copy(r + pc[2], r + pc[2] + site.argc, frame);
+        r[pc[3]] = site.plan->run(frame, target);
+        typed::stack.pop(size);
+        pc += 4;
+        NEXT();
+    }
+    CASE(R_RET) {
+        return r[pc[1]];
+    }
+    CASE(R_FAIL) {
+        throw typed::Bail{};
+    }
+    CASE(R_FOR_PREP) {
+        auto counter = r + pc[1];
+        auto args = r + pc[2];
+        auto argc = pc[3];
+        counter[0].l = argc == 1 ? 0 : args[0].i;
+        counter[1].l = argc == 1 ? args[0].i : args[1].i;
+        counter[2].l = argc == 3 ? args[2].i : 1;
+        if (counter[2].l == 0) {
+            throw typed::Bail{};
+        }
+        pc += 4;
+        NEXT();
+    }
+    CASE(R_FOR_NEXT) {
+        auto counter = r + pc[1];
+        auto cur = counter[0].l, end = counter[1].l;
+        if (counter[2].l > 0 ? cur < end : cur > end) {
+            r[pc[2]].i = static_cast<int>(cur);
+            pc += 4;
+        } else {
+            pc = code + pc[3];
+        }
+        NEXT();
+    }
+    CASE(R_FOR_STEP) {
+        auto counter = r + pc[1];
+        counter[0].l += counter[2].l;
+        pc += 2;
+        NEXT();
+    }
+    JUMP_UNLESS(R_JUMP_UNLESS_EQ_I, ==)
+    JUMP_UNLESS(R_JUMP_UNLESS_NE_I, !=)
+    JUMP_UNLESS(R_JUMP_UNLESS_LT_I, <)
+    JUMP_UNLESS(R_JUMP_UNLESS_GT_I, >)
+    JUMP_UNLESS(R_JUMP_UNLESS_LE_I, <=)
+    JUMP_UNLESS(R_JUMP_UNLESS_GE_I, >=)
+
+    WAII_VM_END
+#undef CASE
+#undef NEXT
+#undef BINARY
+#undef UNARY
+#undef JUMP_UNLESS
+}
+
+class RegisterChunk : public typed::Code {
+    public:
+    RegisterCode rc;
+
+    explicit RegisterChunk(RegisterCode rc) : rc(std::move(rc)) {
+    }
+    Slot run(Slot *slots, environment::Enviroment *env) {
+        if (options.histogram || options.stats) {
+            return executeRegisters<true>(rc, slots, env);
+        }
+        return executeRegisters<false>(rc, slots, env);
+    }
+};
+
+} // namespace vm
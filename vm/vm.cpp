@@ -0,0 +1,438 @@
+#pragma once
+
+#include "../eval/typed.cpp"
+#include "./bytecode.cpp"
+#include "./register.cpp"
+#include <algorithm>
+#include <format>
+#include <memory>
+#include <string>
+#include <vector>
+
+// 栈式字节码的解释执行
+// 分派循环只写一遍, WAII_VM_THREADED 时每条指令结束后直接 goto 到下一条
+// 指令的标签 (每个指令各自有一个间接跳转, 分支预测更准), 否则是普通的 switch
+// Profile 版本额外统计每种指令和相邻指令对的执行次数, 用来挑选超级指令
+namespace vm {
+
+// 统计只记当前线程的
+thread_local Stats<OP_COUNT> stats;
+thread_local size_t codeBytes = 0; // 编译出的指令和常量的总大小
+
+template <bool Profile>
+Slot execute(const Bytecode &bc, Slot *slots, environment::Enviroment *env) {
+    using typed::calc;
+    const int32_t *code = bc.code.data();
+    const int32_t *pc = code;
+    const Slot *consts = bc.consts.data();
+    Slot *sp = slots + bc.locals + bc.hidden; // 操作数栈的下一个空位
+    [[maybe_unused]] int32_t prev = -1;
+
+#define CASE(name) WAII_VM_CASE(name)
+#define NEXT() WAII_VM_NEXT(stats)
+    WAII_VM_BEGIN(stats, WAII_VM_OPCODES)
+
+#define BINARY(name, T, expr)                                                  \
+    CASE(name) {                                                               \
+        T a = typed::get<T>(sp[-2]), b = typed::get<T>(sp[-1]);                \
+        sp[-2] = typed::slot(expr);                                            \
+        sp--;                                                                  \
+        pc++;                                                                  \
+        NEXT();                                                                \
+    }
+#define UNARY(name, From, expr)                                                \
+    CASE(name) {                                                               \
+        From a = typed::get<From>(sp[-1]);                                     \
+        sp[-1] = typed::slot(expr);                                            \
+        pc++;                                                                  \
+        NEXT();                                                                \
+    }
+#define JUMP_UNLESS(name, op)                                                  \
+    CASE(name) {                                                               \
+        bool res = sp[-2].i op sp[-1].i;                                       \
+        sp -= 2;                                                               \
+        pc = res ? pc + 2 : code + pc[1];                                      \
+        NEXT();                                                                \
+    }
+
+    CASE(CONST) {
+        *sp++ = consts[pc[1]];
+        pc += 2;
+        NEXT();
+    }
+    CASE(LOAD) {
+        *sp++ = slots[pc[1]];
+        pc += 2;
+        NEXT();
+    }
+    CASE(STORE) {
+        slots[pc[1]] = *--sp;
+        pc += 2;
+        NEXT();
+    }
+    CASE(POP) {
+        sp--;
+        pc++;
+        NEXT();
+    }
+    BINARY(ADD_I, int, calc<token::PLUS>(a, b))
+    BINARY(SUB_I, int, calc<token::MINUS>(a, b))
+    BINARY(MUL_I, int, calc<token::ASTERISK>(a, b))
+    BINARY(DIV_I, int, calc<token::SLASH>(a, b))
+    BINARY(ADD_F, double, a + b)
+    BINARY(SUB_F, double, a - b)
+    BINARY(MUL_F, double, a * b)
+    BINARY(DIV_F, double, a / b)
+    BINARY(EQ_I, int, a == b)
+    BINARY(NE_I, int, a != b)
+    BINARY(LT_I, int, a < b)
+    BINARY(GT_I, int, a > b)
+    BINARY(LE_I, int, a <= b)
+    BINARY(GE_I, int, a >= b)
+    BINARY(EQ_F, double, a == b)
+    BINARY(NE_F, double, a != b)
+    BINARY(LT_F, double, a < b)
+    BINARY(GT_F, double, a > b)
+    BINARY(LE_F, double, a <= b)
+    BINARY(GE_F, double, a >= b)
+    UNARY(NOT_I, int, !a)
+    UNARY(NOT_F, double, (static_cast<void>(a), false))
+    UNARY(NOT_B, bool, !a)
+    UNARY(NEG_I, int, static_cast<int>(0u - static_cast<unsigned>(a)))
+    UNARY(NEG_F, double, -a)
+    UNARY(I2F, int, static_cast<double>(a))
+    UNARY(I2B, int, static_cast<bool>(a))
+    UNARY(F2I, double, static_cast<int>(a))
+    UNARY(F2B, double, static_cast<bool>(a))
+    UNARY(B2I, bool, static_cast<int>(a))
+    UNARY(B2F, bool, static_cast<double>(a))
+    CASE(JUMP) {
+        pc = code + pc[1];
+        NEXT();
+    }
+    CASE(JUMP_IF_FALSE) {
+        pc = (--sp)->b ? pc + 2 : code + pc[1];
+        NEXT();
+    }
+    CASE(JUMP_IF_TRUE) {
+        pc = (--sp)->b ? code + pc[1] : pc + 2;
+        NEXT();
+    }
+    CASE(CALL) {
+        auto &site = bc.calls[pc[1]];
+        auto target = typed::callee(site.plan, site.sym, env);
+        auto size = site.plan->frameSize();
+        auto frame = typed::stack.push(size);
+        sp -= site.argc;
+        std::copy(sp, sp + site.argc, frame);
+        *sp++ = site.plan->run(frame, target);
+        typed::stack.pop(size);
+        pc += 2;
+        NEXT();
+    }
+    CASE(RET) {
+        return sp[-1];
+    }
+    CASE(FAIL) {
+        // 推断保证函数体以 return 结束
+        throw typed::Bail{};
+    }
+    CASE(FOR_PREP) {
+        auto counter = slots + pc[1];
+        auto argc = pc[2];
+        sp -= argc;
+        counter[0].l = argc == 1 ? 0 : sp[0].i;
+        counter[1].l = argc == 1 ? sp[0].i : sp[1].i;
+        counter[2].l = argc == 3 ? sp[2].i : 1;
+        if (counter[2].l == 0) {
+            throw typed::Bail{};
+        }
+        pc += 3;
+        NEXT();
+    }
+    CASE(FOR_NEXT) {
+        auto counter = slots + pc[1];
+        auto cur = counter[0].l, end = counter[1].l;
+        if (counter[2].l > 0 ? cur < end : cur > end) {
+            slots[pc[2]].i = static_cast<int>(cur);
+            pc += 4;
+        } else {
+            pc = code + pc[3];
+        }
+        NEXT();
+    }
+    CASE(FOR_STEP) {
+        auto counter = slots + pc[1];
+        counter[0].l += counter[2].l;
+        pc += 2;
+        NEXT();
+    }
+    CASE(LOAD_LOAD) {
+        sp[0] = slots[pc[1]];
+        sp[1] = slots[pc[2]];
+        sp += 2;
+        pc += 3;
+        NEXT();
+    }
+    CASE(LOAD_CONST) {
+        sp[0] = slots[pc[1]];
+        sp[1] = consts[pc[2]];
+        sp += 2;
+        pc += 3;
+        NEXT();
+    }
+    CASE(ADD_LOCAL_CONST_I) {
+        *sp++ = typed::slot(
+            calc<token::PLUS>(slots[pc[1]].i, consts[pc[2]].i));
+        pc += 3;
+        NEXT();
+    }
+    JUMP_UNLESS(JUMP_UNLESS_EQ_I, ==)
+    JUMP_UNLESS(JUMP_UNLESS_NE_I, !=)
+    JUMP_UNLESS(JUMP_UNLESS_LT_I, <)
+    JUMP_UNLESS(JUMP_UNLESS_GT_I, >)
+    JUMP_UNLESS(JUMP_UNLESS_LE_I, <=)
+    JUMP_UNLESS(JUMP_UNLESS_GE_I, >=)
+
+    WAII_VM_END
+#undef CASE
+#undef NEXT
+#undef BINARY
+#undef UNARY
+#undef JUMP_UNLESS
+}
+
+class Chunk : public typed::Code {
+    public:
+    Bytecode bc;
+
+    explicit Chunk(Bytecode bc) : bc(std::move(bc)) {
+    }
+    Slot run(Slot *slots, environment::Enviroment *env) {
+        if (options.histogram || options.stats) {
+            return execute<true>(bc, slots, env);
+        }
+        return execute<false>(bc, slots, env);
+    }
+};
+
+// 把 plan 的节点树编译成字节码, 之后调用 plan 时执行字节码
+// 寄存器字节码由不合并超级指令的栈式字节码转换得到
+void compile(typed::Plan &plan) {
+    bool registers = options.backend == Backend::Register;
+    Assembler as(plan.slotTypes.size(),
+                 options.superinstructions && !registers);
+    for (auto &stmt : plan.body) {
+        stmt->emit(as);
+    }
+    as.emit(FAIL);
+    if (registers) {
+        auto code = Translator(as.out, options.superinstructions).translate();
+        plan.scratch = code.frame - code.locals;
+        codeBytes += code.code.size() * sizeof(int32_t) +
+                     code.consts.size() * sizeof(Slot);
+        plan.code = std::make_unique<RegisterChunk>(std::move(code));
+    } else {
+        plan.scratch = as.out.hidden + as.out.maxStack;
+        codeBytes += as.out.code.size() * sizeof(int32_t) +
+                     as.out.consts.size() * sizeof(Slot);
+        plan.code = std::make_unique<Chunk>(std::move(as.out));
+    }
+}
+
+// --vm-histogram 的输出
+string histogram(size_t top = 20) {
+    if (options.backend == Backend::Register) {
+        return regStats.histogram(regOpNames, top);
+    }
+    return stats.histogram(opNames, top);
+}
+
+// --vm-stats 的输出
+string summary() {
+    bool registers = options.backend == Backend::Register;
+    return std::format("vm: {} backend, {} instructions executed, "
+                       "{} bytes of code\n",
+                       registers ? "register" : "stack",
+                       registers ? regStats.total() : stats.total(),
+                       codeBytes);
+}
+
+} // namespace vm
+
+// typed 节点的代码生成, 与各节点的 eval / exec 一一对应
+namespace typed {
+
+namespace {
+
+template <typename T>
+constexpr vm::Op arithBase() {
+    return std::is_same_v<T, int> ? vm::ADD_I : vm::ADD_F;
+}
+template <typename T>
+constexpr vm::Op compareBase() {
+    return std::is_same_v<T, int> ? vm::EQ_I : vm::EQ_F;
+}
+
+constexpr int arithIndex(token::TokenType op) {
+    return op == token::PLUS    ? 0
+           : op == token::MINUS ? 1
+           : op == token::ASTERISK ? 2
+                                   : 3;
+}
+constexpr int compareIndex(token::TokenType op) {
+    return op == token::EQ       ? 0
+           : op == token::NOT_EQ ? 1
+           : op == token::LT     ? 2
+           : op == token::GT     ? 3
+           : op == token::LE     ? 4
+                                 : 5;
+}
+
+template <typename From, typename To>
+constexpr vm::Op convertOp() {
+    if constexpr (std::is_same_v<From, int>) {
+        return std::is_same_v<To, double> ? vm::I2F : vm::I2B;
+    } else if constexpr (std::is_same_v<From, double>) {
+        return std::is_same_v<To, int> ? vm::F2I : vm::F2B;
+    } else {
+        return std::is_same_v<To, int> ? vm::B2I : vm::B2F;
+    }
+}
+
+} // namespace
+
+void Const::emit(vm::Assembler &as) {
+    as.constant(val);
+}
+
+void Load::emit(vm::Assembler &as) {
+    as.emit(vm::LOAD, {static_cast<int32_t>(index)});
+}
+
+template <typename From, typename To>
+void Convert<From, To>::emit(vm::Assembler &as) {
+    val->emit(as);
+    as.emit(convertOp<From, To>());
+}
+
+template <typename T, token::TokenType Op>
+void Arith<T, Op>::emit(vm::Assembler &as) {
+    left->emit(as);
+    right->emit(as);
+    as.emit(static_cast<vm::Op>(arithBase<T>() + arithIndex(Op)));
+}
+
+template <typename T, token::TokenType Op>
+void Compare<T, Op>::emit(vm::Assembler &as) {
+    left->emit(as);
+    right->emit(as);
+    as.emit(static_cast<vm::Op>(compareBase<T>() + compareIndex(Op)));
+}
+
+template <bool IsOr>
+void Logic<IsOr>::emit(vm::Assembler &as) {
+    auto shortcut = as.label(), end = as.label();
+    left->emit(as);
+    as.jump(IsOr ? vm::JUMP_IF_TRUE : vm::JUMP_IF_FALSE, shortcut);
+    right->emit(as);
+    as.jump(vm::JUMP, end);
+    as.bind(shortcut);
+    as.constant(slot(IsOr));
+    as.bind(end);
+}
+
+template <typename T>
+void Not<T>::emit(vm::Assembler &as) {
+    val->emit(as);
+    if constexpr (std::is_same_v<T, int>) {
+        as.emit(vm::NOT_I);
+    } else if constexpr (std::is_same_v<T, double>) {
+        as.emit(vm::NOT_F);
+    } else {
+        as.emit(vm::NOT_B);
+    }
+}
+
+template <typename T>
+void Neg<T>::emit(vm::Assembler &as) {
+    val->emit(as);
+    as.emit(std::is_same_v<T, int> ? vm::NEG_I : vm::NEG_F);
+}
+
+void Call::emit(vm::Assembler &as) {
+    for (auto &arg : args) {
+        arg->emit(as);
+    }
+    as.call(plan, sym, args.size());
+}
+
+void Let::emit(vm::Assembler &as) {
+    val->emit(as);
+    as.emit(vm::STORE, {static_cast<int32_t>(index)});
+}
+
+void Discard::emit(vm::Assembler &as) {
+    val->emit(as);
+    as.emit(vm::POP);
+}
+
+void Return::emit(vm::Assembler &as) {
+    val->emit(as);
+    as.ret();
+}
+
+void Block::emit(vm::Assembler &as) {
+    for (auto &stmt : stmts) {
+        stmt->emit(as);
+    }
+}
+
+void If::emit(vm::Assembler &as) {
+    auto otherwise = as.label(), end = as.label();
+    cond->emit(as);
+    as.jump(vm::JUMP_IF_FALSE, otherwise);
+    consequence->emit(as);
+    if (alternative != nullptr) {
+        as.jump(vm::JUMP, end);
+        as.bind(otherwise);
+        alternative->emit(as);
+    } else {
+        as.bind(otherwise);
+    }
+    as.bind(end);
+}
+
+void Seq::emit(vm::Assembler &as) {
+    body->emit(as);
+    val->emit(as);
+}
+
+void While::emit(vm::Assembler &as) {
+    auto top = as.label(), end = as.label();
+    as.bind(top);
+    cond->emit(as);
+    as.jump(vm::JUMP_IF_FALSE, end);
+    as.enterLoop(top);
+    body->emit(as);
+    as.leaveLoop();
+    as.jump(vm::JUMP, top);
+    as.bind(end);
+}
+
+void ForRange::emit(vm::Assembler &as) {
+    auto counter = as.hidden(3);
+    auto top = as.label(), end = as.label();
+    for (auto &arg : args) {
+        arg->emit(as);
+    }
+    as.forPrep(counter, args.size());
+    as.bind(top);
+    as.forNext(counter, index, end);
+    body->emit(as);
+    as.emit(vm::FOR_STEP, {counter});
+    as.jump(vm::JUMP, top);
+    as.bind(end);
+}
+
+} // namespace typed